@@ -0,0 +1,321 @@
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Copyright 2015, Tim Armstrong
+#
+# Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+
+# Generate lexer tables header from spec, see tsconfig_lex.spec for format.
+#
+# Usage: awk -f gen_lex_tables.awk tsconfig_lex.spec > tsconfig_lex_tables.h
+#
+# Bytes that behave the same in all DFA states are merged into one input
+# class, so the transition table is only as wide as needed.
+
+BEGIN {
+  for (i = 33; i < 127; i++) {
+    ord[sprintf("%c", i)] = i;
+  }
+
+  # Class 0 is the default for ASCII bytes not listed
+  nstart = 1;
+  start_name[0] = "UNQUOTED";
+  start_id["UNQUOTED"] = 0;
+
+  nflags = 0;
+
+  # State 0 is dead state, state 1 starts trie of keywords
+  nstates = 2;
+  state_id["KEYWORD:start"] = 1;
+  state_label[0] = "dead";
+  state_label[1] = "KEYWORD:start";
+  state_defined[1] = 1;
+  ndfa = 1;
+  dfa_name[1] = "KEYWORD";
+  dfa_start[1] = 1;
+
+  cur_dfa = "";
+  cur_state = 0;
+}
+
+function die(msg) {
+  printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr";
+  failed = 1;
+  exit 1;
+}
+
+function hexval(s,   v, i, d) {
+  v = 0;
+  s = tolower(s);
+  for (i = 1; i <= length(s); i++) {
+    d = index("0123456789abcdef", substr(s, i, 1)) - 1;
+    if (d < 0) {
+      die("invalid hex code: " s);
+    }
+    v = v * 16 + d;
+  }
+  return v;
+}
+
+function byteval(s) {
+  if (s ~ /^0x[0-9a-fA-F][0-9a-fA-F]$/) {
+    return hexval(substr(s, 3));
+  } else if (length(s) == 1 && (s in ord)) {
+    return ord[s];
+  }
+  die("invalid byte: " s);
+}
+
+# Add bytes matching spec s to set
+function parse_bytes(s, set,   p, lo, hi, b) {
+  p = (length(s) > 1) ? index(substr(s, 2), "-") : 0;
+  if (p > 0) {
+    lo = byteval(substr(s, 1, p));
+    hi = byteval(substr(s, p + 2));
+  } else {
+    lo = hi = byteval(s);
+  }
+
+  for (b = lo; b <= hi; b++) {
+    set[b] = 1;
+  }
+}
+
+# Parse byte specs in fields first to last into set
+function parse_fields(first, last, set,   i) {
+  split("", set);
+  for (i = first; i <= last; i++) {
+    parse_bytes($i, set);
+  }
+}
+
+# Look up state by qualified name, creating if needed
+function get_state(name) {
+  if (!(name in state_id)) {
+    if (nstates == 256) {
+      die("too many DFA states");
+    }
+    state_id[name] = nstates;
+    state_label[nstates] = name;
+    nstates++;
+  }
+  return state_id[name];
+}
+
+/^#/ || NF == 0 {
+  next;
+}
+
+$1 == "start" && NF >= 3 {
+  if (!($2 in start_id)) {
+    start_id[$2] = nstart;
+    start_name[nstart++] = $2;
+  }
+  parse_fields(3, NF, bytes);
+  for (b in bytes) {
+    byte_start[b] = start_id[$2];
+  }
+  next;
+}
+
+$1 == "flag" && NF >= 3 {
+  name = $2;
+  clear = (substr(name, 1, 1) == "!");
+  if (clear) {
+    name = substr(name, 2);
+  }
+
+  if (!(name in flag_id)) {
+    if (clear || nflags == 8) {
+      die("invalid flag: " $2);
+    }
+    flag_id[name] = nflags;
+    flag_name[nflags++] = name;
+  }
+
+  parse_fields(3, NF, bytes);
+  for (b in bytes) {
+    byte_flag[b, flag_id[name]] = !clear;
+  }
+  next;
+}
+
+$1 == "tok" && NF >= 3 {
+  parse_fields(3, NF, bytes);
+  for (b in bytes) {
+    byte_tok[b] = $2;
+  }
+  next;
+}
+
+$1 == "keyword" && NF == 3 {
+  s = 1;
+  for (i = 1; i <= length($2); i++) {
+    b = byteval(substr($2, i, 1));
+    if (!((s, b) in next_state)) {
+      t = get_state("KEYWORD:" substr($2, 1, i));
+      state_defined[t] = 1;
+      next_state[s, b] = t;
+    }
+    s = next_state[s, b];
+  }
+  accept[s] = $3;
+  next;
+}
+
+$1 == "dfa" && NF == 2 {
+  if ($2 in dfa_id) {
+    die("duplicate DFA: " $2);
+  }
+  cur_dfa = $2;
+  dfa_id[$2] = ++ndfa;
+  dfa_name[ndfa] = $2;
+  dfa_start[ndfa] = get_state(cur_dfa ":start");
+  cur_state = 0;
+  next;
+}
+
+$1 == "state" && (NF == 2 || NF == 3) {
+  if (cur_dfa == "") {
+    die("state outside DFA");
+  }
+  cur_state = get_state(cur_dfa ":" $2);
+  state_defined[cur_state] = 1;
+  if (NF == 3) {
+    accept[cur_state] = $3;
+  }
+  next;
+}
+
+NF >= 3 && $(NF - 1) == "->" {
+  if (cur_state == 0) {
+    die("transition outside state");
+  }
+  t = get_state(cur_dfa ":" $NF);
+  parse_fields(1, NF - 2, bytes);
+  for (b in bytes) {
+    next_state[cur_state, b] = t;
+  }
+  next;
+}
+
+{
+  die("invalid line: " $0);
+}
+
+END {
+  if (failed) {
+    exit 1;
+  }
+
+  for (s = 1; s < nstates; s++) {
+    if (!(s in state_defined)) {
+      printf("undefined DFA state: %s\n", state_label[s]) > "/dev/stderr";
+      exit 1;
+    }
+  }
+
+  # Group bytes with the same transitions in every state into classes,
+  # with class 0 for bytes that have none
+  nclasses = 0;
+  for (b = -1; b < 256; b++) {
+    sig = "";
+    for (s = 1; s < nstates; s++) {
+      sig = sig "," ((b >= 0 && (s, b) in next_state) ? next_state[s, b] : 0);
+    }
+    if (!(sig in class_id)) {
+      class_id[sig] = nclasses;
+      class_rep[nclasses++] = b;
+    }
+    if (b >= 0) {
+      byte_class[b] = class_id[sig];
+    }
+  }
+
+  print "/* Generated from tsconfig_lex.spec by gen_lex_tables.awk: do not edit */";
+  print "";
+  print "#ifndef __TSCONFIG_LEX_TABLES_H";
+  print "#define __TSCONFIG_LEX_TABLES_H";
+  print "";
+  print "#include <stdint.h>";
+  print "";
+  print "#include \"tsconfig_tok.h\"";
+  print "";
+  print "/*";
+  print " * Classes of bytes that start a token";
+  print " */";
+  print "typedef enum {";
+  for (i = 0; i < nstart; i++) {
+    printf("  LEX_START_%s,\n", start_name[i]);
+  }
+  print "} tscfg_lex_start;";
+  print "";
+  print "/*";
+  print " * Flags for bytes";
+  print " */";
+  for (i = 0; i < nflags; i++) {
+    printf("#define LEX_F_%s 0x%02x\n", flag_name[i], 2 ^ i);
+  }
+  print "";
+  print "/*";
+  print " * Start states of DFAs.  State 0 is the dead state.";
+  print " */";
+  print "#define LEX_DFA_DEAD 0";
+  for (i = 1; i <= ndfa; i++) {
+    printf("#define LEX_DFA_%s %d\n", dfa_name[i], dfa_start[i]);
+  }
+  printf("#define LEX_DFA_STATES %d\n", nstates);
+  printf("#define LEX_DFA_CLASSES %d\n", nclasses);
+  print "";
+  print "typedef struct {";
+  print "  uint8_t start; // tscfg_lex_start class";
+  print "  uint8_t flags; // LEX_F_* flags";
+  print "  uint8_t tok; // Tag of single byte token";
+  print "  uint8_t dfa; // Input class for DFAs";
+  print "} tscfg_lex_byte;";
+  print "";
+  print "static const tscfg_lex_byte tscfg_lex_bytes[256] = {";
+  for (b = 0; b < 256; b++) {
+    start = (b in byte_start) ? byte_start[b] : 0;
+    flags = 0;
+    for (i = 0; i < nflags; i++) {
+      if (byte_flag[b, i]) {
+        flags += 2 ^ i;
+      }
+    }
+    tok = (b in byte_tok) ? byte_tok[b] : "TSCFG_TOK_INVALID";
+    printf("  /* 0x%02x */ { LEX_START_%s, 0x%02x, %s, %d },\n",
+           b, start_name[start], flags, tok, byte_class[b]);
+  }
+  print "};";
+  print "";
+  print "static const uint8_t";
+  print "tscfg_lex_dfa_next[LEX_DFA_STATES][LEX_DFA_CLASSES] = {";
+  for (s = 0; s < nstates; s++) {
+    line = "  /* " s " " state_label[s] " */ {";
+    for (c = 0; c < nclasses; c++) {
+      b = class_rep[c];
+      t = (s > 0 && b >= 0 && (s, b) in next_state) ? next_state[s, b] : 0;
+      line = line ((c == 0) ? " " : ", ") t;
+    }
+    print line " },";
+  }
+  print "};";
+  print "";
+  print "static const uint8_t tscfg_lex_dfa_accept[LEX_DFA_STATES] = {";
+  for (s = 0; s < nstates; s++) {
+    printf("  /* %d */ %s,\n", s, (s in accept) ? accept[s] : "TSCFG_TOK_INVALID");
+  }
+  print "};";
+  print "";
+  print "#endif // __TSCONFIG_LEX_TABLES_H";
+}
@@ -27,12 +27,19 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "tsconfig_alloc.h"
+#include "tsconfig_arena.h"
 #include "tsconfig_err.h"
 #include "tsconfig_lex.h"
+#include "tsconfig_limits.h"
+#include "tsconfig_paths.h"
+#include "tsconfig_split.h"
+#include "tsconfig_stats.h"
 #include "tsconfig_tree_reader.h"
 
 /*
@@ -58,255 +65,1362 @@
 #define DEBUG(fmt, ...)
 #endif
 
+// Capacity of token lookahead queue, must be a power of two
+#define TOK_LOOKAHEAD 4
+
+/*
+ * Circular queue of tokens read ahead from lexer.
+ */
 typedef struct {
-  tscfg_reader reader;
+  tscfg_tok toks[TOK_LOOKAHEAD];
+  unsigned head; // Index of first token
+  unsigned len; // Number of tokens in queue
+} ts_tok_queue;
+
+typedef struct {
+  tscfg_batch_reader reader;
   void *reader_state;
 
+  // Events not yet passed to reader
+  tscfg_event *events;
+  int nevents;
+  int batch_size;
+  int events_size; // Allocated size of events, at least batch_size
+
+  // Nesting depth of current position
+  int depth;
+  // Deepest nesting allowed, or 0 for no limit
+  int max_depth;
+
   tscfg_lex_state lex_state;
 
-  tscfg_tok_array toks;
+  ts_tok_queue toks;
+
+  /*
+   * If non-NULL, token strings and token arrays passed to reader are
+   * allocated from arena and owned by it, rather than by the reader.
+   */
+  tscfg_arena *arena;
+
+  // Token array kept for reuse if arrays are copied into arena
+  tscfg_tok_array spare_toks;
+
+  /*
+   * Set once the reader has taken a batch of events, after which the
+   * arena only holds strings of tokens still held by the parser.
+   */
+  bool arena_stale;
+
+  // Buffer for moving token strings while rewinding arena
+  char *rewind_buf;
+  size_t rewind_buf_size;
+
+  // Stack of ts_parse_frame values, innermost last
+  uint8_t *frames;
+  int nframes;
+  int frames_size;
+
+  /*
+   * Whitespace tokens after last token of innermost value, which are
+   * passed on if the value continues with another token.
+   */
+  tscfg_tok_array ws_toks;
+
+  // Paths wanted, or NULL if all values are wanted
+  const tscfg_path_filter *filter;
+
+  // Stack of filter positions of objects being filtered, innermost last
+  tscfg_filter_pos *filter_pos;
+  int nfilter_pos;
+  int filter_pos_size;
+
+  // Stats to collect into, or NULL
+  tsconfig_stats *stats;
 } ts_parse_state;
 
+/*
+ * What is left to parse in a nesting level of the input, so that the
+ * parser can stop between any two events and pick up where it left off.
+ */
+typedef enum {
+  FRAME_ROOT, // Start of input
+  FRAME_ROOT_CLOSE_BRACE, // After body of root object with open brace
+  FRAME_ROOT_CLOSE_SQUARE, // After body of root array
+  FRAME_ROOT_END, // After root, expecting end of input
+  FRAME_OBJ_START, // Start of object body
+  FRAME_OBJ_FIELD, // Before next field in object body, or end
+  FRAME_OBJ_FIELD_END, // After value of field
+  FRAME_ARR_START, // Start of array body
+  FRAME_ARR_ELEM, // Before next element in array body, or end
+  FRAME_ARR_ELEM_END, // After value of element
+  FRAME_VAL_START, // Start of value
+  FRAME_VAL_ITEM, // Before next item in concatenated value
+  FRAME_VAL_CLOSE_BRACE, // After body of object in value
+  FRAME_VAL_CLOSE_SQUARE, // After body of array in value
+} ts_parse_frame;
+
+/*
+ * Flags kept in frames with a ts_parse_frame value.
+ *
+ * FRAME_FILTERED: on object frame, fields are matched against filter at
+ *    innermost filter position.  On value frame, objects in value are.
+ * FRAME_PARTIAL: on object frame, value of current field pushed a filter
+ *    position, to be popped after it.
+ */
+#define FRAME_FILTERED 0x80
+#define FRAME_PARTIAL 0x40
+#define FRAME_FLAGS (FRAME_FILTERED | FRAME_PARTIAL)
+
+// Initial capacity of filter position stack
+#define INIT_FILTER_POS 8
+
+// Initial capacity of frame stack
+#define INIT_FRAMES 16
+
+// Initial capacity of event queue for iterator
+#define ITER_INIT_EVENTS 8
+
+struct tsconfig_iter {
+  /*
+   * Parse state without reader: events are queued in state.events by the
+   * parser until taken.
+   */
+  ts_parse_state state;
+
+  // Index in state.events of next event to hand out
+  int next_event;
+
+  // Error that stopped iteration, if any
+  tscfg_rc rc;
+};
+
+struct tsconfig_parser {
+  // Parse state, stopped between inputs
+  ts_parse_state state;
+
+  // Tree reader reset for next tree, or NULL if not created yet
+  tscfg_treeread_state *tree_reader;
+  tscfg_batch_reader tree_batch_reader;
+
+  // Pool for last number of threads requested, NULL if single threaded
+  tscfg_pool *pool;
+  int pool_threads;
+  bool pool_valid;
+
+  // Allocator for memory kept, or NULL for malloc
+  const tscfg_allocator *alloc;
+
+  // Limits for parsing events
+  tsconfig_limits limits;
+};
+
+/*
+ * Adapter to deliver batched events to a callback reader.
+ */
+typedef struct {
+  tscfg_reader reader;
+  void *reader_state;
+} ts_callback_adapter;
+
 static tscfg_rc ts_parse_state_init(ts_parse_state *state, tsconfig_input in,
-  tscfg_reader reader, void *reader_state);
+  tscfg_batch_reader reader, void *reader_state, tscfg_arena *arena,
+  const tscfg_path_filter *filter);
+static void ts_parse_state_clear(ts_parse_state *state);
+static tscfg_rc ts_parse_state_start(ts_parse_state *state,
+  tsconfig_input in, tscfg_batch_reader reader, void *reader_state,
+  tscfg_arena *arena, const tscfg_path_filter *filter);
+static void ts_parse_state_stop(ts_parse_state *state);
 static void ts_parse_state_finalize(ts_parse_state *state);
 static void ts_parse_report_err(const char *file, int line,
               ts_parse_state *state, const char *fmt, ...);
 
-static tscfg_rc parse_hocon(tsconfig_input in, tscfg_reader reader,
-                            void *reader_state);
-static tscfg_rc parse_hocon_obj_body(ts_parse_state *state);
-static tscfg_rc parse_hocon_arr_body(ts_parse_state *state);
-
+static tscfg_rc subs_in_filter(const tsconfig_tree *tree,
+              const tscfg_path_filter *filter, bool *covered);
+
+static tscfg_rc parse_tree(tsconfig_parser *parser, tsconfig_input in,
+      tscfg_fmt fmt, const tsconfig_parse_opts *opts, tsconfig_tree *cfg);
+static tscfg_rc parse_tree_with_alloc(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, const tsconfig_parse_opts *opts,
+      tsconfig_tree *cfg);
+static tscfg_rc read_tree(tsconfig_parser *parser, tsconfig_input in,
+      const char *path, tscfg_pool *pool, const tscfg_path_filter *filter,
+      tsconfig_tree *tree);
+static tscfg_rc read_tree_whole(tsconfig_parser *parser, tsconfig_input in,
+      const char *path, int depth, tscfg_pool *pool,
+      const tscfg_path_filter *filter, tsconfig_tree *tree,
+      tscfg_include ***incs, size_t *nincs);
+static tscfg_rc parser_tree_reader(tsconfig_parser *parser,
+      tscfg_batch_reader *reader, tscfg_treeread_state **reader_state);
+static void parser_tree_reader_done(tsconfig_parser *parser);
+static tscfg_rc parser_pool(tsconfig_parser *parser, int threads,
+                            tscfg_pool **pool);
+static void parser_use_alloc(tsconfig_parser *parser,
+                             const tscfg_allocator *alloc);
+
+static tscfg_rc parse(ts_parse_state *kept, tsconfig_input in,
+      tscfg_fmt fmt, tscfg_batch_reader reader, void *reader_state,
+      tscfg_arena *arena);
+static tscfg_rc parse_hocon(ts_parse_state *kept, tsconfig_input in,
+                            tscfg_batch_reader reader, void *reader_state,
+                            tscfg_arena *arena,
+                            const tscfg_path_filter *filter);
+
+static tscfg_rc callback_adapter_init(tscfg_reader reader, void *reader_state,
+        ts_callback_adapter *adapter,
+        tscfg_batch_reader *batch_reader);
+static bool dispatch_events(void *s, tscfg_event *events, int nevents);
+static tscfg_rc parse_step(ts_parse_state *state);
+static tscfg_rc parse_obj_field(ts_parse_state *state, uint8_t *frame);
+static tscfg_rc parse_arr_elem(ts_parse_state *state, uint8_t *frame);
+static tscfg_rc push_frame(ts_parse_state *state, int frame);
+static inline void set_frame(uint8_t *frame, ts_parse_frame next);
+static tscfg_rc skip_value(ts_parse_state *state, tscfg_tok_tag sep);
+static tscfg_rc push_filter_pos(ts_parse_state *state, tscfg_filter_pos pos);
+
+static tscfg_rc parse_include(ts_parse_state *state);
 static tscfg_rc kv_sep(ts_parse_state *state, tscfg_tok_tag *tag);
 static tscfg_rc accum_whitespace(ts_parse_state *state, bool *newline,
                    bool *comment, tscfg_tok_array *ws_toks);
 
 static tscfg_rc key(ts_parse_state *state, tscfg_tok_array *toks);
-static tscfg_rc value(ts_parse_state *state);
+static tscfg_rc value_item(ts_parse_state *state, uint8_t *frame);
+static tscfg_rc value_sep(ts_parse_state *state, uint8_t *frame);
+static bool value_start_tag(tscfg_tok_tag tag);
 
 static tscfg_rc emit_toks(ts_parse_state *state, tscfg_tok_array *toks,
                           bool check_no_comments);
+static tscfg_rc hand_off_toks(ts_parse_state *state, tscfg_tok_array *toks,
+                              tscfg_tok **out);
+
+static inline tscfg_rc emit_event(ts_parse_state *state, tscfg_event ev);
+static tscfg_rc flush_events(ts_parse_state *state);
+static tscfg_rc rewind_arena(ts_parse_state *state);
+static tscfg_tok *held_tok(ts_parse_state *state, unsigned i);
+static void free_events(tscfg_event *events, int nevents, tscfg_arena *arena);
 
 static tscfg_rc expect_tag(ts_parse_state *state, tscfg_tok_tag expected,
                       const char *errmsg_start);
 
-static tscfg_rc peek_tok(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got);
-static tscfg_rc peek_tok_skip_ws(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got);
-static tscfg_rc peek_tok_impl(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got, bool include_ws);
+static tscfg_rc peek_tok(ts_parse_state *state, tscfg_tok **tok);
+static tscfg_rc peek_tok_skip_ws(ts_parse_state *state, tscfg_tok **tok);
+static tscfg_rc peek_tok_impl(ts_parse_state *state, unsigned ahead,
+                       tscfg_tok **tok, bool include_ws);
 static tscfg_rc peek_tag(ts_parse_state *state, tscfg_tok_tag *tag);
 static tscfg_rc peek_tag_skip_ws(ts_parse_state *state, tscfg_tok_tag *tag);
 
-static void pop_toks(ts_parse_state *state, int count, bool free_toks);
-static tscfg_rc pop_append_toks(ts_parse_state *state, tscfg_tok_array *toks,
-                                int count);
+static inline tscfg_tok *tok_queue_at(ts_tok_queue *q, unsigned i);
+static void count_tok(tsconfig_stats *stats, const tscfg_tok *tok,
+                      unsigned queued, uint64_t start);
+static inline void count_depth(tsconfig_stats *stats, int depth);
+static void pop_toks(ts_parse_state *state, unsigned count, bool free_toks);
+static tscfg_rc pop_append_tok(ts_parse_state *state, tscfg_tok_array *toks);
 
 static tscfg_rc skip_whitespace(ts_parse_state *state, bool *newline);
 
 tscfg_rc tsconfig_parse_tree(tsconfig_input in, tscfg_fmt fmt,
                               tsconfig_tree *cfg) {
-  tscfg_reader reader;
-  tscfg_treeread_state *reader_state;
-  tscfg_rc rc = tscfg_tree_reader_init(&reader, &reader_state);
-  TSCFG_CHECK(rc);
+  return tsconfig_parse_tree_opts(in, fmt, NULL, cfg);
+}
+
+tscfg_rc tsconfig_parse_tree_opts(tsconfig_input in, tscfg_fmt fmt,
+                    const tsconfig_parse_opts *opts, tsconfig_tree *cfg) {
+  return parse_tree(NULL, in, fmt, opts, cfg);
+}
+
+tscfg_rc tsconfig_parser_new(tsconfig_parser **parser) {
+  tsconfig_parser *p = tscfg_malloc(sizeof(tsconfig_parser));
+  TSCFG_CHECK_MALLOC(p);
+
+  ts_parse_state_clear(&p->state);
+  p->tree_reader = NULL;
+  p->pool = NULL;
+  p->pool_threads = 0;
+  p->pool_valid = false;
+  p->alloc = NULL;
+  p->limits = (tsconfig_limits){ 0 };
+
+  *parser = p;
+  return TSCFG_OK;
+}
 
-  rc = tsconfig_parse(in, fmt, reader, (void*)reader_state);
+void tsconfig_parser_free(tsconfig_parser *parser) {
+  if (parser == NULL) {
+    return;
+  }
+
+  parser_use_alloc(parser, NULL);
+  ts_parse_state_finalize(&parser->state);
+  if (parser->tree_reader != NULL) {
+    tscfg_tree_reader_free(parser->tree_reader);
+  }
+  if (parser->pool != NULL) {
+    tscfg_pool_free(parser->pool);
+  }
+  tscfg_free(parser);
+}
+
+tscfg_rc tsconfig_parser_parse_tree(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, const tsconfig_parse_opts *opts,
+      tsconfig_tree *cfg) {
+  return parse_tree(parser, in, fmt, opts, cfg);
+}
+
+void tsconfig_parser_set_limits(tsconfig_parser *parser,
+                                const tsconfig_limits *limits) {
+  parser->limits = (limits != NULL) ? *limits : (tsconfig_limits){ 0 };
+}
+
+tscfg_rc tsconfig_parser_parse(tsconfig_parser *parser, tsconfig_input in,
+      tscfg_fmt fmt, tscfg_reader reader, void *reader_state) {
+  ts_callback_adapter adapter;
+  tscfg_batch_reader batch_reader;
+  tscfg_rc rc = callback_adapter_init(reader, reader_state, &adapter,
+                                      &batch_reader);
   TSCFG_CHECK(rc);
 
+  // Reader takes ownership of tokens, which it frees with malloc
+  parser_use_alloc(parser, NULL);
+  const tsconfig_limits *prev = tscfg_limits_use(&parser->limits);
+  rc = parse(&parser->state, in, fmt, batch_reader, &adapter, NULL);
+  tscfg_limits_use(prev);
+  return rc;
+}
+
+tscfg_rc tsconfig_parser_parse_batch(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, tscfg_batch_reader reader,
+      void *reader_state) {
+  if (reader.events == NULL) {
+    REPORT_ERR("Invalid batch reader");
+    return TSCFG_ERR_ARG;
+  }
+
+  // Reader takes ownership of tokens, which it frees with malloc
+  parser_use_alloc(parser, NULL);
+  const tsconfig_limits *prev = tscfg_limits_use(&parser->limits);
+  tscfg_rc rc = parse(&parser->state, in, fmt, reader, reader_state, NULL);
+  tscfg_limits_use(prev);
+  return rc;
+}
+
+/*
+ * Parse to tree, reusing memory from parser if non-NULL.
+ */
+static tscfg_rc parse_tree(tsconfig_parser *parser, tsconfig_input in,
+      tscfg_fmt fmt, const tsconfig_parse_opts *opts, tsconfig_tree *cfg) {
+  static const tsconfig_parse_opts default_opts = { 0 };
+  if (opts == NULL) {
+    opts = &default_opts;
+  }
+
+  if (parser != NULL) {
+    parser_use_alloc(parser, opts->alloc);
+  }
+
+  if (opts->stats != NULL) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+  }
+
+  // All memory for parse is from allocator, including in worker threads
+  const tscfg_allocator *prev = tscfg_alloc_use(opts->alloc);
+  tsconfig_stats *prev_stats = tscfg_stats_use(opts->stats);
+  const tsconfig_limits *prev_limits = tscfg_limits_use(&opts->limits);
+  tscfg_rc rc = parse_tree_with_alloc(parser, in, fmt, opts, cfg);
+  tscfg_limits_use(prev_limits);
+  tscfg_stats_use(prev_stats);
+  tscfg_alloc_use(prev);
+  return rc;
+}
+
+static tscfg_rc parse_tree_with_alloc(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, const tsconfig_parse_opts *opts,
+      tsconfig_tree *cfg) {
+  if (fmt != TSCFG_HOCON) {
+    REPORT_ERR("Invalid file format code %i", (int)fmt);
+    return TSCFG_ERR_ARG;
+  }
+
+  if (opts->threads < 0) {
+    REPORT_ERR("Invalid number of threads %i", opts->threads);
+    return TSCFG_ERR_ARG;
+  }
+
+  if (opts->npaths < 0) {
+    REPORT_ERR("Invalid number of filter paths %i", opts->npaths);
+    return TSCFG_ERR_ARG;
+  }
+
+  if (opts->limits.max_depth < 0) {
+    REPORT_ERR("Invalid depth limit %i", opts->limits.max_depth);
+    return TSCFG_ERR_ARG;
+  }
+
+  // Input must be read again if filter turns out not to be enough
+  bool can_filter = opts->npaths > 0 && in.kind != TS_CONFIG_IN_FUNC;
+  long file_start = 0;
+  if (can_filter && in.kind == TS_CONFIG_IN_FILE) {
+    file_start = ftell(in.data.f);
+    can_filter = (file_start >= 0);
+  }
+
+  tscfg_path_filter *filter = NULL;
+  tscfg_rc rc;
+  if (can_filter) {
+    rc = tscfg_path_filter_new(opts->paths, opts->npaths, &filter);
+    TSCFG_CHECK(rc);
+  }
+
+  // Only a mapped file has a path for includes to be relative to
+  const char *path = (in.kind == TS_CONFIG_IN_MMAP) ? in.data.path : NULL;
+
+  // Parser keeps its pool, so threads are only started once
+  tscfg_pool *pool = NULL;
+  if (parser != NULL) {
+    rc = parser_pool(parser, opts->threads, &pool);
+  } else {
+    rc = tscfg_pool_new(opts->threads, &pool);
+  }
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
   tsconfig_tree tree;
-  rc = tscfg_tree_reader_done(reader_state, &tree);
-  TSCFG_CHECK(rc);
+  rc = read_tree(parser, in, path, pool, filter, &tree);
+  TSCFG_CHECK_GOTO(rc, cleanup);
 
-  // TODO: additional processing to merge values, etc
+  if (filter != NULL) {
+    bool covered;
+    rc = subs_in_filter(&tree, filter, &covered);
+    if (rc == TSCFG_OK && !covered) {
+      // Substitution may refer to skipped value: parse all of input
+      tsconfig_tree_free(&tree);
+      if (in.kind == TS_CONFIG_IN_FILE &&
+          fseek(in.data.f, file_start, SEEK_SET) != 0) {
+        REPORT_ERR("Could not seek to start of input file");
+        rc = TSCFG_ERR_IO;
+        goto cleanup;
+      }
+
+      rc = read_tree(parser, in, path, pool, NULL, &tree);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+    } else if (rc != TSCFG_OK) {
+      tsconfig_tree_free(&tree);
+      goto cleanup;
+    }
+  }
+
+  if (pool != NULL && parser == NULL) {
+    tscfg_pool_free(pool);
+  }
+  tscfg_path_filter_free(filter);
+
+  rc = tscfg_finish_tree(&tree, opts->stats);
+  TSCFG_CHECK(rc);
 
   *cfg = tree;
   return TSCFG_OK;
+
+cleanup:
+  if (pool != NULL && parser == NULL) {
+    tscfg_pool_free(pool);
+  }
+  tscfg_path_filter_free(filter);
+  return rc;
+}
+
+tscfg_rc tscfg_finish_tree(tsconfig_tree *tree, tsconfig_stats *stats) {
+  uint64_t t0 = 0, t1 = 0, t2 = 0;
+  TSCFG_STAT(stats, t0 = tscfg_stats_now());
+  tscfg_rc rc = tscfg_tree_merge(tree);
+  TSCFG_STAT(stats, t1 = tscfg_stats_now());
+  if (rc == TSCFG_OK) {
+    rc = tscfg_tree_build_index(tree);
+  }
+  TSCFG_STAT(stats, t2 = tscfg_stats_now());
+  if (rc == TSCFG_OK) {
+    rc = tscfg_tree_resolve(tree);
+  }
+  TSCFG_STAT(stats, stats->merge_ns += t1 - t0;
+                    stats->build_ns += t2 - t1;
+                    stats->resolve_ns += tscfg_stats_now() - t2);
+  if (rc != TSCFG_OK) {
+    tsconfig_tree_free(tree);
+    return rc;
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Get pool for number of threads, creating a new one if the number
+ * changed since the last tree.
+ */
+static tscfg_rc parser_pool(tsconfig_parser *parser, int threads,
+                            tscfg_pool **pool) {
+  if (!parser->pool_valid || parser->pool_threads != threads) {
+    if (parser->pool != NULL) {
+      tscfg_pool_free(parser->pool);
+      parser->pool = NULL;
+    }
+    parser->pool_valid = false;
+
+    tscfg_rc rc = tscfg_pool_new(threads, &parser->pool);
+    TSCFG_CHECK(rc);
+
+    parser->pool_threads = threads;
+    parser->pool_valid = true;
+  }
+
+  *pool = parser->pool;
+  return TSCFG_OK;
+}
+
+/*
+ * Check that substitutions in unmerged tree only refer to paths wanted by
+ * filter, so that they resolve to the same values as without filter.
+ * Paths from included files are checked with and without the prefix, as
+ * both may be looked up.
+ */
+static tscfg_rc subs_in_filter(const tsconfig_tree *tree,
+              const tscfg_path_filter *filter, bool *covered) {
+  tscfg_rc rc = TSCFG_OK;
+  const char **elems = NULL;
+  size_t *lens = NULL;
+  size_t size = 0;
+
+  *covered = true;
+  for (size_t i = 0; i < tree->tape_len && *covered; i++) {
+    tscfg_tape_tag tag = tscfg_tape_get_tag(tree->tape[i]);
+    if (tag != TSCFG_TAPE_SUB && tag != TSCFG_TAPE_SUB_OPT) {
+      continue;
+    }
+
+    size_t end = i + (size_t)tscfg_tape_get_payload(tree->tape[i]);
+    size_t nelems = end - i - 1;
+    if (nelems > size) {
+      size = nelems * 2;
+      void *tmp = tscfg_realloc(elems, sizeof(elems[0]) * size);
+      TSCFG_CHECK_MALLOC_GOTO(tmp, cleanup, rc);
+      elems = tmp;
+
+      tmp = tscfg_realloc(lens, sizeof(lens[0]) * size);
+      TSCFG_CHECK_MALLOC_GOTO(tmp, cleanup, rc);
+      lens = tmp;
+    }
+
+    size_t nprefix = 0;
+    for (size_t j = 0; j < nelems; j++) {
+      tscfg_tape_entry e = tree->tape[i + 1 + j];
+      if (tscfg_tape_get_tag(e) == TSCFG_TAPE_PATH_PREFIX) {
+        nprefix++;
+      }
+      elems[j] = tscfg_tape_str(tree, e, &lens[j]);
+    }
+
+    *covered = tscfg_path_filter_covers(filter, elems, lens, (int)nelems) &&
+        (nprefix == 0 || tscfg_path_filter_covers(filter, elems + nprefix,
+                              lens + nprefix, (int)(nelems - nprefix)));
+    i = end;
+  }
+
+cleanup:
+  tscfg_free(elems);
+  tscfg_free(lens);
+  return rc;
+}
+
+tscfg_rc tscfg_read_tree(tsconfig_input in, const char *path, int depth,
+                         tscfg_pool *pool, const tscfg_path_filter *filter,
+                         tsconfig_tree *tree, tscfg_include ***incs,
+                         size_t *nincs) {
+  if (pool != NULL) {
+    bool done;
+    tscfg_rc rc = tscfg_read_tree_parts(in, path, depth, pool, filter, tree,
+                                        incs, nincs, &done);
+    if (done) {
+      return rc;
+    }
+  }
+
+  return read_tree_whole(NULL, in, path, depth, pool, filter, tree, incs,
+                         nincs);
+}
+
+/*
+ * Read top-level tree as tscfg_read_tree(), reusing memory from parser
+ * if non-NULL when not split into parts.
+ */
+static tscfg_rc read_tree(tsconfig_parser *parser, tsconfig_input in,
+      const char *path, tscfg_pool *pool, const tscfg_path_filter *filter,
+      tsconfig_tree *tree) {
+  if (pool != NULL) {
+    bool done;
+    tscfg_rc rc = tscfg_read_tree_parts(in, path, 0, pool, filter, tree,
+                                        NULL, NULL, &done);
+    if (done) {
+      return rc;
+    }
+  }
+
+  return read_tree_whole(parser, in, path, 0, pool, filter, tree, NULL,
+                         NULL);
+}
+
+tscfg_rc tscfg_read_tree_whole(tsconfig_input in, const char *path,
+                               int depth, tscfg_pool *pool,
+                               const tscfg_path_filter *filter,
+                               tsconfig_tree *tree, tscfg_include ***incs,
+                               size_t *nincs) {
+  return read_tree_whole(NULL, in, path, depth, pool, filter, tree, incs,
+                         nincs);
+}
+
+/*
+ * Read tree as tscfg_read_tree_whole(), reusing parse state and tree
+ * reader from parser if non-NULL.
+ */
+static tscfg_rc read_tree_whole(tsconfig_parser *parser, tsconfig_input in,
+      const char *path, int depth, tscfg_pool *pool,
+      const tscfg_path_filter *filter, tsconfig_tree *tree,
+      tscfg_include ***incs, size_t *nincs) {
+  tscfg_batch_reader reader;
+  tscfg_treeread_state *reader_state;
+  tscfg_rc rc;
+  if (parser != NULL) {
+    rc = parser_tree_reader(parser, &reader, &reader_state);
+  } else {
+    rc = tscfg_tree_reader_init(&reader, &reader_state);
+  }
+  TSCFG_CHECK(rc);
+
+  rc = tscfg_tree_reader_set_file(reader_state, path, depth, pool);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  // Tokens are copied into tree, so can be allocated from scratch arena
+  tscfg_arena *arena = tscfg_tree_reader_arena(reader_state);
+  rc = parse_hocon((parser != NULL) ? &parser->state : NULL, in, reader,
+                   reader_state, arena, filter);
+  if (rc == TSCFG_ERR_READER) {
+    rc = tscfg_tree_reader_err(reader_state);
+  }
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  rc = tscfg_tree_reader_finish_includes(reader_state);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  if (incs != NULL) {
+    tscfg_tree_reader_take_includes(reader_state, incs, nincs);
+  }
+
+  if (parser != NULL) {
+    rc = tscfg_tree_reader_take(reader_state, tree);
+    parser_tree_reader_done(parser);
+  } else {
+    rc = tscfg_tree_reader_done(reader_state, tree);
+  }
+  if (rc != TSCFG_OK && incs != NULL) {
+    for (size_t i = 0; i < *nincs; i++) {
+      tscfg_include_release((*incs)[i]);
+    }
+    tscfg_free(*incs);
+  }
+  return rc;
+
+cleanup:
+  if (parser != NULL) {
+    parser_tree_reader_done(parser);
+  } else {
+    tscfg_tree_reader_free(reader_state);
+  }
+  return rc;
+}
+
+/*
+ * Switch allocator for memory kept by parser, freeing memory from the
+ * previous allocator.
+ */
+static void parser_use_alloc(tsconfig_parser *parser,
+                             const tscfg_allocator *alloc) {
+  if (parser->alloc == alloc) {
+    return;
+  }
+
+  const tscfg_allocator *prev = tscfg_alloc_use(parser->alloc);
+  ts_parse_state_finalize(&parser->state);
+  ts_parse_state_clear(&parser->state);
+  if (parser->tree_reader != NULL) {
+    tscfg_tree_reader_free(parser->tree_reader);
+    parser->tree_reader = NULL;
+  }
+  tscfg_alloc_use(prev);
+
+  parser->alloc = alloc;
+}
+
+/*
+ * Get parser's tree reader, creating it for the first tree.
+ */
+static tscfg_rc parser_tree_reader(tsconfig_parser *parser,
+      tscfg_batch_reader *reader, tscfg_treeread_state **reader_state) {
+  if (parser->tree_reader == NULL) {
+    tscfg_rc rc = tscfg_tree_reader_init(&parser->tree_batch_reader,
+                                         &parser->tree_reader);
+    TSCFG_CHECK(rc);
+  }
+
+  *reader = parser->tree_batch_reader;
+  *reader_state = parser->tree_reader;
+  return TSCFG_OK;
+}
+
+/*
+ * Reset parser's tree reader after a tree was read or failed, freeing it
+ * if it can't be reset.
+ */
+static void parser_tree_reader_done(tsconfig_parser *parser) {
+  tscfg_rc rc = tscfg_tree_reader_reset(parser->tree_reader);
+  if (rc != TSCFG_OK) {
+    tscfg_tree_reader_free(parser->tree_reader);
+    parser->tree_reader = NULL;
+  }
 }
 
 tscfg_rc tsconfig_parse(tsconfig_input in, tscfg_fmt fmt,
       tscfg_reader reader, void *reader_state) {
+  ts_callback_adapter adapter;
+  tscfg_batch_reader batch_reader;
+  tscfg_rc rc = callback_adapter_init(reader, reader_state, &adapter,
+                                      &batch_reader);
+  TSCFG_CHECK(rc);
+
+  // Reader takes ownership of tokens
+  return parse(NULL, in, fmt, batch_reader, &adapter, NULL);
+}
+
+tscfg_rc tsconfig_parse_batch(tsconfig_input in, tscfg_fmt fmt,
+      tscfg_batch_reader reader, void *reader_state) {
+  if (reader.events == NULL) {
+    REPORT_ERR("Invalid batch reader");
+    return TSCFG_ERR_ARG;
+  }
+
+  // Reader takes ownership of tokens
+  return parse(NULL, in, fmt, reader, reader_state, NULL);
+}
+
+/*
+ * kept: parse state to reuse, or NULL to use a new one
+ */
+static tscfg_rc parse(ts_parse_state *kept, tsconfig_input in,
+      tscfg_fmt fmt, tscfg_batch_reader reader, void *reader_state,
+      tscfg_arena *arena) {
   if (fmt == TSCFG_HOCON) {
-    return parse_hocon(in, reader, reader_state);
+    return parse_hocon(kept, in, reader, reader_state, arena, NULL);
   } else {
     REPORT_ERR("Invalid file format code %i", (int)fmt);
     return TSCFG_ERR_ARG;
   }
 }
 
-static tscfg_rc parse_hocon(tsconfig_input in, tscfg_reader reader,
-    void *reader_state) {
-  ts_parse_state state;
+/*
+ * kept: parse state to reuse, or NULL to use a new one
+ */
+static tscfg_rc parse_hocon(ts_parse_state *kept, tsconfig_input in,
+    tscfg_batch_reader reader, void *reader_state, tscfg_arena *arena,
+    const tscfg_path_filter *filter) {
+  ts_parse_state fresh;
+  ts_parse_state *state = kept;
+  if (state == NULL) {
+    state = &fresh;
+    ts_parse_state_clear(state);
+  }
 
-  tscfg_rc rc = TSCFG_ERR_UNKNOWN;
+  // Parse time excludes time in lexer and reader
+  tsconfig_stats *stats = tscfg_stats_current();
+  uint64_t start = 0, lex_start = 0, build_start = 0;
+  TSCFG_STAT(stats, start = tscfg_stats_now();
+                    lex_start = stats->lex_ns;
+                    build_start = stats->build_ns);
 
-  rc = ts_parse_state_init(&state, in, reader, reader_state);
+  tscfg_rc rc = ts_parse_state_start(state, in, reader, reader_state, arena,
+                                     filter);
   TSCFG_CHECK_GOTO(rc, cleanup);
 
-  tscfg_tok_tag open_tag; // E.g. open brace
+  while (state->nframes > 0) {
+    rc = parse_step(state);
+    TSCFG_CHECK_GOTO(rc, cleanup);
 
-  rc = peek_tag_skip_ws(&state, &open_tag);
+    if (state->arena_stale) {
+      rc = rewind_arena(state);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+    }
+  }
+
+  // Deliver remaining events
+  rc = flush_events(state);
   TSCFG_CHECK_GOTO(rc, cleanup);
 
-  if (open_tag == TSCFG_TOK_OPEN_BRACE ||
-      open_tag == TSCFG_TOK_OPEN_SQUARE) {
-    pop_toks(&state, 1, true);
+  rc = TSCFG_OK;
+cleanup:
+  if (kept != NULL) {
+    ts_parse_state_stop(state);
   } else {
-    // No initial punctuation
-    open_tag = TSCFG_TOK_INVALID;
+    ts_parse_state_finalize(state);
   }
 
-  if (open_tag == TSCFG_TOK_OPEN_SQUARE) {
-    // Array
-    rc = parse_hocon_arr_body(&state);
-    TSCFG_CHECK_GOTO(rc, cleanup);
-  } else {
-    // Explicit or implicit object
-    rc = parse_hocon_obj_body(&state);
-    TSCFG_CHECK_GOTO(rc, cleanup);
+  TSCFG_STAT(stats, stats->parse_ns += tscfg_stats_now() - start -
+              (stats->lex_ns - lex_start) - (stats->build_ns - build_start));
+  return rc;
+}
+
+tscfg_rc tsconfig_iter_new(tsconfig_input in, tscfg_fmt fmt,
+                           tsconfig_iter **it) {
+  if (fmt != TSCFG_HOCON) {
+    REPORT_ERR("Invalid file format code %i", (int)fmt);
+    return TSCFG_ERR_ARG;
   }
 
-  if (open_tag != TSCFG_TOK_INVALID) {
-    tscfg_tok_tag close_tag;
+  tsconfig_iter *i = tscfg_malloc(sizeof(tsconfig_iter));
+  TSCFG_CHECK_MALLOC(i);
 
-    // Whitespace should be all consumed before here
-    rc = peek_tag(&state, &close_tag);
-    TSCFG_CHECK_GOTO(rc, cleanup);
+  // No reader: events stay queued for tsconfig_iter_next()
+  tscfg_batch_reader reader = { .events = NULL,
+                                .batch_size = ITER_INIT_EVENTS };
+  tscfg_rc rc = ts_parse_state_init(&i->state, in, reader, NULL, NULL,
+                                    NULL);
+  if (rc != TSCFG_OK) {
+    tscfg_free(i);
+    return rc;
+  }
 
-    if ((open_tag == TSCFG_TOK_OPEN_BRACE &&
-          close_tag == TSCFG_TOK_CLOSE_BRACE) ||
-        (open_tag == TSCFG_TOK_OPEN_SQUARE &&
-          close_tag == TSCFG_TOK_CLOSE_SQUARE)) {
-      pop_toks(&state, 1, true);
-    } else {
-      const char *msg = (open_tag == TSCFG_TOK_OPEN_BRACE) ?
-              "Expected closing brace to match initial open" :
-              "Expected closing square bracket to match initial open";
-      PARSE_REPORT_ERR(&state, msg);
-      rc = TSCFG_ERR_SYNTAX;
-      goto cleanup;
-    }
+  i->next_event = 0;
+  i->rc = TSCFG_OK;
+  *it = i;
+  return TSCFG_OK;
+}
+
+tscfg_rc tsconfig_iter_next(tsconfig_iter *it, tscfg_event *ev, bool *done) {
+  ts_parse_state *state = &it->state;
+  if (it->rc != TSCFG_OK) {
+    return it->rc;
   }
 
-  tscfg_tok tok;
-  int got;
-  rc = peek_tok_skip_ws(&state, &tok, 1, &got);
-  assert(got == 1); // Should get at least end of file
-  if (tok.tag != TSCFG_TOK_EOF) {
-    // TODO: include token tag
-    PARSE_REPORT_ERR(&state, "Trailing tokens, starting with: %.*s",
-                             (int)tok.len, tok.str);
+  // Parse until at least one event is queued, reusing the queue
+  while (it->next_event == state->nevents) {
+    it->next_event = 0;
+    state->nevents = 0;
+
+    if (state->nframes == 0) {
+      *done = true;
+      return TSCFG_OK;
+    }
+
+    tscfg_rc rc = parse_step(state);
+    if (rc != TSCFG_OK) {
+      it->rc = rc;
+      return rc;
+    }
   }
 
-  rc = TSCFG_OK;
-cleanup:
-  ts_parse_state_finalize(&state);
-  return rc;
+  // Caller takes over event
+  *ev = state->events[it->next_event++];
+  *done = false;
+  return TSCFG_OK;
+}
+
+void tsconfig_iter_free(tsconfig_iter *it) {
+  ts_parse_state *state = &it->state;
+
+  // Free events not yet handed out
+  free_events(&state->events[it->next_event],
+              state->nevents - it->next_event, NULL);
+  state->nevents = 0;
+
+  ts_parse_state_finalize(state);
+  tscfg_free(it);
+}
+
+void tsconfig_event_free(tscfg_event *ev) {
+  free_events(ev, 1, NULL);
 }
 
 /*
- * Parse object body, returning when we hit } or EOF
+ * Parse the next part of the input for the innermost frame, passing on
+ * any events.  The parser is finished once the frame stack is empty.
+ *
+ * Each nesting level of the input has frames on the stack instead of
+ * recursive calls, so that the iterator can stop after any event.
  */
-static tscfg_rc parse_hocon_obj_body(ts_parse_state *state) {
+static tscfg_rc parse_step(ts_parse_state *state) {
   tscfg_rc rc;
-  bool ok;
+  assert(state->nframes > 0);
+  uint8_t *frame = &state->frames[state->nframes - 1];
 
-  rc = skip_whitespace(state, NULL);
-  TSCFG_CHECK(rc);
+  switch ((ts_parse_frame)(*frame & ~FRAME_FLAGS)) {
+    case FRAME_ROOT: {
+      tscfg_tok_tag open_tag; // E.g. open brace
 
-  ok = state->reader.obj_start(state->reader_state);
-  TSCFG_COND(ok, TSCFG_ERR_READER);
+      rc = peek_tag_skip_ws(state, &open_tag);
+      TSCFG_CHECK(rc);
 
-  while (true) {
-    // Check for close brace or EOF.
-    // Whitespace should already be consumed.
-    tscfg_tok tok;
-    int got;
-    rc = peek_tok(state, &tok, 1, &got);
-    TSCFG_CHECK(rc);
-    if (got == 0 ||
-        tok.tag == TSCFG_TOK_CLOSE_BRACE ||
-        tok.tag == TSCFG_TOK_EOF) {
-      break;
+      if (open_tag == TSCFG_TOK_OPEN_SQUARE) {
+        // Array
+        pop_toks(state, 1, true);
+        set_frame(frame, FRAME_ROOT_CLOSE_SQUARE);
+        return push_frame(state, FRAME_ARR_START);
+      }
+
+      // Fields of root object are filtered, but not elements of array
+      int obj_frame = FRAME_OBJ_START;
+      if (state->filter != NULL) {
+        obj_frame |= FRAME_FILTERED;
+      }
+
+      if (open_tag == TSCFG_TOK_OPEN_BRACE) {
+        // Explicit object
+        pop_toks(state, 1, true);
+        set_frame(frame, FRAME_ROOT_CLOSE_BRACE);
+        return push_frame(state, obj_frame);
+      } else {
+        // Implicit object: no initial punctuation
+        set_frame(frame, FRAME_ROOT_END);
+        return push_frame(state, obj_frame);
+      }
     }
-    
-    // Include is handled as a special case of an unquoted string
-    if (tok.tag == TSCFG_TOK_UNQUOTED &&
-        tok.len == 7 && memcmp("include", tok.str, 7) == 0) {
+
+    case FRAME_ROOT_CLOSE_BRACE:
+    case FRAME_ROOT_CLOSE_SQUARE: {
+      bool brace = (*frame == FRAME_ROOT_CLOSE_BRACE);
+      tscfg_tok_tag close_tag;
+
+      // Whitespace should be all consumed before here
+      rc = peek_tag(state, &close_tag);
+      TSCFG_CHECK(rc);
+
+      if (close_tag != (brace ? TSCFG_TOK_CLOSE_BRACE :
+                                TSCFG_TOK_CLOSE_SQUARE)) {
+        const char *msg = brace ?
+                "Expected closing brace to match initial open" :
+                "Expected closing square bracket to match initial open";
+        PARSE_REPORT_ERR(state, msg);
+        return TSCFG_ERR_SYNTAX;
+      }
+
       pop_toks(state, 1, true);
+      set_frame(frame, FRAME_ROOT_END);
+      return TSCFG_OK;
+    }
 
-      // TODO: check for quoted string, or file()/url()/classpath()
-      PARSE_REPORT_ERR(state, "HOCON includes not yet supported");
-      return TSCFG_ERR_UNIMPL;
-    } else {
-      tscfg_tok_array key_toks;
-      rc = key(state, &key_toks);
+    case FRAME_ROOT_END: {
+      tscfg_tok *tok;
+      rc = peek_tok_skip_ws(state, &tok);
+      TSCFG_CHECK(rc);
+      if (tok->tag != TSCFG_TOK_EOF) {
+        // TODO: include token tag
+        PARSE_REPORT_ERR(state, "Trailing tokens, starting with: %.*s",
+                                 (int)tok->len, tok->str);
+        return TSCFG_ERR_SYNTAX;
+      }
+
+      state->nframes--;
+      return TSCFG_OK;
+    }
+
+    case FRAME_OBJ_START:
+      rc = skip_whitespace(state, NULL);
+      TSCFG_CHECK(rc);
+
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_OBJ_START });
+      TSCFG_CHECK(rc);
+      state->depth++;
+      TSCFG_STAT(state->stats, count_depth(state->stats, state->depth));
+
+      set_frame(frame, FRAME_OBJ_FIELD);
+      return parse_obj_field(state, frame);
+
+    case FRAME_OBJ_FIELD:
+      return parse_obj_field(state, frame);
+
+    case FRAME_OBJ_FIELD_END:
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_KEY_VAL_END });
+      TSCFG_CHECK(rc);
+
+      if ((*frame & FRAME_PARTIAL) != 0) {
+        state->nfilter_pos--;
+        *frame &= (uint8_t)~FRAME_PARTIAL;
+      }
+
+      set_frame(frame, FRAME_OBJ_FIELD);
+      return parse_obj_field(state, frame);
+
+    case FRAME_ARR_START:
+      rc = skip_whitespace(state, NULL);
+      TSCFG_CHECK(rc);
+
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_ARR_START });
+      TSCFG_CHECK(rc);
+      state->depth++;
+      TSCFG_STAT(state->stats, count_depth(state->stats, state->depth));
+
+      set_frame(frame, FRAME_ARR_ELEM);
+      return parse_arr_elem(state, frame);
+
+    case FRAME_ARR_ELEM:
+      return parse_arr_elem(state, frame);
+
+    case FRAME_ARR_ELEM_END:
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_VAL_END });
       TSCFG_CHECK(rc);
 
-      // Separator before value
-      tscfg_tok_tag sep;
-      rc = kv_sep(state, &sep);
+      set_frame(frame, FRAME_ARR_ELEM);
+      return parse_arr_elem(state, frame);
+
+    case FRAME_VAL_START:
+      rc = skip_whitespace(state, NULL);
       TSCFG_CHECK(rc);
 
-      ok = state->reader.key_val_start(state->reader_state,
-                        key_toks.toks, key_toks.len, sep);
-      key_toks = TSCFG_EMPTY_TOK_ARRAY; // Ownership of array passed in
-      TSCFG_COND(ok, TSCFG_ERR_READER);
+      set_frame(frame, FRAME_VAL_ITEM);
+      return value_item(state, frame);
+
+    case FRAME_VAL_ITEM:
+      return value_item(state, frame);
 
-      // Parse value
-      rc = value(state);
+    case FRAME_VAL_CLOSE_BRACE:
+      rc = expect_tag(state, TSCFG_TOK_CLOSE_BRACE, "Expected close brace");
       TSCFG_CHECK(rc);
 
-      ok = state->reader.key_val_end(state->reader_state);
-      TSCFG_COND(ok, TSCFG_ERR_READER);
+      pop_toks(state, 1, true);
+      return value_sep(state, frame);
+
+    case FRAME_VAL_CLOSE_SQUARE:
+      rc = expect_tag(state, TSCFG_TOK_CLOSE_SQUARE,
+                      "Expected close square bracket");
+      TSCFG_CHECK(rc);
+
+      pop_toks(state, 1, true);
+      return value_sep(state, frame);
+  }
+
+  assert(false);
+  return TSCFG_ERR_UNKNOWN;
+}
+
+/*
+ * Parse next field of object body, or finish object if we hit } or EOF.
+ * frame: innermost frame, which may be invalidated by pushing a frame
+ */
+static tscfg_rc parse_obj_field(ts_parse_state *state, uint8_t *frame) {
+  tscfg_rc rc;
+
+  // Check for close brace or EOF, skipping any whitespace after comma.
+  tscfg_tok *tok;
+  rc = peek_tok_skip_ws(state, &tok);
+  TSCFG_CHECK(rc);
+  if (tok->tag == TSCFG_TOK_CLOSE_BRACE ||
+      tok->tag == TSCFG_TOK_EOF) {
+    state->nframes--;
+    state->depth--;
+    return emit_event(state, (tscfg_event){ .tag = TSCFG_EV_OBJ_END });
+  }
+
+  // Include is handled as a special case of an unquoted string
+  if (tok->tag == TSCFG_TOK_UNQUOTED &&
+      tok->len == 7 && memcmp("include", tok->str, 7) == 0) {
+    pop_toks(state, 1, true);
+    return parse_include(state);
+  }
+
+  tscfg_tok_array key_toks;
+  rc = key(state, &key_toks);
+  TSCFG_CHECK(rc);
+
+  // Separator before value
+  tscfg_tok_tag sep;
+  rc = kv_sep(state, &sep);
+  if (rc != TSCFG_OK) {
+    tscfg_tok_array_free(&key_toks, true);
+    return rc;
+  }
+
+  tscfg_filter_match match = TSCFG_FILTER_KEEP;
+  tscfg_filter_pos inner;
+  if ((*frame & FRAME_FILTERED) != 0) {
+    match = tscfg_path_filter_key(state->filter,
+                  state->filter_pos[state->nfilter_pos - 1],
+                  key_toks.toks, key_toks.len, &inner);
+    if (match == TSCFG_FILTER_SKIP) {
+      // Keep array for next key
+      tscfg_tok_array_free(&key_toks, false);
+      tscfg_tok_array_free(&state->spare_toks, true);
+      state->spare_toks = key_toks;
+      return skip_value(state, sep);
     }
   }
 
-  ok = state->reader.obj_end(state->reader_state);
-  TSCFG_COND(ok, TSCFG_ERR_READER);
-  return TSCFG_OK;
+  if (match == TSCFG_FILTER_EMPTY) {
+    // Only key up to wanted prefix is kept, e.g. a of a.c for a.b
+    int depth = state->filter_pos[state->nfilter_pos - 1].depth;
+    int nkeep = tscfg_path_key_prefix(key_toks.toks, key_toks.len,
+                                      inner.depth - depth);
+    for (int i = nkeep; i < key_toks.len; i++) {
+      tscfg_tok_free(&key_toks.toks[i]);
+    }
+    key_toks.len = nkeep;
+  }
+
+  int nkey_toks = key_toks.len;
+  tscfg_tok *key_arr;
+  rc = hand_off_toks(state, &key_toks, &key_arr);
+  TSCFG_CHECK(rc);
+
+  if (match == TSCFG_FILTER_EMPTY) {
+    // Field with empty object in place of value
+    rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_KEY_VAL_START,
+                .data.key = { key_arr, nkey_toks, TSCFG_TOK_OPEN_BRACE } });
+    TSCFG_CHECK(rc);
+
+    const tscfg_event_tag tags[] = { TSCFG_EV_OBJ_START, TSCFG_EV_OBJ_END,
+                                     TSCFG_EV_KEY_VAL_END };
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+      rc = emit_event(state, (tscfg_event){ .tag = tags[i] });
+      TSCFG_CHECK(rc);
+    }
+    return skip_value(state, sep);
+  }
+
+  rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_KEY_VAL_START,
+                    .data.key = { key_arr, nkey_toks, sep } });
+  TSCFG_CHECK(rc);
+
+  // Parse value
+  set_frame(frame, FRAME_OBJ_FIELD_END);
+
+  // Objects in value are filtered unless appended to array
+  if (match == TSCFG_FILTER_PARTIAL && sep != TSCFG_TOK_PLUSEQUAL) {
+    rc = push_filter_pos(state, inner);
+    TSCFG_CHECK(rc);
+
+    *frame |= FRAME_PARTIAL;
+    return push_frame(state, FRAME_VAL_START | FRAME_FILTERED);
+  }
+  return push_frame(state, FRAME_VAL_START);
+}
+
+/*
+ * Skip over value of field that filter doesn't want, without tokenizing
+ * it.
+ * sep: key/value separator, already consumed unless open brace
+ */
+static tscfg_rc skip_value(ts_parse_state *state, tscfg_tok_tag sep) {
+  bool in_obj = false;
+  if (sep == TSCFG_TOK_OPEN_BRACE) {
+    pop_toks(state, 1, true);
+    in_obj = true;
+  }
+
+  // Lexer must be positioned right after separator
+  assert(state->toks.len == 0);
+  uint64_t start = 0;
+  TSCFG_STAT(state->stats, start = tscfg_stats_now());
+  tscfg_rc rc = tscfg_lex_skip_value(&state->lex_state, in_obj);
+  TSCFG_STAT(state->stats,
+             state->stats->lex_ns += tscfg_stats_now() - start);
+  return rc;
 }
 
 /*
- * Parse array body, returning when we hit } or EOF
+ * Parse next element of array body, or finish array if we hit ] or EOF.
+ * frame: innermost frame, which may be invalidated by pushing a frame
  */
-static tscfg_rc parse_hocon_arr_body(ts_parse_state *state) {
+static tscfg_rc parse_arr_elem(ts_parse_state *state, uint8_t *frame) {
   tscfg_rc rc;
-  bool ok;
 
-  rc = skip_whitespace(state, NULL);
+  // Check for close square bracket or EOF, skipping any whitespace
+  // after comma.
+  tscfg_tok_tag tag;
+  rc = peek_tag_skip_ws(state, &tag);
   TSCFG_CHECK(rc);
+  if (tag == TSCFG_TOK_CLOSE_SQUARE ||
+      tag == TSCFG_TOK_EOF) {
+    state->nframes--;
+    state->depth--;
+    return emit_event(state, (tscfg_event){ .tag = TSCFG_EV_ARR_END });
+  }
 
-  ok = state->reader.arr_start(state->reader_state);
-  TSCFG_COND(ok, TSCFG_ERR_READER);
+  // Value would consume nothing, so we'd never make progress
+  if (!value_start_tag(tag)) {
+    PARSE_REPORT_ERR(state, "Unexpected token in array: %s",
+                     tscfg_tok_tag_name(tag));
+    return TSCFG_ERR_SYNTAX;
+  }
+
+  rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_VAL_START });
+  TSCFG_CHECK(rc);
+
+  // Parse value
+  set_frame(frame, FRAME_ARR_ELEM_END);
+  return push_frame(state, FRAME_VAL_START);
+}
+
+/*
+ * Push frame for new innermost nesting level.
+ * frame: ts_parse_frame value, with any flags
+ */
+static tscfg_rc push_frame(ts_parse_state *state, int frame) {
+  // Object or array is nested one deeper than current position
+  int next = frame & ~FRAME_FLAGS;
+  if ((next == FRAME_OBJ_START || next == FRAME_ARR_START) &&
+      state->max_depth > 0 && state->depth >= state->max_depth) {
+    REPORT_ERR("Nesting at input offset %zu deeper than limit of %i",
+               tscfg_lex_offset(&state->lex_state), state->max_depth);
+    return TSCFG_ERR_LIMIT;
+  }
+
+  if (state->nframes == state->frames_size) {
+    int new_size = (state->frames_size == 0) ? INIT_FRAMES
+                                             : state->frames_size * 2;
+    void *tmp = tscfg_realloc(state->frames, (size_t)new_size);
+    TSCFG_CHECK_MALLOC(tmp);
+
+    state->frames = tmp;
+    state->frames_size = new_size;
+  }
+
+  state->frames[state->nframes++] = (uint8_t)frame;
+  return TSCFG_OK;
+}
 
+/*
+ * Change state of frame, keeping flags.
+ */
+static inline void set_frame(uint8_t *frame, ts_parse_frame next) {
+  *frame = (uint8_t)((*frame & FRAME_FLAGS) | (int)next);
+}
+
+/*
+ * Push filter position for object in value of current field.
+ */
+static tscfg_rc push_filter_pos(ts_parse_state *state, tscfg_filter_pos pos) {
+  if (state->nfilter_pos == state->filter_pos_size) {
+    int new_size = (state->filter_pos_size == 0) ? INIT_FILTER_POS
+                                                 : state->filter_pos_size * 2;
+    void *tmp = tscfg_realloc(state->filter_pos,
+                        sizeof(state->filter_pos[0]) * (size_t)new_size);
+    TSCFG_CHECK_MALLOC(tmp);
+
+    state->filter_pos = tmp;
+    state->filter_pos_size = new_size;
+  }
+
+  state->filter_pos[state->nfilter_pos++] = pos;
+  return TSCFG_OK;
+}
+
+/*
+ * Parse include statement after include keyword:
+ *   include "a.conf"
+ *   include file("a.conf")
+ *   include required("a.conf")
+ *   include required(file("a.conf"))
+ *
+ * Parentheses aren't special in unquoted strings, so "required(file(" may
+ * be a single token: the text of tokens either side of the quoted name is
+ * matched instead.
+ */
+static tscfg_rc parse_include(ts_parse_state *state) {
+  tscfg_rc rc;
+
+  // Longest valid text before quoted name is "required(classpath("
+  char text[24];
+  size_t text_len = 0;
+
+  tscfg_tok *tok;
   while (true) {
-    // Check for close square bracket or EOF.
-    // Whitespace should already be consumed.
-    tscfg_tok_tag tag;
-    rc = peek_tag(state, &tag);
+    rc = peek_tok(state, &tok);
     TSCFG_CHECK(rc);
-    if (tag == TSCFG_TOK_CLOSE_SQUARE ||
-        tag == TSCFG_TOK_EOF) {
+
+    const char *str;
+    size_t len;
+    if (tok->tag == TSCFG_TOK_WS) {
+      pop_toks(state, 1, true);
+      continue;
+    } else if (tok->tag == TSCFG_TOK_UNQUOTED) {
+      str = tok->str;
+      len = tok->len;
+    } else if (tok->tag == TSCFG_TOK_OPEN_PAREN) {
+      str = "(";
+      len = 1;
+    } else {
       break;
     }
 
-    ok = state->reader.val_start(state->reader_state);
-    TSCFG_COND(ok, TSCFG_ERR_READER);
+    if (len > sizeof(text) - text_len) {
+      PARSE_REPORT_ERR(state, "Invalid include: %.*s", (int)text_len, text);
+      return TSCFG_ERR_SYNTAX;
+    }
+    memcpy(&text[text_len], str, len);
+    text_len += len;
+    pop_toks(state, 1, true);
+  }
+
+  static const struct {
+    const char *text;
+    bool required;
+    bool supported;
+  } forms[] = {
+    { "", false, true },
+    { "file(", false, true },
+    { "required(", true, true },
+    { "required(file(", true, true },
+    { "url(", false, false },
+    { "classpath(", false, false },
+    { "required(url(", true, false },
+    { "required(classpath(", true, false },
+  };
+
+  int form = -1;
+  for (int i = 0; i < (int)(sizeof(forms) / sizeof(forms[0])); i++) {
+    if (strlen(forms[i].text) == text_len &&
+        memcmp(forms[i].text, text, text_len) == 0) {
+      form = i;
+      break;
+    }
+  }
 
-    // Parse value
-    rc = value(state);
-    TSCFG_CHECK(rc);
+  if (form < 0 || tok->tag != TSCFG_TOK_STRING) {
+    PARSE_REPORT_ERR(state, "Invalid include: expected quoted file name "
+                     "after include %.*s", (int)text_len, text);
+    return TSCFG_ERR_SYNTAX;
+  } else if (!forms[form].supported) {
+    PARSE_REPORT_ERR(state, "Only file includes are supported, not "
+                     "include %.*s", (int)text_len, text);
+    return TSCFG_ERR_UNIMPL;
+  }
 
-    ok = state->reader.val_end(state->reader_state);
-    TSCFG_COND(ok, TSCFG_ERR_READER);
+  // Event takes over token
+  rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_INCLUDE,
+                    .data.include = { *tok, forms[form].required } });
+  pop_toks(state, 1, false);
+  TSCFG_CHECK(rc);
 
+  // Match close parentheses
+  size_t nclose = 0;
+  for (size_t i = 0; i < text_len; i++) {
+    nclose += (text[i] == '(');
+  }
+
+  while (nclose > 0) {
+    rc = peek_tok(state, &tok);
+    TSCFG_CHECK(rc);
+
+    if (tok->tag == TSCFG_TOK_WS) {
+      pop_toks(state, 1, true);
+    } else if (tok->tag == TSCFG_TOK_CLOSE_PAREN) {
+      pop_toks(state, 1, true);
+      nclose--;
+    } else {
+      PARSE_REPORT_ERR(state, "Expected ) to close include %.*s",
+                       (int)text_len, text);
+      return TSCFG_ERR_SYNTAX;
+    }
   }
 
-  ok = state->reader.arr_end(state->reader_state);
-  TSCFG_COND(ok, TSCFG_ERR_READER);
   return TSCFG_OK;
 }
 
@@ -367,30 +1481,25 @@ static tscfg_rc accum_whitespace(ts_parse_state *state, bool *newline,
   *newline = false;
   *comment = false;
 
-  *ws_toks = TSCFG_EMPTY_TOK_ARRAY;
+  // Reuse caller's array: any previous tokens were already handed on
+  assert(ws_toks->len == 0);
 
   while (true) {
-    tscfg_tok tok;
-
-    int got;
-    rc = peek_tok(state, &tok, 1, &got);
+    tscfg_tok *tok;
+    rc = peek_tok(state, &tok);
     TSCFG_CHECK_GOTO(rc, cleanup);
 
-    if (got == 0) {
-      break;
-    }
-
-    if (tok.tag == TSCFG_TOK_WS) {
+    if (tok->tag == TSCFG_TOK_WS) {
       // Regular whitespace
-    } else if (tok.tag == TSCFG_TOK_WS_NEWLINE) {
+    } else if (tok->tag == TSCFG_TOK_WS_NEWLINE) {
       *newline = true;
-    } else if(tok.tag == TSCFG_TOK_COMMENT) {
+    } else if(tok->tag == TSCFG_TOK_COMMENT) {
       *comment = true;
     } else {
       break;
     }
 
-    rc = pop_append_toks(state, ws_toks, 1);
+    rc = pop_append_tok(state, ws_toks);
     TSCFG_CHECK_GOTO(rc, cleanup);
   }
 
@@ -411,32 +1520,31 @@ cleanup:
 static tscfg_rc key(ts_parse_state *state, tscfg_tok_array *toks) {
   tscfg_rc rc;
 
-  *toks = TSCFG_EMPTY_TOK_ARRAY;
-
-  rc = skip_whitespace(state, NULL);
-  TSCFG_CHECK(rc);
+  // Reuse array if possible
+  *toks = state->spare_toks;
+  state->spare_toks = TSCFG_EMPTY_TOK_ARRAY;
+  assert(toks->len == 0);
 
   /* Need to track whitespace tokens in case of concatenation.
-   * This array tracks whitespace tokens preceding current token. */
-  tscfg_tok_array ws_toks = TSCFG_EMPTY_TOK_ARRAY;
+   * This array tracks whitespace tokens preceding current token.
+   * Any whitespace before the key was already handed on. */
+  tscfg_tok_array *ws_toks = &state->ws_toks;
+  assert(ws_toks->len == 0);
 
   bool newline = false, comment = false;
 
+  rc = skip_whitespace(state, NULL);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
   // Loop until end of value
   // TODO: how to handle '.' path separators
   while (true) {
-    tscfg_tok tok;
-    int got;
-    rc = peek_tok(state, &tok, 1, &got);
+    tscfg_tok *tok;
+    rc = peek_tok(state, &tok);
     TSCFG_CHECK_GOTO(rc, cleanup);
 
-    if (got == 0) {
-      // No more elements possible
-      return TSCFG_OK;
-    }
-
     // Check for value element
-    switch (tok.tag) {
+    switch (tok->tag) {
       case TSCFG_TOK_TRUE:
       case TSCFG_TOK_FALSE:
       case TSCFG_TOK_NULL:
@@ -450,10 +1558,10 @@ static tscfg_rc key(ts_parse_state *state, tscfg_tok_array *toks) {
           goto cleanup;
         }
 
-        rc = tscfg_tok_array_concat(toks, &ws_toks);
+        rc = tscfg_tok_array_concat(toks, ws_toks);
         TSCFG_CHECK_GOTO(rc, cleanup);
 
-        rc = pop_append_toks(state, toks, 1);
+        rc = pop_append_tok(state, toks);
         TSCFG_CHECK_GOTO(rc, cleanup);
         break;
       default:
@@ -462,167 +1570,177 @@ static tscfg_rc key(ts_parse_state *state, tscfg_tok_array *toks) {
         goto cleanup;
     }
 
-    rc = accum_whitespace(state, &newline, &comment, &ws_toks);
+    rc = accum_whitespace(state, &newline, &comment, ws_toks);
     TSCFG_CHECK_GOTO(rc, cleanup);
   }
 
   rc = TSCFG_OK;
 
 cleanup:
-  tscfg_tok_array_free(&ws_toks, true);
+  // Whitespace after key is dropped, keep array for reuse
+  tscfg_tok_array_free(ws_toks, false);
+  if (rc != TSCFG_OK) {
+    // Keep array for next key
+    tscfg_tok_array_free(toks, false);
+    tscfg_tok_array_free(&state->spare_toks, true);
+    state->spare_toks = *toks;
+    *toks = TSCFG_EMPTY_TOK_ARRAY;
+  }
   return rc;
 }
 
 /*
- * Parse a value: nested object, array or concatenated tokens.
- * Call the appropriate methods on the reader object as tokens, etc are
- * encountered.
- * If there is not a valid value at the current position,
- * return TSCFG_ERR_SYNTAX.
+ * Parse next item of a value: nested object, array or token of
+ * concatenated tokens.  Pass on the appropriate events as tokens, etc are
+ * encountered, and finish the value at a token that can't be part of it.
+ * frame: innermost frame, which may be invalidated by pushing a frame
  */
-static tscfg_rc value(ts_parse_state *state) {
+static tscfg_rc value_item(ts_parse_state *state, uint8_t *frame) {
   tscfg_rc rc;
-  bool ok;
 
-  rc = skip_whitespace(state, NULL);
+  tscfg_tok *tok;
+  rc = peek_tok(state, &tok);
   TSCFG_CHECK(rc);
 
-  /* Need to track whitespace tokens in case of concatenation.
-   * This array tracks whitespace tokens preceding current token. */
-  tscfg_tok_array ws_toks = TSCFG_EMPTY_TOK_ARRAY;
-
-  bool first = true;
-  bool newline = false;
-
-  // Loop until end of value
-  while (true) {
-    tscfg_tok tok;
-    int got;
-    rc = peek_tok(state, &tok, 1, &got);
-    TSCFG_CHECK_GOTO(rc, cleanup);
-
-    if (got == 0) {
-      // No more elements possible
-      break;
-    }
-
-    // Check for value element
-    switch (tok.tag) {
-      case TSCFG_TOK_TRUE:
-      case TSCFG_TOK_FALSE:
-      case TSCFG_TOK_NULL:
-      case TSCFG_TOK_NUMBER:
-      case TSCFG_TOK_UNQUOTED:
-      case TSCFG_TOK_STRING:
-        rc = emit_toks(state, &ws_toks, true);
-        TSCFG_CHECK_GOTO(rc, cleanup);
-
-        pop_toks(state, 1, false);
-
-        ok = state->reader.token(state->reader_state, &tok);
-        TSCFG_COND_GOTO(ok, rc, TSCFG_ERR_READER, cleanup);
-        break;
-
-      case TSCFG_TOK_OPEN_SUB:
-      case TSCFG_TOK_OPEN_OPT_SUB: {
-        rc = emit_toks(state, &ws_toks, true);
-        TSCFG_CHECK_GOTO(rc, cleanup);
+  // Check for value element
+  switch (tok->tag) {
+    case TSCFG_TOK_TRUE:
+    case TSCFG_TOK_FALSE:
+    case TSCFG_TOK_NULL:
+    case TSCFG_TOK_NUMBER:
+    case TSCFG_TOK_UNQUOTED:
+    case TSCFG_TOK_STRING:
+      rc = emit_toks(state, &state->ws_toks, true);
+      TSCFG_CHECK(rc);
 
-        pop_toks(state, 1, false);
-        
-        tscfg_tok_array path_toks;
-        rc = key(state, &path_toks);
-        TSCFG_CHECK_GOTO(rc, cleanup);
+      // Event takes over token
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_TOKEN,
+                                            .data.tok = *tok });
+      pop_toks(state, 1, false);
+      TSCFG_CHECK(rc);
+      return value_sep(state, frame);
 
-        bool option = (tok.tag == TSCFG_TOK_OPEN_OPT_SUB);
+    case TSCFG_TOK_OPEN_SUB:
+    case TSCFG_TOK_OPEN_OPT_SUB: {
+      rc = emit_toks(state, &state->ws_toks, true);
+      TSCFG_CHECK(rc);
 
-        ok = state->reader.var_sub(state->reader_state, path_toks.toks,
-                                   path_toks.len, option);
-        path_toks = TSCFG_EMPTY_TOK_ARRAY; // Ownership of array passed in
-        TSCFG_COND_GOTO(ok, rc, TSCFG_ERR_READER, cleanup);
+      bool option = (tok->tag == TSCFG_TOK_OPEN_OPT_SUB);
+      pop_toks(state, 1, false);
 
-        rc = expect_tag(state, TSCFG_TOK_CLOSE_BRACE,
-                        "Expected close brace for substitution");
-        TSCFG_CHECK_GOTO(rc, cleanup);
+      tscfg_tok_array path_toks;
+      rc = key(state, &path_toks);
+      TSCFG_CHECK(rc);
 
-        pop_toks(state, 1, true);
-        break;
-      }
+      int npath_toks = path_toks.len;
+      tscfg_tok *path_arr;
+      rc = hand_off_toks(state, &path_toks, &path_arr);
+      TSCFG_CHECK(rc);
 
-      case TSCFG_TOK_OPEN_BRACE:
-        rc = emit_toks(state, &ws_toks, true);
-        TSCFG_CHECK_GOTO(rc, cleanup);
+      rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_VAR_SUB,
+                        .data.sub = { path_arr, npath_toks, option } });
+      TSCFG_CHECK(rc);
 
-        pop_toks(state, 1, true);
+      rc = expect_tag(state, TSCFG_TOK_CLOSE_BRACE,
+                      "Expected close brace for substitution");
+      TSCFG_CHECK(rc);
 
-        rc = parse_hocon_obj_body(state);
-        TSCFG_CHECK(rc);
+      pop_toks(state, 1, true);
+      return value_sep(state, frame);
+    }
 
-        rc = expect_tag(state, TSCFG_TOK_CLOSE_BRACE,
-                        "Expected close brace");
-        TSCFG_CHECK_GOTO(rc, cleanup);
+    case TSCFG_TOK_OPEN_BRACE: {
+      rc = emit_toks(state, &state->ws_toks, true);
+      TSCFG_CHECK(rc);
 
-        pop_toks(state, 1, true);
-        break;
+      pop_toks(state, 1, true);
 
-      case TSCFG_TOK_OPEN_SQUARE:
-        rc = emit_toks(state, &ws_toks, true);
-        TSCFG_CHECK_GOTO(rc, cleanup);
+      // Object is filtered if value is
+      int obj_frame = FRAME_OBJ_START | (*frame & FRAME_FILTERED);
+      set_frame(frame, FRAME_VAL_CLOSE_BRACE);
+      return push_frame(state, obj_frame);
+    }
 
-        pop_toks(state, 1, true);
+    case TSCFG_TOK_OPEN_SQUARE:
+      rc = emit_toks(state, &state->ws_toks, true);
+      TSCFG_CHECK(rc);
 
-        rc = parse_hocon_arr_body(state);
-        TSCFG_CHECK(rc);
+      pop_toks(state, 1, true);
 
-        rc = expect_tag(state, TSCFG_TOK_CLOSE_SQUARE,
-                        "Expected close square bracket");
-        TSCFG_CHECK_GOTO(rc, cleanup);
+      set_frame(frame, FRAME_VAL_CLOSE_SQUARE);
+      return push_frame(state, FRAME_ARR_START);
 
-        pop_toks(state, 1, true);
-        break;
+    case TSCFG_TOK_COMMA:
+      // Only reached before first item, since value_sep() takes commas
+      if (!ALLOW_EMPTY_VALUE)  {
+        PARSE_REPORT_ERR(state, "Empty values are not valid syntax");
+        return TSCFG_ERR_SYNTAX;
+      }
 
-      case TSCFG_TOK_COMMA:
-        assert(first); // Should only happen on first iteration
-        if (ALLOW_EMPTY_VALUE)  {
-          /* Don't emit anything, keep comma as next token*/
-          tscfg_tok_array_free(&ws_toks, false);
-        } else {
-          PARSE_REPORT_ERR(state, "Empty values are not valid syntax");
-          rc = TSCFG_ERR_SYNTAX;
-          goto cleanup;
-        }
+      // Don't emit anything: comma separates empty value from next item
+      pop_toks(state, 1, true);
+      tscfg_tok_array_free(&state->ws_toks, false);
+      state->nframes--;
+      return TSCFG_OK;
 
-      default:
-        // Token cannot be part of value, leave
-        rc = TSCFG_OK;
-        goto cleanup;
-    }
+    default:
+      // Token cannot be part of value, leave
+      tscfg_tok_array_free(&state->ws_toks, false);
+      state->nframes--;
+      return TSCFG_OK;
+  }
+}
 
-    bool comment;
-    rc = accum_whitespace(state, &newline, &comment, &ws_toks);
-    TSCFG_CHECK_GOTO(rc, cleanup);
+/*
+ * After item of value, check for separator that finishes value.
+ * Finishes on an explicit comma separator or an implicit newline
+ * separator, otherwise the value may continue with the next item.
+ */
+static tscfg_rc value_sep(ts_parse_state *state, uint8_t *frame) {
+  tscfg_rc rc;
 
-    tscfg_tok_tag next_tag;
-    rc = peek_tag(state, &next_tag);
-    TSCFG_CHECK_GOTO(rc, cleanup);
+  bool newline, comment;
+  rc = accum_whitespace(state, &newline, &comment, &state->ws_toks);
+  TSCFG_CHECK(rc);
 
-    if (next_tag == TSCFG_TOK_COMMA) {
-      pop_toks(state, 1, true); // Remove comma
-      // Explicit separator: ready for next item
-      break;
-    } else if (newline) {
-      // Implicit separator: ready for next item
-      break;
-    }
+  tscfg_tok_tag next_tag;
+  rc = peek_tag(state, &next_tag);
+  TSCFG_CHECK(rc);
 
-    first = false;
+  if (next_tag == TSCFG_TOK_COMMA) {
+    pop_toks(state, 1, true); // Remove comma
+    // Explicit separator: ready for next item
+  } else if (!newline) {
+    set_frame(frame, FRAME_VAL_ITEM);
+    return TSCFG_OK;
   }
 
-  rc = TSCFG_OK;
+  // Explicit or implicit separator: ready for next item
+  tscfg_tok_array_free(&state->ws_toks, false);
+  state->nframes--;
+  return TSCFG_OK;
+}
 
-cleanup:
-  tscfg_tok_array_free(&ws_toks, true);
-  return rc;
+/*
+ * Whether token can start a value, including an empty value.
+ */
+static bool value_start_tag(tscfg_tok_tag tag) {
+  switch (tag) {
+    case TSCFG_TOK_TRUE:
+    case TSCFG_TOK_FALSE:
+    case TSCFG_TOK_NULL:
+    case TSCFG_TOK_NUMBER:
+    case TSCFG_TOK_UNQUOTED:
+    case TSCFG_TOK_STRING:
+    case TSCFG_TOK_OPEN_SUB:
+    case TSCFG_TOK_OPEN_OPT_SUB:
+    case TSCFG_TOK_OPEN_BRACE:
+    case TSCFG_TOK_OPEN_SQUARE:
+    case TSCFG_TOK_COMMA:
+      return true;
+    default:
+      return false;
+  }
 }
 
 /*
@@ -640,58 +1758,450 @@ static tscfg_rc emit_toks(ts_parse_state *state, tscfg_tok_array *toks,
       return TSCFG_ERR_SYNTAX;
     }
 
-    bool ok = state->reader.token(state->reader_state, tok);
+    tscfg_rc rc = emit_event(state, (tscfg_event){ .tag = TSCFG_EV_TOKEN,
+                                                   .data.tok = *tok });
 
     // We handed over token, so invalidate
     tok->tag = TSCFG_TOK_INVALID;
     tok->str = NULL;
     tok->len = 0;
+    tok->borrowed = false;
 
-    TSCFG_COND(ok, TSCFG_ERR_READER);
+    TSCFG_CHECK(rc);
   }
 
   toks->len = 0; // No longer own tokens
   return TSCFG_OK;
 }
 
-static tscfg_rc ts_parse_state_init(ts_parse_state *state, tsconfig_input in,
-  tscfg_reader reader, void *reader_state) {
-  tscfg_rc rc;
+/*
+ * Hand over array of tokens to reader.
+ *
+ * If parsing into an arena, the tokens are copied into the arena and the
+ * array is kept to be reused, otherwise the reader takes ownership of the
+ * array.
+ * out: set to array to pass to reader
+ */
+static tscfg_rc hand_off_toks(ts_parse_state *state, tscfg_tok_array *toks,
+                              tscfg_tok **out) {
+  if (state->arena == NULL) {
+    *out = toks->toks;
+    *toks = TSCFG_EMPTY_TOK_ARRAY; // Ownership of array passed in
+    return TSCFG_OK;
+  }
+
+  size_t bytes = sizeof(toks->toks[0]) * (size_t)toks->len;
+  *out = tscfg_arena_alloc(state->arena, bytes);
+  TSCFG_CHECK_MALLOC(*out);
+
+  if (bytes > 0) {
+    memcpy(*out, toks->toks, bytes);
+  }
+
+  // Tokens now in arena copy, keep array
+  toks->len = 0;
+  tscfg_tok_array_free(&state->spare_toks, true);
+  state->spare_toks = *toks;
+  *toks = TSCFG_EMPTY_TOK_ARRAY;
+  return TSCFG_OK;
+}
+
+/*
+ * Queue event to be passed to reader, passing on batch if full.
+ * Ownership of any tokens in event is passed on, even if error.
+ */
+static inline tscfg_rc emit_event(ts_parse_state *state, tscfg_event ev) {
+  ev.depth = state->depth;
+  state->events[state->nevents++] = ev;
+
+  if (state->nevents == state->batch_size) {
+    return flush_events(state);
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Pass all queued events to reader.  Without a reader, i.e. for an
+ * iterator, the queue is grown instead.
+ */
+static tscfg_rc flush_events(ts_parse_state *state) {
+  if (state->nevents == 0) {
+    return TSCFG_OK;
+  }
+
+  if (state->reader.events == NULL) {
+    int new_size = state->batch_size * 2;
+    void *tmp = tscfg_realloc(state->events,
+                        sizeof(state->events[0]) * (size_t)new_size);
+    TSCFG_CHECK_MALLOC(tmp);
+
+    state->events = tmp;
+    state->batch_size = new_size;
+    state->events_size = new_size;
+    return TSCFG_OK;
+  }
+
+  // Reader owns events from here, even if it fails
+  int nevents = state->nevents;
+  state->nevents = 0;
+
+  uint64_t start = 0;
+  TSCFG_STAT(state->stats, start = tscfg_stats_now());
+  bool ok = state->reader.events(state->reader_state, state->events,
+                                 nevents);
+  TSCFG_STAT(state->stats,
+             state->stats->build_ns += tscfg_stats_now() - start);
+  TSCFG_COND(ok, TSCFG_ERR_READER);
+
+  // Reader has copied what it needs from arena
+  state->arena_stale = state->arena != NULL;
+  return TSCFG_OK;
+}
+
+/*
+ * Free memory in arena once the reader has taken a batch of events, so
+ * that memory used while parsing is bounded by the batch size rather
+ * than growing with the input.  Events queued since the batch are passed
+ * on first.  Between parse steps, the only tokens then held by the parser
+ * are in the lookahead queue and the whitespace array, so their strings
+ * are moved to the start of the emptied arena.
+ */
+static tscfg_rc rewind_arena(ts_parse_state *state) {
+  tscfg_rc rc = flush_events(state);
+  TSCFG_CHECK(rc);
+
+  unsigned nheld = state->toks.len + (unsigned)state->ws_toks.len;
+  size_t bytes = 0;
+  for (unsigned i = 0; i < nheld; i++) {
+    tscfg_tok *tok = held_tok(state, i);
+    if (tok->borrowed && tok->str != NULL) {
+      bytes += tok->len + 1;
+    }
+  }
+
+  if (bytes > state->rewind_buf_size) {
+    char *tmp = tscfg_realloc(state->rewind_buf, bytes);
+    TSCFG_CHECK_MALLOC(tmp);
+    state->rewind_buf = tmp;
+    state->rewind_buf_size = bytes;
+  }
+
+  size_t pos = 0;
+  for (unsigned i = 0; i < nheld; i++) {
+    tscfg_tok *tok = held_tok(state, i);
+    if (tok->borrowed && tok->str != NULL) {
+      memcpy(&state->rewind_buf[pos], tok->str, tok->len);
+      pos += tok->len + 1;
+    }
+  }
+
+  tscfg_arena_reset(state->arena);
+
+  pos = 0;
+  for (unsigned i = 0; i < nheld; i++) {
+    tscfg_tok *tok = held_tok(state, i);
+    if (tok->borrowed && tok->str != NULL) {
+      tok->str = tscfg_arena_strdup(state->arena, &state->rewind_buf[pos],
+                                    tok->len);
+      TSCFG_CHECK_MALLOC(tok->str);
+      pos += tok->len + 1;
+    }
+  }
+
+  state->arena_stale = false;
+  return TSCFG_OK;
+}
+
+/*
+ * Token held by parser between steps: queued tokens, then whitespace.
+ */
+static tscfg_tok *held_tok(ts_parse_state *state, unsigned i) {
+  if (i < state->toks.len) {
+    return tok_queue_at(&state->toks, i);
+  }
+  return &state->ws_toks.toks[i - state->toks.len];
+}
+
+/*
+ * Free memory owned by events that won't be passed on.
+ * arena: if non-NULL, memory was allocated from arena so nothing to free
+ */
+static void free_events(tscfg_event *events, int nevents, tscfg_arena *arena) {
+  if (arena != NULL) {
+    return;
+  }
+
+  for (int i = 0; i < nevents; i++) {
+    tscfg_event *ev = &events[i];
+    if (ev->tag == TSCFG_EV_TOKEN) {
+      tscfg_tok_free(&ev->data.tok);
+    } else if (ev->tag == TSCFG_EV_KEY_VAL_START) {
+      tscfg_tok_array toks = { .toks = ev->data.key.toks,
+          .size = ev->data.key.ntoks, .len = ev->data.key.ntoks };
+      tscfg_tok_array_free(&toks, true);
+    } else if (ev->tag == TSCFG_EV_VAR_SUB) {
+      tscfg_tok_array toks = { .toks = ev->data.sub.toks,
+          .size = ev->data.sub.ntoks, .len = ev->data.sub.ntoks };
+      tscfg_tok_array_free(&toks, true);
+    } else if (ev->tag == TSCFG_EV_INCLUDE) {
+      tscfg_tok_free(&ev->data.include.tok);
+    }
+  }
+}
 
+static tscfg_rc callback_adapter_init(tscfg_reader reader, void *reader_state,
+        ts_callback_adapter *adapter,
+        tscfg_batch_reader *batch_reader) {
   if (reader.obj_start == NULL || reader.obj_end == NULL ||
       reader.arr_start == NULL || reader.arr_end == NULL ||
       reader.key_val_start == NULL || reader.key_val_end == NULL ||
       reader.val_start == NULL || reader.val_end == NULL ||
-      reader.token == NULL) {
+      reader.token == NULL || reader.var_sub == NULL) {
     REPORT_ERR("Reader has NULL function");
     return TSCFG_ERR_ARG;
   }
 
+  adapter->reader = reader;
+  adapter->reader_state = reader_state;
+
+  batch_reader->events = dispatch_events;
+  batch_reader->batch_size = TSCFG_DEFAULT_BATCH_SIZE;
+  return TSCFG_OK;
+}
+
+/*
+ * Batch reader function that calls callback reader for each event.
+ */
+static bool dispatch_events(void *s, tscfg_event *events, int nevents) {
+  ts_callback_adapter *adapter = s;
+  tscfg_reader *r = &adapter->reader;
+  void *rs = adapter->reader_state;
+
+  for (int i = 0; i < nevents; i++) {
+    tscfg_event *ev = &events[i];
+    bool ok;
+    switch (ev->tag) {
+      case TSCFG_EV_OBJ_START:
+        ok = r->obj_start(rs);
+        break;
+      case TSCFG_EV_OBJ_END:
+        ok = r->obj_end(rs);
+        break;
+      case TSCFG_EV_ARR_START:
+        ok = r->arr_start(rs);
+        break;
+      case TSCFG_EV_ARR_END:
+        ok = r->arr_end(rs);
+        break;
+      case TSCFG_EV_KEY_VAL_START:
+        ok = r->key_val_start(rs, ev->data.key.toks, ev->data.key.ntoks,
+                              ev->data.key.sep);
+        break;
+      case TSCFG_EV_KEY_VAL_END:
+        ok = r->key_val_end(rs);
+        break;
+      case TSCFG_EV_VAL_START:
+        ok = r->val_start(rs);
+        break;
+      case TSCFG_EV_VAL_END:
+        ok = r->val_end(rs);
+        break;
+      case TSCFG_EV_TOKEN:
+        ok = r->token(rs, &ev->data.tok);
+        break;
+      case TSCFG_EV_VAR_SUB:
+        ok = r->var_sub(rs, ev->data.sub.toks, ev->data.sub.ntoks,
+                        ev->data.sub.optional);
+        break;
+      case TSCFG_EV_INCLUDE:
+        if (r->include == NULL) {
+          REPORT_ERR("Reader does not support includes");
+          tscfg_tok_free(&ev->data.include.tok);
+          ok = false;
+          break;
+        }
+        ok = r->include(rs, &ev->data.include.tok,
+                        ev->data.include.required);
+        break;
+      default:
+        assert(false);
+        ok = false;
+        break;
+    }
+
+    if (!ok) {
+      // Events after failure still need to be freed
+      free_events(&events[i + 1], nevents - i - 1, NULL);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static tscfg_rc ts_parse_state_init(ts_parse_state *state, tsconfig_input in,
+  tscfg_batch_reader reader, void *reader_state, tscfg_arena *arena,
+  const tscfg_path_filter *filter) {
+  ts_parse_state_clear(state);
+  tscfg_rc rc = ts_parse_state_start(state, in, reader, reader_state, arena,
+                                     filter);
+  if (rc != TSCFG_OK) {
+    ts_parse_state_finalize(state);
+    return rc;
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Initialize state without input or memory, to be started with
+ * ts_parse_state_start().
+ */
+static void ts_parse_state_clear(ts_parse_state *state) {
+  state->events = NULL;
+  state->nevents = 0;
+  state->events_size = 0;
+  state->depth = 0;
+  state->max_depth = 0;
+
+  tscfg_lex_init_empty(&state->lex_state);
+
+  state->toks.head = 0;
+  state->toks.len = 0;
+  state->arena = NULL;
+  state->spare_toks = TSCFG_EMPTY_TOK_ARRAY;
+  state->arena_stale = false;
+  state->rewind_buf = NULL;
+  state->rewind_buf_size = 0;
+
+  state->frames = NULL;
+  state->nframes = 0;
+  state->frames_size = 0;
+  state->ws_toks = TSCFG_EMPTY_TOK_ARRAY;
+
+  state->filter = NULL;
+  state->filter_pos = NULL;
+  state->nfilter_pos = 0;
+  state->filter_pos_size = 0;
+  state->stats = NULL;
+}
+
+/*
+ * Start parsing input, reusing memory from any earlier input.  State must
+ * be stopped afterwards, even if this fails.
+ */
+static tscfg_rc ts_parse_state_start(ts_parse_state *state,
+  tsconfig_input in, tscfg_batch_reader reader, void *reader_state,
+  tscfg_arena *arena, const tscfg_path_filter *filter) {
+  tscfg_rc rc;
+
+  // No events function means events are queued for an iterator
+  if (reader.batch_size < 0) {
+    REPORT_ERR("Invalid batch reader");
+    return TSCFG_ERR_ARG;
+  }
+
   state->reader = reader;
   state->reader_state = reader_state;
+  state->batch_size = (reader.batch_size > 0) ? reader.batch_size
+                                              : TSCFG_DEFAULT_BATCH_SIZE;
+  state->nevents = 0;
+  state->depth = 0;
+  if (state->events_size < state->batch_size) {
+    void *tmp = tscfg_realloc(state->events, sizeof(state->events[0]) *
+                                       (size_t)state->batch_size);
+    TSCFG_CHECK_MALLOC(tmp);
+    state->events = tmp;
+    state->events_size = state->batch_size;
+  }
+
+  rc = tscfg_lex_reset(&state->lex_state, in);
+  TSCFG_CHECK(rc);
+
+  state->lex_state.arena = arena;
+  state->arena = arena;
+  state->arena_stale = false;
+  state->stats = tscfg_stats_current();
+  state->lex_state.stats = state->stats;
+
+  const tsconfig_limits *limits = tscfg_limits_current();
+  if (limits != NULL) {
+    state->max_depth = limits->max_depth;
+    rc = tscfg_lex_set_limits(&state->lex_state, limits->max_bytes,
+                              limits->max_tok_len);
+    TSCFG_CHECK(rc);
+  } else {
+    state->max_depth = 0;
+  }
+
+  state->toks.head = 0;
+  state->toks.len = 0;
+  state->nframes = 0;
+  state->filter = filter;
+  state->nfilter_pos = 0;
 
-  rc = tscfg_lex_init(&state->lex_state, in);
+  rc = push_frame(state, FRAME_ROOT);
   TSCFG_CHECK(rc);
 
-  state->toks = TSCFG_EMPTY_TOK_ARRAY;
+  if (filter != NULL) {
+    rc = push_filter_pos(state, tscfg_path_filter_root(filter));
+    TSCFG_CHECK(rc);
+  }
 
   return TSCFG_OK;
 }
 
+/*
+ * Finish with input, freeing anything not passed on, but keeping
+ * buffers and arrays for the next input.
+ */
+static void ts_parse_state_stop(ts_parse_state *state) {
+  TSCFG_STAT(state->stats,
+             state->stats->bytes += tscfg_lex_offset(&state->lex_state));
+  state->stats = NULL;
+  tscfg_lex_close(&state->lex_state);
+
+  pop_toks(state, state->toks.len, true);
+  tscfg_tok_array_free(&state->ws_toks, false);
+
+  // Events not passed on if error
+  free_events(state->events, state->nevents, state->arena);
+  state->nevents = 0;
+  state->nframes = 0;
+  state->nfilter_pos = 0;
+  state->depth = 0;
+}
+
 static void ts_parse_state_finalize(ts_parse_state *state) {
-  tscfg_lex_finalize(&state->lex_state);
+  ts_parse_state_stop(state);
 
   // Free memory
-  tscfg_tok_array_free(&state->toks, true);
+  tscfg_lex_finalize(&state->lex_state);
+  tscfg_tok_array_free(&state->spare_toks, true);
+  tscfg_tok_array_free(&state->ws_toks, true);
+  tscfg_free(state->rewind_buf);
+  tscfg_free(state->frames);
+  tscfg_free(state->filter_pos);
+  tscfg_free(state->events);
 }
 
 static void ts_parse_report_err(const char *file, int line,
               ts_parse_state *state, const char *fmt, ...) {
-  // TODO: include context in errors.
   va_list args;
   va_start(args, fmt);
   tscfg_report_err_v(file, line, fmt, args);
   va_end(args);
+
+  // Error is usually about next token, if one was read
+  size_t offset = (state->toks.len > 0) ?
+                    tok_queue_at(&state->toks, 0)->offset :
+                    tscfg_lex_offset(&state->lex_state);
+  int in_line, in_col;
+  if (tscfg_lex_location(&state->lex_state, offset, &in_line, &in_col)) {
+    tscfg_report_err(NULL, 0, "Parse error at input location %i:%i",
+                     in_line, in_col);
+  } else {
+    tscfg_report_err(NULL, 0, "Parse error at input offset %zu", offset);
+  }
 }
 
 static tscfg_rc expect_tag(ts_parse_state *state, tscfg_tok_tag expected,
@@ -704,7 +2214,7 @@ static tscfg_rc expect_tag(ts_parse_state *state, tscfg_tok_tag expected,
 
   if (tag != expected) {
     // TODO: report actual tag
-    PARSE_REPORT_ERR(state, "%s. Next token is", errmsg_start,
+    PARSE_REPORT_ERR(state, "%s. Next token is %s", errmsg_start,
                     tscfg_tok_tag_name(tag));
     return TSCFG_ERR_SYNTAX;
   }
@@ -713,89 +2223,107 @@ static tscfg_rc expect_tag(ts_parse_state *state, tscfg_tok_tag expected,
 }
 
 /*
- * Peek ahead into tokens without removing
- * count: number of tokens to look ahead
- * got: number of tokens got, less than len iff end of file
+ * Peek at next token without removing it.
+ * tok: set to token in lookahead queue, valid until next peek or pop.
+ *      Will be TSCFG_TOK_EOF at end of input.
  */
-static tscfg_rc peek_tok(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got) {
+static tscfg_rc peek_tok(ts_parse_state *state, tscfg_tok **tok) {
   bool include_ws = true;
-  return peek_tok_impl(state, toks, count, got, include_ws);
+  return peek_tok_impl(state, 0, tok, include_ws);
 }
 
-static tscfg_rc peek_tok_skip_ws(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got) {
+static tscfg_rc peek_tok_skip_ws(ts_parse_state *state, tscfg_tok **tok) {
   tscfg_rc rc;
   rc = skip_whitespace(state, NULL);
   TSCFG_CHECK(rc);
 
   bool include_ws = false;
-  return peek_tok_impl(state, toks, count, got, include_ws);
+  return peek_tok_impl(state, 0, tok, include_ws);
 }
 
-static tscfg_rc peek_tok_impl(ts_parse_state *state, tscfg_tok *toks,
-                       int count, int *got, bool include_ws) {
+/*
+ * Peek ahead into tokens without removing
+ * ahead: index of token to peek, less than TOK_LOOKAHEAD
+ * tok: set to pointer into queue.  If input ends first, set to EOF token.
+ */
+static tscfg_rc peek_tok_impl(ts_parse_state *state, unsigned ahead,
+                       tscfg_tok **tok, bool include_ws) {
   tscfg_rc rc;
+  ts_tok_queue *q = &state->toks;
+  assert(ahead < TOK_LOOKAHEAD);
 
-  // Resize token buffer to be large enough
-  rc = tscfg_tok_array_expand(&state->toks, count);
-  TSCFG_CHECK(rc);
-
-  while (state->toks.len < count) {
-    if (state->toks.len > 0 &&
-        state->toks.toks[state->toks.len - 1].tag == TSCFG_TOK_EOF) {
+  while (q->len <= ahead) {
+    if (q->len > 0 && tok_queue_at(q, q->len - 1)->tag == TSCFG_TOK_EOF) {
       // Already hit end of file
-      break;
+      *tok = tok_queue_at(q, q->len - 1);
+      return TSCFG_OK;
     }
 
     tscfg_lex_opts opts = { .include_ws_str = include_ws,
                             .include_comm_str = false };
-    rc = tscfg_read_tok(&state->lex_state,
-          &state->toks.toks[state->toks.len], opts);
+    tscfg_tok *next = tok_queue_at(q, q->len);
+    uint64_t start = 0;
+    TSCFG_STAT(state->stats, start = tscfg_stats_now());
+    rc = tscfg_read_tok(&state->lex_state, next, opts);
     TSCFG_CHECK(rc);
 
-    state->toks.len++;
+    q->len++;
+    TSCFG_STAT(state->stats, count_tok(state->stats, next, q->len, start));
   }
 
-  *got = state->toks.len < count ? state->toks.len : count;
-  memcpy(toks, state->toks.toks, sizeof(toks[0]) * (size_t)*got);
+  *tok = tok_queue_at(q, ahead);
   return TSCFG_OK;
 }
 
+/*
+ * Count token read from lexer.
+ * queued: tokens in lookahead queue, including this one
+ * start: time before token was read
+ */
+static void count_tok(tsconfig_stats *stats, const tscfg_tok *tok,
+                      unsigned queued, uint64_t start) {
+  stats->lex_ns += tscfg_stats_now() - start;
+  stats->toks[tok->tag]++;
+  if ((int)queued > stats->max_lookahead) {
+    stats->max_lookahead = (int)queued;
+  }
+}
+
+static inline void count_depth(tsconfig_stats *stats, int depth) {
+  if (depth > stats->max_depth) {
+    stats->max_depth = depth;
+  }
+}
+
 /*
  * Peek at tag of next token
  * tag: set to next tag, TSCFG_TOK_EOF if no more
  */
 static tscfg_rc peek_tag(ts_parse_state *state, tscfg_tok_tag *tag) {
-  tscfg_tok tok;
-  int got;
-  tscfg_rc rc = peek_tok(state, &tok, 1, &got);
+  tscfg_tok *tok;
+  tscfg_rc rc = peek_tok(state, &tok);
   TSCFG_CHECK(rc);
 
-  if (got == 0) {
-    *tag = TSCFG_TOK_EOF;
-  } else {
-    *tag = tok.tag;
-  }
-
+  *tag = tok->tag;
   return TSCFG_OK;
 }
 
 static tscfg_rc peek_tag_skip_ws(ts_parse_state *state, tscfg_tok_tag *tag){
-  tscfg_tok tok;
-  int got;
-  tscfg_rc rc = peek_tok_skip_ws(state, &tok, 1, &got);
+  tscfg_tok *tok;
+  tscfg_rc rc = peek_tok_skip_ws(state, &tok);
   TSCFG_CHECK(rc);
 
-  if (got == 0) {
-    *tag = TSCFG_TOK_EOF;
-  } else {
-    *tag = tok.tag;
-  }
-
+  *tag = tok->tag;
   return TSCFG_OK;
 }
 
+/*
+ * Token at position i from front of queue.
+ */
+static inline tscfg_tok *tok_queue_at(ts_tok_queue *q, unsigned i) {
+  return &q->toks[(q->head + i) & (TOK_LOOKAHEAD - 1)];
+}
+
 /*
  * Remove leading tokens from input.
  *
@@ -803,26 +2331,26 @@ static tscfg_rc peek_tag_skip_ws(ts_parse_state *state, tscfg_tok_tag *tag){
  *
  * free_toks: if true, free any strings not set to NULL.
  */
-static void pop_toks(ts_parse_state *state, int count, bool free_toks) {
-  assert(count >= 0);
-  assert(count <= state->toks.len);
+static void pop_toks(ts_parse_state *state, unsigned count, bool free_toks) {
+  ts_tok_queue *q = &state->toks;
+  assert(count <= q->len);
 
-  for (int i = 0; i < count; i++) {
-    tscfg_tok *tok = &state->toks.toks[i];
-    DEBUG("pop_toks: tok %i is %s(%.*s)", i, tscfg_tok_tag_name(tok->tag),
+  for (unsigned i = 0; i < count; i++) {
+    tscfg_tok *tok = tok_queue_at(q, i);
+    DEBUG("pop_toks: tok %u is %s(%.*s)", i, tscfg_tok_tag_name(tok->tag),
           (int)tok->len, tok->str);
-  }
 
-  // Cleanup memory first
-  if (free_toks) {
-    for (int i = 0; i < count; i++) {
-      tscfg_tok_free(&state->toks.toks[i]);
+    if (free_toks) {
+      if (state->arena != NULL) {
+        // Reclaim string if it was the last thing allocated
+        tscfg_arena_release(state->arena, tok->str);
+      }
+      tscfg_tok_free(tok);
     }
   }
 
-  memmove(&state->toks.toks[0], &state->toks.toks[count],
-          sizeof(state->toks.toks[0]) * (size_t)(state->toks.len - count));
-  state->toks.len -= count;
+  q->head = (q->head + count) & (TOK_LOOKAHEAD - 1);
+  q->len -= count;
 }
 
 /*
@@ -837,41 +2365,35 @@ static tscfg_rc skip_whitespace(ts_parse_state *state, bool *newline) {
   }
 
   while (true) {
-    tscfg_tok tok;
-    int got = 0;
-    rc = peek_tok_impl(state, &tok, 1, &got, false);
+    tscfg_tok *tok;
+    rc = peek_tok_impl(state, 0, &tok, false);
     TSCFG_CHECK(rc);
 
-    if (got == 1 && (
-        tok.tag == TSCFG_TOK_WS ||
-        tok.tag == TSCFG_TOK_WS_NEWLINE ||
-        tok.tag == TSCFG_TOK_COMMENT)) {
-      pop_toks(state, 1, true);
-
+    if (tok->tag == TSCFG_TOK_WS ||
+        tok->tag == TSCFG_TOK_WS_NEWLINE ||
+        tok->tag == TSCFG_TOK_COMMENT) {
       if (newline != NULL &&
-          tok.tag == TSCFG_TOK_WS_NEWLINE) {
+          tok->tag == TSCFG_TOK_WS_NEWLINE) {
         *newline = true;
       }
+
+      pop_toks(state, 1, true);
     } else {
       return TSCFG_OK;
     }
   }
 }
 
-static tscfg_rc pop_append_toks(ts_parse_state *state, tscfg_tok_array *toks,
-                                int count) {
+/*
+ * Move first token from queue to end of array.
+ */
+static tscfg_rc pop_append_tok(ts_parse_state *state, tscfg_tok_array *toks) {
   tscfg_rc rc;
-  assert(state->toks.len >= count);
-
-  if (toks->len == toks->size) {
-    rc = tscfg_tok_array_expand(toks, toks->len + count);
-    TSCFG_CHECK(rc);
-  }
+  assert(state->toks.len >= 1);
 
-  for (int i = 0; i < count; i++) {
-    toks->toks[toks->len++] = state->toks.toks[i];
-  }
+  rc = tscfg_tok_array_append(toks, tok_queue_at(&state->toks, 0));
+  TSCFG_CHECK(rc);
 
-  pop_toks(state, count, false);
+  pop_toks(state, 1, false);
   return TSCFG_OK;
 }
@@ -36,6 +36,15 @@ typedef enum {
   TSCFG_HOCON,
 } tscfg_fmt;
 
+/*
+ * Read callback for streaming input.
+ * Read up to len bytes into buf and set got to the number of bytes read.
+ * Short reads are allowed: setting got to 0 signals end of input.
+ * Any return code other than TSCFG_OK aborts parsing.
+ */
+typedef tscfg_rc (*tsconfig_read_fn)(void *ctx, void *buf, size_t len,
+                                     size_t *got);
+
 /*
  * Tagged union to represent possible input types for parser.
  */
@@ -43,26 +52,246 @@ typedef enum {
   TS_CONFIG_IN_NONE,
   TS_CONFIG_IN_FILE,
   TS_CONFIG_IN_STR,
+  /*
+   * In-memory string like TS_CONFIG_IN_STR, but tokens passed to the reader
+   * may borrow slices of the string (see tscfg_tok.borrowed) instead of
+   * owning a copy.  The string must outlive any tokens kept by the reader.
+   */
+  TS_CONFIG_IN_STR_BORROW,
+  /*
+   * Path of file to be memory-mapped read-only and scanned in place.
+   * The mapping is released when parsing finishes, so tokens passed to
+   * the reader own copies of their strings.
+   */
+  TS_CONFIG_IN_MMAP,
+  /*
+   * Streaming input from a read callback, e.g. for pipes or sockets.
+   */
+  TS_CONFIG_IN_FUNC,
 } tsconfig_input_kind;
 
 typedef struct {
   tsconfig_input_kind kind;
   union {
     FILE* f;
+    const char *path;
     struct {
       const char *str;
       size_t len;
       size_t pos;
     } s;
+    struct {
+      tsconfig_read_fn read;
+      void *ctx;
+      size_t chunk_size; // Bytes to request per read, 0 for default
+    } fn;
   } data;
 } tsconfig_input;
 
 /*
  * Parse a typesafe config file to a tree using the specified format.
+ *
+ * Included files are relative to the directory of the input file for
+ * TS_CONFIG_IN_MMAP, otherwise to the working directory.  They are parsed
+ * once and cached for the life of the process, and parsed again if they
+ * change on disk.
  */
 tscfg_rc tsconfig_parse_tree(tsconfig_input in, tscfg_fmt fmt,
                         tsconfig_tree *cfg);
 
+/*
+ * Statistics for parsing to tree, e.g. to find unusually large inputs.
+ * Lexer and parser counts are for the top-level input, not included
+ * files, but merging and resolving cover the whole tree.  Times are in
+ * nanoseconds of thread time, summed over threads if parsed in parts.
+ * Lexing time is measured around every token, so collecting stats slows
+ * down parsing.  Stats are all zero if the library was configured with
+ * --disable-stats.
+ */
+typedef struct {
+  uint64_t bytes; // Bytes of input lexed
+  uint64_t refills; // Reads of more input from a file or read function
+  uint64_t toks[TSCFG_TOK_NTAGS]; // Tokens lexed by tscfg_tok_tag
+  int max_depth; // Deepest nesting of objects and arrays
+  int max_lookahead; // Most tokens read ahead by parser
+  uint64_t subs; // Substitutions resolved
+  uint64_t merge_collisions; // Definitions of keys merged with earlier ones
+
+  uint64_t lex_ns; // Lexing
+  uint64_t parse_ns; // Parsing tokens to events
+  uint64_t build_ns; // Building tree from events, and its key index
+  uint64_t merge_ns; // Merging duplicate keys
+  uint64_t resolve_ns; // Resolving substitutions
+} tsconfig_stats;
+
+/*
+ * Limits on input, so that memory and time used for input from a less
+ * trusted source are bounded.  Parsing fails with TSCFG_ERR_LIMIT as
+ * soon as a limit is exceeded, before memory is allocated for the rest.
+ * Zero for any limit means no limit.  Limits apply to the input itself,
+ * not to files included by it.
+ */
+typedef struct {
+  int max_depth; // Deepest nesting of objects and arrays
+  size_t max_tok_len; // Longest string of a token, in bytes
+  size_t max_bytes; // Most bytes of input
+} tsconfig_limits;
+
+/*
+ * Options for parsing to tree.  Zero-initialized options are the
+ * defaults.
+ */
+typedef struct {
+  /*
+   * Threads for parsing, counting the calling thread, or 0 for the number
+   * of processors (up to 8).  Files included by a file are loaded at the
+   * same time, and large files (4MB or more) in memory or read with
+   * TS_CONFIG_IN_MMAP are split into parts between top-level fields that
+   * are parsed at the same time.  Results are joined in order, so that
+   * precedence is unchanged.  With 1, no threads are started and
+   * everything is parsed in order.
+   */
+  int threads;
+
+  /*
+   * If npaths > 0, only values at or under these paths are wanted, e.g.
+   * "db" and "http.server".  Other fields are skipped over without being
+   * tokenized or stored, so syntax errors in them may not be found.
+   * Files included by the input are parsed whole.  If a substitution
+   * refers to a path outside the filter, e.g. an environment variable,
+   * the input is parsed again without the filter, so values are always
+   * the same as for a full parse.  Ignored for TS_CONFIG_IN_FUNC input
+   * and files that can't be seeked, which can't be parsed again.
+   */
+  const char *const *paths;
+  int npaths;
+
+  /*
+   * Allocator for tree and all memory used while parsing, or NULL for
+   * malloc.  Must stay valid until tree is freed.  Included files are
+   * cached for the whole process, so use malloc.  A tscfg_counting_alloc
+   * reports memory used by a parse.
+   */
+  const tscfg_allocator *alloc;
+
+  // If non-NULL, filled in with statistics for parse
+  tsconfig_stats *stats;
+
+  // Limits on input, by default none
+  tsconfig_limits limits;
+} tsconfig_parse_opts;
+
+/*
+ * Stack enough for the calling thread of tsconfig_parse_tree() and
+ * tsconfig_parse_tree_opts(), e.g. for small-stack worker threads.  No
+ * pass recurses per level of nested objects, arrays or substitutions, so
+ * this holds for input of any depth.  Only included files are parsed
+ * recursively, up to 32 deep, which this allows for.  Threads started
+ * for parsing use the default stack size.
+ */
+#define TSCFG_PARSE_STACK_SIZE (128 * 1024)
+
+/*
+ * Parse to tree as tsconfig_parse_tree, with options.
+ * opts: options, or NULL for defaults
+ */
+tscfg_rc tsconfig_parse_tree_opts(tsconfig_input in, tscfg_fmt fmt,
+                    const tsconfig_parse_opts *opts, tsconfig_tree *cfg);
+
+/*
+ * Parser context that keeps its buffers and scratch memory between
+ * inputs, so that parsing many small inputs doesn't allocate and free
+ * them for every input.  A parser can be used by one thread at a time.
+ * Trees and events are the same as without a parser.
+ */
+typedef struct tsconfig_parser tsconfig_parser;
+
+tscfg_rc tsconfig_parser_new(tsconfig_parser **parser);
+
+/*
+ * Free parser and all memory kept.  Trees parsed with it are unaffected.
+ */
+void tsconfig_parser_free(tsconfig_parser *parser);
+
+/*
+ * Parse to tree as tsconfig_parse_tree_opts, reusing parser's memory.
+ * Worker threads are also kept while opts->threads stays the same.
+ * Memory kept is from opts->alloc, so is freed if it changes.
+ */
+tscfg_rc tsconfig_parser_parse_tree(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, const tsconfig_parse_opts *opts,
+      tsconfig_tree *cfg);
+
+/*
+ * Set limits for tsconfig_parser_parse and tsconfig_parser_parse_batch.
+ * Trees use the limits in their options instead.
+ * limits: limits, or NULL for none
+ */
+void tsconfig_parser_set_limits(tsconfig_parser *parser,
+                                const tsconfig_limits *limits);
+
+/*
+ * Parse with a custom reader as tsconfig_parse, reusing parser's memory.
+ */
+tscfg_rc tsconfig_parser_parse(tsconfig_parser *parser, tsconfig_input in,
+      tscfg_fmt fmt, tscfg_reader reader, void *reader_state);
+
+/*
+ * Parse with a custom batch reader as tsconfig_parse_batch, reusing
+ * parser's memory.
+ */
+tscfg_rc tsconfig_parser_parse_batch(tsconfig_parser *parser,
+      tsconfig_input in, tscfg_fmt fmt, tscfg_batch_reader reader,
+      void *reader_state);
+
+/*
+ * Free all cached included files.  Trees already parsed are unaffected.
+ */
+void tsconfig_include_cache_clear(void);
+
+/*
+ * Send error messages from the calling thread to a handler instead of
+ * stderr, e.g. to collect errors per input when parsing inputs on several
+ * threads at once.  Messages from worker threads parsing parts of an
+ * input or included files go to the handler of the thread they work for.
+ * fn: handler, or NULL for stderr
+ */
+void tsconfig_set_err_handler(tsconfig_err_fn fn, void *ctx);
+
+/*
+ * Loader for config made up of several files, e.g. defaults followed by
+ * overrides, that is loaded again when files change.  Each file is
+ * loaded as an included file, so is parsed once and cached with its size,
+ * modification time and a hash of its contents.  On reload, only changed
+ * files are parsed again: unchanged files are reused as they were
+ * parsed.  The files are then merged and resolved, unless none changed.
+ */
+typedef struct tsconfig_loader tsconfig_loader;
+
+/*
+ * Create loader for files, with later files taking precedence.  Missing
+ * files are treated as empty, e.g. for optional overrides.
+ */
+tscfg_rc tsconfig_loader_new(const char *const *paths, int npaths,
+                             tsconfig_loader **loader);
+
+/*
+ * Free loader.  Trees loaded with it are unaffected.
+ */
+void tsconfig_loader_free(tsconfig_loader *loader);
+
+/*
+ * Load files, parsing only those that changed since the last load.
+ * opts: options as for tsconfig_parse_tree_opts, or NULL for defaults.
+ *       Paths and limits are not supported.  Stats only cover merging
+ *       and resolving, as files are parsed into the include cache.
+ * changed: set to false if no file changed since the last load, in which
+ *          case cfg is not set
+ * cfg: set to new tree if changed, owned by caller
+ */
+tscfg_rc tsconfig_loader_load(tsconfig_loader *loader,
+      const tsconfig_parse_opts *opts, bool *changed, tsconfig_tree *cfg);
+
 /*
  * Parse a typesafe config file with a custom reader.
  *
@@ -71,4 +300,70 @@ tscfg_rc tsconfig_parse_tree(tsconfig_input in, tscfg_fmt fmt,
 tscfg_rc tsconfig_parse(tsconfig_input in, tscfg_fmt fmt,
       tscfg_reader reader, void *reader_state);
 
+/*
+ * Parse a typesafe config file with a custom batch reader.
+ *
+ * Events are delivered in batches of up to reader.batch_size.  If the
+ * reader returns an error, this returns TSCFG_ERR_READER
+ */
+tscfg_rc tsconfig_parse_batch(tsconfig_input in, tscfg_fmt fmt,
+      tscfg_batch_reader reader, void *reader_state);
+
+/*
+ * Pull parser that returns parser events one at a time, in the same order
+ * as tsconfig_parse_batch.  Memory used is proportional to the nesting
+ * depth of the input plus the current token, however long the input is.
+ * Parsing can be stopped at any point by freeing the iterator.
+ */
+typedef struct tsconfig_iter tsconfig_iter;
+
+/*
+ * Start iterating over events for input.  Includes are not loaded: they
+ * are returned as TSCFG_EV_INCLUDE events.
+ */
+tscfg_rc tsconfig_iter_new(tsconfig_input in, tscfg_fmt fmt,
+                           tsconfig_iter **it);
+
+/*
+ * Parse up to the next event.
+ * ev: set to the next event.  Ownership of tokens and token arrays in
+ *    the event is passed to the caller, who must free them, e.g. with
+ *    tsconfig_event_free()
+ * done: set to true, without an event, at the end of input
+ * return: error if input is invalid, after which the same error is
+ *    returned by every call
+ */
+tscfg_rc tsconfig_iter_next(tsconfig_iter *it, tscfg_event *ev, bool *done);
+
+/*
+ * Free iterator and any input not yet parsed.
+ */
+void tsconfig_iter_free(tsconfig_iter *it);
+
+/*
+ * Free memory owned by an event.
+ */
+void tsconfig_event_free(tscfg_event *ev);
+
+/*
+ * Index of lines in input text, to find the line and column numbers of
+ * byte offsets such as tscfg_tok.offset.  Newlines are only found when
+ * a location is asked for, up to the furthest offset so far.  The text
+ * must outlive the index.
+ */
+typedef struct tsconfig_lines tsconfig_lines;
+
+tscfg_rc tsconfig_lines_new(const char *text, size_t len,
+                            tsconfig_lines **lines);
+
+/*
+ * Location of byte offset in text.
+ * line, col: set to line number and UTF-8 character number in line,
+ *            both starting at 1
+ */
+tscfg_rc tsconfig_lines_find(tsconfig_lines *lines, size_t offset,
+                             int *line, int *col);
+
+void tsconfig_lines_free(tsconfig_lines *lines);
+
 #endif // __TSCONFIG_H
@@ -0,0 +1,211 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+
+/*
+ * Pluggable memory allocation.
+ */
+
+#include "tsconfig_alloc.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Header before each block from counting allocator, padded to keep
+ * alignment of malloc.
+ */
+typedef union {
+  size_t size;
+  long double pad_ld;
+  void *pad_ptr;
+  long long pad_ll;
+} count_hdr;
+
+// Allocator for this thread, or NULL for malloc
+static __thread const tscfg_allocator *alloc_current = NULL;
+
+static void *count_malloc(void *ctx, size_t size);
+static void *count_realloc(void *ctx, void *ptr, size_t size);
+static void count_free(void *ctx, void *ptr);
+static void count_add(tscfg_counting_alloc *ca, size_t old_size,
+                      size_t new_size);
+
+static void *base_malloc(const tscfg_allocator *alloc, size_t size);
+static void *base_realloc(const tscfg_allocator *alloc, void *ptr,
+                          size_t size);
+static void base_free(const tscfg_allocator *alloc, void *ptr);
+
+const tscfg_allocator *tscfg_alloc_use(const tscfg_allocator *alloc) {
+  const tscfg_allocator *prev = alloc_current;
+  alloc_current = alloc;
+  return prev;
+}
+
+const tscfg_allocator *tscfg_alloc_current(void) {
+  return alloc_current;
+}
+
+void *tscfg_malloc(size_t size) {
+  return base_malloc(alloc_current, size);
+}
+
+void *tscfg_calloc(size_t count, size_t size) {
+  if (alloc_current == NULL) {
+    return calloc(count, size);
+  }
+
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+
+  void *ptr = base_malloc(alloc_current, count * size);
+  if (ptr != NULL) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+void *tscfg_realloc(void *ptr, size_t size) {
+  return base_realloc(alloc_current, ptr, size);
+}
+
+void tscfg_free(void *ptr) {
+  base_free(alloc_current, ptr);
+}
+
+void tscfg_counting_alloc_init(tscfg_counting_alloc *ca,
+                               const tscfg_allocator *base) {
+  ca->alloc.malloc = count_malloc;
+  ca->alloc.realloc = count_realloc;
+  ca->alloc.free = count_free;
+  ca->alloc.ctx = ca;
+  ca->base = base;
+  memset(&ca->stats, 0, sizeof(ca->stats));
+}
+
+void tscfg_counting_alloc_stats(tscfg_counting_alloc *ca,
+                                tscfg_alloc_stats *stats) {
+  stats->allocs = __atomic_load_n(&ca->stats.allocs, __ATOMIC_RELAXED);
+  stats->frees = __atomic_load_n(&ca->stats.frees, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n(&ca->stats.bytes, __ATOMIC_RELAXED);
+  stats->current = __atomic_load_n(&ca->stats.current, __ATOMIC_RELAXED);
+  stats->peak = __atomic_load_n(&ca->stats.peak, __ATOMIC_RELAXED);
+}
+
+void tscfg_counting_alloc_reset(tscfg_counting_alloc *ca) {
+  size_t current = __atomic_load_n(&ca->stats.current, __ATOMIC_RELAXED);
+  __atomic_store_n(&ca->stats.allocs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&ca->stats.frees, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&ca->stats.bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&ca->stats.peak, current, __ATOMIC_RELAXED);
+}
+
+static void *count_malloc(void *ctx, size_t size) {
+  tscfg_counting_alloc *ca = ctx;
+  if (size > SIZE_MAX - sizeof(count_hdr)) {
+    return NULL;
+  }
+
+  count_hdr *hdr = base_malloc(ca->base, sizeof(count_hdr) + size);
+  if (hdr == NULL) {
+    return NULL;
+  }
+
+  hdr->size = size;
+  count_add(ca, 0, size);
+  return hdr + 1;
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t size) {
+  tscfg_counting_alloc *ca = ctx;
+  if (ptr == NULL) {
+    return count_malloc(ctx, size);
+  }
+  if (size > SIZE_MAX - sizeof(count_hdr)) {
+    return NULL;
+  }
+
+  count_hdr *hdr = (count_hdr*)ptr - 1;
+  size_t old_size = hdr->size;
+  hdr = base_realloc(ca->base, hdr, sizeof(count_hdr) + size);
+  if (hdr == NULL) {
+    return NULL;
+  }
+
+  hdr->size = size;
+  count_add(ca, old_size, size);
+  return hdr + 1;
+}
+
+static void count_free(void *ctx, void *ptr) {
+  tscfg_counting_alloc *ca = ctx;
+  if (ptr == NULL) {
+    return;
+  }
+
+  count_hdr *hdr = (count_hdr*)ptr - 1;
+  __atomic_fetch_add(&ca->stats.frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&ca->stats.current, hdr->size, __ATOMIC_RELAXED);
+  base_free(ca->base, hdr);
+}
+
+/*
+ * Count allocation or reallocation from old_size to new_size.
+ */
+static void count_add(tscfg_counting_alloc *ca, size_t old_size,
+                      size_t new_size) {
+  __atomic_fetch_add(&ca->stats.allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ca->stats.bytes, new_size, __ATOMIC_RELAXED);
+
+  size_t current;
+  if (new_size >= old_size) {
+    current = __atomic_add_fetch(&ca->stats.current, new_size - old_size,
+                                 __ATOMIC_RELAXED);
+  } else {
+    current = __atomic_sub_fetch(&ca->stats.current, old_size - new_size,
+                                 __ATOMIC_RELAXED);
+  }
+
+  size_t peak = __atomic_load_n(&ca->stats.peak, __ATOMIC_RELAXED);
+  while (current > peak &&
+         !__atomic_compare_exchange_n(&ca->stats.peak, &peak, current, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // peak was reloaded, try again
+  }
+}
+
+static void *base_malloc(const tscfg_allocator *alloc, size_t size) {
+  return (alloc == NULL) ? malloc(size) : alloc->malloc(alloc->ctx, size);
+}
+
+static void *base_realloc(const tscfg_allocator *alloc, void *ptr,
+                          size_t size) {
+  return (alloc == NULL) ? realloc(ptr, size) :
+                           alloc->realloc(alloc->ctx, ptr, size);
+}
+
+static void base_free(const tscfg_allocator *alloc, void *ptr) {
+  if (alloc == NULL) {
+    free(ptr);
+  } else {
+    alloc->free(alloc->ctx, ptr);
+  }
+}
@@ -0,0 +1,117 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+
+/*
+ * Pluggable memory allocation.
+ *
+ * All memory for a tree and for parsing it is allocated with the allocator
+ * in tsconfig_parse_opts, or malloc if none is given.  The allocator in
+ * use is per thread, and is passed on to worker threads with jobs.
+ * Included files are cached for the whole process, so are always
+ * allocated with malloc.
+ */
+
+#ifndef __TSCONFIG_ALLOC_H
+#define __TSCONFIG_ALLOC_H
+
+#include <stddef.h>
+
+#include "tsconfig_common.h"
+
+/*
+ * Allocator functions with same semantics as malloc, realloc and free.
+ * Functions may be called from several threads at once if parsing with
+ * threads.
+ */
+typedef struct {
+  void *(*malloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+} tscfg_allocator;
+
+/*
+ * Counts of allocation.  Sizes are as requested, not including allocator
+ * overhead.
+ */
+typedef struct {
+  size_t allocs; // Calls to malloc and realloc
+  size_t frees; // Calls to free
+  size_t bytes; // Total bytes requested
+  size_t current; // Bytes allocated and not freed
+  size_t peak; // Highest value of current
+} tscfg_alloc_stats;
+
+/*
+ * Allocator that counts allocations and passes them on to another
+ * allocator.  Counters are updated atomically, so the same allocator can
+ * be used by many parses at once.
+ */
+typedef struct {
+  tscfg_allocator alloc; // Allocator to pass to parser
+  const tscfg_allocator *base; // Underlying allocator, NULL for malloc
+  tscfg_alloc_stats stats;
+} tscfg_counting_alloc;
+
+/*
+ * Initialize counting allocator with zero counts.  Memory allocated with
+ * it must be freed before it goes away.
+ * base: allocator to pass allocations on to, or NULL for malloc
+ */
+void tscfg_counting_alloc_init(tscfg_counting_alloc *ca,
+                               const tscfg_allocator *base);
+
+/*
+ * Get counts so far.
+ */
+void tscfg_counting_alloc_stats(tscfg_counting_alloc *ca,
+                                tscfg_alloc_stats *stats);
+
+/*
+ * Zero counts, except for memory currently allocated, which becomes the
+ * peak, e.g. to measure the next parse.
+ */
+void tscfg_counting_alloc_reset(tscfg_counting_alloc *ca);
+
+/*
+ * Internal to library.
+ */
+
+/*
+ * Set allocator for this thread.
+ * alloc: allocator, or NULL for malloc
+ * return: previous allocator, to be restored when done
+ */
+const tscfg_allocator *tscfg_alloc_use(const tscfg_allocator *alloc);
+
+/*
+ * Get allocator for this thread, or NULL for malloc.
+ */
+const tscfg_allocator *tscfg_alloc_current(void);
+
+/*
+ * Allocate with allocator for this thread.  Memory must be freed with the
+ * same allocator.
+ */
+void *tscfg_malloc(size_t size);
+void *tscfg_calloc(size_t count, size_t size);
+void *tscfg_realloc(void *ptr, size_t size);
+void tscfg_free(void *ptr);
+
+#endif // __TSCONFIG_ALLOC_H
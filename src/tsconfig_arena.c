@@ -0,0 +1,160 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Bump allocator for memory with the same lifetime.
+ */
+
+#include "tsconfig_arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsconfig_alloc.h"
+
+struct tscfg_arena_block {
+  tscfg_arena_block *next;
+};
+
+// Size of block header, padded so data is aligned
+#define BLOCK_HEADER_SIZE TSCFG_ARENA_ALIGN_UP(sizeof(tscfg_arena_block))
+
+#define BLOCK_DATA(block) ((char*)(block) + BLOCK_HEADER_SIZE)
+
+static tscfg_arena_block *new_block(size_t size);
+
+tscfg_arena *tscfg_arena_new(size_t block_size) {
+  tscfg_arena *arena = tscfg_malloc(sizeof(tscfg_arena));
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  arena->pos = NULL;
+  arena->end = NULL;
+  arena->last = NULL;
+  arena->blocks = NULL;
+  arena->block_size = (block_size > 0) ? block_size : TSCFG_ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+void tscfg_arena_free(tscfg_arena *arena) {
+  if (arena == NULL) {
+    return;
+  }
+
+  tscfg_arena_block *block = arena->blocks;
+  while (block != NULL) {
+    tscfg_arena_block *next = block->next;
+    tscfg_free(block);
+    block = next;
+  }
+
+  tscfg_free(arena);
+}
+
+void tscfg_arena_reset(tscfg_arena *arena) {
+  // Current block is the first, unless there are only large blocks
+  tscfg_arena_block *keep = (arena->pos != NULL) ? arena->blocks : NULL;
+  tscfg_arena_block *block = arena->blocks;
+  while (block != NULL) {
+    tscfg_arena_block *next = block->next;
+    if (block != keep) {
+      tscfg_free(block);
+    }
+    block = next;
+  }
+
+  arena->blocks = keep;
+  arena->last = NULL;
+  if (keep != NULL) {
+    keep->next = NULL;
+    arena->pos = BLOCK_DATA(keep);
+  }
+}
+
+void *tscfg_arena_alloc_slow(tscfg_arena *arena, size_t size) {
+  size_t aligned = TSCFG_ARENA_ALIGN_UP(size);
+  if (aligned < size) {
+    // Overflow
+    return NULL;
+  }
+
+  if (aligned > arena->block_size / 4) {
+    /*
+     * Large allocation: give it a dedicated block behind the current one,
+     * so that remaining space in current block isn't wasted.
+     */
+    tscfg_arena_block *block = new_block(aligned);
+    if (block == NULL) {
+      return NULL;
+    }
+
+    if (arena->blocks == NULL) {
+      arena->blocks = block;
+    } else {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    }
+
+    // Can't extend in place
+    arena->last = NULL;
+    return BLOCK_DATA(block);
+  }
+
+  tscfg_arena_block *block = new_block(arena->block_size);
+  if (block == NULL) {
+    return NULL;
+  }
+
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena->pos = BLOCK_DATA(block);
+  arena->end = arena->pos + arena->block_size;
+
+  return tscfg_arena_alloc(arena, size);
+}
+
+char *tscfg_arena_strdup(tscfg_arena *arena, const char *str, size_t len) {
+  if (len == SIZE_MAX) {
+    return NULL;
+  }
+
+  char *copy = tscfg_arena_alloc(arena, len + 1);
+  if (copy == NULL) {
+    return NULL;
+  }
+
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+static tscfg_arena_block *new_block(size_t size) {
+  if (size > SIZE_MAX - BLOCK_HEADER_SIZE) {
+    return NULL;
+  }
+
+  tscfg_arena_block *block = tscfg_malloc(BLOCK_HEADER_SIZE + size);
+  if (block == NULL) {
+    return NULL;
+  }
+
+  block->next = NULL;
+  return block;
+}
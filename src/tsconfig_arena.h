@@ -0,0 +1,138 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Bump allocator for memory with the same lifetime, e.g. everything
+ * allocated while parsing a config into a tree.
+ *
+ * Memory is carved out of large blocks and freed all at once when the
+ * arena is freed.  The most recent allocation can be grown or released
+ * in place, which suits strings built up incrementally by the lexer.
+ */
+
+#ifndef __TSCONFIG_ARENA_H
+#define __TSCONFIG_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Alignment of all allocations
+#define TSCFG_ARENA_ALIGN 8
+
+// Default size of blocks
+#define TSCFG_ARENA_BLOCK_SIZE 65536
+
+#define TSCFG_ARENA_ALIGN_UP(size) \
+  (((size) + TSCFG_ARENA_ALIGN - 1) & ~(size_t)(TSCFG_ARENA_ALIGN - 1))
+
+typedef struct tscfg_arena_block tscfg_arena_block;
+
+typedef struct tscfg_arena {
+  char *pos; // Next free byte in current block
+  char *end; // End of current block
+  char *last; // Start of most recent allocation, or NULL
+  tscfg_arena_block *blocks; // Blocks, current block first
+  size_t block_size;
+} tscfg_arena;
+
+/*
+ * Create a new empty arena.
+ * block_size: size of blocks to allocate, or 0 for default
+ * return: NULL if out of memory
+ */
+tscfg_arena *tscfg_arena_new(size_t block_size);
+
+/*
+ * Free arena and all memory allocated from it.
+ */
+void tscfg_arena_free(tscfg_arena *arena);
+
+/*
+ * Free all memory allocated from arena, but keep one block to reuse.
+ */
+void tscfg_arena_reset(tscfg_arena *arena);
+
+/*
+ * Slow path for allocation when current block is full.
+ */
+void *tscfg_arena_alloc_slow(tscfg_arena *arena, size_t size);
+
+/*
+ * Allocate memory from arena.
+ * return: NULL if out of memory
+ */
+static inline void *tscfg_arena_alloc(tscfg_arena *arena, size_t size) {
+  size_t aligned = TSCFG_ARENA_ALIGN_UP(size);
+  if (aligned >= size && aligned <= (size_t)(arena->end - arena->pos)) {
+    char *p = arena->pos;
+    arena->last = p;
+    arena->pos = p + aligned;
+    return p;
+  }
+
+  return tscfg_arena_alloc_slow(arena, size);
+}
+
+/*
+ * Try to grow most recent allocation in place.
+ * return: true if p now has room for new_size bytes, false if caller
+ *    must allocate elsewhere and copy.
+ */
+static inline bool tscfg_arena_extend(tscfg_arena *arena, void *p,
+                                      size_t new_size) {
+  size_t aligned = TSCFG_ARENA_ALIGN_UP(new_size);
+  if (p == NULL || (char*)p != arena->last || aligned < new_size ||
+      aligned > (size_t)(arena->end - arena->last)) {
+    return false;
+  }
+
+  arena->pos = arena->last + aligned;
+  return true;
+}
+
+/*
+ * Shrink most recent allocation to new_size bytes, giving back the rest
+ * of it.  Does nothing if p is not the most recent allocation.
+ */
+static inline void tscfg_arena_shrink(tscfg_arena *arena, void *p,
+                                      size_t new_size) {
+  size_t aligned = TSCFG_ARENA_ALIGN_UP(new_size);
+  if (p != NULL && (char*)p == arena->last && aligned >= new_size &&
+      aligned < (size_t)(arena->pos - arena->last)) {
+    arena->pos = arena->last + aligned;
+  }
+}
+
+/*
+ * Give back memory if it was the most recent allocation, otherwise it is
+ * only reclaimed when the arena is freed.
+ */
+static inline void tscfg_arena_release(tscfg_arena *arena, void *p) {
+  if (p != NULL && (char*)p == arena->last) {
+    arena->pos = arena->last;
+    arena->last = NULL;
+  }
+}
+
+/*
+ * Copy string into arena with null terminator.
+ * return: NULL if out of memory
+ */
+char *tscfg_arena_strdup(tscfg_arena *arena, const char *str, size_t len);
+
+#endif // __TSCONFIG_ARENA_H
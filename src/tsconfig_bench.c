@@ -0,0 +1,588 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Benchmark for parsing to tree, with generated inputs.
+ *
+ * Each kind of input stresses one part of the parser.  Inputs are
+ * generated from a fixed seed, so they are the same on every run, and are
+ * parsed from each kind of input source.  For each, the best time of a
+ * number of runs is reported, along with allocations and peak heap use
+ * from a separate run with a counting allocator.  Each source is parsed
+ * in a child process of its own, so that peak resident memory is only
+ * for that input, including the generated text.  Tokens per second are
+ * n/a if the library was configured with --disable-stats.
+ *
+ * Usage: tsconfig_bench [-s MB] [-n runs] [-t threads] [-k kind] [-g dir]
+ *   -s MB: approximate size of each input (default 4)
+ *   -n runs: timed runs of each input, best is reported (default 5)
+ *   -t threads: threads for parsing, as tsconfig_parse_opts (default 1)
+ *   -k kind: only run this kind of input
+ *   -g dir: only write inputs to files in dir
+ */
+
+// Needed for getopt, mkdtemp, clock_gettime and fork
+#define _XOPEN_SOURCE 700
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsconfig.h"
+#include "tsconfig_alloc.h"
+
+/*
+ * Growable buffer for generated input.
+ */
+typedef struct {
+  char *str;
+  size_t len;
+  size_t size;
+} gen_buf;
+
+typedef struct {
+  const char *name;
+  void (*gen)(gen_buf *b, uint64_t *rng, size_t size);
+} gen_kind;
+
+static void gen_wide(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_deep(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_strings(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_comments(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_subs(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_dups(gen_buf *b, uint64_t *rng, size_t size);
+static void gen_json(gen_buf *b, uint64_t *rng, size_t size);
+
+static const gen_kind kinds[] = {
+  { "wide", gen_wide },
+  { "deep", gen_deep },
+  { "strings", gen_strings },
+  { "comments", gen_comments },
+  { "subs", gen_subs },
+  { "dups", gen_dups },
+  { "json", gen_json },
+};
+
+#define NKINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+typedef struct {
+  const char *name;
+  tsconfig_input_kind kind;
+} input_source;
+
+static const input_source sources[] = {
+  { "FILE", TS_CONFIG_IN_FILE },
+  { "STR", TS_CONFIG_IN_STR },
+  { "MMAP", TS_CONFIG_IN_MMAP },
+};
+
+#define NSOURCES (sizeof(sources) / sizeof(sources[0]))
+
+static void append(gen_buf *b, const char *fmt, ...);
+static uint64_t next_rand(uint64_t *rng);
+static void gen_input(const gen_kind *k, size_t size, gen_buf *b);
+static void write_file(const char *path, const gen_buf *b);
+static void bench_input(const char *kind, const char *path,
+                        const gen_buf *b, int runs, int threads);
+static void bench_source(const char *kind, const input_source *src,
+                         const char *path, const gen_buf *b, int runs,
+                         int threads);
+static bool parse_once(tsconfig_input_kind src, const char *path,
+                       const gen_buf *b, tsconfig_parse_opts *opts);
+static double now_sec(void);
+static void usage(void);
+
+int main(int argc, char **argv) {
+  double size_mb = 4;
+  int runs = 5;
+  int threads = 1;
+  const char *only = NULL;
+  const char *gen_dir = NULL;
+
+  int c;
+  while ((c = getopt(argc, argv, "s:n:t:k:g:")) != -1) {
+    switch (c) {
+      case 's':
+        size_mb = atof(optarg);
+        break;
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'k':
+        only = optarg;
+        break;
+      case 'g':
+        gen_dir = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind != argc || size_mb <= 0 || runs < 1 || threads < 0) {
+    usage();
+    return 1;
+  }
+
+  char tmp_dir[] = "/tmp/tsconfig_bench.XXXXXX";
+  const char *dir = gen_dir;
+  if (dir == NULL) {
+    dir = mkdtemp(tmp_dir);
+    if (dir == NULL) {
+      perror("Could not create temporary directory");
+      return 1;
+    }
+
+    printf("%-9s %-5s %8s %9s %10s %10s %10s %9s\n", "input", "from",
+           "MB", "MB/s", "Mtok/s", "allocs", "peak MB", "RSS MB");
+  }
+
+  bool found = false;
+  for (size_t i = 0; i < NKINDS; i++) {
+    if (only != NULL && strcmp(only, kinds[i].name) != 0) {
+      continue;
+    }
+    found = true;
+
+    gen_buf b = { NULL, 0, 0 };
+    gen_input(&kinds[i], (size_t)(size_mb * 1024 * 1024), &b);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.conf", dir, kinds[i].name);
+    write_file(path, &b);
+
+    if (gen_dir == NULL) {
+      bench_input(kinds[i].name, path, &b, runs, threads);
+      remove(path);
+    }
+    free(b.str);
+  }
+
+  if (gen_dir == NULL) {
+    rmdir(dir);
+  }
+
+  if (!found) {
+    fprintf(stderr, "Unknown kind of input: %s\n", only);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Parse input from each source, and print results.
+ */
+static void bench_input(const char *kind, const char *path,
+                        const gen_buf *b, int runs, int threads) {
+  for (size_t s = 0; s < NSOURCES; s++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("Could not fork");
+      exit(1);
+    } else if (pid == 0) {
+      bench_source(kind, &sources[s], path, b, runs, threads);
+      fflush(stdout);
+      _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Benchmark of %s from %s failed\n", kind,
+              sources[s].name);
+      exit(1);
+    }
+  }
+}
+
+/*
+ * Parse input from one source and print results, in child process.
+ */
+static void bench_source(const char *kind, const input_source *src,
+                         const char *path, const gen_buf *b, int runs,
+                         int threads) {
+  // Counts are from a run of their own, as they slow down parsing
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tsconfig_stats stats;
+  tsconfig_parse_opts opts = { .threads = threads, .alloc = &ca.alloc,
+                               .stats = &stats };
+  if (!parse_once(src->kind, path, b, &opts)) {
+    _exit(1);
+  }
+
+  uint64_t ntoks = 0;
+  for (int i = 0; i < TSCFG_TOK_NTAGS; i++) {
+    ntoks += stats.toks[i];
+  }
+
+  tscfg_alloc_stats alloc_stats;
+  tscfg_counting_alloc_stats(&ca, &alloc_stats);
+
+  opts = (tsconfig_parse_opts){ .threads = threads };
+  double best = 0;
+  for (int r = 0; r < runs; r++) {
+    double start = now_sec();
+    if (!parse_once(src->kind, path, b, &opts)) {
+      _exit(1);
+    }
+
+    double t = now_sec() - start;
+    if (r == 0 || t < best) {
+      best = t;
+    }
+  }
+
+  // High-water mark for this process, which only parsed this input
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  // Stats are all zero if compiled out
+  char tok_rate[32];
+  if (stats.bytes > 0) {
+    snprintf(tok_rate, sizeof(tok_rate), "%.2f",
+             (double)ntoks / best / 1e6);
+  } else {
+    snprintf(tok_rate, sizeof(tok_rate), "n/a");
+  }
+
+  double mb = (double)b->len / (1024 * 1024);
+  printf("%-9s %-5s %8.2f %9.1f %10s %10zu %10.2f %9.1f\n", kind,
+         src->name, mb, mb / best, tok_rate, alloc_stats.allocs,
+         (double)alloc_stats.peak / (1024 * 1024),
+         (double)ru.ru_maxrss / 1024);
+}
+
+/*
+ * Parse input from source to tree and free tree.
+ * return: false on error, after printing message
+ */
+static bool parse_once(tsconfig_input_kind src, const char *path,
+                       const gen_buf *b, tsconfig_parse_opts *opts) {
+  tsconfig_input in = { .kind = src };
+  FILE *f = NULL;
+  if (src == TS_CONFIG_IN_FILE) {
+    f = fopen(path, "r");
+    if (f == NULL) {
+      perror(path);
+      return false;
+    }
+    in.data.f = f;
+  } else if (src == TS_CONFIG_IN_STR) {
+    in.data.s.str = b->str;
+    in.data.s.len = b->len;
+    in.data.s.pos = 0;
+  } else {
+    in.data.path = path;
+  }
+
+  tsconfig_tree tree;
+  tscfg_rc rc = tsconfig_parse_tree_opts(in, TSCFG_HOCON, opts, &tree);
+  if (f != NULL) {
+    fclose(f);
+  }
+
+  if (rc != TSCFG_OK) {
+    fprintf(stderr, "Error parsing %s: %i\n", path, (int)rc);
+    return false;
+  }
+
+  tsconfig_tree_free(&tree);
+  return true;
+}
+
+static void gen_input(const gen_kind *k, size_t size, gen_buf *b) {
+  // Same seed for every kind, so inputs don't depend on which are run
+  uint64_t rng = 0x9E3779B97F4A7C15ull;
+  k->gen(b, &rng, size);
+}
+
+/*
+ * Objects with many keys, with scalar values of all types.
+ */
+static void gen_wide(gen_buf *b, uint64_t *rng, size_t size) {
+  for (int obj = 0; b->len < size; obj++) {
+    append(b, "obj%d {\n", obj);
+    for (int key = 0; key < 1000; key++) {
+      uint64_t r = next_rand(rng);
+      switch (r % 4) {
+        case 0:
+          append(b, "  key%d = %d\n", key, (int)((r >> 8) % 100000));
+          break;
+        case 1:
+          append(b, "  key%d = \"value %d\"\n", key, (int)((r >> 8) % 1000));
+          break;
+        case 2:
+          append(b, "  key%d: %s\n", key, (r & 16) ? "true" : "false");
+          break;
+        default:
+          append(b, "  key%d = %d.%d\n", key, (int)((r >> 8) % 1000),
+                 (int)((r >> 20) % 1000));
+          break;
+      }
+    }
+    append(b, "}\n");
+  }
+}
+
+/*
+ * Deeply nested objects and arrays.
+ */
+static void gen_deep(gen_buf *b, uint64_t *rng, size_t size) {
+  enum { DEPTH = 100 };
+  char closes[DEPTH];
+  for (int n = 0; b->len < size; n++) {
+    append(b, "nest%d = ", n);
+    for (int d = 0; d < DEPTH; d++) {
+      if (next_rand(rng) % 4 == 0) {
+        append(b, "[");
+        closes[d] = ']';
+      } else {
+        append(b, "{ k%d = ", d);
+        closes[d] = '}';
+      }
+    }
+    append(b, "%d", n);
+
+    for (int d = DEPTH - 1; d >= 0; d--) {
+      append(b, " %c", closes[d]);
+    }
+    append(b, "\n");
+  }
+}
+
+/*
+ * Long quoted strings with escapes, and triple-quoted strings.
+ */
+static void gen_strings(gen_buf *b, uint64_t *rng, size_t size) {
+  static const char *const words[] = {
+    "alpha", "beta", "gamma", "delta", "config", "value", "caf\xc3\xa9",
+    "\\n", "\\t", "\\\"quoted\\\"", "\\u00e9", "path\\\\to",
+  };
+  const size_t nwords = sizeof(words) / sizeof(words[0]);
+
+  for (int n = 0; b->len < size; n++) {
+    bool triple = (n % 3 == 2);
+    append(b, "str%d = %s", n, triple ? "\"\"\"" : "\"");
+    int len = 50 + (int)(next_rand(rng) % 400);
+    for (int w = 0; w < len; w++) {
+      const char *word = words[next_rand(rng) % nwords];
+      if (triple && word[0] == '\\') {
+        // No escapes in triple-quoted strings, but newlines are allowed
+        word = (w % 10 == 9) ? "\n" : "raw";
+      }
+      append(b, "%s ", word);
+    }
+    append(b, "%s\n", triple ? "\"\"\"" : "\"");
+  }
+}
+
+/*
+ * Mostly comments of all styles, with a few fields.
+ */
+static void gen_comments(gen_buf *b, uint64_t *rng, size_t size) {
+  for (int n = 0; b->len < size; n++) {
+    switch (next_rand(rng) % 4) {
+      case 0:
+        append(b, "# Comment %d about the next setting, which is not very "
+                  "interesting but is here anyway\n", n);
+        break;
+      case 1:
+        append(b, "// Comment %d in another style, // with nested "
+                  "markers # inside it\n", n);
+        break;
+      case 2:
+        append(b, "    # Indented comment %d\n\n", n);
+        break;
+      default:
+        append(b, "field%d = %d // trailing comment\n", n, n);
+        break;
+    }
+  }
+}
+
+/*
+ * Many substitutions of other values and of environment variables.
+ */
+static void gen_subs(gen_buf *b, uint64_t *rng, size_t size) {
+  const int nbase = 1000;
+  append(b, "base {\n");
+  for (int i = 0; i < nbase; i++) {
+    append(b, "  n%d = %d\n  s%d = \"str%d\"\n  o%d { a = %d }\n", i, i, i,
+           i, i, i);
+  }
+  append(b, "}\n");
+
+  for (int n = 0; b->len < size; n++) {
+    int i = (int)(next_rand(rng) % (uint64_t)nbase);
+    int j = (int)(next_rand(rng) % (uint64_t)nbase);
+    switch (n % 5) {
+      case 0:
+        append(b, "v%d = ${base.n%d}\n", n, i);
+        break;
+      case 1:
+        append(b, "v%d = ${base.s%d}\"-\"${base.s%d}\n", n, i, j);
+        break;
+      case 2:
+        append(b, "v%d = ${base.o%d} { b = ${base.n%d} }\n", n, i, j);
+        break;
+      case 3:
+        append(b, "v%d = ${?TSCFG_BENCH_UNSET_%d}\n", n, i);
+        break;
+      default:
+        // Self-reference, to previous value of key
+        append(b, "v%d = [%d]\nv%d = ${v%d} [%d]\n", n, i, n, n, j);
+        break;
+    }
+  }
+}
+
+/*
+ * Same keys defined many times, to be merged or overridden.
+ */
+static void gen_dups(gen_buf *b, uint64_t *rng, size_t size) {
+  const int nsvcs = 50;
+  for (int n = 0; b->len < size; n++) {
+    int svc = (int)(next_rand(rng) % (uint64_t)nsvcs);
+    switch (n % 4) {
+      case 0:
+        append(b, "svc%d { port = %d, host = \"h%d\", opts { retries = %d } "
+                  "}\n", svc, 8000 + n % 1000, n, n % 10);
+        break;
+      case 1:
+        append(b, "svc%d.port = %d\n", svc, 9000 + n % 1000);
+        break;
+      case 2:
+        append(b, "svc%d.opts { timeout = %dms, retries = %d }\n", svc,
+               n % 5000, n % 7);
+        break;
+      default:
+        append(b, "svc%d.tags = [\"t%d\", \"u%d\"]\n", svc, n, n % 13);
+        break;
+    }
+  }
+}
+
+/*
+ * JSON document with large arrays.
+ */
+static void gen_json(gen_buf *b, uint64_t *rng, size_t size) {
+  append(b, "{\n  \"numbers\": [");
+  size_t part = size / 3;
+  for (int n = 0; b->len < part; n++) {
+    uint64_t r = next_rand(rng);
+    if (r % 2 == 0) {
+      append(b, "%s%d", n == 0 ? "" : ", ",
+             (int)((r >> 16) % 1000000) - 500000);
+    } else {
+      append(b, "%s%d.%de%d", n == 0 ? "" : ", ", (int)((r >> 16) % 1000),
+             (int)((r >> 32) % 1000), (int)((r >> 48) % 20) - 10);
+    }
+  }
+
+  append(b, "],\n  \"records\": [\n");
+  for (int n = 0; b->len < size; n++) {
+    uint64_t r = next_rand(rng);
+    append(b, "%s    {\"id\": %d, \"name\": \"record %d\", \"active\": %s, "
+              "\"score\": %d.%d, \"parent\": null, \"tags\": [\"a\", "
+              "\"b%d\"]}", n == 0 ? "" : ",\n", n, n,
+           (r & 1) ? "true" : "false", (int)((r >> 8) % 100),
+           (int)((r >> 16) % 100), (int)((r >> 24) % 50));
+  }
+  append(b, "\n  ]\n}\n");
+}
+
+static void append(gen_buf *b, const char *fmt, ...) {
+  while (true) {
+    va_list args;
+    va_start(args, fmt);
+    size_t avail = b->size - b->len;
+    int n = vsnprintf(b->str + b->len, avail, fmt, args);
+    va_end(args);
+
+    if (n < 0) {
+      fprintf(stderr, "Could not format input\n");
+      exit(1);
+    }
+    if ((size_t)n < avail) {
+      b->len += (size_t)n;
+      return;
+    }
+
+    size_t new_size = (b->size == 0) ? 65536 : b->size * 2;
+    while (new_size - b->len <= (size_t)n) {
+      new_size *= 2;
+    }
+    char *tmp = realloc(b->str, new_size);
+    if (tmp == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    b->str = tmp;
+    b->size = new_size;
+  }
+}
+
+/*
+ * xorshift64* generator, so that inputs are the same on all platforms.
+ */
+static uint64_t next_rand(uint64_t *rng) {
+  uint64_t x = *rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *rng = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+static void write_file(const char *path, const gen_buf *b) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL || fwrite(b->str, 1, b->len, f) != b->len ||
+      fclose(f) != 0) {
+    perror(path);
+    exit(1);
+  }
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: tsconfig_bench [-s MB] [-n runs] [-t threads] "
+                  "[-k kind] [-g dir]\n");
+  fprintf(stderr, "Kinds of input:");
+  for (size_t i = 0; i < NKINDS; i++) {
+    fprintf(stderr, " %s", kinds[i].name);
+  }
+  fprintf(stderr, "\n");
+}
@@ -0,0 +1,415 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that many config files parse and resolve, e.g. before deploying
+ * them.  Files are checked in parallel by worker threads, each reusing
+ * one parser, and errors are collected per file so that output from
+ * different files is not interleaved.
+ *
+ * Usage: tsconfig_check [-j workers] [-v] path...
+ *   -j workers: files checked at once (default number of processors)
+ *   -v: also list files that are valid, and for invalid files the trace
+ *       of library source locations where checks failed
+ * Paths may be files or directories, which are searched recursively for
+ * files ending in .conf, .json or .hocon.  Exits with status 1 if any
+ * file is invalid.
+ */
+
+// Needed for nftw, sysconf and clock_gettime
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsconfig.h"
+
+// Limit on open directories while searching
+#define MAX_OPEN_DIRS 64
+
+static const char *const exts[] = { ".conf", ".json", ".hocon" };
+
+#define NEXTS (sizeof(exts) / sizeof(exts[0]))
+
+/*
+ * File to check, and result once checked.
+ */
+typedef struct {
+  char *path;
+  size_t size;
+  tscfg_rc rc;
+  double secs;
+
+  // Error messages reported while checking, separated by newlines
+  char *errs;
+  size_t errs_len;
+  size_t errs_size;
+} check_file;
+
+typedef struct {
+  check_file *files;
+  size_t nfiles;
+  size_t files_size;
+
+  // Index of next file to check, claimed atomically by workers
+  size_t next;
+} check_state;
+
+// Files found by nftw(), which has no argument for callback
+static check_state *found_state = NULL;
+
+// Whether to keep trace messages, which only give library source locations
+static bool keep_traces = false;
+
+// Ending of trace messages reported as errors unwind through the library
+static const char trace_msg[] = "Check failed";
+
+static bool add_file(check_state *cs, const char *path, size_t size);
+static bool add_path(check_state *cs, const char *path);
+static int add_found(const char *path, const struct stat *st, int type,
+                     struct FTW *ftw);
+static bool has_ext(const char *path);
+static int cmp_files(const void *a, const void *b);
+static void *worker_main(void *arg);
+static void collect_err(void *ctx, const char *msg);
+static bool is_trace(const char *msg, size_t len);
+static void print_result(const check_file *f, bool verbose);
+static const char *rc_str(tscfg_rc rc);
+static double now_sec(void);
+static void usage(void);
+
+int main(int argc, char **argv) {
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  bool verbose = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "j:v")) != -1) {
+    switch (c) {
+      case 'j':
+        workers = atol(optarg);
+        if (workers < 1) {
+          usage();
+          return 2;
+        }
+        break;
+      case 'v':
+        verbose = true;
+        keep_traces = true;
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+
+  if (optind == argc) {
+    usage();
+    return 2;
+  }
+
+  check_state cs = { .files = NULL };
+  for (int i = optind; i < argc; i++) {
+    if (!add_path(&cs, argv[i])) {
+      return 2;
+    }
+  }
+
+  if (workers < 1) {
+    workers = 1;
+  }
+  if ((size_t)workers > cs.nfiles) {
+    workers = cs.nfiles > 0 ? (long)cs.nfiles : 1;
+  }
+
+  double start = now_sec();
+
+  // Calling thread is one of the workers
+  pthread_t *threads = malloc(sizeof(threads[0]) * (size_t)workers);
+  if (threads == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  long started = 1;
+  for (; started < workers; started++) {
+    if (pthread_create(&threads[started], NULL, worker_main, &cs) != 0) {
+      break;
+    }
+  }
+  worker_main(&cs);
+  for (long i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  double elapsed = now_sec() - start;
+
+  size_t nfailed = 0, bytes = 0;
+  const check_file *slowest = NULL;
+  for (size_t i = 0; i < cs.nfiles; i++) {
+    const check_file *f = &cs.files[i];
+    print_result(f, verbose);
+    nfailed += (f->rc != TSCFG_OK);
+    bytes += f->size;
+    if (slowest == NULL || f->secs > slowest->secs) {
+      slowest = f;
+    }
+  }
+
+  double mb = (double)bytes / (1024 * 1024);
+  printf("%zu files, %zu invalid, %.1f MB in %.3f s with %ld workers: "
+         "%.0f files/s, %.1f MB/s\n", cs.nfiles, nfailed, mb, elapsed,
+         started, elapsed > 0 ? (double)cs.nfiles / elapsed : 0.0,
+         elapsed > 0 ? mb / elapsed : 0.0);
+  if (slowest != NULL) {
+    printf("Slowest: %s in %.3f s\n", slowest->path, slowest->secs);
+  }
+
+  for (size_t i = 0; i < cs.nfiles; i++) {
+    free(cs.files[i].path);
+    free(cs.files[i].errs);
+  }
+  free(cs.files);
+  return nfailed > 0 ? 1 : 0;
+}
+
+static bool add_file(check_state *cs, const char *path, size_t size) {
+  if (cs->nfiles == cs->files_size) {
+    size_t new_size = cs->files_size > 0 ? cs->files_size * 2 : 64;
+    check_file *new_files = realloc(cs->files,
+                                    sizeof(cs->files[0]) * new_size);
+    if (new_files == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return false;
+    }
+    cs->files = new_files;
+    cs->files_size = new_size;
+  }
+
+  char *copy = malloc(strlen(path) + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return false;
+  }
+  strcpy(copy, path);
+
+  cs->files[cs->nfiles++] = (check_file){ .path = copy, .size = size };
+  return true;
+}
+
+/*
+ * Add file, or files found under directory in sorted order.
+ */
+static bool add_path(check_state *cs, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return false;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    return add_file(cs, path, (size_t)st.st_size);
+  }
+
+  size_t first = cs->nfiles;
+  found_state = cs;
+  int rc = nftw(path, add_found, MAX_OPEN_DIRS, FTW_PHYS);
+  found_state = NULL;
+  if (rc != 0) {
+    if (rc < 0) {
+      perror(path);
+    }
+    return false;
+  }
+
+  qsort(&cs->files[first], cs->nfiles - first, sizeof(cs->files[0]),
+        cmp_files);
+  return true;
+}
+
+static int add_found(const char *path, const struct stat *st, int type,
+                     struct FTW *ftw) {
+  (void)ftw;
+  if (type != FTW_F || !S_ISREG(st->st_mode) || !has_ext(path)) {
+    return 0;
+  }
+  return add_file(found_state, path, (size_t)st->st_size) ? 0 : 1;
+}
+
+static bool has_ext(const char *path) {
+  size_t len = strlen(path);
+  for (size_t i = 0; i < NEXTS; i++) {
+    size_t ext_len = strlen(exts[i]);
+    if (len > ext_len && strcmp(&path[len - ext_len], exts[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int cmp_files(const void *a, const void *b) {
+  return strcmp(((const check_file*)a)->path, ((const check_file*)b)->path);
+}
+
+/*
+ * Check files until none are left, with a parser kept for all of them.
+ */
+static void *worker_main(void *arg) {
+  check_state *cs = arg;
+  tsconfig_parser *parser = NULL;
+  if (tsconfig_parser_new(&parser) != TSCFG_OK) {
+    // Parse without reusing memory instead
+    parser = NULL;
+  }
+
+  // Each file is parsed on this thread only, as files are checked in
+  // parallel already
+  tsconfig_parse_opts opts = { .threads = 1 };
+
+  for (;;) {
+    size_t i = __atomic_fetch_add(&cs->next, 1, __ATOMIC_RELAXED);
+    if (i >= cs->nfiles) {
+      break;
+    }
+
+    check_file *f = &cs->files[i];
+    tsconfig_set_err_handler(collect_err, f);
+
+    tsconfig_input in = { .kind = TS_CONFIG_IN_MMAP };
+    in.data.path = f->path;
+    tsconfig_tree cfg;
+    double start = now_sec();
+    if (parser != NULL) {
+      f->rc = tsconfig_parser_parse_tree(parser, in, TSCFG_HOCON, &opts,
+                                         &cfg);
+    } else {
+      f->rc = tsconfig_parse_tree_opts(in, TSCFG_HOCON, &opts, &cfg);
+    }
+    if (f->rc == TSCFG_OK) {
+      tsconfig_tree_free(&cfg);
+    }
+    f->secs = now_sec() - start;
+  }
+
+  tsconfig_set_err_handler(NULL, NULL);
+  tsconfig_parser_free(parser);
+  return NULL;
+}
+
+/*
+ * Append error message to file being checked.
+ */
+static void collect_err(void *ctx, const char *msg) {
+  check_file *f = ctx;
+  size_t len = strlen(msg);
+  if (!keep_traces && is_trace(msg, len)) {
+    return;
+  }
+
+  if (f->errs_size - f->errs_len < len + 2) {
+    size_t new_size = f->errs_size > 0 ? f->errs_size : 256;
+    while (new_size - f->errs_len < len + 2) {
+      new_size *= 2;
+    }
+    char *new_errs = realloc(f->errs, new_size);
+    if (new_errs == NULL) {
+      // Drop message rather than fail the check
+      return;
+    }
+    f->errs = new_errs;
+    f->errs_size = new_size;
+  }
+
+  memcpy(&f->errs[f->errs_len], msg, len);
+  f->errs_len += len;
+  f->errs[f->errs_len++] = '\n';
+  f->errs[f->errs_len] = '\0';
+}
+
+/*
+ * Whether message is only a trace of a failed check, e.g.
+ * "tsconfig.c:123: Check failed", rather than describing an error.
+ */
+static bool is_trace(const char *msg, size_t len) {
+  size_t trace_len = sizeof(trace_msg) - 1;
+  return len >= trace_len &&
+         memcmp(&msg[len - trace_len], trace_msg, trace_len) == 0 &&
+         (len == trace_len || msg[len - trace_len - 1] == ' ');
+}
+
+static void print_result(const check_file *f, bool verbose) {
+  if (f->rc == TSCFG_OK) {
+    if (verbose) {
+      printf("%s: ok\n", f->path);
+    }
+    return;
+  }
+
+  printf("%s: %s\n", f->path, rc_str(f->rc));
+  for (const char *line = f->errs; line != NULL && *line != '\0'; ) {
+    const char *end = strchr(line, '\n');
+    printf("  %.*s\n", (int)(end - line), line);
+    line = end + 1;
+  }
+}
+
+static const char *rc_str(tscfg_rc rc) {
+  switch (rc) {
+    case TSCFG_OK:
+      return "ok";
+    case TSCFG_ERR_ARG:
+      return "invalid argument";
+    case TSCFG_ERR_OOM:
+      return "out of memory";
+    case TSCFG_ERR_SYNTAX:
+      return "syntax error";
+    case TSCFG_ERR_INVALID:
+      return "invalid config";
+    case TSCFG_ERR_IO:
+      return "I/O error";
+    case TSCFG_ERR_READER:
+      return "reader error";
+    case TSCFG_ERR_UNIMPL:
+      return "unsupported feature";
+    case TSCFG_ERR_NOT_FOUND:
+      return "not found";
+    case TSCFG_ERR_TYPE:
+      return "wrong type";
+    case TSCFG_ERR_LIMIT:
+      return "limit exceeded";
+    case TSCFG_ERR_UNKNOWN:
+      break;
+  }
+  return "unknown error";
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: tsconfig_check [-j workers] [-v] path...\n");
+}
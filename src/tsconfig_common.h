@@ -34,6 +34,15 @@ typedef enum {
   TSCFG_ERR_READER, /* Error caused by reader */
   TSCFG_ERR_UNKNOWN,
   TSCFG_ERR_UNIMPL,
+  TSCFG_ERR_NOT_FOUND, /* Path not present in tree */
+  TSCFG_ERR_TYPE, /* Value not of requested type */
+  TSCFG_ERR_LIMIT, /* Input exceeds limit in options */
 } tscfg_rc;
 
+/*
+ * Handler for error messages, called with each message without a
+ * trailing newline.
+ */
+typedef void (*tsconfig_err_fn)(void *ctx, const char *msg);
+
 #endif // __TSCONFIG_COMMON_H
@@ -25,6 +25,14 @@
 
 #include <stdio.h>
 
+#include "tsconfig.h"
+
+// Longer messages for handlers are truncated
+#define ERR_MSG_MAX 1024
+
+// Error handler for this thread
+static __thread tscfg_err_handler err_handler = { NULL, NULL };
+
 /*
  * Put an error message in the appropriate place and return
  * code.
@@ -39,10 +47,38 @@ void tscfg_report_err(const char *file, int line, const char *fmt, ...) {
 
 void tscfg_report_err_v(const char *file, int line, const char *fmt,
                         va_list args) {
+  if (err_handler.fn != NULL) {
+    char msg[ERR_MSG_MAX];
+    int n = 0;
+    if (TSCFG_DEBUG && file != NULL) {
+      n = snprintf(msg, sizeof(msg), "%s:%i: ", file, line);
+      if (n < 0 || (size_t)n >= sizeof(msg)) {
+        n = 0;
+      }
+    }
+    vsnprintf(&msg[n], sizeof(msg) - (size_t)n, fmt, args);
+    err_handler.fn(err_handler.ctx, msg);
+    return;
+  }
+
   // TODO: more sophisticated logging facilities.
-  if (TSCFG_DEBUG) {
+  if (TSCFG_DEBUG && file != NULL) {
     fprintf(TSCFG_ERR_FILE, "%s:%i: ", file, line);
   }
   vfprintf(TSCFG_ERR_FILE, fmt, args);
   fputc('\n', TSCFG_ERR_FILE);
 }
+
+void tsconfig_set_err_handler(tsconfig_err_fn fn, void *ctx) {
+  err_handler = (tscfg_err_handler){ .fn = fn, .ctx = ctx };
+}
+
+tscfg_err_handler tscfg_err_handler_use(tscfg_err_handler handler) {
+  tscfg_err_handler prev = err_handler;
+  err_handler = handler;
+  return prev;
+}
+
+tscfg_err_handler tscfg_err_handler_current(void) {
+  return err_handler;
+}
@@ -26,6 +26,8 @@
 
 #include <stdarg.h>
 
+#include "tsconfig_common.h"
+
 // TODO: disable by default
 #define TSCFG_DEBUG 1
 
@@ -34,16 +36,42 @@
 #define REPORT_ERR(...) \
   tscfg_report_err(__FILE__, __LINE__, __VA_ARGS__)
 
+// Trace of checks failed as an error unwinds.  Text is matched by
+// tsconfig_check to leave traces out of its reports.
 #ifdef TSCFG_DEBUG
 #define PRINT_ERR_TRACE() REPORT_ERR("Check failed");
 #else
 #define PRINT_ERR_TRACE()
 #endif
 
+/*
+ * Report error message.
+ * file, line: source location, or NULL for a message that continues the
+ *             previous one, e.g. with the input location
+ */
 void tscfg_report_err(const char *file, int line, const char *fmt, ...);
 void tscfg_report_err_v(const char *file, int line, const char *fmt,
                         va_list args);
 
+/*
+ * Error handler for a thread, set with tsconfig_set_err_handler().
+ */
+typedef struct {
+  tsconfig_err_fn fn; // NULL for stderr
+  void *ctx;
+} tscfg_err_handler;
+
+/*
+ * Set error handler for this thread.
+ * return: previous handler, to be restored when done
+ */
+tscfg_err_handler tscfg_err_handler_use(tscfg_err_handler handler);
+
+/*
+ * Get error handler for this thread.
+ */
+tscfg_err_handler tscfg_err_handler_current(void);
+
 #define TSCFG_CHECK(rc) { \
   tscfg_rc __rc = (rc);               \
   if (__rc != TSCFG_OK) {             \
@@ -0,0 +1,316 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Binary images of trees, which are the tape, string pool and key index
+ * written out as they are in memory after a header, so that an image can
+ * be mapped and used directly as a tree.
+ *
+ * Everything in a tree is an index or offset rather than a pointer, so
+ * the image is position independent.  Sections are 8-byte aligned, in
+ * the order tape, objects, index entries, pool.  Padding bytes are
+ * zeroed so that the same tree always gives the same image.
+ */
+
+// Needed for POSIX file mapping functions and mkstemp
+#define _XOPEN_SOURCE 700
+
+#include "tsconfig_tree.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+
+#define IMAGE_MAGIC "TSCFGIMG"
+#define IMAGE_VERSION 2 // 2: decoded numbers in string pool
+#define IMAGE_BYTE_ORDER 0x01020304u
+#define IMAGE_ALIGN 8
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // IMAGE_BYTE_ORDER in writer's byte order
+
+  // Sizes of structs, which must match reader's
+  uint32_t entry_size;
+  uint32_t obj_size;
+
+  uint64_t image_len;
+
+  // Offsets from start of image and lengths in elements
+  uint64_t tape_off, tape_len;
+  uint64_t objs_off, nobjs;
+  uint64_t index_off, index_len;
+  uint64_t pool_off, pool_len;
+} image_hdr;
+
+typedef struct {
+  FILE *f;
+  uint64_t pos;
+} image_writer;
+
+static tscfg_rc write_bytes(image_writer *w, const void *data, size_t len);
+static tscfg_rc write_pad(image_writer *w);
+static tscfg_rc write_sections(image_writer *w, const tsconfig_tree *tree,
+                               image_hdr *hdr);
+static bool section_ok(const image_hdr *hdr, uint64_t off, uint64_t len,
+                       size_t elem_size);
+
+static inline uint64_t align_up(uint64_t n) {
+  return (n + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1);
+}
+
+tscfg_rc tsconfig_image_write(const tsconfig_tree *tree, const char *path) {
+  TSCFG_COND(tree->tape_len > 0, TSCFG_ERR_ARG);
+  if (tree->nobjs > 0 && tree->objs == NULL) {
+    REPORT_ERR("Tree must be indexed to write image");
+    return TSCFG_ERR_ARG;
+  }
+
+  // Write to temporary file next to image and rename over it, so that
+  // processes with old image mapped are unaffected
+  size_t path_len = strlen(path);
+  char *tmp_path = tscfg_malloc(path_len + sizeof(".XXXXXX"));
+  TSCFG_CHECK_MALLOC(tmp_path);
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    REPORT_ERR("Could not create %s: %s", tmp_path, strerror(errno));
+    tscfg_free(tmp_path);
+    return TSCFG_ERR_IO;
+  }
+
+  // Images are meant to be shared, unlike usual temporary files
+  image_writer w = { .f = NULL, .pos = 0 };
+  if (fchmod(fd, 0644) == 0) {
+    w.f = fdopen(fd, "wb");
+  }
+  if (w.f == NULL) {
+    REPORT_ERR("Could not open %s: %s", tmp_path, strerror(errno));
+    close(fd);
+    unlink(tmp_path);
+    tscfg_free(tmp_path);
+    return TSCFG_ERR_IO;
+  }
+
+  image_hdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.byte_order = IMAGE_BYTE_ORDER;
+  hdr.entry_size = (uint32_t)sizeof(tscfg_index_entry);
+  hdr.obj_size = (uint32_t)sizeof(tscfg_obj_index);
+
+  tscfg_rc rc = write_sections(&w, tree, &hdr);
+  if (rc == TSCFG_OK) {
+    // Fill in header now that offsets are known
+    hdr.image_len = w.pos;
+    if (fseek(w.f, 0, SEEK_SET) != 0) {
+      rc = TSCFG_ERR_IO;
+    } else {
+      rc = write_bytes(&w, &hdr, sizeof(hdr));
+    }
+  }
+
+  if (fclose(w.f) != 0 && rc == TSCFG_OK) {
+    REPORT_ERR("Could not write %s: %s", tmp_path, strerror(errno));
+    rc = TSCFG_ERR_IO;
+  }
+  if (rc == TSCFG_OK && rename(tmp_path, path) != 0) {
+    REPORT_ERR("Could not rename %s to %s: %s", tmp_path, path,
+               strerror(errno));
+    rc = TSCFG_ERR_IO;
+  }
+  if (rc != TSCFG_OK) {
+    unlink(tmp_path);
+  }
+  tscfg_free(tmp_path);
+  return rc;
+}
+
+tscfg_rc tsconfig_image_load(const char *path, tsconfig_tree *tree) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    REPORT_ERR("Could not open %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    REPORT_ERR("Could not stat %s: %s", path, strerror(errno));
+    close(fd);
+    return TSCFG_ERR_IO;
+  }
+
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(image_hdr)) {
+    REPORT_ERR("Not a config image: %s", path);
+    close(fd);
+    return TSCFG_ERR_INVALID;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // Mapping stays valid after close
+  close(fd);
+  if (map == MAP_FAILED) {
+    REPORT_ERR("Could not map %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  const image_hdr *hdr = map;
+  const char *err = NULL;
+  if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0) {
+    err = "not a config image";
+  } else if (hdr->version != IMAGE_VERSION) {
+    err = "unsupported version";
+  } else if (hdr->byte_order != IMAGE_BYTE_ORDER ||
+             hdr->entry_size != sizeof(tscfg_index_entry) ||
+             hdr->obj_size != sizeof(tscfg_obj_index)) {
+    err = "written on incompatible platform";
+  } else if (hdr->image_len != size ||
+             !section_ok(hdr, hdr->tape_off, hdr->tape_len,
+                         sizeof(tscfg_tape_entry)) ||
+             !section_ok(hdr, hdr->objs_off, hdr->nobjs,
+                         sizeof(tscfg_obj_index)) ||
+             !section_ok(hdr, hdr->index_off, hdr->index_len,
+                         sizeof(tscfg_index_entry)) ||
+             !section_ok(hdr, hdr->pool_off, hdr->pool_len, 1) ||
+             hdr->tape_len == 0) {
+    err = "truncated or corrupt";
+  }
+
+  if (err == NULL) {
+    const tscfg_tape_entry *tape = (const tscfg_tape_entry*)
+        ((const char*)map + hdr->tape_off);
+    tscfg_tape_tag root = tscfg_tape_get_tag(tape[0]);
+    if (root != TSCFG_TAPE_OBJ && root != TSCFG_TAPE_ARR) {
+      err = "truncated or corrupt";
+    }
+  }
+
+  if (err != NULL) {
+    REPORT_ERR("Could not load config image %s: %s", path, err);
+    munmap(map, size);
+    return TSCFG_ERR_INVALID;
+  }
+
+  char *base = map;
+  tree->tape = (tscfg_tape_entry*)(base + hdr->tape_off);
+  tree->tape_len = (size_t)hdr->tape_len;
+  tree->pool = base + hdr->pool_off;
+  tree->pool_len = (size_t)hdr->pool_len;
+  tree->objs = (tscfg_obj_index*)(base + hdr->objs_off);
+  tree->nobjs = (size_t)hdr->nobjs;
+  tree->index = (tscfg_index_entry*)(base + hdr->index_off);
+  tree->index_len = tree->index_size = (size_t)hdr->index_len;
+  tree->arena = NULL;
+  tree->alloc = NULL;
+  tree->image = map;
+  tree->image_len = size;
+  return TSCFG_OK;
+}
+
+static tscfg_rc write_bytes(image_writer *w, const void *data, size_t len) {
+  if (len > 0 && fwrite(data, 1, len, w->f) != len) {
+    REPORT_ERR("Could not write config image: %s", strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+  w->pos += len;
+  return TSCFG_OK;
+}
+
+/*
+ * Pad with zeroes to alignment of next section.
+ */
+static tscfg_rc write_pad(image_writer *w) {
+  static const char zeroes[IMAGE_ALIGN];
+  return write_bytes(w, zeroes, (size_t)(align_up(w->pos) - w->pos));
+}
+
+static tscfg_rc write_sections(image_writer *w, const tsconfig_tree *tree,
+                               image_hdr *hdr) {
+  tscfg_rc rc;
+
+  // Placeholder, header is rewritten at end
+  rc = write_bytes(w, hdr, sizeof(*hdr));
+  TSCFG_CHECK(rc);
+
+  rc = write_pad(w);
+  TSCFG_CHECK(rc);
+  hdr->tape_off = w->pos;
+  hdr->tape_len = tree->tape_len;
+  rc = write_bytes(w, tree->tape, sizeof(tree->tape[0]) * tree->tape_len);
+  TSCFG_CHECK(rc);
+
+  // Copy structs with padding so padding is zeroed
+  rc = write_pad(w);
+  TSCFG_CHECK(rc);
+  hdr->objs_off = w->pos;
+  hdr->nobjs = tree->nobjs;
+  for (size_t i = 0; i < tree->nobjs; i++) {
+    tscfg_obj_index obj;
+    memset(&obj, 0, sizeof(obj));
+    obj.entries = tree->objs[i].entries;
+    obj.nentries = tree->objs[i].nentries;
+    obj.hashed = tree->objs[i].hashed;
+    rc = write_bytes(w, &obj, sizeof(obj));
+    TSCFG_CHECK(rc);
+  }
+
+  rc = write_pad(w);
+  TSCFG_CHECK(rc);
+  hdr->index_off = w->pos;
+  hdr->index_len = tree->index_len;
+  for (size_t i = 0; i < tree->index_len; i++) {
+    tscfg_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key_ix = tree->index[i].key_ix;
+    entry.hash = tree->index[i].hash;
+    rc = write_bytes(w, &entry, sizeof(entry));
+    TSCFG_CHECK(rc);
+  }
+
+  rc = write_pad(w);
+  TSCFG_CHECK(rc);
+  hdr->pool_off = w->pos;
+  hdr->pool_len = tree->pool_len;
+  rc = write_bytes(w, tree->pool, tree->pool_len);
+  TSCFG_CHECK(rc);
+
+  return write_pad(w);
+}
+
+/*
+ * Whether section of image is aligned and within image.
+ */
+static bool section_ok(const image_hdr *hdr, uint64_t off, uint64_t len,
+                       size_t elem_size) {
+  return off % IMAGE_ALIGN == 0 && off >= sizeof(image_hdr) &&
+         off <= hdr->image_len &&
+         len <= (hdr->image_len - off) / elem_size;
+}
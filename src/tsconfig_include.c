@@ -0,0 +1,407 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Process-wide cache of parsed included files.
+ *
+ * Cached files are in a fixed size hash table protected by a mutex, and
+ * are reference counted so that a stale file can be replaced while it is
+ * still being spliced into an including file.  Files are checked against
+ * the disk and parsed without holding the lock, so two threads may parse
+ * the same file at once, in which case the last one wins.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "tsconfig_include.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_limits.h"
+#include "tsconfig_stats.h"
+
+#define CACHE_BUCKETS 256
+
+/*
+ * Identity of version of file on disk.
+ */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} file_id;
+
+struct tscfg_include {
+  // Unmerged tree for file
+  tsconfig_tree tree;
+
+  // Files included by this one, with references
+  tscfg_include **incs;
+  size_t nincs;
+
+  char *path; // Canonical path
+  uint32_t hash; // Hash of path
+  file_id id;
+  uint64_t content_hash; // Hash of file contents, see hash_buf()
+
+  int refcount; // Protected by cache_lock
+  tscfg_include *next; // Next in hash bucket
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static tscfg_include *cache[CACHE_BUCKETS];
+
+static tscfg_rc get_file_id(const char *path, file_id *id);
+static void set_file_id(const struct stat *st, file_id *id);
+static tscfg_rc map_file(const char *path, file_id *id, void **map,
+                         size_t *len);
+static uint64_t hash_buf(const unsigned char *buf, size_t len);
+static bool is_current(const tscfg_include *inc);
+static tscfg_include *cache_insert(tscfg_include *inc);
+static void cache_remove(tscfg_include *inc);
+
+tscfg_rc tscfg_include_get(const char *path, int depth, tscfg_pool *pool,
+                           tscfg_include **inc) {
+  tscfg_rc rc;
+
+  char *real = realpath(path, NULL);
+  if (real == NULL) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      return TSCFG_ERR_NOT_FOUND;
+    }
+    REPORT_ERR("Could not resolve path %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  file_id id;
+  rc = get_file_id(real, &id);
+  if (rc != TSCFG_OK) {
+    free(real);
+    return rc;
+  }
+
+  uint32_t hash = tscfg_str_hash(real, strlen(real));
+
+  // Take reference to any cached version, then check it without lock
+  tscfg_include *cached = NULL;
+  file_id cached_id;
+  pthread_mutex_lock(&cache_lock);
+  for (tscfg_include *c = cache[hash % CACHE_BUCKETS]; c != NULL;
+       c = c->next) {
+    if (c->hash == hash && strcmp(c->path, real) == 0) {
+      c->refcount++;
+      cached = c;
+      cached_id = c->id;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  // Unchanged file is found without reading it
+  bool same_id = (cached != NULL) &&
+                 memcmp(&cached_id, &id, sizeof(id)) == 0;
+  bool current = (cached != NULL) &&
+      (same_id || cached_id.size == id.size) && is_current(cached);
+  if (current && same_id) {
+    free(real);
+    *inc = cached;
+    return TSCFG_OK;
+  }
+
+  // Contents are hashed from the same mapping they are parsed from
+  void *map;
+  size_t len;
+  rc = map_file(real, &id, &map, &len);
+  if (rc != TSCFG_OK) {
+    if (cached != NULL) {
+      tscfg_include_release(cached);
+    }
+    free(real);
+    return rc;
+  }
+  uint64_t content_hash = hash_buf(map, len);
+
+  if (cached != NULL) {
+    // May have been written with same contents
+    if (current && cached_id.size == id.size &&
+        cached->content_hash == content_hash) {
+      pthread_mutex_lock(&cache_lock);
+      cached->id = id;
+      pthread_mutex_unlock(&cache_lock);
+
+      if (map != NULL) {
+        munmap(map, len);
+      }
+      free(real);
+      *inc = cached;
+      return TSCFG_OK;
+    }
+
+    cache_remove(cached);
+    tscfg_include_release(cached);
+  }
+
+  tscfg_include *c = malloc(sizeof(tscfg_include));
+  if (c == NULL) {
+    if (map != NULL) {
+      munmap(map, len);
+    }
+    free(real);
+    return TSCFG_ERR_OOM;
+  }
+
+  // Cached files outlive the parse, so don't use its allocator, and
+  // aren't counted in its stats or subject to its limits
+  const tscfg_allocator *prev = tscfg_alloc_use(NULL);
+  tsconfig_stats *prev_stats = tscfg_stats_use(NULL);
+  const tsconfig_limits *prev_limits = tscfg_limits_use(NULL);
+  tsconfig_input in = { .kind = TS_CONFIG_IN_STR };
+  in.data.s.str = (map != NULL) ? map : "";
+  in.data.s.len = len;
+  in.data.s.pos = 0;
+  rc = tscfg_read_tree(in, real, depth, pool, NULL, &c->tree, &c->incs,
+                       &c->nincs);
+  tscfg_limits_use(prev_limits);
+  tscfg_stats_use(prev_stats);
+  tscfg_alloc_use(prev);
+
+  // Tree has copies of any strings from input
+  if (map != NULL) {
+    munmap(map, len);
+  }
+  if (rc != TSCFG_OK) {
+    REPORT_ERR("Error in included file %s", real);
+    free(real);
+    free(c);
+    return rc;
+  }
+
+  c->path = real;
+  c->hash = hash;
+  c->id = id;
+  c->content_hash = content_hash;
+  c->refcount = 2; // For cache and caller
+  c->next = NULL;
+
+  tscfg_include *stale = cache_insert(c);
+  if (stale != NULL) {
+    tscfg_include_release(stale);
+  }
+
+  *inc = c;
+  return TSCFG_OK;
+}
+
+const tsconfig_tree *tscfg_include_tree(const tscfg_include *inc) {
+  return &inc->tree;
+}
+
+void tscfg_include_release(tscfg_include *inc) {
+  pthread_mutex_lock(&cache_lock);
+  bool last = (--inc->refcount == 0);
+  pthread_mutex_unlock(&cache_lock);
+
+  if (!last) {
+    return;
+  }
+
+  for (size_t i = 0; i < inc->nincs; i++) {
+    tscfg_include_release(inc->incs[i]);
+  }
+  free(inc->incs);
+  tsconfig_tree_free(&inc->tree);
+  free(inc->path);
+  free(inc);
+}
+
+void tsconfig_include_cache_clear(void) {
+  tscfg_include *list = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  for (int b = 0; b < CACHE_BUCKETS; b++) {
+    while (cache[b] != NULL) {
+      tscfg_include *c = cache[b];
+      cache[b] = c->next;
+      c->next = list;
+      list = c;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  while (list != NULL) {
+    tscfg_include *next = list->next;
+    tscfg_include_release(list);
+    list = next;
+  }
+}
+
+static tscfg_rc get_file_id(const char *path, file_id *id) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      return TSCFG_ERR_NOT_FOUND;
+    }
+    REPORT_ERR("Could not stat %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  set_file_id(&st, id);
+  return TSCFG_OK;
+}
+
+static void set_file_id(const struct stat *st, file_id *id) {
+  // Zero padding so ids can be compared with memcmp
+  memset(id, 0, sizeof(*id));
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->size = st->st_size;
+  id->mtime = st->st_mtim;
+}
+
+/*
+ * Map file for reading, getting id of the version that was mapped.
+ * map: set to mapping, or NULL for empty file
+ */
+static tscfg_rc map_file(const char *path, file_id *id, void **map,
+                         size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    REPORT_ERR("Could not open %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    REPORT_ERR("Could not stat %s: %s", path, strerror(errno));
+    close(fd);
+    return TSCFG_ERR_IO;
+  }
+  set_file_id(&st, id);
+
+  *len = (size_t)st.st_size;
+  *map = NULL;
+  if (*len > 0) {
+    // Can't map zero-length file
+    *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) {
+      REPORT_ERR("Could not map %s: %s", path, strerror(errno));
+      close(fd);
+      return TSCFG_ERR_IO;
+    }
+  }
+
+  // Mapping stays valid after close
+  close(fd);
+  return TSCFG_OK;
+}
+
+/*
+ * 64-bit FNV-1a hash of file contents.
+ */
+static uint64_t hash_buf(const unsigned char *buf, size_t len) {
+  uint64_t h = UINT64_C(14695981039346656037);
+  for (size_t i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= UINT64_C(1099511628211);
+  }
+  return h;
+}
+
+/*
+ * Whether files included by cached file are unchanged.  Called without
+ * holding cache_lock, so that other lookups don't wait for the files to
+ * be checked, but the caller must have a reference to the file.
+ */
+static bool is_current(const tscfg_include *inc) {
+  for (size_t i = 0; i < inc->nincs; i++) {
+    const tscfg_include *child = inc->incs[i];
+
+    // Id is updated under lock if file is touched without changes
+    file_id child_id;
+    pthread_mutex_lock(&cache_lock);
+    child_id = child->id;
+    pthread_mutex_unlock(&cache_lock);
+
+    file_id id;
+    if (get_file_id(child->path, &id) != TSCFG_OK ||
+        memcmp(&child_id, &id, sizeof(id)) != 0 || !is_current(child)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Add file to cache, replacing any other version.
+ * return: replaced file, whose cache reference must be released
+ */
+static tscfg_include *cache_insert(tscfg_include *inc) {
+  tscfg_include *replaced = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  tscfg_include **bucket = &cache[inc->hash % CACHE_BUCKETS];
+  for (tscfg_include **p = bucket; *p != NULL; p = &(*p)->next) {
+    if ((*p)->hash == inc->hash && strcmp((*p)->path, inc->path) == 0) {
+      replaced = *p;
+      *p = replaced->next;
+      break;
+    }
+  }
+
+  inc->next = *bucket;
+  *bucket = inc;
+  pthread_mutex_unlock(&cache_lock);
+
+  return replaced;
+}
+
+/*
+ * Drop stale file from cache, unless it was already replaced since it
+ * was looked up.
+ */
+static void cache_remove(tscfg_include *inc) {
+  bool removed = false;
+
+  pthread_mutex_lock(&cache_lock);
+  for (tscfg_include **p = &cache[inc->hash % CACHE_BUCKETS]; *p != NULL;
+       p = &(*p)->next) {
+    if (*p == inc) {
+      *p = inc->next;
+      removed = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (removed) {
+    // Cache's reference
+    tscfg_include_release(inc);
+  }
+}
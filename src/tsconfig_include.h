@@ -0,0 +1,97 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Process-wide cache of parsed included files.
+ *
+ * Each file is parsed once into an unmerged tree, i.e. the tape as built by
+ * the tree reader, which is spliced into the tape of each including file.
+ * Cached files are keyed on canonical path and checked against the inode,
+ * size and modification time of the file and of any files it includes, so
+ * changed files are parsed again.  If only the inode or modification time
+ * changed, e.g. because the file was rewritten with the same contents, a
+ * hash of the contents is compared before parsing again.
+ */
+
+#ifndef __TSCONFIG_INCLUDE_H
+#define __TSCONFIG_INCLUDE_H
+
+#include "tsconfig.h"
+#include "tsconfig_paths.h"
+#include "tsconfig_pool.h"
+
+// Limit on nesting of includes, which also stops include cycles
+#define TSCFG_MAX_INCLUDE_DEPTH 32
+
+// Opaque type for cached file, shared by references
+typedef struct tscfg_include tscfg_include;
+
+/*
+ * Get parsed file from cache, parsing it if needed.
+ * depth: nesting depth of includes for file
+ * pool: pool for loading files included by file, or NULL
+ * inc: set to reference to cached file, to be released by caller
+ * return: TSCFG_ERR_NOT_FOUND if file doesn't exist, without reporting
+ *         an error
+ */
+tscfg_rc tscfg_include_get(const char *path, int depth, tscfg_pool *pool,
+                           tscfg_include **inc);
+
+/*
+ * Unmerged tree for cached file.
+ */
+const tsconfig_tree *tscfg_include_tree(const tscfg_include *inc);
+
+/*
+ * Release reference to cached file.
+ */
+void tscfg_include_release(tscfg_include *inc);
+
+/*
+ * Parse input into unmerged tree, splicing in included files.  Defined in
+ * tsconfig.c.
+ * path: path of input for relative includes, or NULL
+ * depth: nesting depth of includes for input
+ * pool: pool for loading included files and parsing large inputs in
+ *       parallel, or NULL
+ * filter: if non-NULL, fields of input not wanted by filter are skipped.
+ *       Included files are parsed whole.
+ * incs: if non-NULL, set to array of files included, owned by caller
+ *       along with references to files
+ */
+tscfg_rc tscfg_read_tree(tsconfig_input in, const char *path, int depth,
+                         tscfg_pool *pool, const tscfg_path_filter *filter,
+                         tsconfig_tree *tree, tscfg_include ***incs,
+                         size_t *nincs);
+
+/*
+ * Merge, index and resolve unmerged tree in place, adding times to stats
+ * if non-NULL.  Tree is freed on error.  Defined in tsconfig.c.
+ */
+tscfg_rc tscfg_finish_tree(tsconfig_tree *tree, tsconfig_stats *stats);
+
+/*
+ * As tscfg_read_tree(), but always parse input as one.
+ */
+tscfg_rc tscfg_read_tree_whole(tsconfig_input in, const char *path,
+                               int depth, tscfg_pool *pool,
+                               const tscfg_path_filter *filter,
+                               tsconfig_tree *tree, tscfg_include ***incs,
+                               size_t *nincs);
+
+#endif // __TSCONFIG_INCLUDE_H
@@ -22,18 +22,34 @@
  * Lexer for HOCON properties file.
  */
 
+// Needed for POSIX file mapping functions
+#define _POSIX_C_SOURCE 200112L
+
 #include "tsconfig_lex.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "tsconfig_alloc.h"
 #include "tsconfig_err.h"
+#include "tsconfig_lex_tables.h"
+#include "tsconfig_num.h"
+#include "tsconfig_scan.h"
+#include "tsconfig_stats.h"
 #include "tsconfig_utf8.h"
 
 // Default amount to buffer when searching ahead
 #define LEX_PEEK_BATCH_SIZE 32
 
+// Default amount to read at a time from streaming input
+#define LEX_DEFAULT_CHUNK_SIZE 16384
+
 // Unicode escape code length (hex digits)
 #define UNICODE_ESCAPE_LEN 4
 
@@ -44,27 +60,48 @@ typedef struct {
   char *str;
   size_t size; // Allocated size in bytes
   size_t len; // Data length in bytes
+  bool borrowed; // If true, str is a slice of lexer buffer
+  tscfg_arena *arena; // If non-NULL, str is owned by arena
+  size_t max_len; // If non-zero, longest string allowed
 } tscfg_strbuf;
 
-static inline void tok_file_line(const tscfg_lex_state *lex, tscfg_tok *tok);
+static inline void tok_offset(const tscfg_lex_state *lex, tscfg_tok *tok);
 static inline void set_str_tok(tscfg_tok_tag tag, tscfg_strbuf *sb,
                                tscfg_tok *tok);
 static inline void set_nostr_tok(tscfg_tok_tag tag, tscfg_tok *tok);
-static inline tscfg_tok_tag tag_from_char(tscfg_char_t c);
 
 static tscfg_rc lex_peek(tscfg_lex_state *lex, tscfg_char_t *chars,
                          int nchars, int *got);
 static tscfg_rc lex_peek_bytes(tscfg_lex_state *lex, char *buf,
                                size_t len, size_t *got);
 static tscfg_rc lex_read_more(tscfg_lex_state *lex, size_t bytes);
+static inline tscfg_rc lex_fill(tscfg_lex_state *lex, size_t bytes);
 static tscfg_rc lex_read(tscfg_lex_state *lex, unsigned char *buf, size_t bytes,
                          size_t *read_bytes);
 static void lex_eat(tscfg_lex_state *lex, int chars);
 static void lex_eat_ascii(tscfg_lex_state *lex, size_t bytes);
-static void lex_update_line(tscfg_lex_state *lex, unsigned char b);
+static void lex_eat_run(tscfg_lex_state *lex, size_t bytes);
+static size_t lex_scan_until(tscfg_lex_state *lex, unsigned char c1,
+                             unsigned char c2);
+static tscfg_rc lex_validate(tscfg_lex_state *lex);
+static void lex_drop(tscfg_lex_state *lex);
+static tscfg_rc lex_check_bytes(tscfg_lex_state *lex, size_t bytes);
+static tscfg_rc read_tok(tscfg_lex_state *lex, tscfg_tok *tok,
+                         tscfg_lex_opts opts);
 
 static tscfg_rc lex_copy_char(tscfg_lex_state *lex, tscfg_strbuf *sb,
                             bool aggressive_resize);
+static tscfg_rc lex_copy_ascii(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                               size_t bytes);
+static tscfg_rc lex_copy_run(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                             size_t bytes);
+static tscfg_rc lex_append_bytes(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                 size_t bytes);
+static tscfg_rc lex_copy_or_eat_ascii(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                      size_t bytes);
+static tscfg_rc lex_strbuf_init(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                size_t init_size);
+static tscfg_rc lex_map_file(tscfg_lex_state *lex, const char *path);
 
 static tscfg_rc extract_hocon_ws(tscfg_lex_state *lex, tscfg_tok *tok,
                                      bool include_str);
@@ -75,9 +112,14 @@ static tscfg_rc extract_line_comment(tscfg_lex_state *lex, tscfg_tok *tok,
 static tscfg_rc extract_multiline_comment(tscfg_lex_state *lex, tscfg_tok *tok,
                                      bool include_str);
 
-static tscfg_rc extract_sub_start(tscfg_lex_state *lex, tscfg_tok *tok);
-static tscfg_rc extract_json_number(tscfg_lex_state *lex, tscfg_char_t c,
-                                    tscfg_tok *tok);
+static tscfg_rc extract_operator(tscfg_lex_state *lex, tscfg_tok *tok);
+static tscfg_rc lex_run_dfa(tscfg_lex_state *lex, uint8_t start,
+                            size_t *len, tscfg_tok_tag *tag);
+static tscfg_rc skip_after_newline(tscfg_lex_state *lex);
+static tscfg_rc skip_str(tscfg_lex_state *lex);
+static tscfg_rc skip_comment(tscfg_lex_state *lex, bool *skipped);
+static tscfg_rc skip_line_comment(tscfg_lex_state *lex);
+static tscfg_rc extract_json_number(tscfg_lex_state *lex, tscfg_tok *tok);
 static tscfg_rc extract_hocon_str(tscfg_lex_state *lex, tscfg_tok *tok);
 static tscfg_rc extract_json_str(tscfg_lex_state *lex, tscfg_tok *tok);
 static tscfg_rc extract_json_str_escape(tscfg_lex_state *lex,
@@ -88,7 +130,7 @@ static tscfg_rc extract_hocon_multiline_str(tscfg_lex_state *lex,
                                             tscfg_tok *tok);
 static tscfg_rc extract_hocon_unquoted(tscfg_lex_state *lex, tscfg_tok *tok);
 static tscfg_rc extract_keyword_or_hocon_unquoted(tscfg_lex_state *lex,
-                                        tscfg_char_t c, tscfg_tok *tok);
+                                                  tscfg_tok *tok);
 
 static tscfg_rc extract_until(tscfg_lex_state *lex, tscfg_strbuf *sb,
                               tscfg_char_t match, bool *found);
@@ -97,14 +139,14 @@ static tscfg_rc eat_until(tscfg_lex_state *lex, tscfg_char_t match,
                           bool *found);
 
 static bool is_hocon_whitespace(tscfg_char_t c);
-static bool is_hocon_newline(tscfg_char_t c);
-static bool is_hocon_unquoted_char(tscfg_char_t c);
-static bool is_comment_start(const tscfg_char_t *buf, int len);
 
 static void strbuf_init_empty(tscfg_strbuf *sb);
-static tscfg_rc strbuf_init(tscfg_strbuf *sb, size_t init_size);
+static tscfg_rc strbuf_init(tscfg_strbuf *sb, size_t init_size,
+                            tscfg_arena *arena);
 static tscfg_rc strbuf_expand(tscfg_strbuf *sb, size_t min_size,
                               bool aggressive);
+static tscfg_rc strbuf_expand_arena(tscfg_strbuf *sb, size_t min_size,
+                                    bool aggressive);
 static void strbuf_finalize(tscfg_strbuf *sb);
 static void strbuf_free(tscfg_strbuf *sb);
 static tscfg_rc strbuf_append_utf8(tscfg_strbuf *sb, tscfg_char_t c,
@@ -122,42 +164,204 @@ static tscfg_rc strbuf_append_utf8(tscfg_strbuf *sb, tscfg_char_t c,
 
 #define CASE_UNICODE_ZP case 0x2029
 
-#define CASE_OTHER_ASCII_WHITESPACE \
-  case '\t': case '\n': case '\r': case '\v': case '\f': \
-  case 0x01C /* file sep */: case 0x01D /* group sep */: \
-  case 0x01E /* record sep */: case 0x01F /* unit sep */
-
-
+/* ASCII whitespace is classified by tscfg_lex_bytes instead */
 #define CASE_HOCON_WHITESPACE \
-  CASE_UNICODE_ZS: CASE_UNICODE_ZL: CASE_UNICODE_ZP: case 0xFEFF /* BOM */: \
-  CASE_OTHER_ASCII_WHITESPACE
+  CASE_UNICODE_ZS: CASE_UNICODE_ZL: CASE_UNICODE_ZP: case 0xFEFF /* BOM */
 
 static void lex_report_err(const char *file, int line,
           tscfg_lex_state *lex, const char *fmt, ...);
 
 tscfg_rc tscfg_lex_init(tscfg_lex_state *lex, tsconfig_input in) {
-  lex->in = in;
+  tscfg_lex_init_empty(lex);
+  return tscfg_lex_reset(lex, in);
+}
 
-  size_t buf_init_size = 512;
-  lex->buf = malloc(buf_init_size);
-  TSCFG_CHECK_MALLOC(lex->buf);
-  lex->buf_size = buf_init_size;
-  lex->buf_len = 0;
+void tscfg_lex_init_empty(tscfg_lex_state *lex) {
+  lex->in.kind = TS_CONFIG_IN_NONE;
+  lex->buf = NULL;
+  lex->buf_size = 0;
   lex->buf_pos = 0;
+  lex->buf_len = 0;
+  lex->buf_borrowed = true;
+  lex->buf_mapped = false;
+  lex->alloc_buf = NULL;
+  lex->alloc_size = 0;
+  lex->arena = NULL;
+  lex->stats = NULL;
+  lex->max_bytes = 0;
+  lex->max_tok_len = 0;
+  lex->lines = TSCFG_EMPTY_LINE_INDEX;
+}
+
+tscfg_rc tscfg_lex_reset(tscfg_lex_state *lex, tsconfig_input in) {
+  assert(lex->in.kind == TS_CONFIG_IN_NONE);
+  lex->chunk_size = LEX_DEFAULT_CHUNK_SIZE;
+  lex->eof = false;
+  lex->arena = NULL;
+  lex->stats = NULL;
+  lex->max_bytes = 0;
+  lex->max_tok_len = 0;
+  lex->buf_offset = 0;
+  lex->buf_line = 1;
+  lex->buf_col = 1;
+  tscfg_line_index_clear(&lex->lines);
+
+  if (in.kind == TS_CONFIG_IN_STR || in.kind == TS_CONFIG_IN_STR_BORROW) {
+    // Scan caller's string in place, no need to copy
+    assert(in.data.s.pos <= in.data.s.len);
+    lex->buf = (unsigned char*)in.data.s.str;
+    lex->buf_size = in.data.s.len;
+    lex->buf_pos = in.data.s.pos;
+    lex->buf_len = in.data.s.len - in.data.s.pos;
+    lex->buf_borrowed = true;
+    lex->buf_mapped = false;
+    lex->borrow_toks = (in.kind == TS_CONFIG_IN_STR_BORROW);
+
+    tscfg_rc rc = lex_validate(lex);
+    TSCFG_CHECK(rc);
+  } else if (in.kind == TS_CONFIG_IN_MMAP) {
+    tscfg_rc rc = lex_map_file(lex, in.data.path);
+    TSCFG_CHECK(rc);
 
-  lex->line = 1;
-  lex->line_char = 1;
+    rc = lex_validate(lex);
+    if (rc != TSCFG_OK) {
+      tscfg_lex_close(lex);
+      return rc;
+    }
+  } else {
+    if (in.kind == TS_CONFIG_IN_FUNC) {
+      if (in.data.fn.read == NULL) {
+        REPORT_ERR("NULL read function for input");
+        return TSCFG_ERR_ARG;
+      }
+
+      if (in.data.fn.chunk_size > 0) {
+        lex->chunk_size = in.data.fn.chunk_size;
+      }
+    }
+
+    // Room for a chunk plus lookahead carried over from previous chunk,
+    // reusing buffer from earlier input if big enough
+    size_t buf_init_size = 2 * lex->chunk_size;
+    if (lex->alloc_size < buf_init_size) {
+      tscfg_free(lex->alloc_buf);
+      lex->alloc_size = 0;
+      lex->alloc_buf = tscfg_malloc(buf_init_size);
+      TSCFG_CHECK_MALLOC(lex->alloc_buf);
+      lex->alloc_size = buf_init_size;
+    }
+    lex->buf = lex->alloc_buf;
+    lex->buf_size = lex->alloc_size;
+    lex->buf_len = 0;
+    lex->buf_pos = 0;
+    lex->buf_borrowed = false;
+    lex->buf_mapped = false;
+    lex->borrow_toks = false;
+    lex->validated = false;
+  }
+
+  lex->in = in;
   return TSCFG_OK;
 }
 
-void tscfg_lex_finalize(tscfg_lex_state *lex) {
+tscfg_rc tscfg_lex_set_limits(tscfg_lex_state *lex, size_t max_bytes,
+                              size_t max_tok_len) {
+  lex->max_bytes = max_bytes;
+  lex->max_tok_len = max_tok_len;
+
+  // All of in-memory input is already in buffer
+  if (lex->buf_borrowed) {
+    return lex_check_bytes(lex, lex->buf_len);
+  }
+  return TSCFG_OK;
+}
+
+void tscfg_lex_close(tscfg_lex_state *lex) {
   // Invalidate input
   lex->in.kind = TS_CONFIG_IN_NONE;
 
-  free(lex->buf);
+  if (lex->buf_mapped) {
+    munmap(lex->buf, lex->buf_size);
+  }
   lex->buf = NULL;
   lex->buf_size = 0;
   lex->buf_len = 0;
+  lex->buf_borrowed = true;
+  lex->buf_mapped = false;
+}
+
+void tscfg_lex_finalize(tscfg_lex_state *lex) {
+  tscfg_lex_close(lex);
+  tscfg_free(lex->alloc_buf);
+  lex->alloc_buf = NULL;
+  lex->alloc_size = 0;
+  tscfg_line_index_free(&lex->lines);
+}
+
+/*
+ * Map whole file into memory as lexer buffer.
+ */
+static tscfg_rc lex_map_file(tscfg_lex_state *lex, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    REPORT_ERR("Could not open %s: %s", path, strerror(errno));
+    return TSCFG_ERR_IO;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    REPORT_ERR("Could not stat %s: %s", path, strerror(errno));
+    close(fd);
+    return TSCFG_ERR_IO;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *map = NULL;
+  if (size > 0) {
+    // Can't map zero-length file
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      REPORT_ERR("Could not map %s: %s", path, strerror(errno));
+      close(fd);
+      return TSCFG_ERR_IO;
+    }
+
+    // Only advisory, so ignore errors
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  }
+
+  // Mapping stays valid after close
+  close(fd);
+
+  lex->buf = map;
+  lex->buf_size = size;
+  lex->buf_pos = 0;
+  lex->buf_len = size;
+  lex->buf_borrowed = true;
+  lex->buf_mapped = (map != NULL);
+  lex->borrow_toks = false;
+  return TSCFG_OK;
+}
+
+/*
+ * Validate whole in-memory buffer up front, so that it doesn't need to be
+ * checked character-by-character while lexing.
+ */
+static tscfg_rc lex_validate(tscfg_lex_state *lex) {
+  size_t err_pos;
+  tscfg_rc rc = TSCFG_OK;
+  if (lex->buf_len > 0) {
+    rc = tscfg_utf8_validate(&lex->buf[lex->buf_pos], lex->buf_len,
+                             &err_pos);
+  }
+  if (rc != TSCFG_OK) {
+    REPORT_ERR("Invalid UTF-8 at byte offset %zu of input",
+               lex->buf_pos + err_pos);
+    return TSCFG_ERR_INVALID;
+  }
+
+  lex->validated = true;
+  return TSCFG_OK;
 }
 
 tscfg_rc tscfg_read_tok(tscfg_lex_state *lex, tscfg_tok *tok,
@@ -165,100 +369,330 @@ tscfg_rc tscfg_read_tok(tscfg_lex_state *lex, tscfg_tok *tok,
   assert(lex != NULL);
   assert(tok != NULL);
 
+  tscfg_rc rc = read_tok(lex, tok, opts);
+
+  // Strings that would grow past limit fail before growing, but borrowed
+  // strings are only checked here
+  if (lex->max_tok_len > 0 && (rc == TSCFG_ERR_LIMIT ||
+        (rc == TSCFG_OK && tok->len > lex->max_tok_len))) {
+    if (rc == TSCFG_OK) {
+      tscfg_tok_free(tok);
+    }
+    REPORT_ERR("Token at input offset %zu longer than limit of %zu bytes",
+               tok->offset, lex->max_tok_len);
+    return TSCFG_ERR_LIMIT;
+  }
+  return rc;
+}
+
+static tscfg_rc read_tok(tscfg_lex_state *lex, tscfg_tok *tok,
+                         tscfg_lex_opts opts) {
   tscfg_rc rc;
 
   // Token starts at current position
-  tok_file_line(lex, tok);
+  tok_offset(lex, tok);
 
-  // Next character should be start of token.
-  tscfg_char_t c;
-  int got;
-  rc = lex_peek(lex, &c, 1, &got);
+  // Dispatch on class of first byte of token
+  rc = lex_fill(lex, 1);
   TSCFG_CHECK(rc);
 
-  if (got == 0) {
+  if (lex->buf_len == 0) {
     set_nostr_tok(TSCFG_TOK_EOF, tok);
     return TSCFG_OK;
   }
 
-  assert(got == 1);
-
-  switch (c) {
-    CASE_HOCON_WHITESPACE:
+  const tscfg_lex_byte *b = &tscfg_lex_bytes[lex->buf[lex->buf_pos]];
+  switch ((tscfg_lex_start)b->start) {
+    case LEX_START_WS:
       return extract_hocon_ws(lex, tok, opts.include_ws_str);
-    case '"':
+    case LEX_START_QUOTE:
       // string, either single quoted or triple quoted
       return extract_hocon_str(lex, tok);
-    case '{':
-    case '}':
-    case '(':
-    case ')':
-    case '[':
-    case ']':
-    case ',':
-    case '=':
-    case ':':
+    case LEX_START_PUNCT:
       // Single character toks
-      lex_eat(lex, 1);
-      set_nostr_tok(tag_from_char(c), tok);
+      lex_eat_ascii(lex, 1);
+      set_nostr_tok((tscfg_tok_tag)b->tok, tok);
       return TSCFG_OK;
-    case '+': {
-      lex_eat(lex, 1);
-
+    case LEX_START_NUMBER:
+      return extract_json_number(lex, tok);
+    case LEX_START_KEYWORD:
+      // try to parse as keyword, otherwise unquoted string
+      return extract_keyword_or_hocon_unquoted(lex, tok);
+    case LEX_START_OPERATOR:
+      return extract_operator(lex, tok);
+    case LEX_START_COMMENT:
+      lex_eat_ascii(lex, 1);
+      return extract_line_comment(lex, tok, opts.include_comm_str);
+    case LEX_START_SLASH:
+      return extract_comment_or_hocon_unquoted(lex, tok, opts.include_comm_str);
+    case LEX_START_UNQUOTED:
+      return extract_hocon_unquoted(lex, tok);
+    case LEX_START_NONASCII: {
+      // Decode to check for unicode whitespace, all else is unquoted
+      tscfg_char_t c;
+      int got;
       rc = lex_peek(lex, &c, 1, &got);
       TSCFG_CHECK(rc);
+      assert(got == 1);
 
-      if (got == 0) {
-        LEX_REPORT_ERR(lex, "Trailing + at end of file");
-        return TSCFG_ERR_SYNTAX;
-      } else if (c != '=') {
-        // Must be += operator
-        lex_eat(lex, 1);
-        set_nostr_tok(TSCFG_TOK_PLUSEQUAL, tok);
-        return TSCFG_OK;
-      } else {
-        LEX_REPORT_ERR(lex, "Invalid char %c after =", c);
-        return TSCFG_ERR_SYNTAX;
+      if (is_hocon_whitespace(c)) {
+        return extract_hocon_ws(lex, tok, opts.include_ws_str);
       }
+      return extract_hocon_unquoted(lex, tok);
     }
+    case LEX_START_INVALID:
+    default:
+      LEX_REPORT_ERR(lex, "Unexpected character: %c",
+                     (char)lex->buf[lex->buf_pos]);
+      return TSCFG_ERR_SYNTAX;
+  }
+}
 
-    case '-': case '0': case '1': case '2': case '3': case '4':
-    case '5': case '6': case '7': case '8': case '9':
-      return extract_json_number(lex, c, tok);
+tscfg_rc tscfg_lex_skip_value(tscfg_lex_state *lex, bool in_obj) {
+  tscfg_rc rc;
 
-    case 't':
-    case 'f':
-    case 'n':
-      // try to parse as keyword, otherwise unquoted string
-      return extract_keyword_or_hocon_unquoted(lex, c, tok);
+  int depth = in_obj ? 1 : 0;
+  bool seen_item = false; // If anything but whitespace at depth 0
 
-    case '#':
-      lex_eat(lex, 1);
-      return extract_line_comment(lex, tok, opts.include_comm_str);
+  while (true) {
+    // Enough for any of the lookahead below
+    rc = lex_fill(lex, 3);
+    TSCFG_CHECK(rc);
 
-    case '/':
-      return extract_comment_or_hocon_unquoted(lex, tok, opts.include_comm_str);
+    if (lex->buf_len == 0) {
+      return TSCFG_OK;
+    }
 
-    case '$':
-      lex_eat(lex, 1);
-      return extract_sub_start(lex, tok);
+    const unsigned char *p = &lex->buf[lex->buf_pos];
+    unsigned char b = p[0];
 
-    default:
-      if (is_hocon_unquoted_char(c)) {
-        return extract_hocon_unquoted(lex, tok);
-      } else {
-        LEX_REPORT_ERR(lex, "Unexpected character: %c", c);
-        return TSCFG_ERR_SYNTAX;
+    // Bytes that end a run of skipped bytes inside brackets, and outside
+    uint8_t stop = (depth > 0) ? LEX_F_SKIP_STOP : LEX_F_SKIP_STOP_TOP;
+    size_t run = 0;
+    while (run < lex->buf_len) {
+      uint8_t flags = tscfg_lex_bytes[p[run]].flags;
+      if ((flags & stop) != 0) {
+        break;
       }
+      // Whitespace before first item isn't part of value
+      seen_item = seen_item || (flags & LEX_F_WS) == 0;
+      run++;
+    }
+
+    if (run > 0) {
+      lex_eat_run(lex, run);
+      continue;
+    }
+
+    bool skipped;
+    switch (b) {
+      case '"':
+        rc = skip_str(lex);
+        TSCFG_CHECK(rc);
+        seen_item = true;
+        break;
+      case '{':
+      case '[':
+        lex_eat_ascii(lex, 1);
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) {
+          // End of enclosing object or array
+          return TSCFG_OK;
+        }
+        lex_eat_ascii(lex, 1);
+        depth--;
+        seen_item = true;
+        break;
+      case '#':
+      case '/':
+        rc = skip_comment(lex, &skipped);
+        TSCFG_CHECK(rc);
+        if (!skipped) {
+          // Part of unquoted string
+          lex_eat_ascii(lex, 1);
+          seen_item = true;
+        }
+        break;
+      // Remaining cases only end runs outside brackets
+      case '\n':
+        lex_eat_ascii(lex, 1);
+        if (seen_item) {
+          // Implicit separator
+          return skip_after_newline(lex);
+        }
+        break;
+      case ',':
+        // Explicit separator
+        lex_eat_ascii(lex, 1);
+        return TSCFG_OK;
+      case ':':
+      case '=':
+        // Can't be part of value, left for parser
+        return TSCFG_OK;
+      default:
+        // Not reached: other bytes are part of runs
+        assert(false);
+        return TSCFG_ERR_UNKNOWN;
+    }
+  }
+}
+
+/*
+ * After newline that ended a skipped value, also skip whitespace and
+ * comments up to the next token, and a comma if that is next, as the
+ * parser would.
+ */
+static tscfg_rc skip_after_newline(tscfg_lex_state *lex) {
+  tscfg_rc rc;
+  while (true) {
+    rc = lex_fill(lex, 2);
+    TSCFG_CHECK(rc);
+
+    if (lex->buf_len == 0) {
+      return TSCFG_OK;
+    }
+
+    unsigned char b = lex->buf[lex->buf_pos];
+    if (b == ',') {
+      lex_eat_ascii(lex, 1);
+      return TSCFG_OK;
+    } else if ((tscfg_lex_bytes[b].flags & LEX_F_WS) != 0) {
+      lex_eat_ascii(lex, 1);
+      continue;
+    }
+
+    bool skipped = false;
+    if (b == '#' || b == '/') {
+      rc = skip_comment(lex, &skipped);
+      TSCFG_CHECK(rc);
+    }
+    if (!skipped) {
+      return TSCFG_OK;
+    }
+  }
+}
+
+/*
+ * Skip quoted string, single or triple quoted, at current position.
+ */
+static tscfg_rc skip_str(tscfg_lex_state *lex) {
+  tscfg_rc rc;
+
+  assert(lex->buf_len >= 1 && lex->buf[lex->buf_pos] == '"');
+  bool triple = (lex->buf_len >= 3 &&
+                 memcmp(&lex->buf[lex->buf_pos], "\"\"\"", 3) == 0);
+  lex_eat_ascii(lex, triple ? 3 : 1);
+
+  while (true) {
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
+
+    const unsigned char *p = &lex->buf[lex->buf_pos];
+    size_t run = triple ? tscfg_scan_until_utf8(p, lex->buf_len, '"', '"')
+                        : tscfg_scan_until_utf8(p, lex->buf_len, '"', '\\');
+    if (run > 0) {
+      lex_eat_run(lex, run);
+      continue;
+    }
+
+    if (lex->buf_len == 0) {
+      LEX_REPORT_ERR(lex, triple ? "Unterminated \"\"\" string" :
+                                   "String missing closing \"");
+      return TSCFG_ERR_SYNTAX;
+    }
+
+    if (p[0] == '\\') {
+      // Escaped character can't end string
+      lex_eat_ascii(lex, 1);
+      rc = lex_fill(lex, 1);
+      TSCFG_CHECK(rc);
+      if (lex->buf_len > 0) {
+        lex_eat_run(lex, 1);
+      }
+    } else if (!triple) {
+      lex_eat_ascii(lex, 1);
+      return TSCFG_OK;
+    } else if (lex->buf_len >= 3 && memcmp(p, "\"\"\"", 3) == 0 &&
+               (lex->buf_len == 3 || p[3] != '"')) {
+      // Last """ of any run of quotes ends string
+      lex_eat_ascii(lex, 3);
+      return TSCFG_OK;
+    } else {
+      lex_eat_ascii(lex, 1);
+    }
+  }
+}
+
+/*
+ * Skip #, // or block comment at current position.
+ * skipped: set to false if not a comment, e.g. a / in unquoted text
+ */
+static tscfg_rc skip_comment(tscfg_lex_state *lex, bool *skipped) {
+  const unsigned char *p = &lex->buf[lex->buf_pos];
+  *skipped = true;
+
+  if (p[0] == '#') {
+    lex_eat_ascii(lex, 1);
+    return skip_line_comment(lex);
+  } else if (lex->buf_len >= 2 && p[1] == '/') {
+    lex_eat_ascii(lex, 2);
+    return skip_line_comment(lex);
+  } else if (lex->buf_len < 2 || p[1] != '*') {
+    *skipped = false;
+    return TSCFG_OK;
+  }
+
+  lex_eat_ascii(lex, 2);
+  while (true) {
+    tscfg_rc rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
+
+    p = &lex->buf[lex->buf_pos];
+    size_t run = tscfg_scan_until_utf8(p, lex->buf_len, '*', '*');
+    if (run > 0) {
+      lex_eat_run(lex, run);
+      continue;
+    }
+
+    if (lex->buf_len < 2) {
+      LEX_REPORT_ERR(lex, "/* comment without matching */");
+      return TSCFG_ERR_SYNTAX;
+    }
+
+    bool end = (p[1] == '/');
+    lex_eat_ascii(lex, end ? 2 : 1);
+    if (end) {
+      return TSCFG_OK;
+    }
   }
 }
 
 /*
- * Token starts at current file/line
+ * Skip rest of line comment, up to but not including newline.
  */
-static inline void tok_file_line(const tscfg_lex_state *lex, tscfg_tok *tok) {
-  tok->line = lex->line;
-  tok->line_char = lex->line_char;
+static tscfg_rc skip_line_comment(tscfg_lex_state *lex) {
+  while (true) {
+    tscfg_rc rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
+
+    const unsigned char *p = &lex->buf[lex->buf_pos];
+    size_t run = tscfg_scan_until_utf8(p, lex->buf_len, '\n', '\n');
+    if (run > 0) {
+      lex_eat_run(lex, run);
+      continue;
+    }
+    return TSCFG_OK;
+  }
+}
+
+/*
+ * Token starts at current position
+ */
+static inline void tok_offset(const tscfg_lex_state *lex, tscfg_tok *tok) {
+  tok->offset = tscfg_lex_offset(lex);
 }
 
 /*
@@ -268,6 +702,7 @@ static inline void set_nostr_tok(tscfg_tok_tag tag, tscfg_tok *tok) {
   tok->tag = tag;
   tok->str = NULL;
   tok->len = 0;
+  tok->borrowed = false;
 }
 
 /*
@@ -281,40 +716,13 @@ static inline void set_str_tok(tscfg_tok_tag tag, tscfg_strbuf *sb, tscfg_tok *t
   strbuf_finalize(sb);
   tok->str = sb->str;
   tok->len = sb->len;
+  // Token doesn't own string if it is in input buffer or arena
+  tok->borrowed = sb->borrowed || sb->arena != NULL;
 
   // Invalidate string buffer
   strbuf_init_empty(sb);
 }
 
-/*
- * Translate single character token into tag.
- */
-static inline tscfg_tok_tag tag_from_char(tscfg_char_t c) {
-  switch (c) {
-    case '{':
-      return TSCFG_TOK_OPEN_BRACE;
-    case '}':
-      return TSCFG_TOK_CLOSE_BRACE;
-    case '(':
-      return TSCFG_TOK_OPEN_PAREN;
-    case ')':
-      return TSCFG_TOK_CLOSE_PAREN;
-    case '[':
-      return TSCFG_TOK_OPEN_SQUARE;
-    case ']':
-      return TSCFG_TOK_CLOSE_SQUARE;
-    case ',':
-      return TSCFG_TOK_COMMA;
-    case '=':
-      return TSCFG_TOK_EQUAL;
-    case ':':
-      return TSCFG_TOK_COLON;
-    default:
-      // Should not get here
-      assert(false);
-  }
-}
-
 /*
  * Read ahead nchars characters (or less if end of input)
  */
@@ -337,6 +745,18 @@ static tscfg_rc lex_peek(tscfg_lex_state *lex, tscfg_char_t *chars,
   size_t buf_pos = lex->buf_pos;
   size_t buf_end = lex->buf_pos + lex->buf_len;
 
+  if (lex->validated) {
+    // Checked already, just decode
+    while (read_chars < nchars && buf_pos < buf_end) {
+      size_t enc_len;
+      chars[read_chars++] = tscfg_decode_valid(&lex->buf[buf_pos], &enc_len);
+      buf_pos += enc_len;
+    }
+
+    *got = read_chars;
+    return TSCFG_OK;
+  }
+
   while (read_chars < nchars && buf_pos < buf_end) {
     unsigned char b = lex->buf[buf_pos];
     size_t enc_len;
@@ -386,44 +806,91 @@ static tscfg_rc lex_peek_bytes(tscfg_lex_state *lex, char *buf,
 }
 
 /*
- * Read additional bytes into buffers.
- * If hits end of file, will not read as many as requested
+ * Ensure at least bytes are buffered, unless at end of input.
+ */
+static inline tscfg_rc lex_fill(tscfg_lex_state *lex, size_t bytes) {
+  if (lex->buf_len >= bytes) {
+    return TSCFG_OK;
+  }
+  return lex_read_more(lex, bytes - lex->buf_len);
+}
+
+/*
+ * Read at least the requested number of additional bytes into buffer.
+ * If hits end of file, will not read as many as requested.
+ *
+ * The buffer is a sliding window: input is read in whole chunks into
+ * free space at the end, and unconsumed bytes are only moved back to
+ * the start once less than a chunk of space remains.
  */
 static tscfg_rc lex_read_more(tscfg_lex_state *lex, size_t bytes) {
   tscfg_rc rc;
-  size_t size_needed = bytes + lex->buf_len;
-
-  if (size_needed >= lex->buf_size) {
-    void *tmp = realloc(lex->buf, size_needed);
-    TSCFG_CHECK_MALLOC(tmp);
 
-    lex->buf = tmp;
-    lex->buf_size = size_needed;
+  if (lex->buf_borrowed) {
+    // All input is already in buffer
+    return TSCFG_OK;
   }
 
-  // TODO: read extra?
+  size_t len_needed = lex->buf_len + bytes;
 
-  // Move data back when needed to free space at end
-  if (lex->buf_pos + size_needed > lex->buf_size) {
-    memmove(lex->buf, &lex->buf[lex->buf_pos], lex->buf_len);
-    lex->buf_pos = 0;
-  }
+  while (lex->buf_len < len_needed && !lex->eof) {
+    size_t free_bytes = lex->buf_size - lex->buf_pos - lex->buf_len;
 
-  size_t read_bytes = 0;
-  rc = lex_read(lex, &lex->buf[lex->buf_pos + lex->buf_len], bytes, &read_bytes);
-  TSCFG_CHECK(rc);
+    if (free_bytes < lex->chunk_size) {
+      // Move data back to free space at end
+      if (lex->buf_pos > 0) {
+        lex_drop(lex);
+        free_bytes = lex->buf_size - lex->buf_len;
+      }
+
+      if (free_bytes < lex->chunk_size) {
+        size_t min_size = lex->buf_len + lex->chunk_size;
+        size_t new_size = lex->buf_size * 2;
+        new_size = (new_size > min_size) ? new_size : min_size;
+
+        void *tmp = tscfg_realloc(lex->buf, new_size);
+        TSCFG_CHECK_MALLOC(tmp);
+
+        lex->alloc_buf = lex->buf = tmp;
+        lex->alloc_size = lex->buf_size = new_size;
+        free_bytes = new_size - lex->buf_len;
+      }
+    }
 
-  lex->buf_len += read_bytes;
+    size_t read_bytes = 0;
+    rc = lex_read(lex, &lex->buf[lex->buf_pos + lex->buf_len], free_bytes,
+                  &read_bytes);
+    TSCFG_CHECK(rc);
+
+    lex->buf_len += read_bytes;
+    TSCFG_STAT(lex->stats, lex->stats->refills++);
+
+    rc = lex_check_bytes(lex, lex->buf_offset + lex->buf_pos + lex->buf_len);
+    TSCFG_CHECK(rc);
+  }
 
   return TSCFG_OK;
 }
 
+/*
+ * Check bytes of input read so far against limit.
+ */
+static tscfg_rc lex_check_bytes(tscfg_lex_state *lex, size_t bytes) {
+  if (lex->max_bytes > 0 && bytes > lex->max_bytes) {
+    REPORT_ERR("Input longer than limit of %zu bytes", lex->max_bytes);
+    return TSCFG_ERR_LIMIT;
+  }
+  return TSCFG_OK;
+}
+
 /*
  * Lexer read from input.
- * read_bytes: on success, set to number of bytes read.  Only < bytes if EOF.
+ * read_bytes: on success, set to number of bytes read.  May be < bytes
+ *    for short reads, sets lex->eof if end of input reached.
  */
 static tscfg_rc lex_read(tscfg_lex_state *lex, unsigned char *buf, size_t bytes,
                          size_t *read_bytes) {
+  tscfg_rc rc;
   tsconfig_input *in = &lex->in;
   if (in->kind == TS_CONFIG_IN_FILE) {
 
@@ -435,17 +902,24 @@ static tscfg_rc lex_read(tscfg_lex_state *lex, unsigned char *buf, size_t bytes,
         LEX_REPORT_ERR(lex, "Error reading input");
         return TSCFG_ERR_IO;
       }
+      lex->eof = true;
+    }
+
+    *read_bytes = read;
+  } else if (in->kind == TS_CONFIG_IN_FUNC) {
+    size_t read = 0;
+    rc = in->data.fn.read(in->data.fn.ctx, buf, bytes, &read);
+    if (rc != TSCFG_OK) {
+      LEX_REPORT_ERR(lex, "Error reading input");
+      return rc;
+    }
+
+    assert(read <= bytes);
+    if (read == 0) {
+      lex->eof = true;
     }
 
     *read_bytes = read;
-  } else if (in->kind == TS_CONFIG_IN_STR) {
-    assert(in->data.s.pos <= in->data.s.len);
-    size_t remaining = in->data.s.len - in->data.s.pos;
-    size_t copy_bytes = (remaining < bytes) ? remaining : bytes;
-    memcpy(buf, &in->data.s.str[in->data.s.pos], copy_bytes);
-    in->data.s.pos += copy_bytes;
-
-    *read_bytes = copy_bytes;
   } else {
     REPORT_ERR("Unsupported input type: %i", (int)in->kind);
     return TSCFG_ERR_UNIMPL;
@@ -472,37 +946,74 @@ static void lex_eat(tscfg_lex_state *lex, int chars) {
     assert(lex->buf_len >= enc_len);
     lex->buf_pos += enc_len;
     lex->buf_len -= enc_len;
-
-    lex_update_line(lex, b);
   }
 }
 
 /*
  * Eat a certain number of single-byte ascii characters.
- * Assertion error max occur if char isn't ascii
  */
 static void lex_eat_ascii(tscfg_lex_state *lex, size_t bytes) {
-  for (size_t i = 0; i < bytes; i++) {
-    unsigned char b = lex->buf[lex->buf_pos + i];
-    assert(b <= 127);
-
-    lex_update_line(lex, b);
-  }
-
+  assert(bytes <= lex->buf_len);
   lex->buf_pos += bytes;
   lex->buf_len -= bytes;
 }
 
 /*
- * Update line position based on first byte of consumed character
+ * Eat a run of bytes, e.g. found by lex_scan_until, that may include
+ * whole multi-byte UTF-8 characters.  Characters aren't counted, so this
+ * is the same as for ascii.
  */
-static void lex_update_line(tscfg_lex_state *lex, unsigned char b) {
-  if (is_hocon_newline(b)) {
-    lex->line++;
-    lex->line_char = 1;
-  } else {
-    lex->line_char++;
+static void lex_eat_run(tscfg_lex_state *lex, size_t bytes) {
+  lex_eat_ascii(lex, bytes);
+}
+
+/*
+ * Length of run of characters at current position not matching either
+ * ascii byte.  Run only includes non-ascii characters if input was
+ * validated already.
+ */
+static size_t lex_scan_until(tscfg_lex_state *lex, unsigned char c1,
+                             unsigned char c2) {
+  const unsigned char *p = &lex->buf[lex->buf_pos];
+  if (lex->validated) {
+    return tscfg_scan_until_utf8(p, lex->buf_len, c1, c2);
+  }
+  return tscfg_scan_until(p, lex->buf_len, c1, c2);
+}
+
+bool tscfg_lex_location(tscfg_lex_state *lex, size_t offset, int *line,
+                        int *col) {
+  size_t buf_end = lex->buf_offset + lex->buf_pos + lex->buf_len;
+  if (offset < lex->buf_offset || offset > buf_end) {
+    return false;
   }
+
+  size_t nlines, nchars;
+  tscfg_rc rc = tscfg_line_index_find(&lex->lines, lex->buf,
+                          offset - lex->buf_offset, &nlines, &nchars);
+  if (rc != TSCFG_OK) {
+    return false;
+  }
+
+  *line = lex->buf_line + (int)nlines;
+  *col = (nlines == 0 ? lex->buf_col : 1) + (int)nchars;
+  return true;
+}
+
+/*
+ * Drop consumed bytes from start of buffer of streaming input, first
+ * counting lines in them so that locations can still be found.
+ */
+static void lex_drop(tscfg_lex_state *lex) {
+  size_t nlines, nchars;
+  tscfg_line_count(lex->buf, lex->buf_pos, &nlines, &nchars);
+  lex->buf_line += (int)nlines;
+  lex->buf_col = (nlines == 0 ? lex->buf_col : 1) + (int)nchars;
+
+  lex->buf_offset += lex->buf_pos;
+  memmove(lex->buf, &lex->buf[lex->buf_pos], lex->buf_len);
+  lex->buf_pos = 0;
+  tscfg_line_index_clear(&lex->lines);
 }
 
 /*
@@ -524,17 +1035,106 @@ static tscfg_rc lex_copy_char(tscfg_lex_state *lex, tscfg_strbuf *sb,
   assert(enc_len >= 1);
   assert(enc_len <= lex->buf_len);
 
-  rc = strbuf_expand(sb, sb->len + enc_len, aggressive_resize);
-  memcpy(&sb->str[sb->len], &lex->buf[lex->buf_pos], enc_len);
-  sb->len += enc_len;
+  if (sb->borrowed && sb->str + sb->len == (char*)&lex->buf[lex->buf_pos]) {
+    // Still contiguous with input: just extend slice
+    sb->len += enc_len;
+  } else {
+    rc = strbuf_expand(sb, sb->len + enc_len, aggressive_resize);
+    TSCFG_CHECK(rc);
+    memcpy(&sb->str[sb->len], &lex->buf[lex->buf_pos], enc_len);
+    sb->len += enc_len;
+  }
 
-  lex_update_line(lex, b);
   lex->buf_pos += enc_len;
   lex->buf_len -= enc_len;
 
   return TSCFG_OK;
 }
 
+/*
+ * Copy single-byte ascii characters.
+ * Assumes that they have been peeked already.
+ */
+static tscfg_rc lex_copy_ascii(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                               size_t bytes) {
+  tscfg_rc rc = lex_append_bytes(lex, sb, bytes);
+  TSCFG_CHECK(rc);
+
+  lex_eat_ascii(lex, bytes);
+  return TSCFG_OK;
+}
+
+/*
+ * Append bytes at current position to buffer without consuming them.
+ */
+static tscfg_rc lex_append_bytes(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                 size_t bytes) {
+  tscfg_rc rc;
+  assert(bytes <= lex->buf_len);
+
+  if (sb->borrowed && sb->str + sb->len == (char*)&lex->buf[lex->buf_pos]) {
+    sb->len += bytes;
+  } else {
+    rc = strbuf_expand(sb, sb->len + bytes, true);
+    TSCFG_CHECK(rc);
+    memcpy(&sb->str[sb->len], &lex->buf[lex->buf_pos], bytes);
+    sb->len += bytes;
+  }
+
+  return TSCFG_OK;
+}
+
+/*
+ * Copy run of characters found by lex_scan_until.
+ */
+static tscfg_rc lex_copy_run(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                             size_t bytes) {
+  if (!lex->validated) {
+    return lex_copy_ascii(lex, sb, bytes);
+  }
+
+  tscfg_rc rc = lex_append_bytes(lex, sb, bytes);
+  TSCFG_CHECK(rc);
+
+  lex_eat_run(lex, bytes);
+  return TSCFG_OK;
+}
+
+/*
+ * Copy ascii characters if buffer provided, otherwise just consume them.
+ */
+static tscfg_rc lex_copy_or_eat_ascii(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                      size_t bytes) {
+  if (sb != NULL) {
+    return lex_copy_ascii(lex, sb, bytes);
+  }
+
+  lex_eat_ascii(lex, bytes);
+  return TSCFG_OK;
+}
+
+/*
+ * Initialise string buffer for token starting at current position.
+ * If tokens can borrow from input, start with an empty slice of the
+ * buffer that is only copied if modified, e.g. by escape codes.
+ */
+static tscfg_rc lex_strbuf_init(tscfg_lex_state *lex, tscfg_strbuf *sb,
+                                size_t init_size) {
+  if (lex->borrow_toks) {
+    sb->str = (char*)&lex->buf[lex->buf_pos];
+    sb->size = 0;
+    sb->len = 0;
+    sb->borrowed = true;
+    sb->arena = lex->arena;
+    sb->max_len = lex->max_tok_len;
+    return TSCFG_OK;
+  }
+
+  tscfg_rc rc = strbuf_init(sb, init_size, lex->arena);
+  sb->max_len = lex->max_tok_len;
+  return rc;
+}
+
 
 static tscfg_rc extract_comment_or_hocon_unquoted(tscfg_lex_state *lex,
                                 tscfg_tok *tok, bool include_comm_str) {
@@ -545,9 +1145,12 @@ static tscfg_rc extract_comment_or_hocon_unquoted(tscfg_lex_state *lex,
   rc = lex_peek(lex, buf, 2, &got);
   TSCFG_CHECK(rc);
 
-  assert(buf[0] == '/'); // Only case handled
+  assert(got >= 1 && buf[0] == '/'); // Only case handled
 
-  if (buf[1] == '/') {
+  if (got < 2) {
+    // Lone / at end of input
+    return extract_hocon_unquoted(lex, tok);
+  } else if (buf[1] == '/') {
     lex_eat(lex, 2);
     return extract_line_comment(lex, tok, include_comm_str);
   } else if (buf[1] == '*') {
@@ -569,7 +1172,7 @@ static tscfg_rc extract_line_comment(tscfg_lex_state *lex, tscfg_tok *tok,
   tscfg_strbuf sb;
   bool found_nl;
   if (include_str) {
-    rc = strbuf_init(&sb, 32);
+    rc = lex_strbuf_init(lex, &sb, 32);
     TSCFG_CHECK(rc);
 
     // Don't care if we found newline
@@ -608,8 +1211,21 @@ cleanup:
 static tscfg_rc extract_until(tscfg_lex_state *lex, tscfg_strbuf *sb,
                               tscfg_char_t match, bool *found) {
   tscfg_rc rc;
+  assert(match < 0x80);
 
   while (true) {
+    // Fast path: copy run of characters
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
+
+    size_t run = lex_scan_until(lex, (unsigned char)match,
+                                (unsigned char)match);
+    if (run > 0) {
+      rc = lex_copy_run(lex, sb, run);
+      TSCFG_CHECK(rc);
+      continue;
+    }
+
     tscfg_char_t c;
     int got;
     rc = lex_peek(lex, &c, 1, &got);
@@ -639,8 +1255,20 @@ static tscfg_rc extract_until(tscfg_lex_state *lex, tscfg_strbuf *sb,
 static tscfg_rc eat_until(tscfg_lex_state *lex, tscfg_char_t match,
                           bool *found) {
   tscfg_rc rc;
+  assert(match < 0x80);
 
   while (true) {
+    // Fast path: skip run of characters
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
+
+    size_t run = lex_scan_until(lex, (unsigned char)match,
+                                (unsigned char)match);
+    if (run > 0) {
+      lex_eat_run(lex, run);
+      continue;
+    }
+
     tscfg_char_t c;
     int got;
     rc = lex_peek(lex, &c, 1, &got);
@@ -669,7 +1297,7 @@ static tscfg_rc extract_multiline_comment(tscfg_lex_state *lex, tscfg_tok *tok,
 
   tscfg_strbuf sb;
   if (include_str) {
-    rc = strbuf_init(&sb, 64);
+    rc = lex_strbuf_init(lex, &sb, 64);
     TSCFG_CHECK(rc);
   } else {
     strbuf_init_empty(&sb);
@@ -738,7 +1366,7 @@ static tscfg_rc extract_hocon_ws(tscfg_lex_state *lex, tscfg_tok *tok,
 
   tscfg_strbuf sb;
   if (include_str) {
-    rc = strbuf_init(&sb, 128);
+    rc = lex_strbuf_init(lex, &sb, 128);
     TSCFG_CHECK(rc);
   } else {
     strbuf_init_empty(&sb);
@@ -747,19 +1375,32 @@ static tscfg_rc extract_hocon_ws(tscfg_lex_state *lex, tscfg_tok *tok,
   bool saw_newline = false;
 
   while (true) {
+    // Fast path: consume run of ascii whitespace
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+
+    const unsigned char *run_start = &lex->buf[lex->buf_pos];
+    size_t run = tscfg_scan_ws(run_start, lex->buf_len);
+    if (run > 0) {
+      if (!saw_newline && memchr(run_start, '\n', run) != NULL) {
+        saw_newline = true;
+      }
+
+      rc = lex_copy_or_eat_ascii(lex, include_str ? &sb : NULL, run);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+      continue;
+    }
+
     tscfg_char_t c;
     int got;
     rc = lex_peek(lex, &c, 1, &got);
     TSCFG_CHECK_GOTO(rc, cleanup);
 
+    // Only non-ASCII whitespace is left, none of which are newlines
     if (got == 0 || !is_hocon_whitespace(c)) {
       break;
     }
 
-    if (is_hocon_newline(c)) {
-      saw_newline = true;
-    }
-
     if (include_str) {
       rc = lex_copy_char(lex, &sb, true);
       TSCFG_CHECK_GOTO(rc, cleanup);
@@ -783,98 +1424,100 @@ cleanup:
 }
 
 /*
- * Extract HOCON variable start: ${ or ${?.
- * Assume initial $ has been consumed.
- * Store variable name into token.
+ * Extract operator: HOCON variable start ${ or ${?, or +=.
  */
-static tscfg_rc extract_sub_start(tscfg_lex_state *lex, tscfg_tok *tok) {
-  tscfg_rc rc;
-
-  char buf[2];
-  size_t got = 0;
-  rc = lex_peek_bytes(lex, buf, 2, &got);
+static tscfg_rc extract_operator(tscfg_lex_state *lex, tscfg_tok *tok) {
+  size_t len;
+  tscfg_tok_tag tag;
+  tscfg_rc rc = lex_run_dfa(lex, LEX_DFA_KEYWORD, &len, &tag);
   TSCFG_CHECK(rc);
 
-  if (buf[0] != '{') {
-    LEX_REPORT_ERR(lex, "Expected { after $, but got %c", buf[0]);
-    return TSCFG_ERR_SYNTAX;
+  if (len > 0) {
+    lex_eat_ascii(lex, len);
+    set_nostr_tok(tag, tok);
+    return TSCFG_OK;
   }
 
-  tscfg_tok_tag tag;
-  size_t chars;
-  if (got == 2 && buf[1] == '?') {
-    tag = TSCFG_TOK_OPEN_OPT_SUB;
-    chars = 2;
+  char first = (char)lex->buf[lex->buf_pos];
+  if (lex->buf_len < 2) {
+    LEX_REPORT_ERR(lex, "Trailing %c at end of file", first);
+  } else if (first == '$') {
+    LEX_REPORT_ERR(lex, "Expected { after $, but got %c",
+                   (char)lex->buf[lex->buf_pos + 1]);
   } else {
-    tag = TSCFG_TOK_OPEN_SUB;
-    chars = 1;
+    LEX_REPORT_ERR(lex, "Invalid char %c after %c",
+                   (char)lex->buf[lex->buf_pos + 1], first);
   }
-
-  lex_eat_ascii(lex, chars);
-  set_nostr_tok(tag, tok);
-
-  return TSCFG_OK;
+  return TSCFG_ERR_SYNTAX;
 }
 
-
 /*
- * Extract JSON/HOCON number token
- * c: first character of string
- * TODO: doesn't handle exponentials
+ * Run DFA from start state over input at current position, without
+ * consuming it.  Costs one lookup per byte for the byte's class and one
+ * for the transition.
+ * len: set to length of longest prefix accepted, or 0 if none
+ * tag: set to tag of accepting state for prefix
  */
-static tscfg_rc extract_json_number(tscfg_lex_state *lex, tscfg_char_t c,
-                                    tscfg_tok *tok) {
-  tscfg_rc rc;
-  tscfg_strbuf sb;
-  rc = strbuf_init(&sb, 32);
-  TSCFG_CHECK(rc);
-
-  // Can assume c is in ascii range, so is same in UTF-8
-  assert(c <= 127);
-  sb.len = 1;
-  sb.str[0] = (char)c;
-  lex_eat_ascii(lex, 1);
-
-  bool saw_dec_point = false;
+static tscfg_rc lex_run_dfa(tscfg_lex_state *lex, uint8_t start,
+                            size_t *len, tscfg_tok_tag *tag) {
+  uint8_t state = start;
+  size_t i = 0;
+  *len = 0;
+  *tag = TSCFG_TOK_INVALID;
 
   while (true) {
-    size_t min_size = sb.len + LEX_PEEK_BATCH_SIZE;
-    rc = strbuf_expand(&sb, min_size, false);
-    TSCFG_CHECK(rc);
-
-    char *pos = &sb.str[sb.len];
-    size_t got;
-    rc = lex_peek_bytes(lex, pos, LEX_PEEK_BATCH_SIZE, &got);
-    TSCFG_CHECK_GOTO(rc, cleanup);
-
-    assert(got <= LEX_PEEK_BATCH_SIZE);
+    const unsigned char *p = &lex->buf[lex->buf_pos];
+    for (; i < lex->buf_len; i++) {
+      state = tscfg_lex_dfa_next[state][tscfg_lex_bytes[p[i]].dfa];
+      if (state == LEX_DFA_DEAD) {
+        return TSCFG_OK;
+      }
 
-    size_t nbytes = 0;
-    while (nbytes < got) {
-      char b = pos[nbytes];
-      if ((b >= '0' && b <= '9')) {
-        nbytes++;
-      } else if (!saw_dec_point && b == '.') {
-        saw_dec_point = true;
-        nbytes++;
-      } else {
-        break;
+      if (tscfg_lex_dfa_accept[state] != TSCFG_TOK_INVALID) {
+        *len = i + 1;
+        *tag = (tscfg_tok_tag)tscfg_lex_dfa_accept[state];
       }
     }
 
-    if (nbytes > 0) {
-      // Any characters consumed are in ASCII range
-      lex_eat_ascii(lex, nbytes);
-      sb.len += nbytes;
-    }
+    // May move buffer
+    tscfg_rc rc = lex_fill(lex, i + LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK(rc);
 
-    if (nbytes < got || got == 0) {
-      // End of whitespace or file
-      break;
+    if (i >= lex->buf_len) {
+      // End of input
+      return TSCFG_OK;
     }
   }
+}
+
+/*
+ * Extract JSON/HOCON number token, with value decoded.  Text that starts
+ * like a number but isn't one, e.g. a lone -, is unquoted text.
+ */
+static tscfg_rc extract_json_number(tscfg_lex_state *lex, tscfg_tok *tok) {
+  size_t len;
+  tscfg_tok_tag tag;
+  tscfg_rc rc = lex_run_dfa(lex, LEX_DFA_NUMBER, &len, &tag);
+  TSCFG_CHECK(rc);
+
+  if (len == 0) {
+    return extract_hocon_unquoted(lex, tok);
+  }
+
+  tscfg_strbuf sb;
+  rc = lex_strbuf_init(lex, &sb, len + 1);
+  TSCFG_CHECK(rc);
+
+  rc = lex_copy_ascii(lex, &sb, len);
+  TSCFG_CHECK_GOTO(rc, cleanup);
 
-  set_str_tok(TSCFG_TOK_NUMBER, &sb, tok);
+  // Same syntax as DFA, so whole token is used
+  size_t used;
+  rc = tscfg_num_scan(sb.str, sb.len, &used, &tok->num);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+  assert(used == sb.len);
+
+  set_str_tok(tag, &sb, tok);
   return TSCFG_OK;
 
 cleanup:
@@ -913,12 +1556,23 @@ static tscfg_rc extract_hocon_str(tscfg_lex_state *lex, tscfg_tok *tok) {
 static tscfg_rc extract_json_str(tscfg_lex_state *lex, tscfg_tok *tok) {
   tscfg_rc rc;
   tscfg_strbuf sb;
-  rc = strbuf_init(&sb, 32);
+  rc = lex_strbuf_init(lex, &sb, 32);
   TSCFG_CHECK(rc);
 
   bool end_of_string = false;
 
   do {
+    // Fast path: copy run of characters without quotes or escapes
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+
+    size_t run = lex_scan_until(lex, '"', '\\');
+    if (run > 0) {
+      rc = lex_copy_run(lex, &sb, run);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+      continue;
+    }
+
     tscfg_char_t c;
     int got;
     rc = lex_peek(lex, &c, 1, &got);
@@ -940,7 +1594,8 @@ static tscfg_rc extract_json_str(tscfg_lex_state *lex, tscfg_tok *tok) {
       rc = extract_json_str_escape(lex, &escaped);
       TSCFG_CHECK_GOTO(rc, cleanup);
 
-      rc = strbuf_append_utf8(&sb, c, true);
+      // Escaped text differs from input, so must copy
+      rc = strbuf_append_utf8(&sb, escaped, true);
       TSCFG_CHECK_GOTO(rc, cleanup);
     } else {
       rc = lex_copy_char(lex, &sb, true);
@@ -1068,7 +1723,7 @@ static tscfg_rc extract_hocon_multiline_str(tscfg_lex_state *lex,
   tscfg_rc rc;
 
   tscfg_strbuf sb;
-  rc = strbuf_init(&sb, 128);
+  rc = lex_strbuf_init(lex, &sb, 128);
   TSCFG_CHECK(rc);
 
   bool in_string = true;
@@ -1092,7 +1747,7 @@ static tscfg_rc extract_hocon_multiline_str(tscfg_lex_state *lex,
 
     if (memcmp(buf, "\"\"\"", 3) == 0) {
       // Need to match last """ according to HOCON
-      if (buf[3] == '"') {
+      if (got == 4 && buf[3] == '"') {
         // Consume first ", then try again
         rc = lex_copy_char(lex, &sb, true);
         TSCFG_CHECK_GOTO(rc, cleanup);
@@ -1123,36 +1778,52 @@ static tscfg_rc extract_hocon_unquoted(tscfg_lex_state *lex, tscfg_tok *tok) {
   tscfg_rc rc;
 
   tscfg_strbuf sb;
-  rc = strbuf_init(&sb, 32);
+  rc = lex_strbuf_init(lex, &sb, 32);
   TSCFG_CHECK(rc);
 
   while (true) {
-    const int UNQUOTED_LOOKAHEAD = 2;
-    // Need to interpret as unicode
-    tscfg_char_t buf[UNQUOTED_LOOKAHEAD];
-    int got;
-    rc = lex_peek(lex, buf, UNQUOTED_LOOKAHEAD, &got);
+    // Fast path: copy run of ascii characters that can't end text
+    rc = lex_fill(lex, LEX_PEEK_BATCH_SIZE);
     TSCFG_CHECK_GOTO(rc, cleanup);
 
-    if (got == 0) {
+    size_t run = tscfg_scan_unquoted(&lex->buf[lex->buf_pos], lex->buf_len);
+    if (run > 0) {
+      rc = lex_copy_ascii(lex, &sb, run);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+      continue;
+    }
+
+    if (lex->buf_len == 0) {
       break;
     }
 
-    if (!is_hocon_unquoted_char(buf[0]) ||
-        is_hocon_whitespace(buf[0])) {
-      // Cases where unquoted text definitely terminates
+    const unsigned char *p = &lex->buf[lex->buf_pos];
+    if (p[0] == '/') {
+      // Part of text unless it starts a comment
+      if (lex->buf_len >= 2 && (p[1] == '/' || p[1] == '*')) {
+        break;
+      }
+      rc = lex_copy_ascii(lex, &sb, 1);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+      continue;
+    } else if (p[0] < 0x80) {
+      // Forbidden character or whitespace
       break;
     }
 
-    // Can check for comment with lookahead two
-    if (is_comment_start(buf, got)) {
+    // Need to interpret as unicode
+    tscfg_char_t c;
+    int got;
+    rc = lex_peek(lex, &c, 1, &got);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+
+    if (is_hocon_whitespace(c)) {
       break;
     }
 
-    // Append first character and advance
+    // Append character and advance
     rc = lex_copy_char(lex, &sb, true);
     TSCFG_CHECK_GOTO(rc, cleanup);
-
   }
 
   set_str_tok(TSCFG_TOK_UNQUOTED, &sb, tok);
@@ -1166,47 +1837,17 @@ cleanup:
 
 /*
  * Extract keyword or unquoted string.
- * c: first character of keyword
  */
 static tscfg_rc extract_keyword_or_hocon_unquoted(tscfg_lex_state *lex,
-                                        tscfg_char_t c, tscfg_tok *tok) {
-  tscfg_rc rc;
-
-  const char *kw;
-  size_t kwlen;
-  tscfg_tok_tag kwtag;
-
-  switch (c) {
-  case 't':
-    kw = "true";
-    kwlen = 4;
-    kwtag = TSCFG_TOK_TRUE;
-    break;
-  case 'f':
-    kw = "false";
-    kwlen = 5;
-    kwtag = TSCFG_TOK_FALSE;
-    break;
-  case 'n':
-    kw = "null";
-    kwlen = 4;
-    kwtag = TSCFG_TOK_NULL;
-    break;
-  default:
-    assert(false);
-    return TSCFG_ERR_UNKNOWN;
-  }
-
-  char buf[kwlen];
-  size_t got;
-  // All keywords are 1 byte per character in utf-8
-  rc = lex_peek_bytes(lex, buf, kwlen, &got);
+                                                  tscfg_tok *tok) {
+  size_t len;
+  tscfg_tok_tag tag;
+  tscfg_rc rc = lex_run_dfa(lex, LEX_DFA_KEYWORD, &len, &tag);
   TSCFG_CHECK(rc);
 
-  if (got == kwlen && memcmp(buf, kw, kwlen) == 0) {
-    lex_eat_ascii(lex, kwlen);
-
-    set_nostr_tok(kwtag, tok);
+  if (len > 0) {
+    lex_eat_ascii(lex, len);
+    set_nostr_tok(tag, tok);
     return TSCFG_OK;
   } else {
     return extract_hocon_unquoted(lex, tok);
@@ -1217,6 +1858,10 @@ static tscfg_rc extract_keyword_or_hocon_unquoted(tscfg_lex_state *lex,
  * Check if whitespace
  */
 static bool is_hocon_whitespace(tscfg_char_t c) {
+  if (c < 0x80) {
+    return (tscfg_lex_bytes[c].flags & LEX_F_WS) != 0;
+  }
+
   switch (c) {
     CASE_HOCON_WHITESPACE:
       return true;
@@ -1225,76 +1870,22 @@ static bool is_hocon_whitespace(tscfg_char_t c) {
   }
 }
 
-/*
- * Return true if character is to be treated semantically as newline\
- * according to the HOCON spec
- */
-static inline bool is_hocon_newline(tscfg_char_t c) {
-  return (c == '\n');
-}
-
-/*
- * Return true if this is a char that can appear in an unquoted string.
- * Note that because it's valid to appear in unquoted text doesn't mean
- * that it should be greedily appended - special cases are handled elsewhere.
- */
-static bool is_hocon_unquoted_char(tscfg_char_t c) {
-  switch (c) {
-    case '$':
-    case '"':
-    case '{':
-    case '}':
-    case '[':
-    case ']':
-    case ':':
-    case '=':
-    case ',':
-    case '+':
-    case '#':
-    case '`':
-    case '^':
-    case '?':
-    case '!':
-    case '@':
-    case '*':
-    case '&':
-    case '\\':
-      // Forbidden characters according to HOCON spec
-      return false;
-    default:
-      if (is_hocon_whitespace(c)) {
-        // Whitespace is also forbidden
-        return false;
-      } else{
-        // All others can appear
-        return true;
-      }
-  }
-}
-
-/*
- * Return true if string is start of comment
- */
-static bool is_comment_start(const tscfg_char_t *buf, int len) {
-  if (len >= 1 && buf[0] == '#') {
-    return true;
-  } else if (len >= 2 && buf[0] == '/' &&
-             (buf[1] == '/' || buf[1] == '*')) {
-    return true;
-  } else {
-    return false;
-  }
-}
-
 static void lex_report_err(const char *file, int line,
           tscfg_lex_state *lex, const char *fmt, ...) {
-  // TODO: include context, e.g. line number, in errors.
   va_list args;
   va_start(args, fmt);
   tscfg_report_err_v(file, line, fmt, args);
   va_end(args);
-  fprintf(TSCFG_ERR_FILE, "Lexer error at input location %i:%i\n",
-          lex->line, lex->line_char);
+
+  // Only work out location now that it's needed
+  size_t offset = tscfg_lex_offset(lex);
+  int in_line, in_col;
+  if (tscfg_lex_location(lex, offset, &in_line, &in_col)) {
+    tscfg_report_err(NULL, 0, "Lexer error at input location %i:%i",
+                     in_line, in_col);
+  } else {
+    tscfg_report_err(NULL, 0, "Lexer error at input offset %zu", offset);
+  }
 }
 
 /*
@@ -1304,35 +1895,63 @@ static void strbuf_init_empty(tscfg_strbuf *sb) {
   sb->str = NULL;
   sb->size = 0;
   sb->len = 0;
+  sb->borrowed = false;
+  sb->arena = NULL;
+  sb->max_len = 0;
 }
 
 /*
  * Allocate to be large enough to hold string of init_size
+ * arena: if non-NULL, allocate from arena instead of malloc
  */
-static tscfg_rc strbuf_init(tscfg_strbuf *sb, size_t init_size) {
+static tscfg_rc strbuf_init(tscfg_strbuf *sb, size_t init_size,
+                            tscfg_arena *arena) {
   if (init_size == 0) {
     sb->str = NULL;
   } else {
     init_size++; // Null term
 
-    sb->str = malloc(init_size);
+    sb->str = (arena != NULL) ? tscfg_arena_alloc(arena, init_size)
+                              : tscfg_malloc(init_size);
     TSCFG_CHECK_MALLOC(sb->str);
   }
 
   sb->size = init_size;
   sb->len = 0;
+  sb->borrowed = false;
+  sb->arena = arena;
+  sb->max_len = 0;
   return TSCFG_OK;
 }
 
 /*
  * Expand to hold string of length min_size, plus null terminator.
+ * Borrowed slices are copied into an owned buffer.
  * aggressive: if true, aggressively allocate memory
  */
 static tscfg_rc strbuf_expand(tscfg_strbuf *sb, size_t min_size,
                               bool aggressive) {
+  if (sb->max_len > 0 && min_size > sb->max_len) {
+    // Reported by caller
+    return TSCFG_ERR_LIMIT;
+  }
+
   min_size++; // Null term
 
-  if (sb->size < min_size) {
+  if (sb->arena != NULL) {
+    return strbuf_expand_arena(sb, min_size, aggressive);
+  }
+
+  if (sb->borrowed) {
+    size_t new_size = aggressive ? sb->len * 2 : 0;
+    new_size = (new_size > min_size) ? new_size : min_size;
+    char *tmp = tscfg_malloc(new_size);
+    TSCFG_CHECK_MALLOC(tmp);
+    memcpy(tmp, sb->str, sb->len);
+    sb->str = tmp;
+    sb->size = new_size;
+    sb->borrowed = false;
+  } else if (sb->size < min_size) {
     size_t new_size;
     if (aggressive) {
       new_size = sb->size * 2;
@@ -1340,8 +1959,8 @@ static tscfg_rc strbuf_expand(tscfg_strbuf *sb, size_t min_size,
       new_size = min_size;
     }
     new_size = (new_size > min_size) ? new_size : min_size;
-    void *tmp = realloc(sb->str, new_size);
-    TSCFG_CHECK_MALLOC(sb->str);
+    void *tmp = tscfg_realloc(sb->str, new_size);
+    TSCFG_CHECK_MALLOC(tmp);
     sb->str = tmp;
     sb->size = new_size;
   }
@@ -1349,17 +1968,60 @@ static tscfg_rc strbuf_expand(tscfg_strbuf *sb, size_t min_size,
   return TSCFG_OK;
 }
 
+/*
+ * Expand buffer allocated from arena.  Most of the time the string being
+ * built is the latest allocation, so can grow in place.
+ */
+static tscfg_rc strbuf_expand_arena(tscfg_strbuf *sb, size_t min_size,
+                                    bool aggressive) {
+  if (!sb->borrowed && sb->size >= min_size) {
+    return TSCFG_OK;
+  }
+
+  if (!sb->borrowed && tscfg_arena_extend(sb->arena, sb->str, min_size)) {
+    sb->size = min_size;
+    return TSCFG_OK;
+  }
+
+  size_t new_size = aggressive ? sb->len * 2 : 0;
+  new_size = (new_size > min_size) ? new_size : min_size;
+  char *tmp = tscfg_arena_alloc(sb->arena, new_size);
+  TSCFG_CHECK_MALLOC(tmp);
+
+  if (sb->len > 0) {
+    memcpy(tmp, sb->str, sb->len);
+  }
+  sb->str = tmp;
+  sb->size = new_size;
+  sb->borrowed = false;
+  return TSCFG_OK;
+}
+
 static void strbuf_finalize(tscfg_strbuf *sb) {
-  if (sb->str == NULL) {
+  if (sb->borrowed) {
+    // Slice of input: not null terminated
+  } else if (sb->str == NULL) {
     assert(sb->size == 0 && sb->len == 0);
   } else {
     assert(sb->size > sb->len); // Need space for null term
     sb->str[sb->len] = '\0';
+
+    if (sb->arena != NULL) {
+      // Give back space reserved for growth, e.g. to next token
+      tscfg_arena_shrink(sb->arena, sb->str, sb->len + 1);
+      sb->size = sb->len + 1;
+    }
   }
 }
 
 static void strbuf_free(tscfg_strbuf *sb) {
-  free(sb->str);
+  if (sb->borrowed) {
+    // Not owned
+  } else if (sb->arena != NULL) {
+    tscfg_arena_release(sb->arena, sb->str);
+  } else {
+    tscfg_free(sb->str);
+  }
 }
 
 static tscfg_rc strbuf_append_utf8(tscfg_strbuf *sb, tscfg_char_t c,
@@ -1376,5 +2038,5 @@ static tscfg_rc strbuf_append_utf8(tscfg_strbuf *sb, tscfg_char_t c,
   tscfg_encode(c, pos);
 
   sb->len += enc_len;
-  return TSCFG_ERR_UNIMPL;
+  return TSCFG_OK;
 }
@@ -27,6 +27,8 @@
 #include <stdbool.h>
 
 #include "tsconfig.h"
+#include "tsconfig_arena.h"
+#include "tsconfig_lines.h"
 #include "tsconfig_tok.h"
 
 typedef struct {
@@ -47,13 +49,79 @@ typedef struct {
   size_t buf_pos; // Position in buffer
   size_t buf_len; // Length of valid bytes beyond buf_pos
 
-  int line;
-  int line_char;
+  // If true, buf points into in-memory input: never written or freed
+  bool buf_borrowed;
+  // If true, buf is a read-only file mapping of buf_size bytes
+  bool buf_mapped;
+
+  // Buffer allocated for streaming input, kept for reuse by next input
+  unsigned char *alloc_buf;
+  size_t alloc_size;
+
+  // Refill streaming input in chunks of this many bytes
+  size_t chunk_size;
+  // If true, no more input can be read
+  bool eof;
+  // If true, token strings may be borrowed slices of buf
+  bool borrow_toks;
+  // If true, whole buffer was checked to be valid UTF-8 up front
+  bool validated;
+  /*
+   * If non-NULL, token strings are allocated from this arena, which owns
+   * them.  Tokens are then marked as borrowed.  NULL by default.
+   */
+  tscfg_arena *arena;
+
+  // If non-NULL, stats to count reads of input in.  NULL by default.
+  tsconfig_stats *stats;
+
+  // Limits on bytes of input and token strings, 0 for none.  0 by default.
+  size_t max_bytes;
+  size_t max_tok_len;
+
+  // Input offset of start of buffer
+  size_t buf_offset;
+  /*
+   * Line and column of start of buffer, which only move if consumed
+   * streaming input is dropped from buffer.
+   */
+  int buf_line;
+  int buf_col;
+  // Newlines in buffer, found when a location is first needed
+  tscfg_line_index lines;
 } tscfg_lex_state;
 
 tscfg_rc tscfg_lex_init(tscfg_lex_state *lex, tsconfig_input in);
 void tscfg_lex_finalize(tscfg_lex_state *lex);
 
+/*
+ * Initialize lexer without input, to be started with tscfg_lex_reset().
+ */
+void tscfg_lex_init_empty(tscfg_lex_state *lex);
+
+/*
+ * Start lexing new input after tscfg_lex_init_empty() or
+ * tscfg_lex_close(), reusing any buffer allocated for earlier input.
+ * Options such as arena are reset to defaults.
+ */
+tscfg_rc tscfg_lex_reset(tscfg_lex_state *lex, tsconfig_input in);
+
+/*
+ * Set limits on input, checked before memory is allocated for more.
+ * Input already in memory is checked at once.
+ * max_bytes: most bytes of input, or 0 for no limit
+ * max_tok_len: longest token string, or 0 for no limit
+ * return: TSCFG_ERR_LIMIT if input is too large
+ */
+tscfg_rc tscfg_lex_set_limits(tscfg_lex_state *lex, size_t max_bytes,
+                              size_t max_tok_len);
+
+/*
+ * Finish with input, but keep memory for next input.  Still needs to be
+ * finalized afterwards.
+ */
+void tscfg_lex_close(tscfg_lex_state *lex);
+
 /*
   Read the next token from the input stream.
 
@@ -62,16 +130,49 @@ void tscfg_lex_finalize(tscfg_lex_state *lex);
 tscfg_rc tscfg_read_tok(tscfg_lex_state *lex, tscfg_tok *tok,
                         tscfg_lex_opts opts);
 
+/*
+  Line and column of input offset, both starting at 1, with column in
+  UTF-8 characters.
+  return: false if offset is not in buffer, e.g. if streaming input was
+          dropped from buffer or memory ran out
+ */
+bool tscfg_lex_location(tscfg_lex_state *lex, size_t offset, int *line,
+                        int *col);
+
+/*
+ * Input offset of current position.
+ */
+static inline size_t tscfg_lex_offset(const tscfg_lex_state *lex) {
+  return lex->buf_offset + lex->buf_pos;
+}
+
+/*
+  Skip over the value of a field, stopping where the parser would after
+  the value and any separator.  Only brackets, strings and comments are
+  matched: no tokens are made and UTF-8 isn't decoded, so syntax errors
+  in the value may not be found.
+
+  in_obj: if true, the open brace of an object at the start of the value
+          was already read
+ */
+tscfg_rc tscfg_lex_skip_value(tscfg_lex_state *lex, bool in_obj);
+
 /*
  * Take ownership of string from token.
+ * Borrowed strings are copied first.  Returns NULL if out of memory.
  */
 static inline char *tscfg_own_token(tscfg_tok *tok, size_t *len) {
+  if (tscfg_tok_own(tok) != TSCFG_OK) {
+    return NULL;
+  }
+
   char *str = tok->str;
   *len = tok->len;
 
   tok->str = NULL;
   tok->len = 0;
   tok->tag = TSCFG_TOK_INVALID;
+  tok->borrowed = false;
 
   return str;
 }
@@ -0,0 +1,100 @@
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Copyright 2015, Tim Armstrong
+#
+# Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+
+# Lexer tables for HOCON.  Compiled into tsconfig_lex_tables.h by
+# gen_lex_tables.awk at build time.
+#
+# Bytes are written as a single character, a hex code like 0x1c, or a
+# range of either like 0-9.  Lines starting with # are comments.
+#
+#   start CLASS bytes...    Class of bytes that start a token.  Any other
+#                           ASCII byte starts unquoted text.
+#   flag FLAG bytes...      Set flag for bytes.  !FLAG clears it again.
+#   tok TAG bytes...        Single byte tokens.
+#   keyword TEXT TAG        Fixed token, matched by the KEYWORD DFA.
+#   dfa NAME                Start DFA, with first state named start.
+#   state NAME [TAG]        State of DFA, accepting if TAG given.
+#   bytes... -> STATE       Transition from last state.
+#
+# DFAs accept the longest prefix that ends in an accepting state.
+
+start WS 0x09-0x0d 0x1c-0x20
+start QUOTE "
+start PUNCT { } ( ) [ ] , = :
+start NUMBER - 0-9
+start KEYWORD t f n
+start OPERATOR $ +
+start COMMENT #
+start SLASH /
+start INVALID ` ^ ? ! @ * & \
+start NONASCII 0x80-0xff
+
+tok TSCFG_TOK_OPEN_BRACE {
+tok TSCFG_TOK_CLOSE_BRACE }
+tok TSCFG_TOK_OPEN_PAREN (
+tok TSCFG_TOK_CLOSE_PAREN )
+tok TSCFG_TOK_OPEN_SQUARE [
+tok TSCFG_TOK_CLOSE_SQUARE ]
+tok TSCFG_TOK_COMMA ,
+tok TSCFG_TOK_EQUAL =
+tok TSCFG_TOK_COLON :
+
+# ASCII whitespace according to HOCON
+flag WS 0x09-0x0d 0x1c-0x20
+
+# Can be appended to unquoted text without lookahead, i.e. excluding
+# forbidden characters, whitespace and /, which may start a comment
+flag UNQUOTED 0x00-0x7f
+flag !UNQUOTED 0x09-0x0d 0x1c-0x20 $ " { } [ ] : = , + # ` ^ ? ! @ * & \ /
+
+# End runs of bytes skipped by tscfg_lex_skip_value() inside brackets,
+# and at top level
+flag SKIP_STOP " { } [ ] # /
+flag SKIP_STOP_TOP " { } [ ] # / 0x0a , : =
+
+keyword true TSCFG_TOK_TRUE
+keyword false TSCFG_TOK_FALSE
+keyword null TSCFG_TOK_NULL
+keyword ${ TSCFG_TOK_OPEN_SUB
+keyword ${? TSCFG_TOK_OPEN_OPT_SUB
+keyword += TSCFG_TOK_PLUSEQUAL
+
+# JSON number, also allowing a decimal point without digits on one side.
+# Exponent is only part of number if e is followed by digits, e.g. not
+# in 10e for exabytes.
+dfa NUMBER
+state start
+  - -> sign
+  0-9 -> int
+state sign
+  0-9 -> int
+  . -> dot
+state dot
+  0-9 -> frac
+state int TSCFG_TOK_NUMBER
+  0-9 -> int
+  . -> frac
+  e E -> exp
+state frac TSCFG_TOK_NUMBER
+  0-9 -> frac
+  e E -> exp
+state exp
+  - + -> exp_sign
+  0-9 -> exp_int
+state exp_sign
+  0-9 -> exp_int
+state exp_int TSCFG_TOK_NUMBER
+  0-9 -> exp_int
@@ -0,0 +1,36 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Limits on input for the current thread.
+ */
+
+#include "tsconfig_limits.h"
+
+// Limits for this thread, or NULL if none
+static __thread const tsconfig_limits *limits_current = NULL;
+
+const tsconfig_limits *tscfg_limits_use(const tsconfig_limits *limits) {
+  const tsconfig_limits *prev = limits_current;
+  limits_current = limits;
+  return prev;
+}
+
+const tsconfig_limits *tscfg_limits_current(void) {
+  return limits_current;
+}
@@ -0,0 +1,45 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Limits on input for the current thread.
+ *
+ * Limits are set by the parse entry point for the top-level input, and
+ * by workers parsing parts of it.  Files loaded for includes are parsed
+ * without limits.  The parser checks nesting depth, and the lexer checks
+ * token lengths and bytes read.
+ */
+
+#ifndef __TSCONFIG_LIMITS_H
+#define __TSCONFIG_LIMITS_H
+
+#include "tsconfig.h"
+
+/*
+ * Set limits for this thread.
+ * limits: limits, or NULL for none.  Must stay valid until replaced.
+ * return: previous limits, to be restored when done
+ */
+const tsconfig_limits *tscfg_limits_use(const tsconfig_limits *limits);
+
+/*
+ * Get limits for this thread, or NULL if none.
+ */
+const tsconfig_limits *tscfg_limits_current(void);
+
+#endif // __TSCONFIG_LIMITS_H
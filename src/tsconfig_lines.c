@@ -0,0 +1,144 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+#include "tsconfig_lines.h"
+
+#include <stdlib.h>
+
+#include "tsconfig.h"
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_scan.h"
+
+// Initial capacity of newline index
+#define INIT_NEWLINES 256
+
+struct tsconfig_lines {
+  const unsigned char *text;
+  size_t len;
+  tscfg_line_index idx;
+};
+
+static size_t count_chars(const unsigned char *p, size_t len);
+
+void tscfg_line_index_free(tscfg_line_index *idx) {
+  tscfg_free(idx->newlines);
+  *idx = TSCFG_EMPTY_LINE_INDEX;
+}
+
+void tscfg_line_index_clear(tscfg_line_index *idx) {
+  idx->nnewlines = 0;
+  idx->scanned = 0;
+}
+
+tscfg_rc tscfg_line_index_find(tscfg_line_index *idx,
+          const unsigned char *text, size_t offset, size_t *nlines,
+          size_t *nchars) {
+  while (idx->scanned < offset) {
+    idx->scanned += tscfg_scan_until_utf8(&text[idx->scanned],
+                          offset - idx->scanned, '\n', '\n');
+    if (idx->scanned == offset) {
+      break;
+    }
+
+    if (idx->nnewlines == idx->size) {
+      size_t new_size = (idx->size == 0) ? INIT_NEWLINES : idx->size * 2;
+      void *tmp = tscfg_realloc(idx->newlines,
+                                sizeof(idx->newlines[0]) * new_size);
+      TSCFG_CHECK_MALLOC(tmp);
+
+      idx->newlines = tmp;
+      idx->size = new_size;
+    }
+    idx->newlines[idx->nnewlines++] = idx->scanned++;
+  }
+
+  // Binary search for first newline at or after offset
+  size_t lo = 0, hi = idx->nnewlines;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->newlines[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  size_t line_start = (lo > 0) ? idx->newlines[lo - 1] + 1 : 0;
+  *nlines = lo;
+  *nchars = count_chars(&text[line_start], offset - line_start);
+  return TSCFG_OK;
+}
+
+void tscfg_line_count(const unsigned char *text, size_t len,
+                      size_t *nlines, size_t *nchars) {
+  *nlines = tscfg_scan_count(text, len, '\n');
+
+  size_t line_start = len;
+  while (line_start > 0 && text[line_start - 1] != '\n') {
+    line_start--;
+  }
+  *nchars = count_chars(&text[line_start], len - line_start);
+}
+
+tscfg_rc tsconfig_lines_new(const char *text, size_t len,
+                            tsconfig_lines **lines) {
+  tsconfig_lines *l = tscfg_malloc(sizeof(tsconfig_lines));
+  TSCFG_CHECK_MALLOC(l);
+
+  l->text = (const unsigned char*)text;
+  l->len = len;
+  l->idx = TSCFG_EMPTY_LINE_INDEX;
+  *lines = l;
+  return TSCFG_OK;
+}
+
+tscfg_rc tsconfig_lines_find(tsconfig_lines *lines, size_t offset,
+                             int *line, int *col) {
+  if (offset > lines->len) {
+    REPORT_ERR("Offset %zu is past end of text of length %zu", offset,
+               lines->len);
+    return TSCFG_ERR_ARG;
+  }
+
+  size_t nlines, nchars;
+  tscfg_rc rc = tscfg_line_index_find(&lines->idx, lines->text, offset,
+                                      &nlines, &nchars);
+  TSCFG_CHECK(rc);
+
+  *line = (int)nlines + 1;
+  *col = (int)nchars + 1;
+  return TSCFG_OK;
+}
+
+void tsconfig_lines_free(tsconfig_lines *lines) {
+  tscfg_line_index_free(&lines->idx);
+  tscfg_free(lines);
+}
+
+/*
+ * Count UTF-8 characters by their first bytes, i.e. all bytes but
+ * continuation bytes 10xx xxxx.
+ */
+static size_t count_chars(const unsigned char *p, size_t len) {
+  size_t chars = 0;
+  for (size_t i = 0; i < len; i++) {
+    chars += ((p[i] & 0xC0) != 0x80);
+  }
+  return chars;
+}
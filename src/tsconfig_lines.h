@@ -0,0 +1,73 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Line and column numbers of byte offsets in input.
+ *
+ * Tokens only record byte offsets, so that nothing is counted while
+ * lexing.  Lines are found when a location is needed, e.g. to report an
+ * error, by an index of newlines built up to the offset asked for.
+ */
+
+#ifndef __TSCONFIG_LINES_H
+#define __TSCONFIG_LINES_H
+
+#include <stddef.h>
+
+#include "tsconfig_common.h"
+
+typedef struct {
+  size_t *newlines; // Offsets of newlines in text, ascending
+  size_t nnewlines;
+  size_t size;
+  size_t scanned; // Length of start of text that newlines were found in
+} tscfg_line_index;
+
+static const tscfg_line_index TSCFG_EMPTY_LINE_INDEX = {
+  .newlines = NULL, .nnewlines = 0, .size = 0, .scanned = 0
+};
+
+/*
+ * Free memory and reset index to empty.
+ */
+void tscfg_line_index_free(tscfg_line_index *idx);
+
+/*
+ * Forget newlines found, e.g. if text moved, but keep memory.
+ */
+void tscfg_line_index_clear(tscfg_line_index *idx);
+
+/*
+ * Find location of offset in text, adding newlines to index as needed.
+ * text: same text for all calls, with at least offset bytes
+ * nlines: set to number of newlines before offset
+ * nchars: set to number of UTF-8 characters between last newline, or
+ *         start of text, and offset
+ */
+tscfg_rc tscfg_line_index_find(tscfg_line_index *idx,
+          const unsigned char *text, size_t offset, size_t *nlines,
+          size_t *nchars);
+
+/*
+ * Count lines in text without an index, for text that is only needed
+ * once.  Arguments are as for tscfg_line_index_find() with offset len.
+ */
+void tscfg_line_count(const unsigned char *text, size_t len,
+                      size_t *nlines, size_t *nchars);
+
+#endif // __TSCONFIG_LINES_H
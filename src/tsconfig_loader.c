@@ -0,0 +1,243 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Loading config from several files, reusing files that didn't change.
+ *
+ * Files are got from the include cache, which only parses a file again
+ * if it or a file it includes changed.  So if the cache returns the same
+ * files as last time, nothing changed.  Otherwise the unmerged trees for
+ * the files are spliced together in order, as if they were included by
+ * an empty file, then merged and resolved.
+ */
+
+// Needed for strdup
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsconfig.h"
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_include.h"
+#include "tsconfig_pool.h"
+#include "tsconfig_stats.h"
+#include "tsconfig_tree_reader.h"
+
+struct tsconfig_loader {
+  char **paths;
+  int npaths;
+
+  // Files from last load, NULL if missing, or NULL array if not loaded
+  tscfg_include **incs;
+};
+
+static tscfg_rc get_files(tsconfig_loader *loader, tscfg_pool *pool,
+                          tscfg_include **incs);
+static tscfg_rc join_files(tscfg_include **incs, int nincs,
+                           tsconfig_tree *tree);
+static void release_files(tscfg_include **incs, int nincs);
+
+tscfg_rc tsconfig_loader_new(const char *const *paths, int npaths,
+                             tsconfig_loader **loader) {
+  if (npaths < 0) {
+    REPORT_ERR("Invalid number of paths %i", npaths);
+    return TSCFG_ERR_ARG;
+  }
+
+  // Keeps references to cached files, so use malloc like the cache
+  tsconfig_loader *l = malloc(sizeof(tsconfig_loader));
+  TSCFG_CHECK_MALLOC(l);
+
+  l->npaths = 0;
+  l->incs = NULL;
+  l->paths = malloc(sizeof(l->paths[0]) * (size_t)(npaths > 0 ? npaths : 1));
+  if (l->paths == NULL) {
+    tsconfig_loader_free(l);
+    return TSCFG_ERR_OOM;
+  }
+
+  for (int i = 0; i < npaths; i++) {
+    l->paths[i] = strdup(paths[i]);
+    if (l->paths[i] == NULL) {
+      tsconfig_loader_free(l);
+      return TSCFG_ERR_OOM;
+    }
+    l->npaths++;
+  }
+
+  *loader = l;
+  return TSCFG_OK;
+}
+
+void tsconfig_loader_free(tsconfig_loader *loader) {
+  if (loader == NULL) {
+    return;
+  }
+
+  if (loader->incs != NULL) {
+    release_files(loader->incs, loader->npaths);
+    free(loader->incs);
+  }
+  for (int i = 0; i < loader->npaths; i++) {
+    free(loader->paths[i]);
+  }
+  free(loader->paths);
+  free(loader);
+}
+
+tscfg_rc tsconfig_loader_load(tsconfig_loader *loader,
+      const tsconfig_parse_opts *opts, bool *changed, tsconfig_tree *cfg) {
+  static const tsconfig_parse_opts default_opts = { 0 };
+  if (opts == NULL) {
+    opts = &default_opts;
+  }
+
+  if (opts->threads < 0) {
+    REPORT_ERR("Invalid number of threads %i", opts->threads);
+    return TSCFG_ERR_ARG;
+  }
+
+  if (opts->npaths != 0) {
+    REPORT_ERR("Paths are not supported by loader");
+    return TSCFG_ERR_ARG;
+  }
+
+  if (opts->stats != NULL) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+  }
+
+  tscfg_include **incs = malloc(sizeof(incs[0]) *
+                                (size_t)(loader->npaths > 0 ? loader->npaths
+                                                            : 1));
+  TSCFG_CHECK_MALLOC(incs);
+
+  // Pool loads files included by changed files in parallel
+  tscfg_pool *pool = NULL;
+  tscfg_rc rc = tscfg_pool_new(opts->threads, &pool);
+  TSCFG_CHECK_GOTO(rc, cleanup_incs);
+
+  rc = get_files(loader, pool, incs);
+  if (pool != NULL) {
+    tscfg_pool_free(pool);
+  }
+  TSCFG_CHECK_GOTO(rc, cleanup_incs);
+
+  if (loader->incs != NULL &&
+      memcmp(incs, loader->incs, sizeof(incs[0]) *
+                                 (size_t)loader->npaths) == 0) {
+    release_files(incs, loader->npaths);
+    free(incs);
+    *changed = false;
+    return TSCFG_OK;
+  }
+
+  // Tree is from allocator, but files are cached with malloc
+  const tscfg_allocator *prev = tscfg_alloc_use(opts->alloc);
+  tsconfig_tree tree;
+  rc = join_files(incs, loader->npaths, &tree);
+  if (rc == TSCFG_OK) {
+    rc = tscfg_finish_tree(&tree, opts->stats);
+  }
+  tscfg_alloc_use(prev);
+  if (rc != TSCFG_OK) {
+    release_files(incs, loader->npaths);
+    goto cleanup_incs;
+  }
+
+  if (loader->incs != NULL) {
+    release_files(loader->incs, loader->npaths);
+    free(loader->incs);
+  }
+  loader->incs = incs;
+
+  *changed = true;
+  *cfg = tree;
+  return TSCFG_OK;
+
+cleanup_incs:
+  free(incs);
+  return rc;
+}
+
+/*
+ * Get cached file for each path, parsing files that changed.
+ * incs: filled in with references to files, NULL for missing files
+ */
+static tscfg_rc get_files(tsconfig_loader *loader, tscfg_pool *pool,
+                          tscfg_include **incs) {
+  for (int i = 0; i < loader->npaths; i++) {
+    tscfg_rc rc = tscfg_include_get(loader->paths[i], 0, pool, &incs[i]);
+    if (rc == TSCFG_ERR_NOT_FOUND) {
+      incs[i] = NULL;
+    } else if (rc != TSCFG_OK) {
+      REPORT_ERR("Error loading %s", loader->paths[i]);
+      release_files(incs, i);
+      return rc;
+    }
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Join unmerged trees for files into one unmerged tree, in order.
+ */
+static tscfg_rc join_files(tscfg_include **incs, int nincs,
+                           tsconfig_tree *tree) {
+  tscfg_batch_reader reader;
+  tscfg_treeread_state *state;
+  tscfg_rc rc = tscfg_tree_reader_init(&reader, &state);
+  TSCFG_CHECK(rc);
+
+  rc = tscfg_tree_reader_set_file(state, NULL, 0, NULL);
+  TSCFG_CHECK_GOTO(rc, error);
+
+  tscfg_event ev = { .tag = TSCFG_EV_OBJ_START };
+  if (!reader.events(state, &ev, 1)) {
+    rc = tscfg_tree_reader_err(state);
+    goto error;
+  }
+
+  for (int i = 0; i < nincs; i++) {
+    if (incs[i] != NULL) {
+      rc = tscfg_tree_reader_splice(state, tscfg_include_tree(incs[i]));
+      TSCFG_CHECK_GOTO(rc, error);
+    }
+  }
+
+  ev.tag = TSCFG_EV_OBJ_END;
+  if (!reader.events(state, &ev, 1)) {
+    rc = tscfg_tree_reader_err(state);
+    goto error;
+  }
+
+  return tscfg_tree_reader_done(state, tree);
+
+error:
+  tscfg_tree_reader_free(state);
+  return rc;
+}
+
+static void release_files(tscfg_include **incs, int nincs) {
+  for (int i = 0; i < nincs; i++) {
+    if (incs[i] != NULL) {
+      tscfg_include_release(incs[i]);
+    }
+  }
+}
@@ -0,0 +1,1066 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Merge duplicate keys in tree according to HOCON rules.
+ *
+ * The merged tape is written out in one pass over the source tape.  The
+ * keys of each object, gathered from all definitions of the object, are
+ * sorted by (key, orig_ix) with a stable merge sort, then each run of
+ * matching keys is merged:
+ * - An object value is merged with preceding object values.
+ * - Any other value overrides preceding values.
+ * - a += b appends b to the preceding array value.
+ * Concatenations of only objects or only arrays are merged or
+ * concatenated in the same way.  If the type of a definition depends on
+ * substitutions, e.g. a = ${x} followed by a { y = 1 }, definitions from
+ * the last one that overrides all others are kept in a MERGE value, to be
+ * combined by tscfg_tree_resolve() with the same rules.
+ *
+ * A self-referential substitution, e.g. path = ${path}":/opt/bin", refers
+ * to the previous value of the key, so the merged previous definitions
+ * are spliced in place of the substitution.  Other substitutions are
+ * left for tscfg_tree_resolve().
+ *
+ * Scratch space for keys and sources is managed as stacks that are reused
+ * across the whole tree, so memory is only allocated as they grow.
+ * Pending work on nested objects, arrays and definitions is kept on a
+ * stack of frames in the same way, rather than on the C stack, so that
+ * deeply nested values can be merged on threads with small stacks.
+ */
+
+#include "tsconfig_tree.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_stats.h"
+
+// Merge sort switches to insertion sort below this size
+#define INSERTION_SORT_MAX 16
+
+#define INIT_STACK_SIZE 64
+
+/*
+ * Key of object, with cached prefix to avoid comparing strings.
+ * Position in array before sorting is the original index.
+ */
+typedef struct {
+  uint64_t prefix; // First 8 bytes of key, big endian, zero padded
+  size_t key_ix; // Tape index of key
+} merge_key;
+
+/*
+ * Kinds of pending work.  Ranges are of the keys array for definitions,
+ * otherwise of the source tape.
+ */
+typedef enum {
+  FRAME_OBJ, // Merge each run of matching keys, then close object
+  FRAME_DEFS, // merge_defs() for range
+  FRAME_DEF_RUNS, // merge_known() for each value to combine once resolved
+  FRAME_APPENDS, // merge_appends() for range
+  FRAME_APPEND_ARR, // Emit array of values appended in range
+  FRAME_DEF_VALS, // Emit each value appended in range
+  FRAME_ELEMS, // Emit each value in range
+  FRAME_ARR_ELEMS, // Emit elements of each array in range
+  FRAME_BASE_ELEMS, // Emit each value in range, splicing self-references
+  FRAME_CLOSE, // Emit end of container
+  FRAME_POP_PATH, // Pop key from path
+} merge_frame_kind;
+
+typedef struct {
+  merge_frame_kind kind;
+  size_t next; // Next index in range to process
+  size_t end; // End of range
+
+  /*
+   * Range of keys array with previous definitions of current key.  For
+   * FRAME_OBJ, prev_start is the start of the object's keys instead.
+   */
+  size_t prev_start;
+  size_t prev_end;
+
+  size_t out; // Merged tape index of container start
+} merge_frame;
+
+typedef struct {
+  const tsconfig_tree *tree;
+
+  // Merged tape
+  tscfg_tape_entry *tape;
+  size_t tape_len;
+  size_t tape_size;
+  size_t nobjs;
+
+  // Stack of keys of objects being merged, plus space for sorting
+  merge_key *keys;
+  size_t nkeys;
+  size_t keys_size;
+
+  // Stack of tape indices of values being merged
+  size_t *srcs;
+  size_t nsrcs;
+  size_t srcs_size;
+
+  // Tape indices of keys in path from root to current value
+  size_t *path;
+  size_t npath;
+  size_t path_size;
+
+  // Stack of pending work
+  merge_frame *frames;
+  size_t nframes;
+  size_t frames_size;
+
+  // Stats to collect into, or NULL
+  tsconfig_stats *stats;
+} merge_state;
+
+static tscfg_rc run_frames(merge_state *ms);
+static tscfg_rc push_frame(merge_state *ms, merge_frame f);
+static tscfg_rc open_container(merge_state *ms, tscfg_tape_tag tag);
+static tscfg_tape_tag close_tag(tscfg_tape_tag tag);
+static tscfg_rc merge_objs(merge_state *ms, size_t src_start);
+static size_t key_run_end(merge_state *ms, size_t start, size_t end);
+static tscfg_rc merge_key_run(merge_state *ms, size_t start, size_t end);
+static tscfg_rc merge_defs(merge_state *ms, size_t start, size_t end);
+static size_t def_run_end(merge_state *ms, size_t start, size_t end);
+static tscfg_rc merge_appends(merge_state *ms, size_t prev_start,
+                              size_t start, size_t end);
+static tscfg_rc merge_known(merge_state *ms, size_t prev_start,
+                            size_t start, size_t end);
+static bool self_ref(merge_state *ms, size_t sub_ix);
+static bool has_self_ref(merge_state *ms, size_t ix);
+static tscfg_rc copy_sub(merge_state *ms, size_t ix, size_t start,
+                         size_t end);
+static tscfg_rc copy_base_val(merge_state *ms, size_t ix, size_t start,
+                              size_t end);
+static tscfg_rc copy_base_elem(merge_state *ms, size_t ix, size_t start,
+                               size_t end);
+static tscfg_rc copy_val(merge_state *ms, size_t ix);
+static tscfg_rc copy_arr_elems(merge_state *ms, size_t ix);
+
+static tscfg_rc push_obj_srcs(merge_state *ms, size_t ix);
+static tscfg_rc push_src(merge_state *ms, size_t ix);
+static tscfg_rc reserve_keys(merge_state *ms, size_t n);
+
+static void sort_keys(merge_state *ms, merge_key *keys, merge_key *tmp,
+                      size_t n);
+static int key_cmp(const char *s1, size_t l1, const char *s2, size_t l2);
+
+static tscfg_rc grow_array(void **arr, size_t *size, size_t elem_size,
+                           size_t min_size);
+
+tscfg_rc tscfg_tree_merge(tsconfig_tree *tree) {
+  tscfg_rc rc;
+
+  merge_state ms = { .tree = tree, .stats = tscfg_stats_current() };
+
+  tscfg_tape_tag root_tag = tscfg_tape_get_tag(tree->tape[0]);
+  if (root_tag == TSCFG_TAPE_OBJ) {
+    rc = push_src(&ms, 0);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+
+    rc = merge_objs(&ms, 0);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+  } else {
+    rc = copy_val(&ms, 0);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+  }
+
+  rc = run_frames(&ms);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  assert(ms.nkeys == 0 && ms.nsrcs == 0 && ms.npath == 0);
+
+  tscfg_free(tree->tape);
+  tree->tape = ms.tape;
+  tree->tape_len = ms.tape_len;
+  tree->nobjs = ms.nobjs;
+  tscfg_free(tree->objs); // Index is out of date
+  tree->objs = NULL;
+  tree->index_len = 0;
+  ms.tape = NULL;
+
+  rc = TSCFG_OK;
+cleanup:
+  tscfg_free(ms.tape);
+  tscfg_free(ms.keys);
+  tscfg_free(ms.srcs);
+  tscfg_free(ms.path);
+  tscfg_free(ms.frames);
+  return rc;
+}
+
+static inline tscfg_tape_tag src_tag(merge_state *ms, size_t ix) {
+  return tscfg_tape_get_tag(ms->tree->tape[ix]);
+}
+
+/*
+ * Index of tape entry after value at ix.
+ */
+static inline size_t src_end(merge_state *ms, size_t ix) {
+  return tscfg_val_end((tscfg_val){ .tree = ms->tree, .ix = ix });
+}
+
+/*
+ * Index of end entry of container at ix.
+ */
+static inline size_t src_close(merge_state *ms, size_t ix) {
+  return ix + tscfg_tape_get_payload(ms->tree->tape[ix]);
+}
+
+static inline tscfg_rc emit(merge_state *ms, tscfg_tape_entry e) {
+  if (ms->tape_len == ms->tape_size) {
+    tscfg_rc rc = grow_array((void**)&ms->tape, &ms->tape_size,
+                             sizeof(ms->tape[0]), ms->tape_len + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  ms->tape[ms->tape_len++] = e;
+  return TSCFG_OK;
+}
+
+/*
+ * Emit end of container, filling in offset in start entry.
+ */
+static tscfg_rc emit_close(merge_state *ms, size_t start,
+                      tscfg_tape_tag start_tag, tscfg_tape_tag end_tag) {
+  uint64_t off = ms->tape_len - start;
+  ms->tape[start] = tscfg_tape_make(start_tag, off);
+
+  uint64_t payload = (start_tag == TSCFG_TAPE_OBJ) ? ms->nobjs++ : off;
+  return emit(ms, tscfg_tape_make(end_tag, payload));
+}
+
+/*
+ * Whether value is a concatenation of values all with tag, ignoring
+ * whitespace.
+ */
+static bool concat_of(merge_state *ms, size_t ix, tscfg_tape_tag tag) {
+  if (src_tag(ms, ix) != TSCFG_TAPE_CONCAT) {
+    return false;
+  }
+
+  size_t end = src_close(ms, ix);
+  for (size_t e = ix + 1; e < end; e = src_end(ms, e)) {
+    tscfg_tape_tag t = src_tag(ms, e);
+    if (t != tag && t != TSCFG_TAPE_WS) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline bool obj_like(merge_state *ms, size_t ix) {
+  return src_tag(ms, ix) == TSCFG_TAPE_OBJ ||
+         concat_of(ms, ix, TSCFG_TAPE_OBJ);
+}
+
+static inline bool arr_like(merge_state *ms, size_t ix) {
+  return src_tag(ms, ix) == TSCFG_TAPE_ARR ||
+         concat_of(ms, ix, TSCFG_TAPE_ARR);
+}
+
+/*
+ * Whether type of value depends on substitutions, so it can't be merged
+ * with other definitions until they are resolved.
+ */
+static bool type_unknown(merge_state *ms, size_t ix) {
+  tscfg_tape_tag tag = src_tag(ms, ix);
+  if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+    return true;
+  } else if (tag != TSCFG_TAPE_CONCAT) {
+    return false;
+  }
+
+  size_t end = src_close(ms, ix);
+  for (size_t e = ix + 1; e < end; e = src_end(ms, e)) {
+    tag = src_tag(ms, e);
+    if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Whether value could be an array once substitutions are resolved.
+ */
+static inline bool maybe_arr(merge_state *ms, size_t ix) {
+  tscfg_tape_tag tag = src_tag(ms, ix);
+  return tag == TSCFG_TAPE_ARR || tag == TSCFG_TAPE_CONCAT ||
+         tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT;
+}
+
+static inline const char *key_str(merge_state *ms, size_t key_ix,
+                                  size_t *len) {
+  return tscfg_tape_str(ms->tree, ms->tree->tape[key_ix], len);
+}
+
+static uint64_t key_prefix(const char *str, size_t len) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < 8; i++) {
+    prefix <<= 8;
+    if (i < len) {
+      prefix |= (unsigned char)str[i];
+    }
+  }
+  return prefix;
+}
+
+/*
+ * Run frames on stack until it is empty.
+ */
+static tscfg_rc run_frames(merge_state *ms) {
+  tscfg_rc rc;
+
+  while (ms->nframes > 0) {
+    /*
+     * Advance frame before running step, since step may push frames and
+     * reallocate stack.
+     */
+    merge_frame *top = &ms->frames[ms->nframes - 1];
+    merge_frame f = *top;
+    bool done = f.next >= f.end;
+    if (done || f.kind == FRAME_DEFS || f.kind == FRAME_APPENDS ||
+        f.kind == FRAME_APPEND_ARR || f.kind == FRAME_CLOSE ||
+        f.kind == FRAME_POP_PATH) {
+      ms->nframes--;
+    }
+
+    switch (f.kind) {
+      case FRAME_OBJ:
+        if (done) {
+          ms->nkeys = f.prev_start;
+          rc = emit_close(ms, f.out, TSCFG_TAPE_OBJ, TSCFG_TAPE_OBJ_END);
+        } else {
+          top->next = key_run_end(ms, f.next, f.end);
+          rc = merge_key_run(ms, f.next, top->next);
+        }
+        break;
+
+      case FRAME_DEF_RUNS:
+        if (done) {
+          rc = TSCFG_OK;
+        } else {
+          top->next = def_run_end(ms, f.next, f.end);
+          rc = merge_known(ms, f.prev_start, f.next, top->next);
+        }
+        break;
+
+      case FRAME_DEF_VALS:
+        if (done) {
+          rc = TSCFG_OK;
+        } else {
+          top->next = f.next + 1;
+          rc = copy_val(ms, ms->keys[f.next].key_ix + 1);
+        }
+        break;
+
+      case FRAME_ELEMS:
+        if (done) {
+          rc = TSCFG_OK;
+        } else {
+          top->next = src_end(ms, f.next);
+          rc = copy_val(ms, f.next);
+        }
+        break;
+
+      case FRAME_ARR_ELEMS:
+        if (done) {
+          rc = TSCFG_OK;
+        } else {
+          // Whitespace between arrays is dropped
+          top->next = src_end(ms, f.next);
+          rc = (src_tag(ms, f.next) == TSCFG_TAPE_ARR) ?
+               copy_arr_elems(ms, f.next) : TSCFG_OK;
+        }
+        break;
+
+      case FRAME_BASE_ELEMS:
+        if (done) {
+          rc = TSCFG_OK;
+        } else {
+          top->next = src_end(ms, f.next);
+          rc = copy_base_elem(ms, f.next, f.prev_start, f.prev_end);
+        }
+        break;
+
+      case FRAME_DEFS:
+        rc = merge_defs(ms, f.next, f.end);
+        break;
+
+      case FRAME_APPENDS:
+        rc = merge_appends(ms, f.prev_start, f.next, f.end);
+        break;
+
+      case FRAME_APPEND_ARR:
+        rc = open_container(ms, TSCFG_TAPE_ARR);
+        if (rc == TSCFG_OK) {
+          rc = push_frame(ms, (merge_frame){ .kind = FRAME_DEF_VALS,
+              .next = f.next, .end = f.end });
+        }
+        break;
+
+      case FRAME_CLOSE: {
+        tscfg_tape_tag tag = tscfg_tape_get_tag(ms->tape[f.out]);
+        rc = emit_close(ms, f.out, tag, close_tag(tag));
+        break;
+      }
+
+      case FRAME_POP_PATH:
+        ms->npath--;
+        rc = TSCFG_OK;
+        break;
+
+      default:
+        assert(false);
+        rc = TSCFG_ERR_UNKNOWN;
+        break;
+    }
+    TSCFG_CHECK(rc);
+  }
+  return TSCFG_OK;
+}
+
+static tscfg_rc push_frame(merge_state *ms, merge_frame f) {
+  if (ms->nframes == ms->frames_size) {
+    tscfg_rc rc = grow_array((void**)&ms->frames, &ms->frames_size,
+                             sizeof(ms->frames[0]), ms->nframes + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  ms->frames[ms->nframes++] = f;
+  return TSCFG_OK;
+}
+
+/*
+ * Emit start of container and push frame to close it once frames pushed
+ * after it are done.
+ */
+static tscfg_rc open_container(merge_state *ms, tscfg_tape_tag tag) {
+  size_t start = ms->tape_len;
+  tscfg_rc rc = emit(ms, tscfg_tape_make(tag, 0));
+  TSCFG_CHECK(rc);
+
+  return push_frame(ms, (merge_frame){ .kind = FRAME_CLOSE, .out = start });
+}
+
+static tscfg_tape_tag close_tag(tscfg_tape_tag tag) {
+  switch (tag) {
+    case TSCFG_TAPE_ARR:
+      return TSCFG_TAPE_ARR_END;
+    case TSCFG_TAPE_CONCAT:
+      return TSCFG_TAPE_CONCAT_END;
+    default:
+      assert(tag == TSCFG_TAPE_MERGE);
+      return TSCFG_TAPE_MERGE_END;
+  }
+}
+
+/*
+ * Start merging all objects on source stack from src_start to top into a
+ * single object: emit start of object and push frame to merge its keys.
+ * Pops sources from stack.
+ */
+static tscfg_rc merge_objs(merge_state *ms, size_t src_start) {
+  tscfg_rc rc;
+
+  // Gather keys of all objects in definition order
+  size_t keys_start = ms->nkeys;
+  for (size_t s = src_start; s < ms->nsrcs; s++) {
+    size_t obj_ix = ms->srcs[s];
+    size_t end = src_close(ms, obj_ix);
+    for (size_t ix = obj_ix + 1; ix < end; ix = src_end(ms, ix + 1)) {
+      rc = reserve_keys(ms, 1);
+      TSCFG_CHECK(rc);
+
+      size_t len;
+      const char *str = key_str(ms, ix, &len);
+      ms->keys[ms->nkeys++] = (merge_key){ .prefix = key_prefix(str, len),
+                                           .key_ix = ix };
+    }
+  }
+  ms->nsrcs = src_start;
+
+  size_t n = ms->nkeys - keys_start;
+  rc = reserve_keys(ms, n);
+  TSCFG_CHECK(rc);
+  sort_keys(ms, &ms->keys[keys_start], &ms->keys[ms->nkeys], n);
+
+  size_t obj_start = ms->tape_len;
+  rc = emit(ms, tscfg_tape_make(TSCFG_TAPE_OBJ, 0));
+  TSCFG_CHECK(rc);
+
+  // Keys stay on stack until frame is done
+  return push_frame(ms, (merge_frame){ .kind = FRAME_OBJ,
+      .next = keys_start, .end = ms->nkeys, .prev_start = keys_start,
+      .out = obj_start });
+}
+
+/*
+ * End of run of matching keys from start.
+ */
+static size_t key_run_end(merge_state *ms, size_t start, size_t end) {
+  size_t len;
+  const char *str = key_str(ms, ms->keys[start].key_ix, &len);
+
+  size_t run_end = start + 1;
+  while (run_end < end) {
+    merge_key *k = &ms->keys[run_end];
+    size_t len2;
+    const char *str2 = key_str(ms, k->key_ix, &len2);
+    if (k->prefix != ms->keys[start].prefix ||
+        key_cmp(str, len, str2, len2) != 0) {
+      break;
+    }
+    run_end++;
+  }
+  return run_end;
+}
+
+/*
+ * Emit key and start merging all its definitions.
+ * start, end: range of keys array, in definition order
+ */
+static tscfg_rc merge_key_run(merge_state *ms, size_t start, size_t end) {
+  tscfg_rc rc;
+
+  if (ms->npath == ms->path_size) {
+    rc = grow_array((void**)&ms->path, &ms->path_size, sizeof(ms->path[0]),
+                    ms->npath + 1);
+    TSCFG_CHECK(rc);
+  }
+  ms->path[ms->npath++] = ms->keys[start].key_ix;
+  TSCFG_STAT(ms->stats, ms->stats->merge_collisions += end - start - 1);
+
+  rc = emit(ms, tscfg_tape_make(TSCFG_TAPE_KEY,
+            tscfg_tape_get_payload(ms->tree->tape[ms->keys[end - 1].key_ix])));
+  TSCFG_CHECK(rc);
+
+  rc = push_frame(ms, (merge_frame){ .kind = FRAME_POP_PATH });
+  TSCFG_CHECK(rc);
+
+  return merge_defs(ms, start, end);
+}
+
+static inline bool is_append(merge_state *ms, size_t k) {
+  return src_tag(ms, ms->keys[k].key_ix) == TSCFG_TAPE_KEY_APPEND;
+}
+
+/*
+ * Start merging definitions for current key.
+ * start, end: range of keys array, in definition order
+ */
+static tscfg_rc merge_defs(merge_state *ms, size_t start, size_t end) {
+  tscfg_rc rc;
+
+  /*
+   * Find last definition that overrides all previous ones: a value other
+   * than an object, or appends to a value of unknown type, which must be
+   * an array.
+   */
+  size_t cut = start, cut_end = start;
+  bool after_unknown = false;
+  for (size_t k = start; k < end; k++) {
+    size_t val_ix = ms->keys[k].key_ix + 1;
+    if (is_append(ms, k)) {
+      if (after_unknown) {
+        cut = k;
+        while (k + 1 < end && is_append(ms, k + 1)) {
+          k++;
+        }
+        cut_end = k + 1;
+        after_unknown = false;
+      }
+    } else if (type_unknown(ms, val_ix)) {
+      if (has_self_ref(ms, val_ix)) {
+        // Previous definitions are spliced into value
+        cut = cut_end = k;
+      }
+      after_unknown = true;
+    } else if (obj_like(ms, val_ix)) {
+      after_unknown = false;
+    } else {
+      cut = cut_end = k;
+      after_unknown = false;
+    }
+  }
+
+  // Count values to be combined once resolved
+  size_t nvals = (cut_end > cut) ? 1 : 0;
+  bool unknown = false;
+  for (size_t k = cut_end; k < end; k++) {
+    bool k_unknown = !is_append(ms, k) &&
+                     type_unknown(ms, ms->keys[k].key_ix + 1);
+    if (k_unknown || k == cut_end || unknown) {
+      nvals++;
+    }
+    unknown = k_unknown;
+  }
+
+  if (cut_end == cut && nvals <= 1) {
+    // Only the value at cut and known values after it
+    return merge_known(ms, start, start, end);
+  }
+
+  if (nvals > 1) {
+    rc = open_container(ms, TSCFG_TAPE_MERGE);
+    TSCFG_CHECK(rc);
+  }
+
+  // Frames run in reverse order: appends first, then other values
+  rc = push_frame(ms, (merge_frame){ .kind = FRAME_DEF_RUNS,
+      .next = cut_end, .end = end, .prev_start = start });
+  TSCFG_CHECK(rc);
+
+  if (cut_end > cut) {
+    rc = push_frame(ms, (merge_frame){ .kind = FRAME_APPENDS,
+        .next = cut, .end = cut_end, .prev_start = start });
+    TSCFG_CHECK(rc);
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * End of run of definitions from start that is one value to combine once
+ * resolved: a value of unknown type, or known values up to the next one.
+ */
+static size_t def_run_end(merge_state *ms, size_t start, size_t end) {
+  size_t run_end = start + 1;
+  if (!type_unknown(ms, ms->keys[start].key_ix + 1)) {
+    while (run_end < end && (is_append(ms, run_end) ||
+           !type_unknown(ms, ms->keys[run_end].key_ix + 1))) {
+      run_end++;
+    }
+  }
+  return run_end;
+}
+
+/*
+ * Start emitting appends to previous value of unknown type, which must be
+ * an array: the previous value concatenated with an array of the appended
+ * values.
+ * prev_start, start: range of keys array with previous definitions
+ * start, end: range of keys array with appends
+ */
+static tscfg_rc merge_appends(merge_state *ms, size_t prev_start,
+                              size_t start, size_t end) {
+  tscfg_rc rc = open_container(ms, TSCFG_TAPE_CONCAT);
+  TSCFG_CHECK(rc);
+
+  rc = push_frame(ms, (merge_frame){ .kind = FRAME_APPEND_ARR,
+      .next = start, .end = end });
+  TSCFG_CHECK(rc);
+
+  return push_frame(ms, (merge_frame){ .kind = FRAME_DEFS,
+      .next = prev_start, .end = start });
+}
+
+/*
+ * Merge definitions whose types are known, apart from the first, and
+ * start emitting merged value.
+ * prev_start, start: range of keys array with previous definitions, for
+ *                    self-references
+ * start, end: range of keys array to merge, in definition order
+ */
+static tscfg_rc merge_known(merge_state *ms, size_t prev_start,
+                            size_t start, size_t end) {
+  tscfg_rc rc;
+
+  enum { BASE_NONE, BASE_OBJS, BASE_VAL } base = BASE_NONE;
+  size_t base_ix = 0;
+  size_t base_k = start; // Definition of base_ix
+
+  // Values appended with += are all definitions from appends to end
+  size_t appends = end;
+
+  // Objects to merge if base is BASE_OBJS are pushed onto source stack
+  size_t src_start = ms->nsrcs;
+
+  for (size_t k = start; k < end; k++) {
+    size_t key_ix = ms->keys[k].key_ix;
+    size_t val_ix = key_ix + 1;
+
+    if (src_tag(ms, key_ix) == TSCFG_TAPE_KEY_APPEND) {
+      if (base == BASE_OBJS || (base == BASE_VAL &&
+                                !maybe_arr(ms, base_ix))) {
+        size_t len;
+        const char *str = key_str(ms, key_ix, &len);
+        REPORT_ERR("Cannot append with += to key \"%.*s\": previous value "
+                   "is not an array", (int)len, str);
+        // Leave stacks in consistent state
+        ms->nsrcs = src_start;
+        return TSCFG_ERR_INVALID;
+      }
+
+      if (appends == end) {
+        appends = k;
+      }
+    } else if (obj_like(ms, val_ix)) {
+      if (base != BASE_OBJS) {
+        // Overrides previous value, if any
+        ms->nsrcs = src_start;
+        base = BASE_OBJS;
+      }
+      rc = push_obj_srcs(ms, val_ix);
+      TSCFG_CHECK(rc);
+      appends = end;
+    } else {
+      // Overrides previous value, if any
+      ms->nsrcs = src_start;
+      base = BASE_VAL;
+      base_ix = val_ix;
+      base_k = k;
+      appends = end;
+    }
+  }
+
+  if (base == BASE_OBJS) {
+    return merge_objs(ms, src_start);
+  } else if (appends == end) {
+    assert(base == BASE_VAL);
+    return copy_base_val(ms, base_ix, prev_start, base_k);
+  }
+
+  /*
+   * Appended values.  If previous value isn't known to be an array,
+   * leave concatenation to be resolved later.  Frames run in reverse
+   * order of pushing.
+   */
+  if (base == BASE_VAL && !arr_like(ms, base_ix)) {
+    rc = open_container(ms, TSCFG_TAPE_CONCAT);
+    TSCFG_CHECK(rc);
+
+    rc = push_frame(ms, (merge_frame){ .kind = FRAME_APPEND_ARR,
+        .next = appends, .end = end });
+    TSCFG_CHECK(rc);
+
+    return copy_base_val(ms, base_ix, prev_start, base_k);
+  }
+
+  rc = open_container(ms, TSCFG_TAPE_ARR);
+  TSCFG_CHECK(rc);
+
+  rc = push_frame(ms, (merge_frame){ .kind = FRAME_DEF_VALS,
+      .next = appends, .end = end });
+  TSCFG_CHECK(rc);
+
+  if (base == BASE_VAL) {
+    return copy_arr_elems(ms, base_ix);
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Whether substitution refers to path of current value.
+ */
+static bool self_ref(merge_state *ms, size_t sub_ix) {
+  size_t end = src_close(ms, sub_ix);
+  if (end - sub_ix - 1 != ms->npath) {
+    return false;
+  }
+
+  for (size_t i = 0; i < ms->npath; i++) {
+    size_t l1, l2;
+    const char *s1 = key_str(ms, sub_ix + 1 + i, &l1);
+    const char *s2 = key_str(ms, ms->path[i], &l2);
+    if (key_cmp(s1, l1, s2, l2) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Whether value is a self-reference, or a concatenation containing one.
+ */
+static bool has_self_ref(merge_state *ms, size_t ix) {
+  tscfg_tape_tag tag = src_tag(ms, ix);
+  if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+    return self_ref(ms, ix);
+  } else if (tag != TSCFG_TAPE_CONCAT) {
+    return false;
+  }
+
+  size_t end = src_close(ms, ix);
+  for (size_t e = ix + 1; e < end; e = src_end(ms, e)) {
+    tag = src_tag(ms, e);
+    if ((tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) &&
+        self_ref(ms, e)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Emit substitution, or start merging previous definitions in its place
+ * if it is a self-reference.
+ * start, end: range of keys array with previous definitions
+ */
+static tscfg_rc copy_sub(merge_state *ms, size_t ix, size_t start,
+                         size_t end) {
+  if (end > start && self_ref(ms, ix)) {
+    TSCFG_STAT(ms->stats, ms->stats->subs++);
+    return push_frame(ms, (merge_frame){ .kind = FRAME_DEFS,
+        .next = start, .end = end });
+  }
+
+  // Self-reference with no previous value is left to be resolved from
+  // environment
+  return copy_val(ms, ix);
+}
+
+/*
+ * Start emitting value that may refer to previous definitions of current
+ * key.  Only substitutions that are the whole value or part of a
+ * concatenation are self-references: a substitution nested inside an
+ * object or array is a cycle.
+ * start, end: range of keys array with previous definitions
+ */
+static tscfg_rc copy_base_val(merge_state *ms, size_t ix, size_t start,
+                              size_t end) {
+  tscfg_tape_tag tag = src_tag(ms, ix);
+  if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+    return copy_sub(ms, ix, start, end);
+  } else if (tag != TSCFG_TAPE_CONCAT || obj_like(ms, ix) ||
+             arr_like(ms, ix)) {
+    return copy_val(ms, ix);
+  }
+
+  tscfg_rc rc = open_container(ms, TSCFG_TAPE_CONCAT);
+  TSCFG_CHECK(rc);
+
+  return push_frame(ms, (merge_frame){ .kind = FRAME_BASE_ELEMS,
+      .next = ix + 1, .end = src_close(ms, ix), .prev_start = start,
+      .prev_end = end });
+}
+
+/*
+ * Start emitting element of concatenation from copy_base_val().
+ */
+static tscfg_rc copy_base_elem(merge_state *ms, size_t ix, size_t start,
+                               size_t end) {
+  tscfg_tape_tag tag = src_tag(ms, ix);
+  if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+    return copy_sub(ms, ix, start, end);
+  }
+  return copy_val(ms, ix);
+}
+
+/*
+ * Start emitting value, merging any objects within it.  Scalars are
+ * emitted at once.
+ */
+static tscfg_rc copy_val(merge_state *ms, size_t ix) {
+  tscfg_rc rc;
+
+  switch (src_tag(ms, ix)) {
+    case TSCFG_TAPE_OBJ:
+      rc = push_src(ms, ix);
+      TSCFG_CHECK(rc);
+      return merge_objs(ms, ms->nsrcs - 1);
+
+    case TSCFG_TAPE_ARR:
+      rc = open_container(ms, TSCFG_TAPE_ARR);
+      TSCFG_CHECK(rc);
+      return copy_arr_elems(ms, ix);
+
+    case TSCFG_TAPE_CONCAT: {
+      if (obj_like(ms, ix)) {
+        size_t src_start = ms->nsrcs;
+        rc = push_obj_srcs(ms, ix);
+        TSCFG_CHECK(rc);
+        return merge_objs(ms, src_start);
+      } else if (arr_like(ms, ix)) {
+        rc = open_container(ms, TSCFG_TAPE_ARR);
+        TSCFG_CHECK(rc);
+        return copy_arr_elems(ms, ix);
+      }
+
+      rc = open_container(ms, TSCFG_TAPE_CONCAT);
+      TSCFG_CHECK(rc);
+      return push_frame(ms, (merge_frame){ .kind = FRAME_ELEMS,
+          .next = ix + 1, .end = src_close(ms, ix) });
+    }
+
+    default: {
+      // Scalars and substitutions are copied as-is
+      size_t end = src_end(ms, ix);
+      for (size_t e = ix; e < end; e++) {
+        rc = emit(ms, ms->tree->tape[e]);
+        TSCFG_CHECK(rc);
+      }
+      return TSCFG_OK;
+    }
+  }
+}
+
+/*
+ * Start emitting elements of array, or of concatenation of arrays.
+ */
+static tscfg_rc copy_arr_elems(merge_state *ms, size_t ix) {
+  bool concat = src_tag(ms, ix) == TSCFG_TAPE_CONCAT;
+  assert(concat || src_tag(ms, ix) == TSCFG_TAPE_ARR);
+  return push_frame(ms, (merge_frame){
+      .kind = concat ? FRAME_ARR_ELEMS : FRAME_ELEMS,
+      .next = ix + 1, .end = src_close(ms, ix) });
+}
+
+/*
+ * Push object, or objects in concatenation, onto source stack.
+ */
+static tscfg_rc push_obj_srcs(merge_state *ms, size_t ix) {
+  if (src_tag(ms, ix) == TSCFG_TAPE_OBJ) {
+    return push_src(ms, ix);
+  }
+
+  size_t end = src_close(ms, ix);
+  for (size_t e = ix + 1; e < end; e = src_end(ms, e)) {
+    if (src_tag(ms, e) == TSCFG_TAPE_OBJ) {
+      tscfg_rc rc = push_src(ms, e);
+      TSCFG_CHECK(rc);
+    }
+  }
+  return TSCFG_OK;
+}
+
+static tscfg_rc push_src(merge_state *ms, size_t ix) {
+  if (ms->nsrcs == ms->srcs_size) {
+    tscfg_rc rc = grow_array((void**)&ms->srcs, &ms->srcs_size,
+                             sizeof(ms->srcs[0]), ms->nsrcs + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  ms->srcs[ms->nsrcs++] = ix;
+  return TSCFG_OK;
+}
+
+/*
+ * Ensure there is room for n more keys past top of stack.
+ */
+static tscfg_rc reserve_keys(merge_state *ms, size_t n) {
+  if (n > ms->keys_size - ms->nkeys) {
+    TSCFG_COND(n <= SIZE_MAX - ms->nkeys, TSCFG_ERR_OOM);
+    return grow_array((void**)&ms->keys, &ms->keys_size,
+                      sizeof(ms->keys[0]), ms->nkeys + n);
+  }
+  return TSCFG_OK;
+}
+
+static inline int merge_key_cmp(merge_state *ms, const merge_key *k1,
+                                const merge_key *k2) {
+  if (k1->prefix != k2->prefix) {
+    return (k1->prefix < k2->prefix) ? -1 : 1;
+  }
+
+  size_t l1, l2;
+  const char *s1 = key_str(ms, k1->key_ix, &l1);
+  const char *s2 = key_str(ms, k2->key_ix, &l2);
+  if (l1 <= 8 || l2 <= 8) {
+    // Prefix covers all of shorter key
+    return (l1 == l2) ? 0 : ((l1 < l2) ? -1 : 1);
+  }
+  return key_cmp(s1 + 8, l1 - 8, s2 + 8, l2 - 8);
+}
+
+/*
+ * Stable merge sort by key, so that matching keys remain in original
+ * order.
+ * tmp: scratch space for n keys
+ */
+static void sort_keys(merge_state *ms, merge_key *keys, merge_key *tmp,
+                      size_t n) {
+  if (n <= INSERTION_SORT_MAX) {
+    for (size_t i = 1; i < n; i++) {
+      merge_key k = keys[i];
+      size_t j = i;
+      for (; j > 0 && merge_key_cmp(ms, &keys[j - 1], &k) > 0; j--) {
+        keys[j] = keys[j - 1];
+      }
+      keys[j] = k;
+    }
+    return;
+  }
+
+  size_t half = n / 2;
+  sort_keys(ms, keys, tmp, half);
+  sort_keys(ms, keys + half, tmp, n - half);
+
+  // Already in order, e.g. keys defined in sorted order
+  if (merge_key_cmp(ms, &keys[half - 1], &keys[half]) <= 0) {
+    return;
+  }
+
+  memcpy(tmp, keys, sizeof(keys[0]) * half);
+  size_t i = 0, j = half, out = 0;
+  while (i < half && j < n) {
+    // Take from left on ties for stability
+    if (merge_key_cmp(ms, &keys[j], &tmp[i]) < 0) {
+      keys[out++] = keys[j++];
+    } else {
+      keys[out++] = tmp[i++];
+    }
+  }
+  while (i < half) {
+    keys[out++] = tmp[i++];
+  }
+}
+
+/*
+ * Compare keys with explicit lengths.
+ */
+static int key_cmp(const char *s1, size_t l1, const char *s2, size_t l2) {
+  int result;
+  size_t min_len = (l1 < l2) ?  l1 : l2;
+  if ((result = memcmp(s1, s2, min_len)) != 0) {
+    return result;
+  } else if (l1 == l2) {
+    // Identical
+    return 0;
+  } else {
+    // One has trailing chars
+    return (l1 < l2) ? -1 : 1;
+  }
+}
+
+/*
+ * Grow array by doubling until it has at least min_size elements.
+ */
+static tscfg_rc grow_array(void **arr, size_t *size, size_t elem_size,
+                           size_t min_size) {
+  size_t new_size = (*size > 0) ? *size : INIT_STACK_SIZE;
+  while (new_size < min_size) {
+    TSCFG_COND(new_size <= SIZE_MAX / 2, TSCFG_ERR_OOM);
+    new_size *= 2;
+  }
+  TSCFG_COND(new_size <= SIZE_MAX / elem_size, TSCFG_ERR_OOM);
+
+  void *new_arr = tscfg_realloc(*arr, new_size * elem_size);
+  TSCFG_CHECK_MALLOC(new_arr);
+
+  *arr = new_arr;
+  *size = new_size;
+  return TSCFG_OK;
+}
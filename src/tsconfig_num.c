@@ -0,0 +1,430 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Decoding of numbers, and of HOCON durations and memory sizes.
+ */
+
+#include "tsconfig_num.h"
+
+#include <ctype.h>
+#include <float.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+
+// Largest mantissa that another digit can be added to without overflow
+#define MANT_MAX ((UINT64_MAX - 9) / 10)
+
+// Integers up to this are exact in a double
+#define DOUBLE_EXACT_MAX (UINT64_C(1) << 53)
+
+// Powers of ten up to this are exact in a double
+#define POW10_EXACT_MAX 22
+
+// Exponents are capped here so they can't overflow
+#define EXP_LIMIT 100000
+
+// Numbers up to this long are copied to the stack for strtod()
+#define STRTOD_BUF_SIZE 128
+
+typedef struct {
+  const char *name;
+  int64_t unit;
+} duration_unit;
+
+/*
+ * Duration units as in the HOCON spec.  Names longer than two characters
+ * can also be given without the final s, e.g. second.
+ */
+static const duration_unit duration_units[] = {
+  { "ns", INT64_C(1) },
+  { "nanos", INT64_C(1) },
+  { "nanoseconds", INT64_C(1) },
+  { "us", INT64_C(1000) },
+  { "micros", INT64_C(1000) },
+  { "microseconds", INT64_C(1000) },
+  { "ms", INT64_C(1000000) },
+  { "millis", INT64_C(1000000) },
+  { "milliseconds", INT64_C(1000000) },
+  { "s", INT64_C(1000000000) },
+  { "seconds", INT64_C(1000000000) },
+  { "m", INT64_C(60000000000) },
+  { "minutes", INT64_C(60000000000) },
+  { "h", INT64_C(3600000000000) },
+  { "hours", INT64_C(3600000000000) },
+  { "d", INT64_C(86400000000000) },
+  { "days", INT64_C(86400000000000) },
+};
+
+typedef struct {
+  const char *prefix; // Prefix of word, e.g. kilo in kilobytes
+  int64_t unit;
+  bool binary; // Power of 1024, rather than 1000
+} size_unit;
+
+/*
+ * Memory size units as in the HOCON spec.  Each unit can be written as a
+ * word, e.g. kibibytes, or abbreviated, e.g. K, k, Ki or KiB for binary
+ * prefixes and kB for decimal.  Larger units don't fit in 64 bits.
+ */
+static const size_unit size_units[] = {
+  { "", INT64_C(1), true },
+  { "kilo", INT64_C(1000), false },
+  { "mega", INT64_C(1000000), false },
+  { "giga", INT64_C(1000000000), false },
+  { "tera", INT64_C(1000000000000), false },
+  { "peta", INT64_C(1000000000000000), false },
+  { "exa", INT64_C(1000000000000000000), false },
+  { "kibi", INT64_C(1) << 10, true },
+  { "mebi", INT64_C(1) << 20, true },
+  { "gibi", INT64_C(1) << 30, true },
+  { "tebi", INT64_C(1) << 40, true },
+  { "pebi", INT64_C(1) << 50, true },
+  { "exbi", INT64_C(1) << 60, true },
+};
+
+// Powers of ten that are exact in a double
+static const double pow10_exact[POW10_EXACT_MAX + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool is_digit(char c);
+static inline void add_digit(uint64_t *mant, int64_t *exp10, bool *inexact,
+                             char c, bool frac);
+static bool exact_double(uint64_t mant, int64_t exp10, double *d);
+static tscfg_rc convert_strtod(const char *str, size_t len, double *d);
+static tscfg_rc split_units(const char *str, size_t len, tscfg_num *num,
+                            const char **unit, size_t *unit_len);
+static bool str_eq(const char *str, size_t len, const char *lit,
+                   size_t lit_len);
+static bool duration_unit_matches(const char *name, const char *str,
+                                  size_t len);
+static bool size_unit_matches(const size_unit *u, const char *str,
+                              size_t len);
+
+tscfg_rc tscfg_num_scan(const char *str, size_t len, size_t *used,
+                        tscfg_num *num) {
+  size_t i = 0;
+  bool neg = false;
+  if (i < len && (str[i] == '-' || str[i] == '+')) {
+    neg = (str[i] == '-');
+    i++;
+  }
+
+  // Significant digits, scaled by 10^exp10
+  uint64_t mant = 0;
+  int64_t exp10 = 0;
+  // True if non-zero digits didn't fit in mantissa
+  bool inexact = false;
+
+  size_t ndigits = 0;
+  for (; i < len && is_digit(str[i]); i++, ndigits++) {
+    add_digit(&mant, &exp10, &inexact, str[i], false);
+  }
+
+  bool is_int = true;
+  if (i < len && str[i] == '.') {
+    size_t j = i + 1;
+    for (; j < len && is_digit(str[j]); j++, ndigits++) {
+      add_digit(&mant, &exp10, &inexact, str[j], true);
+    }
+
+    if (ndigits > 0) {
+      i = j;
+      is_int = false;
+    }
+  }
+
+  if (ndigits == 0) {
+    *used = 0;
+    return TSCFG_OK;
+  }
+
+  // Exponent only if e is followed by digits, e.g. not in 10e for exabytes
+  if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+    size_t j = i + 1;
+    bool exp_neg = false;
+    if (j < len && (str[j] == '-' || str[j] == '+')) {
+      exp_neg = (str[j] == '-');
+      j++;
+    }
+
+    if (j < len && is_digit(str[j])) {
+      int64_t e = 0;
+      for (; j < len && is_digit(str[j]); j++) {
+        if (e < EXP_LIMIT) {
+          e = e * 10 + (str[j] - '0');
+        }
+      }
+
+      exp10 += exp_neg ? -e : e;
+      i = j;
+      is_int = false;
+    }
+  }
+
+  *used = i;
+
+  if (is_int && exp10 == 0) {
+    if (!neg && mant <= (uint64_t)INT64_MAX) {
+      num->is_int = true;
+      num->v.i = (int64_t)mant;
+      return TSCFG_OK;
+    } else if (neg && mant <= (uint64_t)INT64_MAX + 1) {
+      num->is_int = true;
+      num->v.i = (mant == (uint64_t)INT64_MAX + 1) ?
+                 INT64_MIN : -(int64_t)mant;
+      return TSCFG_OK;
+    }
+  }
+
+  num->is_int = false;
+  if (!inexact && exact_double(mant, exp10, &num->v.d)) {
+    if (neg) {
+      num->v.d = -num->v.d;
+    }
+    return TSCFG_OK;
+  }
+
+  // Too many digits or too large an exponent to round exactly here
+  return convert_strtod(str, i, &num->v.d);
+}
+
+tscfg_rc tscfg_num_scale(tscfg_num num, int64_t unit, int64_t *result) {
+  if (num.is_int) {
+    if (num.v.i > INT64_MAX / unit || num.v.i < INT64_MIN / unit) {
+      return TSCFG_ERR_TYPE;
+    }
+    *result = num.v.i * unit;
+    return TSCFG_OK;
+  }
+
+  double x = num.v.d * (double)unit;
+  // -2^63 is exact, so this also rejects infinity and NaN
+  if (!(x >= (double)INT64_MIN && x < -(double)INT64_MIN)) {
+    return TSCFG_ERR_TYPE;
+  }
+  *result = (int64_t)x;
+  return TSCFG_OK;
+}
+
+tscfg_rc tscfg_parse_duration(const char *str, size_t len, int64_t *ns) {
+  tscfg_num num;
+  const char *unit;
+  size_t unit_len;
+  tscfg_rc rc = split_units(str, len, &num, &unit, &unit_len);
+  if (rc != TSCFG_OK) {
+    return rc;
+  }
+
+  if (unit_len == 0) {
+    return tscfg_num_scale(num, TSCFG_NS_PER_MS, ns);
+  }
+
+  size_t nunits = sizeof(duration_units) / sizeof(duration_units[0]);
+  for (size_t i = 0; i < nunits; i++) {
+    if (duration_unit_matches(duration_units[i].name, unit, unit_len)) {
+      return tscfg_num_scale(num, duration_units[i].unit, ns);
+    }
+  }
+
+  return TSCFG_ERR_TYPE;
+}
+
+tscfg_rc tscfg_parse_size(const char *str, size_t len, int64_t *bytes) {
+  tscfg_num num;
+  const char *unit;
+  size_t unit_len;
+  tscfg_rc rc = split_units(str, len, &num, &unit, &unit_len);
+  if (rc != TSCFG_OK) {
+    return rc;
+  }
+
+  size_t nunits = sizeof(size_units) / sizeof(size_units[0]);
+  for (size_t i = 0; i < nunits; i++) {
+    if (size_unit_matches(&size_units[i], unit, unit_len)) {
+      return tscfg_num_scale(num, size_units[i].unit, bytes);
+    }
+  }
+
+  return TSCFG_ERR_TYPE;
+}
+
+static inline bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/*
+ * Add digit to mantissa, or to exponent if mantissa is full.
+ * frac: if true, digit is after decimal point
+ */
+static inline void add_digit(uint64_t *mant, int64_t *exp10, bool *inexact,
+                             char c, bool frac) {
+  if (*mant <= MANT_MAX) {
+    *mant = *mant * 10 + (uint64_t)(c - '0');
+    if (frac) {
+      (*exp10)--;
+    }
+  } else {
+    if (c != '0') {
+      *inexact = true;
+    }
+    if (!frac) {
+      (*exp10)++;
+    }
+  }
+}
+
+/*
+ * Convert mant * 10^exp10 to double with one correctly rounded
+ * operation, if both operands are exact doubles (Clinger's fast path).
+ * return: false if not possible
+ */
+static bool exact_double(uint64_t mant, int64_t exp10, double *d) {
+#if FLT_EVAL_METHOD == 0
+  if (mant > DOUBLE_EXACT_MAX) {
+    return false;
+  }
+
+  if (mant == 0) {
+    *d = 0.0;
+    return true;
+  }
+
+  // Move powers of ten into mantissa while it stays exact, e.g. 1e25
+  while (exp10 > POW10_EXACT_MAX && mant <= DOUBLE_EXACT_MAX / 10) {
+    mant *= 10;
+    exp10--;
+  }
+
+  if (exp10 > POW10_EXACT_MAX || exp10 < -POW10_EXACT_MAX) {
+    return false;
+  }
+
+  double x = (double)mant;
+  *d = (exp10 < 0) ? x / pow10_exact[-exp10] : x * pow10_exact[exp10];
+  return true;
+#else
+  // Excess precision in intermediate results would round twice
+  (void)mant;
+  (void)exp10;
+  (void)d;
+  return false;
+#endif
+}
+
+/*
+ * Convert number with strtod(), which needs a null terminated copy.
+ */
+static tscfg_rc convert_strtod(const char *str, size_t len, double *d) {
+  char buf[STRTOD_BUF_SIZE];
+  char *copy = buf;
+  if (len >= sizeof(buf)) {
+    copy = tscfg_malloc(len + 1);
+    TSCFG_CHECK_MALLOC(copy);
+  }
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  // Out of range values become infinity or zero
+  *d = strtod(copy, NULL);
+
+  if (copy != buf) {
+    tscfg_free(copy);
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Split string with optional whitespace around into number and unit.
+ */
+static tscfg_rc split_units(const char *str, size_t len, tscfg_num *num,
+                            const char **unit, size_t *unit_len) {
+  while (len > 0 && isspace((unsigned char)str[0])) {
+    str++;
+    len--;
+  }
+  while (len > 0 && isspace((unsigned char)str[len - 1])) {
+    len--;
+  }
+
+  size_t used;
+  tscfg_rc rc = tscfg_num_scan(str, len, &used, num);
+  TSCFG_CHECK(rc);
+  if (used == 0) {
+    return TSCFG_ERR_TYPE;
+  }
+
+  while (used < len && isspace((unsigned char)str[used])) {
+    used++;
+  }
+
+  *unit = str + used;
+  *unit_len = len - used;
+  return TSCFG_OK;
+}
+
+static bool str_eq(const char *str, size_t len, const char *lit,
+                   size_t lit_len) {
+  return len == lit_len && memcmp(str, lit, len) == 0;
+}
+
+static bool duration_unit_matches(const char *name, const char *str,
+                                  size_t len) {
+  size_t name_len = strlen(name);
+  if (str_eq(str, len, name, name_len)) {
+    return true;
+  }
+
+  // Singular of long name
+  return name_len > 3 && len == name_len - 1 &&
+         memcmp(str, name, len) == 0 && name[len] == 's';
+}
+
+static bool size_unit_matches(const size_unit *u, const char *str,
+                              size_t len) {
+  size_t prefix_len = strlen(u->prefix);
+  if (len >= prefix_len && memcmp(str, u->prefix, prefix_len) == 0 &&
+      (str_eq(str + prefix_len, len - prefix_len, "byte", 4) ||
+       str_eq(str + prefix_len, len - prefix_len, "bytes", 5))) {
+    return true;
+  }
+
+  if (prefix_len == 0) {
+    return len == 0 || str_eq(str, len, "B", 1) || str_eq(str, len, "b", 1);
+  }
+
+  char first = u->prefix[0];
+  char upper = (char)toupper((unsigned char)first);
+  if (u->binary) {
+    // E.g. K, k, Ki or KiB
+    return len >= 1 && len <= 3 &&
+           (len == 1 ? (str[0] == first || str[0] == upper) :
+                       (str[0] == upper && str[1] == 'i' &&
+                        (len == 2 || str[2] == 'B')));
+  } else {
+    // E.g. kB or MB
+    return len == 2 && str[1] == 'B' &&
+           str[0] == (u->unit == 1000 ? first : upper);
+  }
+}
@@ -0,0 +1,70 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Decoding of numbers, and of HOCON durations and memory sizes.
+ */
+
+#ifndef __TSCONFIG_NUM_H
+#define __TSCONFIG_NUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tsconfig_common.h"
+#include "tsconfig_tok.h"
+
+#define TSCFG_NS_PER_MS INT64_C(1000000)
+
+/*
+ * Decode number at start of string, e.g. -12, 1.5 or 2e-3.  A sign,
+ * leading zeros, and a decimal point with no digits on one side are
+ * accepted.  Integers are decoded exactly.  Other values with few enough
+ * digits are converted exactly with double arithmetic, and the rest with
+ * strtod().
+ * used: set to number of bytes of number, or 0 if string doesn't start
+ *       with a number
+ * return: TSCFG_ERR_OOM if memory ran out copying a long number
+ */
+tscfg_rc tscfg_num_scan(const char *str, size_t len, size_t *used,
+                        tscfg_num *num);
+
+/*
+ * Multiply number by unit, truncating any fraction.
+ * return: TSCFG_ERR_TYPE if result does not fit in 64 bits
+ */
+tscfg_rc tscfg_num_scale(tscfg_num num, int64_t unit, int64_t *result);
+
+/*
+ * Parse HOCON duration, a number followed by an optional unit, e.g.
+ * 10s, 1.5 hours or 250.  Numbers without a unit are milliseconds.
+ * ns: set to duration in nanoseconds
+ * return: TSCFG_ERR_TYPE if not a duration or out of range
+ */
+tscfg_rc tscfg_parse_duration(const char *str, size_t len, int64_t *ns);
+
+/*
+ * Parse HOCON memory size, a number followed by an optional unit, e.g.
+ * 512MiB, 10 kB or 4096.  Units like K and Ki are powers of two, kB
+ * powers of ten, and numbers without a unit are bytes.
+ * bytes: set to size in bytes
+ * return: TSCFG_ERR_TYPE if not a size or out of range
+ */
+tscfg_rc tscfg_parse_size(const char *str, size_t len, int64_t *bytes);
+
+#endif // __TSCONFIG_NUM_H
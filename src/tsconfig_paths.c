@@ -25,9 +25,46 @@
 #include "tsconfig_paths.h"
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "tsconfig_alloc.h"
 #include "tsconfig_err.h"
 
+typedef struct {
+  const char *str;
+  size_t len;
+} filter_elem;
+
+typedef struct {
+  char *copy; // Copy of path that elements point into
+  filter_elem *elems;
+  int nelems;
+} filter_path;
+
+struct tscfg_path_filter {
+  // Sorted by elements, so paths with a common prefix are adjacent
+  filter_path *paths;
+  int npaths;
+};
+
+/*
+ * Progress of matching path elements of key against a filter path.
+ */
+typedef struct {
+  const filter_path *path;
+  int elem; // Index of element being matched
+  size_t off; // Bytes of element matched so far
+  bool mismatch;
+} key_matcher;
+
+static tscfg_rc split_filter_path(const char *str, filter_path *path);
+static int cmp_filter_paths(const void *a, const void *b);
+static tscfg_filter_match match_key(const filter_path *path, int depth,
+                      const tscfg_tok *toks, int ntoks, int *matched);
+static void match_text(key_matcher *m, const char *str, size_t len);
+static void match_elem_end(key_matcher *m);
+
 tscfg_rc tscfg_path_parse(tscfg_tok_array *toks, tscfg_tok_array *path) {
   assert(toks != NULL);
   assert(path != NULL);
@@ -70,3 +107,267 @@ cleanup:
   }
   return rc;
 }
+
+tscfg_rc tscfg_path_filter_new(const char *const *paths, int npaths,
+                               tscfg_path_filter **filter) {
+  tscfg_rc rc;
+
+  if (npaths < 0 || (npaths > 0 && paths == NULL)) {
+    REPORT_ERR("Invalid paths for filter");
+    return TSCFG_ERR_ARG;
+  }
+
+  tscfg_path_filter *f = tscfg_malloc(sizeof(tscfg_path_filter));
+  TSCFG_CHECK_MALLOC(f);
+
+  f->npaths = 0;
+  f->paths = tscfg_malloc(sizeof(f->paths[0]) *
+                          (size_t)(npaths > 0 ? npaths : 1));
+  if (f->paths == NULL) {
+    tscfg_free(f);
+    return TSCFG_ERR_OOM;
+  }
+
+  for (int i = 0; i < npaths; i++) {
+    rc = split_filter_path(paths[i], &f->paths[i]);
+    if (rc != TSCFG_OK) {
+      tscfg_path_filter_free(f);
+      return rc;
+    }
+    f->npaths++;
+  }
+
+  qsort(f->paths, (size_t)f->npaths, sizeof(f->paths[0]), cmp_filter_paths);
+
+  *filter = f;
+  return TSCFG_OK;
+}
+
+void tscfg_path_filter_free(tscfg_path_filter *filter) {
+  if (filter == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < filter->npaths; i++) {
+    tscfg_free(filter->paths[i].copy);
+    tscfg_free(filter->paths[i].elems);
+  }
+  tscfg_free(filter->paths);
+  tscfg_free(filter);
+}
+
+tscfg_filter_pos tscfg_path_filter_root(const tscfg_path_filter *filter) {
+  return (tscfg_filter_pos){ .lo = 0, .hi = filter->npaths, .depth = 0 };
+}
+
+tscfg_filter_match tscfg_path_filter_key(const tscfg_path_filter *filter,
+      tscfg_filter_pos pos, const tscfg_tok *toks, int ntoks,
+      tscfg_filter_pos *inner) {
+  int lo = -1, hi = -1, depth = 0;
+  int through = 0; // Depth of deepest wanted prefix key goes through
+
+  for (int i = pos.lo; i < pos.hi; i++) {
+    int matched;
+    tscfg_filter_match m = match_key(&filter->paths[i], pos.depth, toks,
+                                     ntoks, &matched);
+    if (m == TSCFG_FILTER_KEEP) {
+      return TSCFG_FILTER_KEEP;
+    } else if (m == TSCFG_FILTER_PARTIAL) {
+      // Same key matched, so adjacent in sorted order
+      if (lo < 0) {
+        lo = i;
+      }
+      hi = i + 1;
+      depth = matched;
+    } else if (matched > pos.depth && matched > through) {
+      // Mismatch after first element of key
+      through = matched;
+    }
+  }
+
+  if (lo < 0) {
+    if (through == 0) {
+      return TSCFG_FILTER_SKIP;
+    }
+    *inner = (tscfg_filter_pos){ .lo = 0, .hi = 0, .depth = through };
+    return TSCFG_FILTER_EMPTY;
+  }
+
+  *inner = (tscfg_filter_pos){ .lo = lo, .hi = hi, .depth = depth };
+  return TSCFG_FILTER_PARTIAL;
+}
+
+int tscfg_path_key_prefix(tscfg_tok *toks, int ntoks, int nelems) {
+  assert(nelems > 0);
+
+  for (int i = 0; i < ntoks; i++) {
+    tscfg_tok *tok = &toks[i];
+    if (tok->tag != TSCFG_TOK_NUMBER && tok->tag != TSCFG_TOK_UNQUOTED) {
+      continue;
+    }
+
+    const char *p = tok->str, *end = tok->str + tok->len;
+    const char *dot;
+    while ((dot = memchr(p, '.', (size_t)(end - p))) != NULL) {
+      if (--nelems == 0) {
+        tok->len = (size_t)(dot - tok->str);
+        return i + 1;
+      }
+      p = dot + 1;
+    }
+  }
+
+  // Key has no more elements than that
+  assert(false);
+  return ntoks;
+}
+
+bool tscfg_path_filter_covers(const tscfg_path_filter *filter,
+      const char *const *elems, const size_t *lens, int nelems) {
+  for (int i = 0; i < filter->npaths; i++) {
+    const filter_path *path = &filter->paths[i];
+    if (path->nelems > nelems) {
+      continue;
+    }
+
+    int j = 0;
+    while (j < path->nelems && path->elems[j].len == lens[j] &&
+           memcmp(path->elems[j].str, elems[j], lens[j]) == 0) {
+      j++;
+    }
+    if (j == path->nelems) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static tscfg_rc split_filter_path(const char *str, filter_path *path) {
+  size_t len = strlen(str);
+  int nelems = 1;
+  for (size_t i = 0; i < len; i++) {
+    nelems += (str[i] == '.');
+  }
+
+  path->copy = tscfg_malloc(len + 1);
+  path->elems = tscfg_malloc(sizeof(path->elems[0]) * (size_t)nelems);
+  if (path->copy == NULL || path->elems == NULL) {
+    tscfg_free(path->copy);
+    tscfg_free(path->elems);
+    return TSCFG_ERR_OOM;
+  }
+  memcpy(path->copy, str, len + 1);
+  path->nelems = nelems;
+
+  const char *p = path->copy, *end = path->copy + len;
+  for (int i = 0; i < nelems; i++) {
+    const char *dot = memchr(p, '.', (size_t)(end - p));
+    const char *elem_end = (dot != NULL) ? dot : end;
+    if (elem_end == p) {
+      REPORT_ERR("Empty element in filter path: %s", str);
+      tscfg_free(path->copy);
+      tscfg_free(path->elems);
+      return TSCFG_ERR_ARG;
+    }
+
+    path->elems[i].str = p;
+    path->elems[i].len = (size_t)(elem_end - p);
+    p = elem_end + 1;
+  }
+
+  return TSCFG_OK;
+}
+
+static int cmp_filter_paths(const void *a, const void *b) {
+  const filter_path *pa = a, *pb = b;
+  for (int i = 0; i < pa->nelems && i < pb->nelems; i++) {
+    const filter_elem *ea = &pa->elems[i], *eb = &pb->elems[i];
+    size_t len = ea->len < eb->len ? ea->len : eb->len;
+    int c = memcmp(ea->str, eb->str, len);
+    if (c != 0) {
+      return c;
+    } else if (ea->len != eb->len) {
+      return ea->len < eb->len ? -1 : 1;
+    }
+  }
+
+  return (pa->nelems > pb->nelems) - (pa->nelems < pb->nelems);
+}
+
+/*
+ * Match path elements of key against filter path, starting at element
+ * depth of filter path.
+ * matched: set to number of whole elements of filter path matched,
+ *    including those before depth
+ */
+static tscfg_filter_match match_key(const filter_path *path, int depth,
+                      const tscfg_tok *toks, int ntoks, int *matched) {
+  key_matcher m = { .path = path, .elem = depth };
+
+  for (int i = 0; i < ntoks && !m.mismatch && m.elem < path->nelems; i++) {
+    const tscfg_tok *tok = &toks[i];
+    switch (tok->tag) {
+      case TSCFG_TOK_TRUE:
+        match_text(&m, "true", 4);
+        break;
+      case TSCFG_TOK_FALSE:
+        match_text(&m, "false", 5);
+        break;
+      case TSCFG_TOK_NULL:
+        match_text(&m, "null", 4);
+        break;
+      case TSCFG_TOK_NUMBER:
+      case TSCFG_TOK_UNQUOTED: {
+        const char *p = tok->str, *end = tok->str + tok->len;
+        const char *dot;
+        while ((dot = memchr(p, '.', (size_t)(end - p))) != NULL) {
+          match_text(&m, p, (size_t)(dot - p));
+          match_elem_end(&m);
+          p = dot + 1;
+        }
+        match_text(&m, p, (size_t)(end - p));
+        break;
+      }
+      default:
+        // Quoted strings and whitespace are part of element
+        match_text(&m, tok->str, tok->len);
+        break;
+    }
+  }
+  match_elem_end(&m);
+
+  *matched = m.elem;
+  if (m.elem >= path->nelems) {
+    return TSCFG_FILTER_KEEP;
+  } else if (m.mismatch) {
+    return TSCFG_FILTER_SKIP;
+  }
+  return TSCFG_FILTER_PARTIAL;
+}
+
+static void match_text(key_matcher *m, const char *str, size_t len) {
+  if (m->mismatch || m->elem >= m->path->nelems) {
+    return;
+  }
+
+  const filter_elem *e = &m->path->elems[m->elem];
+  if (len > e->len - m->off ||
+      (len > 0 && memcmp(e->str + m->off, str, len) != 0)) {
+    m->mismatch = true;
+  } else {
+    m->off += len;
+  }
+}
+
+static void match_elem_end(key_matcher *m) {
+  if (m->mismatch || m->elem >= m->path->nelems) {
+    return;
+  }
+
+  if (m->off != m->path->elems[m->elem].len) {
+    m->mismatch = true;
+  } else {
+    m->elem++;
+    m->off = 0;
+  }
+}
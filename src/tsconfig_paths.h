@@ -25,6 +25,9 @@
 #ifndef __TSCONFIG_PATHS_H
 #define __TSCONFIG_PATHS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "tsconfig_tok.h"
 
 /*
@@ -42,4 +45,73 @@
  */
 tscfg_rc tscfg_path_parse(tscfg_tok_array *toks, tscfg_tok_array *path);
 
+/*
+ * Set of path prefixes, e.g. db and http.server, to select the parts of
+ * a config that are wanted.
+ */
+typedef struct tscfg_path_filter tscfg_path_filter;
+
+/*
+ * Position in input relative to filter: the range of filter paths that
+ * match the path of the current object, and the number of path elements
+ * that were matched.
+ */
+typedef struct {
+  int lo, hi;
+  int depth;
+} tscfg_filter_pos;
+
+typedef enum {
+  TSCFG_FILTER_SKIP, // Path isn't wanted
+  /*
+   * Path isn't wanted, but key goes through an object that is a proper
+   * prefix of a wanted path, e.g. key a.c for wanted path a.b.  The field
+   * still makes that object an object, replacing any earlier value, so
+   * is kept as an empty object at that prefix, e.g. a {}.
+   */
+  TSCFG_FILTER_EMPTY,
+  TSCFG_FILTER_PARTIAL, // Path is a proper prefix of a wanted path
+  TSCFG_FILTER_KEEP, // Path is at or under a wanted path
+} tscfg_filter_match;
+
+/*
+ * Create filter from paths with elements separated by dots.
+ * return: TSCFG_ERR_ARG if a path has an empty element
+ */
+tscfg_rc tscfg_path_filter_new(const char *const *paths, int npaths,
+                               tscfg_path_filter **filter);
+
+void tscfg_path_filter_free(tscfg_path_filter *filter);
+
+/*
+ * Position of root object, which matches all paths.
+ */
+tscfg_filter_pos tscfg_path_filter_root(const tscfg_path_filter *filter);
+
+/*
+ * Match key of field in object at pos.  Key tokens are split into path
+ * elements in the same way as the tree reader.
+ * inner: if match is partial, set to position inside value of field.
+ *    If match is empty, depth is set to depth of the wanted prefix that
+ *    key goes through.
+ */
+tscfg_filter_match tscfg_path_filter_key(const tscfg_path_filter *filter,
+      tscfg_filter_pos pos, const tscfg_tok *toks, int ntoks,
+      tscfg_filter_pos *inner);
+
+/*
+ * Shorten key to its first nelems path elements, where a dot follows the
+ * last of them in an unquoted token, e.g. a.c to a for nelems 1.  Last
+ * token kept may be shortened.
+ * return: number of tokens kept.  Caller must free any tokens after them.
+ */
+int tscfg_path_key_prefix(tscfg_tok *toks, int ntoks, int nelems);
+
+/*
+ * Whether path from root is at or under a wanted path.
+ * elems, lens: path elements and their lengths
+ */
+bool tscfg_path_filter_covers(const tscfg_path_filter *filter,
+      const char *const *elems, const size_t *lens, int nelems);
+
 #endif // __TSCONFIG_PATHS_H
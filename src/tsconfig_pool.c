@@ -0,0 +1,230 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "tsconfig_pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tsconfig_err.h"
+
+typedef enum {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+} job_status;
+
+struct tscfg_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when job queued or stopping
+  pthread_cond_t done; // Signalled when job finished
+
+  // FIFO of queued jobs
+  tscfg_job *head;
+  tscfg_job *tail;
+
+  pthread_t *workers;
+  int nworkers; // Workers to start
+  int nstarted; // Workers started, -1 for not yet
+  bool stop;
+};
+
+static void *worker_main(void *arg);
+static void start_workers(tscfg_pool *pool);
+static void run_job(tscfg_pool *pool, tscfg_job *job);
+
+tscfg_rc tscfg_pool_new(int nthreads, tscfg_pool **pool) {
+  TSCFG_COND(nthreads >= 0, TSCFG_ERR_ARG);
+
+  if (nthreads == 0) {
+    long procs = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (procs < 1) ? 1 :
+               (procs > TSCFG_POOL_MAX_DEFAULT_THREADS) ?
+                  TSCFG_POOL_MAX_DEFAULT_THREADS : (int)procs;
+  }
+
+  if (nthreads == 1) {
+    *pool = NULL;
+    return TSCFG_OK;
+  }
+
+  tscfg_pool *p = malloc(sizeof(tscfg_pool));
+  TSCFG_CHECK_MALLOC(p);
+
+  p->head = p->tail = NULL;
+  p->workers = NULL;
+  // Waiting thread does its share of the work
+  p->nworkers = nthreads - 1;
+  p->nstarted = -1;
+  p->stop = false;
+
+  if (pthread_mutex_init(&p->lock, NULL) != 0) {
+    free(p);
+    return TSCFG_ERR_UNKNOWN;
+  }
+  if (pthread_cond_init(&p->work, NULL) != 0) {
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return TSCFG_ERR_UNKNOWN;
+  }
+  if (pthread_cond_init(&p->done, NULL) != 0) {
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return TSCFG_ERR_UNKNOWN;
+  }
+
+  *pool = p;
+  return TSCFG_OK;
+}
+
+int tscfg_pool_threads(const tscfg_pool *pool) {
+  return pool->nworkers + 1;
+}
+
+void tscfg_pool_submit(tscfg_pool *pool, tscfg_job *job) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->nstarted < 0) {
+    start_workers(pool);
+  }
+
+  job->status = JOB_QUEUED;
+  job->next = NULL;
+  job->alloc = tscfg_alloc_current();
+  job->err = tscfg_err_handler_current();
+  if (pool->tail == NULL) {
+    pool->head = job;
+  } else {
+    pool->tail->next = job;
+  }
+  pool->tail = job;
+
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void tscfg_pool_wait(tscfg_pool *pool, tscfg_job *job) {
+  pthread_mutex_lock(&pool->lock);
+  if (job->status == JOB_QUEUED) {
+    // Take job from queue and run it here
+    tscfg_job **p = &pool->head, *prev = NULL;
+    while (*p != job) {
+      prev = *p;
+      p = &(*p)->next;
+    }
+    *p = job->next;
+    if (pool->tail == job) {
+      pool->tail = prev;
+    }
+    run_job(pool, job);
+  }
+
+  while (job->status != JOB_DONE) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void tscfg_pool_free(tscfg_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  assert(pool->head == NULL);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nstarted; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  free(pool->workers);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+static void *worker_main(void *arg) {
+  tscfg_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    tscfg_job *job = pool->head;
+    if (job != NULL) {
+      pool->head = job->next;
+      if (pool->head == NULL) {
+        pool->tail = NULL;
+      }
+      run_job(pool, job);
+    } else if (pool->stop) {
+      break;
+    } else {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/*
+ * Start workers, called with lock held.  If threads can't be started,
+ * jobs are run by the threads waiting for them instead.
+ */
+static void start_workers(tscfg_pool *pool) {
+  pool->nstarted = 0;
+  if (pool->nworkers <= 0) {
+    return;
+  }
+
+  pool->workers = malloc(sizeof(pool->workers[0]) * (size_t)pool->nworkers);
+  if (pool->workers == NULL) {
+    return;
+  }
+
+  while (pool->nstarted < pool->nworkers) {
+    if (pthread_create(&pool->workers[pool->nstarted], NULL, worker_main,
+                       pool) != 0) {
+      break;
+    }
+    pool->nstarted++;
+  }
+}
+
+/*
+ * Run dequeued job, called with lock held.  Lock is released while job
+ * runs.
+ */
+static void run_job(tscfg_pool *pool, tscfg_job *job) {
+  job->status = JOB_RUNNING;
+  pthread_mutex_unlock(&pool->lock);
+
+  // Job allocates memory and reports errors as if run by submitting thread
+  const tscfg_allocator *prev = tscfg_alloc_use(job->alloc);
+  tscfg_err_handler prev_err = tscfg_err_handler_use(job->err);
+  job->run(job);
+  tscfg_err_handler_use(prev_err);
+  tscfg_alloc_use(prev);
+
+  pthread_mutex_lock(&pool->lock);
+  job->status = JOB_DONE;
+  pthread_cond_broadcast(&pool->done);
+}
@@ -0,0 +1,87 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Small pool of worker threads for loading included files in parallel.
+ *
+ * Workers are started when the first job is submitted, so a pool costs
+ * nothing if it is never used.  A thread waiting for a job that hasn't
+ * started runs it itself, so jobs can wait for jobs they submit without
+ * deadlocking, even with no workers.
+ */
+
+#ifndef __TSCONFIG_POOL_H
+#define __TSCONFIG_POOL_H
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_common.h"
+#include "tsconfig_err.h"
+
+// Default limit on threads, if number of processors is higher
+#define TSCFG_POOL_MAX_DEFAULT_THREADS 8
+
+typedef struct tscfg_pool tscfg_pool;
+
+typedef struct tscfg_job tscfg_job;
+
+/*
+ * Job to be run by pool, embedded in caller's own struct.  Only run needs
+ * to be set before submitting.
+ */
+struct tscfg_job {
+  void (*run)(tscfg_job *job);
+
+  // Private to pool
+  int status;
+  tscfg_job *next;
+  const tscfg_allocator *alloc; // Allocator of submitting thread
+  tscfg_err_handler err; // Error handler of submitting thread
+};
+
+/*
+ * Create pool.
+ * nthreads: threads to run jobs, counting the thread waiting for them,
+ *           or 0 for default of number of processors
+ * pool: set to NULL if there would only be one thread, in which case the
+ *       caller should run jobs directly
+ */
+tscfg_rc tscfg_pool_new(int nthreads, tscfg_pool **pool);
+
+/*
+ * Number of threads to run jobs, counting the waiting thread.
+ */
+int tscfg_pool_threads(const tscfg_pool *pool);
+
+/*
+ * Queue job to be run by a worker.  Caller must wait for job before
+ * freeing it.
+ */
+void tscfg_pool_submit(tscfg_pool *pool, tscfg_job *job);
+
+/*
+ * Wait for job to finish, running it in this thread if not started.
+ */
+void tscfg_pool_wait(tscfg_pool *pool, tscfg_job *job);
+
+/*
+ * Stop workers and free pool.  All submitted jobs must have been waited
+ * for.
+ */
+void tscfg_pool_free(tscfg_pool *pool);
+
+#endif // __TSCONFIG_POOL_H
@@ -90,6 +90,85 @@ typedef struct {
    */
   bool (*var_sub)(void *s, tscfg_tok *toks, int ntoks, bool optional);
 
+  /*
+   * An include statement in an object, e.g. include "a.conf" or
+   * include required(file("a.conf")).  May be NULL if the reader does
+   * not support includes, in which case includes are a parse error.
+   * tok: quoted file name
+   * required: if true, a missing file is an error
+   */
+  bool (*include)(void *s, tscfg_tok *tok, bool required);
+
 } tscfg_reader;
 
+/*
+ * Batched alternative to tscfg_reader: the parser fills an array of
+ * events and hands over the whole array at once, avoiding an indirect
+ * call per event.
+ */
+typedef enum {
+  TSCFG_EV_OBJ_START,
+  TSCFG_EV_OBJ_END,
+  TSCFG_EV_ARR_START,
+  TSCFG_EV_ARR_END,
+  TSCFG_EV_KEY_VAL_START, // Uses data.key
+  TSCFG_EV_KEY_VAL_END,
+  TSCFG_EV_VAL_START,
+  TSCFG_EV_VAL_END,
+  TSCFG_EV_TOKEN, // Uses data.tok
+  TSCFG_EV_VAR_SUB, // Uses data.sub
+  TSCFG_EV_INCLUDE, // Uses data.include
+} tscfg_event_tag;
+
+/*
+ * A parser event, corresponding to one tscfg_reader call.
+ * Ownership of tokens and token arrays is as for tscfg_reader.
+ */
+typedef struct {
+  tscfg_event_tag tag;
+
+  /*
+   * Nesting depth: the root object or array starts at depth 0, and the
+   * events for its contents, including nested starts and ends, are at
+   * depth 1, etc.
+   */
+  int depth;
+
+  union {
+    // Span of input for token, with string and location
+    tscfg_tok tok;
+
+    struct {
+      tscfg_tok *toks;
+      int ntoks;
+      tscfg_tok_tag sep;
+    } key;
+
+    struct {
+      tscfg_tok *toks;
+      int ntoks;
+      bool optional;
+    } sub;
+
+    struct {
+      tscfg_tok tok;
+      bool required;
+    } include;
+  } data;
+} tscfg_event;
+
+// Default maximum number of events per batch
+#define TSCFG_DEFAULT_BATCH_SIZE 64
+
+typedef struct {
+  /*
+   * Process next batch of events in input order.
+   * Returning false halts parsing as for tscfg_reader.
+   */
+  bool (*events)(void *s, tscfg_event *events, int nevents);
+
+  // Maximum events per batch, 0 for default
+  int batch_size;
+} tscfg_batch_reader;
+
 #endif // __TSCONFIG_READER_H
@@ -0,0 +1,570 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Render tree as JSON or HOCON text.
+ *
+ * Text is generated in one pass over the tape, following references,
+ * with an explicit stack of open objects and arrays so that deep trees
+ * do not recurse.  Keys are unique in merged objects, so fields are
+ * written in tape order without looking anything up.
+ *
+ * Output is appended to a buffer with memcpy(): the caller's buffer,
+ * grown ahead of time from the size of the tree, or a fixed-size buffer
+ * flushed to a file descriptor when full.  Strings are escaped by copying
+ * runs of bytes that need no escaping, found with vector instructions.
+ */
+
+// Needed for POSIX write()
+#define _XOPEN_SOURCE 700
+
+#include "tsconfig_tree.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_scan.h"
+
+#define INIT_STACK_SIZE 64
+#define INIT_BUF_SIZE 256
+#define FD_BUF_SIZE 65536
+#define INDENT_WIDTH 2
+
+// Newline followed by spaces, for indenting in chunks
+static const char newline_indent[] =
+  "\n                                                                ";
+#define INDENT_CHUNK (sizeof(newline_indent) - 2)
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t size;
+  int fd; // File descriptor to flush buffer to, or -1 to grow buffer
+} render_out;
+
+/*
+ * Object or array being written.
+ */
+typedef struct {
+  size_t next; // Tape index of next key or element
+  size_t close; // Tape index of OBJ_END or ARR_END
+  size_t indent; // Indentation level of contents
+  bool obj;
+  bool empty; // Nothing written inside yet
+  bool bare; // Root object in HOCON, without braces
+} render_frame;
+
+typedef struct {
+  const tsconfig_tree *tree;
+  tscfg_render_fmt fmt;
+  render_out out;
+
+  render_frame *stack;
+  size_t depth;
+  size_t stack_size;
+} render_state;
+
+static tscfg_rc render(render_state *rs);
+static tscfg_rc render_item(render_state *rs, render_frame *f,
+                            size_t key_ix, size_t val_ix);
+static tscfg_rc render_close(render_state *rs, const render_frame *f);
+static tscfg_rc render_value(render_state *rs, size_t ix, size_t indent);
+static tscfg_rc push_frame(render_state *rs, size_t ix, size_t indent,
+                           bool bare);
+static tscfg_rc put_quoted(render_out *out, const char *str, size_t len);
+static tscfg_rc put_escape(render_out *out, unsigned char c);
+static tscfg_rc put_key(render_out *out, const char *key, size_t len,
+                        tscfg_render_fmt fmt);
+static bool plain_key(const char *key, size_t len);
+static tscfg_rc put_json_number(render_out *out, const char *num,
+                                size_t len);
+static tscfg_rc put_newline(render_out *out, size_t indent);
+static inline tscfg_rc out_put(render_out *out, const char *s, size_t n);
+static inline tscfg_rc out_putc(render_out *out, char c);
+static tscfg_rc out_put_slow(render_out *out, const char *s, size_t n);
+static tscfg_rc write_all(int fd, const char *data, size_t len);
+
+tscfg_rc tsconfig_render(const tsconfig_tree *tree, tscfg_render_fmt fmt,
+                         char **buf, size_t *len, size_t *size) {
+  render_state rs = {
+    .tree = tree,
+    .fmt = fmt,
+    .out = { .buf = *buf, .len = *len, .size = *size, .fd = -1 },
+  };
+
+  // Reserve space up front from size of tree, to avoid most regrowing
+  size_t estimate = tree->pool_len + tree->tape_len *
+                    (fmt == TSCFG_RENDER_JSON ? 2 : 2 + INDENT_WIDTH * 4);
+  if (rs.out.size - rs.out.len < estimate) {
+    char *new_buf = realloc(rs.out.buf, rs.out.len + estimate);
+    TSCFG_CHECK_MALLOC(new_buf);
+    *buf = rs.out.buf = new_buf;
+    *size = rs.out.size = rs.out.len + estimate;
+  }
+
+  tscfg_rc rc = render(&rs);
+  if (rc == TSCFG_OK) {
+    // Null terminator, not counted in length
+    rc = out_putc(&rs.out, '\0');
+    rs.out.len--;
+  }
+
+  *buf = rs.out.buf;
+  *size = rs.out.size;
+  if (rc == TSCFG_OK) {
+    *len = rs.out.len;
+  }
+  tscfg_free(rs.stack);
+  return rc;
+}
+
+tscfg_rc tsconfig_render_fd(const tsconfig_tree *tree, tscfg_render_fmt fmt,
+                            int fd) {
+  render_state rs = {
+    .tree = tree,
+    .fmt = fmt,
+    .out = { .buf = tscfg_malloc(FD_BUF_SIZE), .size = FD_BUF_SIZE,
+             .fd = fd },
+  };
+  TSCFG_CHECK_MALLOC(rs.out.buf);
+
+  tscfg_rc rc = render(&rs);
+  if (rc == TSCFG_OK) {
+    rc = write_all(fd, rs.out.buf, rs.out.len);
+  }
+
+  tscfg_free(rs.out.buf);
+  tscfg_free(rs.stack);
+  return rc;
+}
+
+/*
+ * Write root value, then contents of open objects and arrays until
+ * stack is empty.
+ */
+static tscfg_rc render(render_state *rs) {
+  tscfg_rc rc;
+  const tsconfig_tree *tree = rs->tree;
+
+  size_t root_ix = tscfg_val_deref(tsconfig_root(tree)).ix;
+  bool bare = rs->fmt == TSCFG_RENDER_HOCON &&
+              tscfg_tape_get_tag(tree->tape[root_ix]) == TSCFG_TAPE_OBJ;
+  if (bare) {
+    rc = push_frame(rs, root_ix, 0, true);
+  } else {
+    rc = render_value(rs, root_ix, 0);
+  }
+  TSCFG_CHECK(rc);
+
+  while (rs->depth > 0) {
+    render_frame *f = &rs->stack[rs->depth - 1];
+
+    // Find next item, skipping undefined values
+    size_t key_ix = 0, val_ix = 0;
+    bool found = false;
+    while (f->next < f->close && !found) {
+      size_t ix = f->next;
+      if (f->obj) {
+        key_ix = ix++;
+      }
+      tscfg_val val = { .tree = tree, .ix = ix };
+      f->next = tscfg_val_end(val);
+      val_ix = tscfg_val_deref(val).ix;
+      found = tscfg_tape_get_tag(tree->tape[val_ix]) != TSCFG_TAPE_UNDEF;
+    }
+
+    if (found) {
+      // May push frame for value
+      rc = render_item(rs, f, key_ix, val_ix);
+      TSCFG_CHECK(rc);
+    } else {
+      rs->depth--;
+      rc = render_close(rs, f);
+      TSCFG_CHECK(rc);
+    }
+  }
+
+  if (!bare && rs->fmt != TSCFG_RENDER_JSON) {
+    return out_putc(&rs->out, '\n');
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Write separator and key if in object, then value of item in object or
+ * array.
+ * key_ix: tape index of key, ignored for arrays
+ * val_ix: tape index of value, with references followed
+ */
+static tscfg_rc render_item(render_state *rs, render_frame *f,
+                            size_t key_ix, size_t val_ix) {
+  tscfg_rc rc;
+  render_out *out = &rs->out;
+  bool first = f->empty;
+  f->empty = false;
+
+  if (rs->fmt != TSCFG_RENDER_HOCON && !first) {
+    rc = out_putc(out, ',');
+    TSCFG_CHECK(rc);
+  }
+  if (f->bare) {
+    // Fields of root object start at beginning of line
+    if (!first) {
+      rc = out_putc(out, '\n');
+      TSCFG_CHECK(rc);
+    }
+  } else if (rs->fmt != TSCFG_RENDER_JSON) {
+    rc = put_newline(out, f->indent);
+    TSCFG_CHECK(rc);
+  }
+
+  if (f->obj) {
+    size_t len;
+    const char *key = tscfg_tape_str(rs->tree, rs->tree->tape[key_ix],
+                                     &len);
+    rc = put_key(out, key, len, rs->fmt);
+    TSCFG_CHECK(rc);
+
+    switch (rs->fmt) {
+      case TSCFG_RENDER_JSON:
+        rc = out_putc(out, ':');
+        break;
+      case TSCFG_RENDER_JSON_PRETTY:
+        rc = out_put(out, ": ", 2);
+        break;
+      case TSCFG_RENDER_HOCON:
+        if (tscfg_tape_get_tag(rs->tree->tape[val_ix]) == TSCFG_TAPE_OBJ) {
+          rc = out_putc(out, ' ');
+        } else {
+          rc = out_put(out, " = ", 3);
+        }
+        break;
+    }
+    TSCFG_CHECK(rc);
+  }
+
+  return render_value(rs, val_ix, f->indent);
+}
+
+/*
+ * Write end of object or array once all items are written.
+ */
+static tscfg_rc render_close(render_state *rs, const render_frame *f) {
+  tscfg_rc rc;
+  if (f->bare) {
+    return f->empty ? TSCFG_OK : out_putc(&rs->out, '\n');
+  }
+
+  if (!f->empty && rs->fmt != TSCFG_RENDER_JSON) {
+    rc = put_newline(&rs->out, f->indent - 1);
+    TSCFG_CHECK(rc);
+  }
+  return out_putc(&rs->out, f->obj ? '}' : ']');
+}
+
+/*
+ * Write scalar value, or start of object or array, pushing a frame for
+ * its contents.
+ * ix: tape index of value, with references followed
+ * indent: indentation level of value
+ */
+static tscfg_rc render_value(render_state *rs, size_t ix, size_t indent) {
+  render_out *out = &rs->out;
+  tscfg_tape_entry e = rs->tree->tape[ix];
+  const char *str;
+  size_t len;
+
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_OBJ: {
+      tscfg_rc rc = out_putc(out, '{');
+      TSCFG_CHECK(rc);
+      return push_frame(rs, ix, indent + 1, false);
+    }
+    case TSCFG_TAPE_ARR: {
+      tscfg_rc rc = out_putc(out, '[');
+      TSCFG_CHECK(rc);
+      return push_frame(rs, ix, indent + 1, false);
+    }
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED:
+      str = tscfg_tape_str(rs->tree, e, &len);
+      return put_quoted(out, str, len);
+    case TSCFG_TAPE_NUMBER:
+      str = tscfg_tape_str(rs->tree, e, &len);
+      if (rs->fmt == TSCFG_RENDER_HOCON) {
+        // Text was accepted by lexer, so can be written back as it was
+        return out_put(out, str, len);
+      }
+      return put_json_number(out, str, len);
+    case TSCFG_TAPE_TRUE:
+      return out_put(out, "true", 4);
+    case TSCFG_TAPE_FALSE:
+      return out_put(out, "false", 5);
+    case TSCFG_TAPE_NULL:
+      return out_put(out, "null", 4);
+    default:
+      REPORT_ERR("Cannot render unresolved value in config tree");
+      return TSCFG_ERR_INVALID;
+  }
+}
+
+/*
+ * Push frame for contents of object or array.
+ * ix: tape index of OBJ or ARR
+ */
+static tscfg_rc push_frame(render_state *rs, size_t ix, size_t indent,
+                           bool bare) {
+  if (rs->depth == rs->stack_size) {
+    size_t new_size = rs->stack_size > 0 ? rs->stack_size * 2
+                                         : INIT_STACK_SIZE;
+    TSCFG_COND(new_size <= SIZE_MAX / sizeof(rs->stack[0]), TSCFG_ERR_OOM);
+    render_frame *new_stack = tscfg_realloc(rs->stack,
+                                            new_size * sizeof(rs->stack[0]));
+    TSCFG_CHECK_MALLOC(new_stack);
+
+    rs->stack = new_stack;
+    rs->stack_size = new_size;
+  }
+
+  tscfg_tape_entry e = rs->tree->tape[ix];
+  rs->stack[rs->depth++] = (render_frame){
+    .next = ix + 1,
+    .close = ix + (size_t)tscfg_tape_get_payload(e),
+    .indent = indent,
+    .obj = tscfg_tape_get_tag(e) == TSCFG_TAPE_OBJ,
+    .empty = true,
+    .bare = bare,
+  };
+  return TSCFG_OK;
+}
+
+/*
+ * Write string in double quotes with JSON escapes, which HOCON shares.
+ */
+static tscfg_rc put_quoted(render_out *out, const char *str, size_t len) {
+  tscfg_rc rc = out_putc(out, '"');
+  TSCFG_CHECK(rc);
+
+  size_t i = 0;
+  while (i < len) {
+    size_t run = tscfg_scan_quoted_utf8((const unsigned char*)&str[i],
+                                        len - i);
+    rc = out_put(out, &str[i], run);
+    TSCFG_CHECK(rc);
+
+    i += run;
+    if (i < len) {
+      rc = put_escape(out, (unsigned char)str[i++]);
+      TSCFG_CHECK(rc);
+    }
+  }
+
+  return out_putc(out, '"');
+}
+
+static tscfg_rc put_escape(render_out *out, unsigned char c) {
+  static const char hex[] = "0123456789abcdef";
+  switch (c) {
+    case '"':
+      return out_put(out, "\\\"", 2);
+    case '\\':
+      return out_put(out, "\\\\", 2);
+    case '\b':
+      return out_put(out, "\\b", 2);
+    case '\f':
+      return out_put(out, "\\f", 2);
+    case '\n':
+      return out_put(out, "\\n", 2);
+    case '\r':
+      return out_put(out, "\\r", 2);
+    case '\t':
+      return out_put(out, "\\t", 2);
+    default: {
+      char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+      return out_put(out, esc, sizeof(esc));
+    }
+  }
+}
+
+static tscfg_rc put_key(render_out *out, const char *key, size_t len,
+                        tscfg_render_fmt fmt) {
+  if (fmt == TSCFG_RENDER_HOCON && plain_key(key, len)) {
+    return out_put(out, key, len);
+  }
+  return put_quoted(out, key, len);
+}
+
+/*
+ * Whether key can be written unquoted in HOCON and read back as the same
+ * single key: letters, digits, '_' and '-', not starting with a digit or
+ * '-', and not starting with a keyword or being include.
+ */
+static bool plain_key(const char *key, size_t len) {
+  static const char *const reserved[] = { "true", "false", "null" };
+
+  if (len == 0 || (key[0] >= '0' && key[0] <= '9') || key[0] == '-') {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = key[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '_' || c == '-')) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+    size_t rlen = strlen(reserved[i]);
+    if (len >= rlen && memcmp(key, reserved[i], rlen) == 0) {
+      return false;
+    }
+  }
+  return !(len == 7 && memcmp(key, "include", 7) == 0);
+}
+
+/*
+ * Write number text as valid JSON.  The lexer also accepts leading zeros
+ * and a decimal point without digits on one side, e.g. 007, 1. or -.5,
+ * which JSON does not.
+ */
+static tscfg_rc put_json_number(render_out *out, const char *num,
+                                size_t len) {
+  tscfg_rc rc;
+  size_t i = 0;
+  if (i < len && num[i] == '-') {
+    rc = out_putc(out, '-');
+    TSCFG_CHECK(rc);
+    i++;
+  }
+
+  // Integer part, without leading zeros
+  size_t int_end = i;
+  while (int_end < len && num[int_end] >= '0' && num[int_end] <= '9') {
+    int_end++;
+  }
+  while (i + 1 < int_end && num[i] == '0') {
+    i++;
+  }
+  rc = (i == int_end) ? out_putc(out, '0')
+                      : out_put(out, &num[i], int_end - i);
+  TSCFG_CHECK(rc);
+  i = int_end;
+
+  if (i < len && num[i] == '.') {
+    size_t frac = ++i;
+    while (i < len && num[i] >= '0' && num[i] <= '9') {
+      i++;
+    }
+    rc = (i == frac) ? out_put(out, ".0", 2)
+                     : out_put(out, &num[frac - 1], i - frac + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  // Exponent is already valid
+  return out_put(out, &num[i], len - i);
+}
+
+/*
+ * Start new line indented to level.
+ */
+static tscfg_rc put_newline(render_out *out, size_t indent) {
+  size_t spaces = indent * INDENT_WIDTH;
+  size_t n = spaces < INDENT_CHUNK ? spaces : INDENT_CHUNK;
+  tscfg_rc rc = out_put(out, newline_indent, n + 1);
+  TSCFG_CHECK(rc);
+
+  for (spaces -= n; spaces > 0; spaces -= n) {
+    n = spaces < INDENT_CHUNK ? spaces : INDENT_CHUNK;
+    rc = out_put(out, &newline_indent[1], n);
+    TSCFG_CHECK(rc);
+  }
+  return TSCFG_OK;
+}
+
+static inline tscfg_rc out_put(render_out *out, const char *s, size_t n) {
+  if (n > out->size - out->len) {
+    return out_put_slow(out, s, n);
+  }
+  memcpy(&out->buf[out->len], s, n);
+  out->len += n;
+  return TSCFG_OK;
+}
+
+static inline tscfg_rc out_putc(render_out *out, char c) {
+  if (out->len == out->size) {
+    return out_put_slow(out, &c, 1);
+  }
+  out->buf[out->len++] = c;
+  return TSCFG_OK;
+}
+
+/*
+ * Append to output when buffer is full, flushing or growing it.
+ */
+static tscfg_rc out_put_slow(render_out *out, const char *s, size_t n) {
+  tscfg_rc rc;
+  if (out->fd >= 0) {
+    rc = write_all(out->fd, out->buf, out->len);
+    TSCFG_CHECK(rc);
+    out->len = 0;
+
+    if (n > out->size) {
+      return write_all(out->fd, s, n);
+    }
+  } else if (n > out->size - out->len) {
+    TSCFG_COND(n <= SIZE_MAX - out->len, TSCFG_ERR_OOM);
+    size_t new_size = out->size > 0 ? out->size : INIT_BUF_SIZE;
+    while (new_size < out->len + n) {
+      TSCFG_COND(new_size <= SIZE_MAX / 2, TSCFG_ERR_OOM);
+      new_size *= 2;
+    }
+
+    // Caller's buffer is from malloc(), not the configured allocator
+    char *new_buf = realloc(out->buf, new_size);
+    TSCFG_CHECK_MALLOC(new_buf);
+    out->buf = new_buf;
+    out->size = new_size;
+  }
+
+  if (n > 0) {
+    memcpy(&out->buf[out->len], s, n);
+    out->len += n;
+  }
+  return TSCFG_OK;
+}
+
+static tscfg_rc write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      REPORT_ERR("Could not write rendered config: %s", strerror(errno));
+      return TSCFG_ERR_IO;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return TSCFG_OK;
+}
@@ -0,0 +1,1201 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Resolve substitutions, concatenations and merges in tree.
+ *
+ * Substitution sites form a dependency graph, which is walked depth first
+ * from each unresolved site: resolving a site looks up the target of the
+ * substitution, resolving any sites encountered on the way.  A resolved
+ * site is overwritten in place with a reference to its target, so each
+ * site is resolved exactly once no matter how many times it is referenced,
+ * and referencing a value never copies it.  Sites currently being resolved
+ * are kept on a stack, so that reaching one again is reported as a cycle.
+ * Pending work is kept on a stack of frames rather than the C stack, so
+ * long chains of substitutions and deeply nested objects to merge can be
+ * resolved on threads with small stacks.
+ *
+ * Self-references to previous values of a key were already spliced in by
+ * tscfg_tree_merge(), so a substitution that reaches the value containing
+ * it has no previous value and falls back to the environment.  Where
+ * merging definitions of a key depends on substitutions, the definitions
+ * were left in a MERGE site, which is resolved like a concatenation.
+ *
+ * Values created by resolution, e.g. merged objects and concatenated
+ * strings, are appended to the tape after the root value.  They are made
+ * up of references to existing values.
+ */
+
+#include "tsconfig_tree.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_stats.h"
+
+#define INIT_STACK_SIZE 64
+
+typedef enum {
+  SITE_UNVISITED = 0,
+  SITE_ACTIVE,
+  SITE_DONE,
+} site_state;
+
+typedef enum {
+  FRAME_NONE,
+  FRAME_SITE, // Resolve site
+  FRAME_MERGE, // Merge objects into new object
+} frame_kind;
+
+typedef enum {
+  // FRAME_SITE
+  SITE_START = 0, // Gathering values, or looking up path of substitution
+  SITE_LOOKUP_ROOT, // Looking up path relative to root, from include
+  SITE_MERGE_WAIT, // Waiting for objects to be merged
+
+  // FRAME_MERGE
+  MERGE_START = 0,
+  MERGE_KEYS, // Finding next key not in later objects
+  MERGE_DEFS, // Resolving definitions of key
+  MERGE_KEY, // Adding key with single value
+  MERGE_NESTED, // Waiting for definitions of key to be merged
+} frame_stage;
+
+/*
+ * Pending work.  A frame that reaches a site not yet resolved waits for
+ * a child frame to resolve it, then continues from where it left off.
+ */
+typedef struct {
+  frame_kind kind;
+  frame_stage stage;
+  size_t ix; // Site being resolved
+  size_t next; // Next element, path element or key to visit
+  size_t cur; // Current value in lookup, or object in merge
+
+  // Values on value stack: from start for a site, or objects to merge
+  size_t start;
+  size_t end;
+
+  // Merge: start of new object on scratch stack, and definitions of
+  // current key on value stack, with next to resolve and next to keep
+  size_t scratch_start;
+  size_t defs_start;
+  size_t def;
+  size_t out;
+} resolve_frame;
+
+typedef struct {
+  tsconfig_tree *tree;
+  size_t tape_size;
+  size_t pool_size;
+  size_t objs_size;
+
+  // State of sites in original tape
+  uint8_t *sites;
+  size_t nsites;
+
+  // Stack of sites being resolved
+  size_t *active;
+  size_t nactive;
+  size_t active_size;
+
+  // Stack of pending work
+  resolve_frame *frames;
+  size_t nframes;
+  size_t frames_size;
+
+  // Tape index of object from last merge
+  size_t result;
+
+  // Stack of tape indices of values being combined
+  size_t *vals;
+  size_t nvals;
+  size_t vals_size;
+
+  // Stack of entries for values being built
+  tscfg_tape_entry *scratch;
+  size_t nscratch;
+  size_t scratch_size;
+
+  // Buffer for building strings
+  char *buf;
+  size_t buf_size;
+
+  // Tape index of shared UNDEF entry, or SIZE_MAX if not yet added
+  size_t undef_ix;
+
+  // Stats to collect into, or NULL
+  tsconfig_stats *stats;
+} resolve_state;
+
+static inline bool is_site(tscfg_tape_tag tag);
+static inline size_t path_start(resolve_state *rs, size_t sub_ix,
+                                bool prefix);
+static tscfg_rc run_frames(resolve_state *rs);
+static tscfg_rc push_frame(resolve_state *rs, resolve_frame f);
+static tscfg_rc push_site(resolve_state *rs, size_t ix);
+static bool wait_site(resolve_state *rs, size_t ix, resolve_frame *child);
+static tscfg_rc wait_merge(resolve_frame *f, size_t start, size_t end,
+                           resolve_frame *child);
+static tscfg_rc step_site(resolve_state *rs, resolve_frame *f,
+                          resolve_frame *child);
+static tscfg_rc step_merge(resolve_state *rs, resolve_frame *f,
+                           resolve_frame *child);
+static tscfg_rc resolve_sub(resolve_state *rs, resolve_frame *f,
+                            resolve_frame *child, size_t *target);
+static tscfg_rc resolve_concat(resolve_state *rs, resolve_frame *f,
+                               resolve_frame *child, size_t *target);
+static tscfg_rc resolve_merge(resolve_state *rs, resolve_frame *f,
+                              resolve_frame *child, size_t *target);
+static void deref(resolve_state *rs, size_t ix, size_t *target);
+static tscfg_rc lookup(resolve_state *rs, resolve_frame *f,
+                       resolve_frame *child, size_t *target);
+static tscfg_rc lookup_env(resolve_state *rs, size_t sub_ix,
+                           size_t *target);
+static tscfg_rc concat_arrays(resolve_state *rs, size_t start,
+                              size_t *target);
+static tscfg_rc concat_strings(resolve_state *rs, size_t start,
+                               size_t *target);
+
+static tscfg_rc check_acyclic(resolve_state *rs);
+static tscfg_rc report_cycle(resolve_state *rs, size_t ix);
+static tscfg_rc path_str(resolve_state *rs, size_t sub_ix, bool prefix,
+                         size_t *len);
+
+static tscfg_rc append_entries(resolve_state *rs, size_t start,
+                               size_t *ix);
+static tscfg_rc push_val(resolve_state *rs, size_t ix);
+static tscfg_rc push_scratch(resolve_state *rs, tscfg_tape_entry e);
+static tscfg_rc reserve_buf(resolve_state *rs, size_t size);
+static tscfg_rc grow_array(void **arr, size_t *size, size_t elem_size,
+                           size_t min_size);
+
+tscfg_rc tscfg_tree_resolve(tsconfig_tree *tree) {
+  tscfg_rc rc;
+
+  resolve_state rs = {
+    .tree = tree,
+    .tape_size = tree->tape_len,
+    .pool_size = tree->pool_len,
+    .objs_size = tree->nobjs,
+    .nsites = tree->tape_len,
+    .undef_ix = SIZE_MAX,
+    .stats = tscfg_stats_current(),
+  };
+
+  rs.sites = tscfg_calloc(rs.nsites > 0 ? rs.nsites : 1, sizeof(rs.sites[0]));
+  TSCFG_CHECK_MALLOC(rs.sites);
+
+  /*
+   * Sites nested in resolved values may still be referenced, e.g. values
+   * in merged objects, so visit every site.  Values appended during
+   * resolution have no sites, so stop at original end of tape.
+   */
+  for (size_t ix = 0; ix < rs.nsites; ix++) {
+    if (is_site(tscfg_tape_get_tag(tree->tape[ix])) &&
+        rs.sites[ix] == SITE_UNVISITED) {
+      rc = push_site(&rs, ix);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+
+      rc = run_frames(&rs);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+    }
+  }
+
+  rc = check_acyclic(&rs);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  assert(rs.nactive == 0 && rs.nvals == 0 && rs.nscratch == 0);
+  rc = TSCFG_OK;
+
+cleanup:
+  tscfg_free(rs.sites);
+  tscfg_free(rs.active);
+  tscfg_free(rs.frames);
+  tscfg_free(rs.vals);
+  tscfg_free(rs.scratch);
+  tscfg_free(rs.buf);
+  return rc;
+}
+
+static inline tscfg_tape_tag tag_at(resolve_state *rs, size_t ix) {
+  return tscfg_tape_get_tag(rs->tree->tape[ix]);
+}
+
+/*
+ * Index of end entry of container at ix.
+ */
+static inline size_t close_at(resolve_state *rs, size_t ix) {
+  return ix + tscfg_tape_get_payload(rs->tree->tape[ix]);
+}
+
+static inline size_t end_at(resolve_state *rs, size_t ix) {
+  return tscfg_val_end((tscfg_val){ .tree = rs->tree, .ix = ix });
+}
+
+static inline bool is_site(tscfg_tape_tag tag) {
+  return tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT ||
+         tag == TSCFG_TAPE_CONCAT || tag == TSCFG_TAPE_MERGE;
+}
+
+/*
+ * Index of first element of path of substitution.
+ * prefix: whether to include prefix from include
+ */
+static inline size_t path_start(resolve_state *rs, size_t sub_ix,
+                                bool prefix) {
+  size_t p = sub_ix + 1;
+  while (!prefix && tag_at(rs, p) == TSCFG_TAPE_PATH_PREFIX) {
+    p++;
+  }
+  return p;
+}
+
+/*
+ * Run frames on stack until it is empty.  A step either finishes its
+ * frame, or sets child to a frame that must finish first, after which
+ * the step is run again.
+ */
+static tscfg_rc run_frames(resolve_state *rs) {
+  tscfg_rc rc;
+
+  while (rs->nframes > 0) {
+    // Step works on copy, since pushing child may reallocate stack
+    size_t fi = rs->nframes - 1;
+    resolve_frame f = rs->frames[fi];
+    resolve_frame child = { .kind = FRAME_NONE };
+    if (f.kind == FRAME_SITE) {
+      rc = step_site(rs, &f, &child);
+    } else {
+      rc = step_merge(rs, &f, &child);
+    }
+    TSCFG_CHECK(rc);
+
+    rs->frames[fi] = f;
+    if (child.kind == FRAME_NONE) {
+      rs->nframes--;
+    } else if (child.kind == FRAME_SITE) {
+      rc = push_site(rs, child.ix);
+      TSCFG_CHECK(rc);
+    } else {
+      rc = push_frame(rs, child);
+      TSCFG_CHECK(rc);
+    }
+  }
+  return TSCFG_OK;
+}
+
+static tscfg_rc push_frame(resolve_state *rs, resolve_frame f) {
+  if (rs->nframes == rs->frames_size) {
+    tscfg_rc rc = grow_array((void**)&rs->frames, &rs->frames_size,
+                             sizeof(rs->frames[0]), rs->nframes + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  rs->frames[rs->nframes++] = f;
+  return TSCFG_OK;
+}
+
+/*
+ * Mark site as active and push frame to resolve it.
+ */
+static tscfg_rc push_site(resolve_state *rs, size_t ix) {
+  tscfg_rc rc;
+
+  assert(rs->sites[ix] == SITE_UNVISITED);
+  if (rs->nactive == rs->active_size) {
+    rc = grow_array((void**)&rs->active, &rs->active_size,
+                    sizeof(rs->active[0]), rs->nactive + 1);
+    TSCFG_CHECK(rc);
+  }
+  rs->active[rs->nactive++] = ix;
+  rs->sites[ix] = SITE_ACTIVE;
+
+  tscfg_tape_tag tag = tag_at(rs, ix);
+  bool sub = tag != TSCFG_TAPE_CONCAT && tag != TSCFG_TAPE_MERGE;
+  return push_frame(rs, (resolve_frame){ .kind = FRAME_SITE, .ix = ix,
+      .next = sub ? path_start(rs, ix, true) : ix + 1,
+      .start = rs->nvals });
+}
+
+/*
+ * If value is a site not yet visited, set child to resolve it.
+ * return: whether value must be resolved first
+ */
+static bool wait_site(resolve_state *rs, size_t ix, resolve_frame *child) {
+  if (is_site(tag_at(rs, ix)) && rs->sites[ix] == SITE_UNVISITED) {
+    *child = (resolve_frame){ .kind = FRAME_SITE, .ix = ix };
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Resolve site and replace it with reference to target.
+ */
+static tscfg_rc step_site(resolve_state *rs, resolve_frame *f,
+                          resolve_frame *child) {
+  tscfg_rc rc;
+
+  size_t target = 0;
+  tscfg_tape_tag tag = tag_at(rs, f->ix);
+  if (tag == TSCFG_TAPE_CONCAT) {
+    rc = resolve_concat(rs, f, child, &target);
+  } else if (tag == TSCFG_TAPE_MERGE) {
+    rc = resolve_merge(rs, f, child, &target);
+  } else {
+    rc = resolve_sub(rs, f, child, &target);
+  }
+  TSCFG_CHECK(rc);
+
+  if (child->kind != FRAME_NONE) {
+    return TSCFG_OK;
+  } else if (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT) {
+    TSCFG_STAT(rs->stats, rs->stats->subs++);
+  }
+
+  // Span is unchanged, so enclosing values can still be skipped over
+  size_t end = close_at(rs, f->ix);
+  rs->tree->tape[f->ix] = tscfg_tape_make(TSCFG_TAPE_REF, end - f->ix);
+  rs->tree->tape[end] = tscfg_tape_make(TSCFG_TAPE_REF_END, target);
+
+  rs->sites[f->ix] = SITE_DONE;
+  rs->nactive--;
+  return TSCFG_OK;
+}
+
+/*
+ * Follow references from value.
+ * target: set to index of value that is not a reference, which is a
+ *         site if one not yet resolved was reached
+ */
+static void deref(resolve_state *rs, size_t ix, size_t *target) {
+  while (tag_at(rs, ix) == TSCFG_TAPE_REF) {
+    ix = tscfg_tape_get_payload(rs->tree->tape[close_at(rs, ix)]);
+  }
+  *target = ix;
+}
+
+static tscfg_rc undef_val(resolve_state *rs, size_t *target) {
+  if (rs->undef_ix == SIZE_MAX) {
+    size_t scratch_start = rs->nscratch;
+    tscfg_rc rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_UNDEF, 0));
+    TSCFG_CHECK(rc);
+
+    rc = append_entries(rs, scratch_start, &rs->undef_ix);
+    TSCFG_CHECK(rc);
+  }
+
+  *target = rs->undef_ix;
+  return TSCFG_OK;
+}
+
+static tscfg_rc resolve_sub(resolve_state *rs, resolve_frame *f,
+                            resolve_frame *child, size_t *target) {
+  tscfg_rc rc;
+
+  size_t ix = f->ix;
+  bool optional = (tag_at(rs, ix) == TSCFG_TAPE_SUB_OPT);
+
+  if (f->stage == SITE_START) {
+    rc = lookup(rs, f, child, target);
+    if (rc != TSCFG_ERR_NOT_FOUND || child->kind != FRAME_NONE) {
+      return rc;
+    }
+
+    f->stage = SITE_LOOKUP_ROOT;
+    f->next = path_start(rs, ix, false);
+    f->cur = 0;
+  }
+
+  if (f->stage == SITE_LOOKUP_ROOT &&
+      tag_at(rs, ix + 1) == TSCFG_TAPE_PATH_PREFIX) {
+    // From included file: fall back to path relative to root
+    rc = lookup(rs, f, child, target);
+    if (rc != TSCFG_ERR_NOT_FOUND || child->kind != FRAME_NONE) {
+      return rc;
+    }
+  }
+
+  rc = lookup_env(rs, ix, target);
+  if (rc != TSCFG_ERR_NOT_FOUND) {
+    return rc;
+  } else if (optional) {
+    return undef_val(rs, target);
+  }
+
+  size_t len;
+  rc = path_str(rs, ix, false, &len);
+  TSCFG_CHECK(rc);
+
+  REPORT_ERR("Could not resolve substitution ${%.*s}", (int)len, rs->buf);
+  return TSCFG_ERR_INVALID;
+}
+/*
+ * Whether substitution is the value at ix or part of its concatenation,
+ * rather than nested inside an object or array in it.
+ */
+static bool self_ref(resolve_state *rs, size_t ix, size_t sub_ix) {
+  while (ix != sub_ix) {
+    tscfg_tape_tag tag = tag_at(rs, ix);
+    if ((tag != TSCFG_TAPE_CONCAT && tag != TSCFG_TAPE_MERGE) ||
+        sub_ix < ix || sub_ix >= close_at(rs, ix)) {
+      return false;
+    }
+
+    size_t end = close_at(rs, ix);
+    size_t e = ix + 1;
+    while (end_at(rs, e) <= sub_ix && e < end) {
+      e = end_at(rs, e);
+    }
+    ix = e;
+  }
+  return true;
+}
+
+/*
+ * Look up path of substitution from root, continuing from path element
+ * f->next in value f->cur.
+ * return: TSCFG_ERR_NOT_FOUND if not present, or path refers to the value
+ *    containing the substitution
+ */
+static tscfg_rc lookup(resolve_state *rs, resolve_frame *f,
+                       resolve_frame *child, size_t *target) {
+  tscfg_rc rc;
+
+  size_t sub_ix = f->ix;
+  size_t path_end = close_at(rs, sub_ix);
+  size_t cur;
+  for (;; f->next++) {
+    deref(rs, f->cur, &cur);
+    if (wait_site(rs, cur, child)) {
+      return TSCFG_OK;
+    }
+
+    tscfg_tape_tag tag = tag_at(rs, cur);
+    if (is_site(tag)) {
+      // Still being resolved
+      if (self_ref(rs, cur, sub_ix)) {
+        // Self-reference with no previous value
+        return TSCFG_ERR_NOT_FOUND;
+      }
+      return report_cycle(rs, cur);
+    }
+
+    if (f->next == path_end) {
+      if ((tag == TSCFG_TAPE_OBJ || tag == TSCFG_TAPE_ARR) &&
+          sub_ix > cur && sub_ix < close_at(rs, cur)) {
+        size_t len;
+        rc = path_str(rs, sub_ix, true, &len);
+        TSCFG_CHECK(rc);
+        REPORT_ERR("Substitution cycle: ${%.*s} refers to value containing "
+                   "it", (int)len, rs->buf);
+        return TSCFG_ERR_INVALID;
+      }
+      break;
+    } else if (tag != TSCFG_TAPE_OBJ) {
+      return TSCFG_ERR_NOT_FOUND;
+    }
+
+    size_t len;
+    const char *key = tscfg_tape_str(rs->tree, rs->tree->tape[f->next],
+                                     &len);
+    rc = tscfg_obj_find(rs->tree, cur, key, len, &f->cur);
+    if (rc != TSCFG_OK) {
+      return rc;
+    }
+  }
+
+  if (tag_at(rs, cur) == TSCFG_TAPE_UNDEF &&
+      tag_at(rs, sub_ix) == TSCFG_TAPE_SUB) {
+    // Required substitution can't refer to undefined value
+    return TSCFG_ERR_NOT_FOUND;
+  }
+
+  *target = cur;
+  return TSCFG_OK;
+}
+
+/*
+ * Look up environment variable named by path of substitution.
+ */
+static tscfg_rc lookup_env(resolve_state *rs, size_t sub_ix,
+                           size_t *target) {
+  tscfg_rc rc;
+
+  size_t len;
+  rc = path_str(rs, sub_ix, false, &len);
+  TSCFG_CHECK(rc);
+
+  const char *val = getenv(rs->buf);
+  if (val == NULL) {
+    return TSCFG_ERR_NOT_FOUND;
+  }
+
+  tsconfig_tree *tree = rs->tree;
+  uint64_t off;
+  rc = tscfg_pool_add(&tree->pool, &tree->pool_len, &rs->pool_size,
+                      val, strlen(val), &off);
+  TSCFG_CHECK(rc);
+
+  size_t scratch_start = rs->nscratch;
+  rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_STRING, off));
+  TSCFG_CHECK(rc);
+
+  return append_entries(rs, scratch_start, target);
+}
+
+/*
+ * Resolve concatenation of values.  Undefined values are dropped, then
+ * remaining values must be all objects, which are merged, all arrays,
+ * which are concatenated, or all scalars, which are concatenated into
+ * a string.  Values are gathered onto the value stack from f->start.
+ */
+static tscfg_rc resolve_concat(resolve_state *rs, resolve_frame *f,
+                               resolve_frame *child, size_t *target) {
+  tscfg_rc rc;
+
+  size_t vals_start = f->start;
+  if (f->stage == SITE_MERGE_WAIT) {
+    *target = rs->result;
+    rs->nvals = vals_start;
+    return TSCFG_OK;
+  }
+
+  // Tape may be reallocated when resolving elements, so index each time
+  for (; f->next < close_at(rs, f->ix); f->next = end_at(rs, f->next)) {
+    size_t val;
+    deref(rs, f->next, &val);
+    if (wait_site(rs, val, child)) {
+      return TSCFG_OK;
+    } else if (is_site(tag_at(rs, val))) {
+      rs->nvals = vals_start;
+      return report_cycle(rs, val);
+    } else if (tag_at(rs, val) != TSCFG_TAPE_UNDEF) {
+      rc = push_val(rs, val);
+      TSCFG_CHECK(rc);
+    }
+  }
+
+  size_t nobjs = 0, narrs = 0, nscalars = 0;
+  for (size_t i = vals_start; i < rs->nvals; i++) {
+    switch (tag_at(rs, rs->vals[i])) {
+      case TSCFG_TAPE_WS:
+        break;
+      case TSCFG_TAPE_OBJ:
+        nobjs++;
+        break;
+      case TSCFG_TAPE_ARR:
+        narrs++;
+        break;
+      default:
+        nscalars++;
+        break;
+    }
+  }
+
+  if ((nobjs > 0) + (narrs > 0) + (nscalars > 0) > 1) {
+    rs->nvals = vals_start;
+    REPORT_ERR("Cannot concatenate %s with %s",
+               (nobjs > 0) ? "object" : "array",
+               (nscalars > 0) ? "string" : "array");
+    return TSCFG_ERR_INVALID;
+  }
+
+  if (nobjs > 0 || narrs > 0) {
+    // Whitespace between objects or arrays is insignificant
+    size_t out = vals_start;
+    for (size_t i = vals_start; i < rs->nvals; i++) {
+      if (tag_at(rs, rs->vals[i]) != TSCFG_TAPE_WS) {
+        rs->vals[out++] = rs->vals[i];
+      }
+    }
+    rs->nvals = out;
+  } else {
+    // Whitespace at ends is trimmed
+    while (rs->nvals > vals_start &&
+           tag_at(rs, rs->vals[rs->nvals - 1]) == TSCFG_TAPE_WS) {
+      rs->nvals--;
+    }
+    size_t first = vals_start;
+    while (first < rs->nvals && tag_at(rs, rs->vals[first]) == TSCFG_TAPE_WS) {
+      first++;
+    }
+    memmove(&rs->vals[vals_start], &rs->vals[first],
+            sizeof(rs->vals[0]) * (rs->nvals - first));
+    rs->nvals -= first - vals_start;
+  }
+
+  size_t n = rs->nvals - vals_start;
+  if (n == 0) {
+    rc = undef_val(rs, target);
+  } else if (n == 1) {
+    // Refer to single value directly, keeping its type
+    *target = rs->vals[vals_start];
+    rc = TSCFG_OK;
+  } else if (nobjs > 0) {
+    return wait_merge(f, vals_start, rs->nvals, child);
+  } else if (narrs > 0) {
+    rc = concat_arrays(rs, vals_start, target);
+  } else {
+    rc = concat_strings(rs, vals_start, target);
+  }
+
+  rs->nvals = vals_start;
+  return rc;
+}
+
+/*
+ * Resolve definitions of a key in order: undefined values are skipped,
+ * objects are merged with a previous object and other values override.
+ */
+static tscfg_rc resolve_merge(resolve_state *rs, resolve_frame *f,
+                              resolve_frame *child, size_t *target) {
+  tscfg_rc rc;
+
+  size_t vals_start = f->start;
+  if (f->stage == SITE_MERGE_WAIT) {
+    *target = rs->result;
+    rs->nvals = vals_start;
+    return TSCFG_OK;
+  }
+
+  // Tape may be reallocated when resolving elements, so index each time
+  for (; f->next < close_at(rs, f->ix); f->next = end_at(rs, f->next)) {
+    size_t val;
+    deref(rs, f->next, &val);
+    if (wait_site(rs, val, child)) {
+      return TSCFG_OK;
+    } else if (is_site(tag_at(rs, val))) {
+      rs->nvals = vals_start;
+      return report_cycle(rs, val);
+    }
+
+    tscfg_tape_tag tag = tag_at(rs, val);
+    if (tag == TSCFG_TAPE_UNDEF) {
+      continue;
+    } else if (tag != TSCFG_TAPE_OBJ || rs->nvals == vals_start ||
+               tag_at(rs, rs->vals[vals_start]) != TSCFG_TAPE_OBJ) {
+      // Overrides previous value, if any
+      rs->nvals = vals_start;
+    }
+
+    rc = push_val(rs, val);
+    TSCFG_CHECK(rc);
+  }
+
+  size_t n = rs->nvals - vals_start;
+  if (n == 0) {
+    rc = undef_val(rs, target);
+  } else if (n == 1) {
+    *target = rs->vals[vals_start];
+    rc = TSCFG_OK;
+  } else {
+    return wait_merge(f, vals_start, rs->nvals, child);
+  }
+
+  rs->nvals = vals_start;
+  return rc;
+}
+
+/*
+ * Set child to merge objects on value stack, with result in rs->result
+ * when frame is run again.
+ */
+static tscfg_rc wait_merge(resolve_frame *f, size_t start, size_t end,
+                           resolve_frame *child) {
+  f->stage = (f->kind == FRAME_SITE) ? SITE_MERGE_WAIT : MERGE_NESTED;
+  *child = (resolve_frame){ .kind = FRAME_MERGE, .start = start,
+                            .end = end };
+  return TSCFG_OK;
+}
+
+/*
+ * Whether object has key in it.
+ */
+static bool obj_has_key(resolve_state *rs, size_t obj_ix, const char *key,
+                        size_t len) {
+  size_t val_ix;
+  return tscfg_obj_find(rs->tree, obj_ix, key, len, &val_ix) == TSCFG_OK;
+}
+
+/*
+ * Merge objects on value stack from f->start to f->end, with later
+ * objects taking precedence, into a new object, setting rs->result.
+ * Values of a key that are objects in consecutive objects are merged by
+ * a child frame.
+ */
+static tscfg_rc step_merge(resolve_state *rs, resolve_frame *f,
+                           resolve_frame *child) {
+  tscfg_rc rc;
+
+  if (f->stage == MERGE_START) {
+    f->scratch_start = rs->nscratch;
+    rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_OBJ, 0));
+    TSCFG_CHECK(rc);
+
+    // Visit keys from last object to first, skipping those seen already
+    f->cur = f->end;
+    f->next = 0;
+    f->stage = MERGE_KEYS;
+  }
+
+  while (true) {
+    size_t val_ix;
+    if (f->stage == MERGE_KEYS) {
+      if (f->next == 0 || f->next >= close_at(rs, rs->vals[f->cur])) {
+        if (f->cur == f->start) {
+          break;
+        }
+        f->cur--;
+        f->next = rs->vals[f->cur] + 1;
+        continue;
+      }
+
+      size_t len;
+      const char *str = tscfg_tape_str(rs->tree, rs->tree->tape[f->next],
+                                       &len);
+      bool seen = false;
+      for (size_t j = f->cur + 1; j < f->end && !seen; j++) {
+        seen = obj_has_key(rs, rs->vals[j], str, len);
+      }
+      if (seen) {
+        f->next = end_at(rs, f->next + 1);
+        continue;
+      }
+
+      // Gather definitions from this and earlier objects, latest first
+      f->defs_start = rs->nvals;
+      for (size_t j = f->cur + 1; j-- > f->start; ) {
+        rc = tscfg_obj_find(rs->tree, rs->vals[j], str, len, &val_ix);
+        if (rc == TSCFG_ERR_NOT_FOUND) {
+          continue;
+        }
+        TSCFG_CHECK(rc);
+
+        rc = push_val(rs, val_ix);
+        TSCFG_CHECK(rc);
+      }
+
+      // Otherwise single definition is resolved later if needed
+      if (rs->nvals - f->defs_start > 1) {
+        f->stage = MERGE_DEFS;
+        f->def = f->out = f->defs_start;
+      } else {
+        f->stage = MERGE_KEY;
+        continue;
+      }
+    }
+
+    if (f->stage == MERGE_DEFS) {
+      // Resolve to find which definitions are merged
+      for (; f->def < rs->nvals; f->def++) {
+        deref(rs, rs->vals[f->def], &val_ix);
+        if (wait_site(rs, val_ix, child)) {
+          return TSCFG_OK;
+        }
+
+        tscfg_tape_tag tag = tag_at(rs, val_ix);
+        if (is_site(tag)) {
+          return report_cycle(rs, val_ix);
+        } else if (tag == TSCFG_TAPE_UNDEF) {
+          continue;
+        } else if (f->out > f->defs_start &&
+                   (tag != TSCFG_TAPE_OBJ ||
+                    tag_at(rs, rs->vals[f->defs_start]) != TSCFG_TAPE_OBJ)) {
+          // Overridden by later definitions
+          break;
+        }
+        rs->vals[f->out++] = val_ix;
+      }
+      rs->nvals = f->out;
+
+      size_t ndefs = rs->nvals - f->defs_start;
+      if (ndefs > 1) {
+        // Put in definition order before merging
+        for (size_t a = f->defs_start, b = rs->nvals - 1; a < b; a++, b--) {
+          size_t tmp = rs->vals[a];
+          rs->vals[a] = rs->vals[b];
+          rs->vals[b] = tmp;
+        }
+        return wait_merge(f, f->defs_start, rs->nvals, child);
+      }
+      f->stage = MERGE_KEY;
+    }
+
+    if (f->stage == MERGE_NESTED) {
+      val_ix = rs->result;
+    } else if (rs->nvals > f->defs_start) {
+      val_ix = rs->vals[f->defs_start];
+    } else {
+      // Only undefined values
+      f->next = end_at(rs, f->next + 1);
+      f->stage = MERGE_KEYS;
+      continue;
+    }
+    rs->nvals = f->defs_start;
+
+    tscfg_tape_entry key = rs->tree->tape[f->next];
+    rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_KEY,
+                                          tscfg_tape_get_payload(key)));
+    TSCFG_CHECK(rc);
+    rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_REF, 1));
+    TSCFG_CHECK(rc);
+    rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_REF_END, val_ix));
+    TSCFG_CHECK(rc);
+
+    f->next = end_at(rs, f->next + 1);
+    f->stage = MERGE_KEYS;
+  }
+
+  size_t len = rs->nscratch - f->scratch_start;
+  rs->scratch[f->scratch_start] = tscfg_tape_make(TSCFG_TAPE_OBJ, len);
+  rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_OBJ_END,
+                                        rs->tree->nobjs++));
+  TSCFG_CHECK(rc);
+
+  rc = append_entries(rs, f->scratch_start, &rs->result);
+  TSCFG_CHECK(rc);
+
+  return tscfg_tree_index_obj(rs->tree, rs->result, &rs->objs_size);
+}
+
+/*
+ * Concatenate arrays on value stack from start to top into a new array.
+ */
+static tscfg_rc concat_arrays(resolve_state *rs, size_t start,
+                              size_t *target) {
+  tscfg_rc rc;
+
+  size_t scratch_start = rs->nscratch;
+  rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_ARR, 0));
+  TSCFG_CHECK(rc);
+
+  for (size_t i = start; i < rs->nvals; i++) {
+    size_t arr_ix = rs->vals[i];
+    size_t arr_close = close_at(rs, arr_ix);
+    for (size_t e = arr_ix + 1; e < arr_close; e = end_at(rs, e)) {
+      rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_REF, 1));
+      TSCFG_CHECK(rc);
+      rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_REF_END, e));
+      TSCFG_CHECK(rc);
+    }
+  }
+
+  size_t len = rs->nscratch - scratch_start;
+  rs->scratch[scratch_start] = tscfg_tape_make(TSCFG_TAPE_ARR, len);
+  rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_ARR_END, len));
+  TSCFG_CHECK(rc);
+
+  return append_entries(rs, scratch_start, target);
+}
+
+/*
+ * Text of scalar value.
+ */
+static const char *scalar_str(resolve_state *rs, size_t ix, size_t *len) {
+  tscfg_tape_entry e = rs->tree->tape[ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_TRUE:
+      *len = 4;
+      return "true";
+    case TSCFG_TAPE_FALSE:
+      *len = 5;
+      return "false";
+    case TSCFG_TAPE_NULL:
+      *len = 4;
+      return "null";
+    default:
+      return tscfg_tape_str(rs->tree, e, len);
+  }
+}
+
+/*
+ * Concatenate scalars on value stack from start to top into a new string.
+ */
+static tscfg_rc concat_strings(resolve_state *rs, size_t start,
+                               size_t *target) {
+  tscfg_rc rc;
+
+  size_t total = 0;
+  for (size_t i = start; i < rs->nvals; i++) {
+    size_t len;
+    scalar_str(rs, rs->vals[i], &len);
+    TSCFG_COND(len <= SIZE_MAX - 1 - total, TSCFG_ERR_OOM);
+    total += len;
+  }
+
+  rc = reserve_buf(rs, total + 1);
+  TSCFG_CHECK(rc);
+
+  size_t pos = 0;
+  for (size_t i = start; i < rs->nvals; i++) {
+    size_t len;
+    const char *str = scalar_str(rs, rs->vals[i], &len);
+    memcpy(&rs->buf[pos], str, len);
+    pos += len;
+  }
+
+  tsconfig_tree *tree = rs->tree;
+  uint64_t off;
+  rc = tscfg_pool_add(&tree->pool, &tree->pool_len, &rs->pool_size,
+                      rs->buf, total, &off);
+  TSCFG_CHECK(rc);
+
+  size_t scratch_start = rs->nscratch;
+  rc = push_scratch(rs, tscfg_tape_make(TSCFG_TAPE_STRING, off));
+  TSCFG_CHECK(rc);
+
+  return append_entries(rs, scratch_start, target);
+}
+
+/*
+ * Check that no value contains a reference to itself, which is possible
+ * if a substitution refers to a merged object containing it.  Containers
+ * are visited depth first, each only once.
+ */
+static tscfg_rc check_acyclic(resolve_state *rs) {
+  tscfg_rc rc;
+  tsconfig_tree *tree = rs->tree;
+
+  uint8_t *visited = tscfg_calloc(tree->tape_len, sizeof(visited[0]));
+  TSCFG_CHECK_MALLOC(visited);
+
+  // Stack of (container, next element) pairs
+  assert(rs->nvals == 0);
+  rc = push_val(rs, 0);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+  rc = push_val(rs, 0);
+  TSCFG_CHECK_GOTO(rc, cleanup);
+
+  while (rs->nvals > 0) {
+    size_t ix = rs->vals[rs->nvals - 2];
+    size_t next = rs->vals[rs->nvals - 1];
+
+    if (next == 0) {
+      // Root or newly reached element
+      ix = tscfg_val_deref((tscfg_val){ .tree = tree, .ix = ix }).ix;
+      tscfg_tape_tag tag = tag_at(rs, ix);
+      if ((tag != TSCFG_TAPE_OBJ && tag != TSCFG_TAPE_ARR) ||
+          visited[ix] == SITE_DONE) {
+        rs->nvals -= 2;
+        continue;
+      } else if (visited[ix] == SITE_ACTIVE) {
+        REPORT_ERR("Substitution cycle: value contains reference to "
+                   "itself");
+        rc = TSCFG_ERR_INVALID;
+        goto cleanup;
+      }
+
+      visited[ix] = SITE_ACTIVE;
+      next = ix + 1;
+      rs->vals[rs->nvals - 2] = ix;
+    }
+
+    if (next >= close_at(rs, ix)) {
+      visited[ix] = SITE_DONE;
+      rs->nvals -= 2;
+      continue;
+    }
+
+    // Skip over key to value
+    size_t elem = next;
+    if (tag_at(rs, ix) == TSCFG_TAPE_OBJ) {
+      elem++;
+    }
+    rs->vals[rs->nvals - 1] = end_at(rs, elem);
+
+    rc = push_val(rs, elem);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+    rc = push_val(rs, 0);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+  }
+
+  rc = TSCFG_OK;
+cleanup:
+  rs->nvals = 0;
+  tscfg_free(visited);
+  return rc;
+}
+
+/*
+ * Report cycle through active sites, starting from ix.
+ */
+static tscfg_rc report_cycle(resolve_state *rs, size_t ix) {
+  tscfg_rc rc;
+
+  size_t first = rs->nactive;
+  while (first > 0 && rs->active[first - 1] != ix) {
+    first--;
+  }
+  assert(first > 0);
+
+  // Describe substitutions in cycle, in order they were reached
+  size_t msg_size = 0;
+  char *msg = NULL;
+  size_t msg_len = 0;
+  for (size_t i = first - 1; i < rs->nactive; i++) {
+    size_t site = rs->active[i];
+    tscfg_tape_tag tag = tag_at(rs, site);
+    if (tag == TSCFG_TAPE_CONCAT || tag == TSCFG_TAPE_MERGE) {
+      continue;
+    }
+
+    size_t len;
+    rc = path_str(rs, site, true, &len);
+    TSCFG_CHECK_GOTO(rc, cleanup);
+
+    if (msg_len + len + 8 > msg_size) {
+      rc = grow_array((void**)&msg, &msg_size, 1, msg_len + len + 8);
+      TSCFG_CHECK_GOTO(rc, cleanup);
+    }
+    if (msg_len > 0) {
+      memcpy(&msg[msg_len], " -> ", 4);
+      msg_len += 4;
+    }
+    memcpy(&msg[msg_len], "${", 2);
+    memcpy(&msg[msg_len + 2], rs->buf, len);
+    msg[msg_len + 2 + len] = '}';
+    msg_len += len + 3;
+  }
+
+  REPORT_ERR("Substitution cycle: %.*s", (int)msg_len,
+             msg != NULL ? msg : "");
+  rc = TSCFG_ERR_INVALID;
+
+cleanup:
+  tscfg_free(msg);
+  return rc;
+}
+
+/*
+ * Write path of substitution into buffer with elements separated by '.'.
+ * prefix: whether to include prefix from include
+ * len: set to length of path, excluding null terminator
+ */
+static tscfg_rc path_str(resolve_state *rs, size_t sub_ix, bool prefix,
+                         size_t *len) {
+  size_t start = path_start(rs, sub_ix, prefix);
+  size_t end = close_at(rs, sub_ix);
+
+  size_t total = 0;
+  for (size_t p = start; p < end; p++) {
+    size_t elem_len;
+    tscfg_tape_str(rs->tree, rs->tree->tape[p], &elem_len);
+    TSCFG_COND(elem_len <= SIZE_MAX - 2 - total, TSCFG_ERR_OOM);
+    total += elem_len + 1;
+  }
+
+  tscfg_rc rc = reserve_buf(rs, total + 1);
+  TSCFG_CHECK(rc);
+
+  size_t pos = 0;
+  for (size_t p = start; p < end; p++) {
+    if (p > start) {
+      rs->buf[pos++] = '.';
+    }
+    size_t elem_len;
+    const char *elem = tscfg_tape_str(rs->tree, rs->tree->tape[p],
+                                      &elem_len);
+    memcpy(&rs->buf[pos], elem, elem_len);
+    pos += elem_len;
+  }
+  rs->buf[pos] = '\0';
+
+  *len = pos;
+  return TSCFG_OK;
+}
+
+/*
+ * Move entries from scratch stack to end of tape.
+ * start: start of entries in scratch stack
+ * ix: set to tape index of first entry
+ */
+static tscfg_rc append_entries(resolve_state *rs, size_t start,
+                               size_t *ix) {
+  tsconfig_tree *tree = rs->tree;
+  size_t n = rs->nscratch - start;
+
+  if (n > rs->tape_size - tree->tape_len) {
+    TSCFG_COND(n <= SIZE_MAX - tree->tape_len, TSCFG_ERR_OOM);
+    tscfg_rc rc = grow_array((void**)&tree->tape, &rs->tape_size,
+                             sizeof(tree->tape[0]), tree->tape_len + n);
+    TSCFG_CHECK(rc);
+  }
+
+  TSCFG_COND(tree->tape_len + n <= TSCFG_TAPE_PAYLOAD_MAX, TSCFG_ERR_OOM);
+  memcpy(&tree->tape[tree->tape_len], &rs->scratch[start],
+         sizeof(tree->tape[0]) * n);
+  *ix = tree->tape_len;
+  tree->tape_len += n;
+  rs->nscratch = start;
+  return TSCFG_OK;
+}
+
+static tscfg_rc push_val(resolve_state *rs, size_t ix) {
+  if (rs->nvals == rs->vals_size) {
+    tscfg_rc rc = grow_array((void**)&rs->vals, &rs->vals_size,
+                             sizeof(rs->vals[0]), rs->nvals + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  rs->vals[rs->nvals++] = ix;
+  return TSCFG_OK;
+}
+
+static tscfg_rc push_scratch(resolve_state *rs, tscfg_tape_entry e) {
+  if (rs->nscratch == rs->scratch_size) {
+    tscfg_rc rc = grow_array((void**)&rs->scratch, &rs->scratch_size,
+                             sizeof(rs->scratch[0]), rs->nscratch + 1);
+    TSCFG_CHECK(rc);
+  }
+
+  rs->scratch[rs->nscratch++] = e;
+  return TSCFG_OK;
+}
+
+static tscfg_rc reserve_buf(resolve_state *rs, size_t size) {
+  if (size > rs->buf_size) {
+    return grow_array((void**)&rs->buf, &rs->buf_size, 1, size);
+  }
+  return TSCFG_OK;
+}
+
+/*
+ * Grow array by doubling until it has at least min_size elements.
+ */
+static tscfg_rc grow_array(void **arr, size_t *size, size_t elem_size,
+                           size_t min_size) {
+  size_t new_size = (*size > 0) ? *size : INIT_STACK_SIZE;
+  while (new_size < min_size) {
+    TSCFG_COND(new_size <= SIZE_MAX / 2, TSCFG_ERR_OOM);
+    new_size *= 2;
+  }
+  TSCFG_COND(new_size <= SIZE_MAX / elem_size, TSCFG_ERR_OOM);
+
+  void *new_arr = tscfg_realloc(*arr, new_size * elem_size);
+  TSCFG_CHECK_MALLOC(new_arr);
+
+  *arr = new_arr;
+  *size = new_size;
+  return TSCFG_OK;
+}
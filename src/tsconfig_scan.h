@@ -0,0 +1,304 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Vectorized scanning for runs of ASCII bytes in lexer buffer or strings.
+ *
+ * Each function returns the length of the longest prefix of the buffer
+ * made up of bytes in some class.  Non-ASCII bytes end a run so that
+ * the caller can fall back to decoding UTF-8, except in the _utf8
+ * variants for input already validated.
+ *
+ * Uses AVX2, SSE2 or NEON if enabled at compile time, otherwise scalar
+ * code.
+ */
+
+#ifndef __TSCONFIG_SCAN_H
+#define __TSCONFIG_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define TSCFG_VEC_BYTES 32
+typedef __m256i tscfg_vec;
+
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define vec_set1(c) _mm256_set1_epi8((char)(c))
+#define vec_eq(x, c) _mm256_cmpeq_epi8((x), vec_set1(c))
+#define vec_or(a, b) _mm256_or_si256((a), (b))
+#define vec_not(a) _mm256_xor_si256((a), _mm256_set1_epi8(-1))
+#define vec_min(a, b) _mm256_min_epu8((a), (b))
+#define vec_sub(a, b) _mm256_sub_epi8((a), (b))
+#define vec_veq(a, b) _mm256_cmpeq_epi8((a), (b))
+#define vec_nonascii(x) _mm256_cmpgt_epi8(_mm256_setzero_si256(), (x))
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define TSCFG_VEC_BYTES 16
+typedef __m128i tscfg_vec;
+
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define vec_set1(c) _mm_set1_epi8((char)(c))
+#define vec_eq(x, c) _mm_cmpeq_epi8((x), vec_set1(c))
+#define vec_or(a, b) _mm_or_si128((a), (b))
+#define vec_not(a) _mm_xor_si128((a), _mm_set1_epi8(-1))
+#define vec_min(a, b) _mm_min_epu8((a), (b))
+#define vec_sub(a, b) _mm_sub_epi8((a), (b))
+#define vec_veq(a, b) _mm_cmpeq_epi8((a), (b))
+#define vec_nonascii(x) _mm_cmplt_epi8((x), _mm_setzero_si128())
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define TSCFG_VEC_BYTES 16
+typedef uint8x16_t tscfg_vec;
+
+#define vec_load(p) vld1q_u8((const uint8_t *)(p))
+#define vec_set1(c) vdupq_n_u8((uint8_t)(c))
+#define vec_eq(x, c) vceqq_u8((x), vec_set1(c))
+#define vec_or(a, b) vorrq_u8((a), (b))
+#define vec_not(a) vmvnq_u8(a)
+#define vec_min(a, b) vminq_u8((a), (b))
+#define vec_sub(a, b) vsubq_u8((a), (b))
+#define vec_veq(a, b) vceqq_u8((a), (b))
+#define vec_nonascii(x) vcgeq_u8((x), vec_set1(0x80))
+
+#endif
+
+#ifdef TSCFG_VEC_BYTES
+/*
+ * Byte mask for bytes x in range [lo, hi].
+ * Uses unsigned wraparound so only needs one comparison.
+ */
+#define vec_range(x, lo, hi) \
+  vec_veq(vec_min(vec_sub((x), vec_set1(lo)), vec_set1((hi) - (lo))), \
+          vec_sub((x), vec_set1(lo)))
+
+/*
+ * Index of first set byte in comparison result, or TSCFG_VEC_BYTES
+ */
+static inline size_t vec_first(tscfg_vec m) {
+#if defined(__AVX2__)
+  uint32_t bits = (uint32_t)_mm256_movemask_epi8(m);
+  return bits == 0 ? TSCFG_VEC_BYTES : (size_t)__builtin_ctz(bits);
+#elif defined(__SSE2__)
+  uint32_t bits = (uint32_t)_mm_movemask_epi8(m);
+  return bits == 0 ? TSCFG_VEC_BYTES : (size_t)__builtin_ctz(bits);
+#else
+  // Narrow each byte to 4 bits of a 64-bit word
+  uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+  return bits == 0 ? TSCFG_VEC_BYTES : (size_t)(__builtin_ctzll(bits) >> 2);
+#endif
+}
+
+/*
+ * Number of set bytes in comparison result.
+ */
+static inline size_t vec_count(tscfg_vec m) {
+#if defined(__AVX2__)
+  return (size_t)__builtin_popcount((uint32_t)_mm256_movemask_epi8(m));
+#elif defined(__SSE2__)
+  return (size_t)__builtin_popcount((uint32_t)_mm_movemask_epi8(m));
+#else
+  uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+  return (size_t)(__builtin_popcountll(bits) >> 2);
+#endif
+}
+#endif // TSCFG_VEC_BYTES
+
+/*
+ * Scalar classification: ASCII whitespace according to HOCON.
+ */
+static inline bool tscfg_scan_is_ws(unsigned char b) {
+  return (b >= '\t' && b <= '\r') || (b >= 0x1C && b <= ' ');
+}
+
+/*
+ * Scalar classification: ASCII byte that can be appended to unquoted text
+ * without any lookahead, i.e. excluding forbidden characters, whitespace
+ * and '/', which may start a comment.
+ */
+static inline bool tscfg_scan_is_unquoted(unsigned char b) {
+  switch (b) {
+    case '$': case '"': case '{': case '}': case '[': case ']':
+    case ':': case '=': case ',': case '+': case '#': case '`':
+    case '^': case '?': case '!': case '@': case '*': case '&':
+    case '\\': case '/':
+      return false;
+    default:
+      return b < 0x80 && !tscfg_scan_is_ws(b);
+  }
+}
+
+/*
+ * Length of run of bytes that can be copied into unquoted text.
+ */
+static inline size_t tscfg_scan_unquoted(const unsigned char *p, size_t len) {
+  size_t i = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    tscfg_vec x = vec_load(&p[i]);
+    tscfg_vec stop = vec_nonascii(x);
+    // Whitespace 0x1C-0x20 is adjacent to forbidden ! " # $
+    stop = vec_or(stop, vec_range(x, '\t', '\r'));
+    stop = vec_or(stop, vec_range(x, 0x1C, '$'));
+    stop = vec_or(stop, vec_eq(x, '&'));
+    stop = vec_or(stop, vec_range(x, '*', ','));
+    stop = vec_or(stop, vec_eq(x, '/'));
+    stop = vec_or(stop, vec_eq(x, ':'));
+    stop = vec_or(stop, vec_eq(x, '='));
+    stop = vec_or(stop, vec_range(x, '?', '@'));
+    stop = vec_or(stop, vec_range(x, '[', '^'));
+    stop = vec_or(stop, vec_eq(x, '`'));
+    stop = vec_or(stop, vec_eq(x, '{'));
+    stop = vec_or(stop, vec_eq(x, '}'));
+
+    size_t first = vec_first(stop);
+    if (first < TSCFG_VEC_BYTES) {
+      return i + first;
+    }
+  }
+#endif
+  while (i < len && tscfg_scan_is_unquoted(p[i])) {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Length of run of ASCII whitespace.
+ */
+static inline size_t tscfg_scan_ws(const unsigned char *p, size_t len) {
+  size_t i = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    tscfg_vec x = vec_load(&p[i]);
+    tscfg_vec ws = vec_or(vec_range(x, '\t', '\r'), vec_range(x, 0x1C, ' '));
+
+    size_t first = vec_first(vec_not(ws));
+    if (first < TSCFG_VEC_BYTES) {
+      return i + first;
+    }
+  }
+#endif
+  while (i < len && tscfg_scan_is_ws(p[i])) {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Length of run of ASCII bytes not equal to either of two ASCII bytes.
+ */
+static inline size_t tscfg_scan_until(const unsigned char *p, size_t len,
+                                      unsigned char c1, unsigned char c2) {
+  size_t i = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    tscfg_vec x = vec_load(&p[i]);
+    tscfg_vec stop = vec_or(vec_nonascii(x),
+                            vec_or(vec_eq(x, c1), vec_eq(x, c2)));
+
+    size_t first = vec_first(stop);
+    if (first < TSCFG_VEC_BYTES) {
+      return i + first;
+    }
+  }
+#endif
+  while (i < len && p[i] < 0x80 && p[i] != c1 && p[i] != c2) {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Length of run of bytes not equal to either of two ASCII bytes.
+ * Unlike tscfg_scan_until, non-ASCII bytes do not end the run, so
+ * the buffer must be known to be valid UTF-8.
+ */
+static inline size_t tscfg_scan_until_utf8(const unsigned char *p, size_t len,
+                                      unsigned char c1, unsigned char c2) {
+  size_t i = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    tscfg_vec x = vec_load(&p[i]);
+    tscfg_vec stop = vec_or(vec_eq(x, c1), vec_eq(x, c2));
+
+    size_t first = vec_first(stop);
+    if (first < TSCFG_VEC_BYTES) {
+      return i + first;
+    }
+  }
+#endif
+  while (i < len && p[i] != c1 && p[i] != c2) {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Length of run of bytes that can be copied into a quoted string without
+ * escaping, i.e. not '"', '\\' or a control character below 0x20.
+ * Non-ASCII bytes do not end the run, so the string must be valid UTF-8.
+ */
+static inline size_t tscfg_scan_quoted_utf8(const unsigned char *p,
+                                            size_t len) {
+  size_t i = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    tscfg_vec x = vec_load(&p[i]);
+    tscfg_vec stop = vec_or(vec_range(x, 0x00, 0x1F),
+                            vec_or(vec_eq(x, '"'), vec_eq(x, '\\')));
+
+    size_t first = vec_first(stop);
+    if (first < TSCFG_VEC_BYTES) {
+      return i + first;
+    }
+  }
+#endif
+  while (i < len && p[i] >= 0x20 && p[i] != '"' && p[i] != '\\') {
+    i++;
+  }
+  return i;
+}
+
+/*
+ * Number of bytes equal to ASCII byte c.
+ */
+static inline size_t tscfg_scan_count(const unsigned char *p, size_t len,
+                                      unsigned char c) {
+  size_t i = 0, count = 0;
+#ifdef TSCFG_VEC_BYTES
+  for (; i + TSCFG_VEC_BYTES <= len; i += TSCFG_VEC_BYTES) {
+    count += vec_count(vec_eq(vec_load(&p[i]), c));
+  }
+#endif
+  for (; i < len; i++) {
+    count += (p[i] == c);
+  }
+  return count;
+}
+
+#endif // __TSCONFIG_SCAN_H
@@ -0,0 +1,285 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Shared trees and snapshots for hot reload.
+ *
+ * Each publish increments the snapshot's epoch.  A reader stores the
+ * epoch it saw in its slot before loading the current tree, and clears
+ * the slot on release.  A tree replaced by the publish that made epoch e
+ * can only be held by readers with a slot epoch below e: readers that saw
+ * e or later load the current tree after it was replaced.  Atomics are
+ * sequentially consistent, so a publisher scanning slots either sees a
+ * reader's slot, or the reader sees the new tree.
+ */
+
+#include "tsconfig_snapshot.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+
+struct tsconfig_shared_tree {
+  tsconfig_tree tree;
+  size_t refs; // Updated atomically
+};
+
+/*
+ * Tree replaced in snapshot, with reference to be released once unused.
+ */
+typedef struct retired_tree {
+  tsconfig_shared_tree *shared;
+  uint64_t epoch; // Epoch of publish that replaced tree
+  struct retired_tree *next;
+} retired_tree;
+
+struct tsconfig_snapshot_reader {
+  tsconfig_snapshot *snap;
+
+  // Epoch seen by acquire, 0 if no tree held.  Read by publishers.
+  uint64_t epoch;
+
+  tsconfig_snapshot_reader *next;
+};
+
+struct tsconfig_snapshot {
+  // Current tree, or NULL.  Accessed atomically.
+  tsconfig_shared_tree *current;
+
+  // Number of publishes plus one.  Accessed atomically.
+  uint64_t epoch;
+
+  // Serializes publishes, and protects readers and retired lists
+  pthread_mutex_t lock;
+  tsconfig_snapshot_reader *readers;
+  retired_tree *retired;
+};
+
+static tsconfig_shared_tree *acquire(tsconfig_snapshot_reader *reader);
+static retired_tree *take_unused(tsconfig_snapshot *snap);
+static void release_retired(retired_tree *list);
+
+tscfg_rc tsconfig_tree_share(tsconfig_tree *tree,
+                             tsconfig_shared_tree **shared) {
+  // Allocated with the tree, so freed with it
+  const tscfg_allocator *prev = tscfg_alloc_use(tree->alloc);
+  tsconfig_shared_tree *s = tscfg_malloc(sizeof(tsconfig_shared_tree));
+  tscfg_alloc_use(prev);
+  TSCFG_CHECK_MALLOC(s);
+
+  s->tree = *tree;
+  s->refs = 1;
+  *tree = (tsconfig_tree){ .tape = NULL };
+
+  *shared = s;
+  return TSCFG_OK;
+}
+
+const tsconfig_tree *tsconfig_shared_tree_get(
+                          const tsconfig_shared_tree *shared) {
+  return &shared->tree;
+}
+
+void tsconfig_shared_tree_retain(tsconfig_shared_tree *shared) {
+  __atomic_fetch_add(&shared->refs, 1, __ATOMIC_RELAXED);
+}
+
+void tsconfig_shared_tree_release(tsconfig_shared_tree *shared) {
+  if (shared == NULL ||
+      __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  const tscfg_allocator *prev = tscfg_alloc_use(shared->tree.alloc);
+  tsconfig_tree_free(&shared->tree);
+  tscfg_free(shared);
+  tscfg_alloc_use(prev);
+}
+
+tscfg_rc tsconfig_snapshot_new(tsconfig_snapshot **snap) {
+  // Outlives any one parse, so use malloc
+  tsconfig_snapshot *s = malloc(sizeof(tsconfig_snapshot));
+  TSCFG_CHECK_MALLOC(s);
+
+  if (pthread_mutex_init(&s->lock, NULL) != 0) {
+    free(s);
+    REPORT_ERR("Could not create mutex");
+    return TSCFG_ERR_UNKNOWN;
+  }
+
+  s->current = NULL;
+  s->epoch = 1;
+  s->readers = NULL;
+  s->retired = NULL;
+
+  *snap = s;
+  return TSCFG_OK;
+}
+
+void tsconfig_snapshot_free(tsconfig_snapshot *snap) {
+  if (snap == NULL) {
+    return;
+  }
+
+  assert(snap->readers == NULL);
+  tsconfig_shared_tree_release(snap->current);
+  release_retired(snap->retired);
+  pthread_mutex_destroy(&snap->lock);
+  free(snap);
+}
+
+tscfg_rc tsconfig_snapshot_publish(tsconfig_snapshot *snap,
+                                   tsconfig_shared_tree *shared) {
+  // Allocate first, so that publish can't fail after swap
+  retired_tree *r = malloc(sizeof(retired_tree));
+  TSCFG_CHECK_MALLOC(r);
+
+  pthread_mutex_lock(&snap->lock);
+  r->shared = __atomic_exchange_n(&snap->current, shared, __ATOMIC_SEQ_CST);
+  r->epoch = __atomic_add_fetch(&snap->epoch, 1, __ATOMIC_SEQ_CST);
+  if (r->shared != NULL) {
+    r->next = snap->retired;
+    snap->retired = r;
+  } else {
+    free(r);
+  }
+
+  retired_tree *unused = take_unused(snap);
+  pthread_mutex_unlock(&snap->lock);
+
+  // Trees may be large, so free outside lock
+  release_retired(unused);
+  return TSCFG_OK;
+}
+
+void tsconfig_snapshot_reclaim(tsconfig_snapshot *snap) {
+  pthread_mutex_lock(&snap->lock);
+  retired_tree *unused = take_unused(snap);
+  pthread_mutex_unlock(&snap->lock);
+
+  release_retired(unused);
+}
+
+tscfg_rc tsconfig_snapshot_reader_new(tsconfig_snapshot *snap,
+                                      tsconfig_snapshot_reader **reader) {
+  tsconfig_snapshot_reader *r = malloc(sizeof(tsconfig_snapshot_reader));
+  TSCFG_CHECK_MALLOC(r);
+
+  r->snap = snap;
+  r->epoch = 0;
+
+  pthread_mutex_lock(&snap->lock);
+  r->next = snap->readers;
+  snap->readers = r;
+  pthread_mutex_unlock(&snap->lock);
+
+  *reader = r;
+  return TSCFG_OK;
+}
+
+void tsconfig_snapshot_reader_free(tsconfig_snapshot_reader *reader) {
+  if (reader == NULL) {
+    return;
+  }
+
+  assert(reader->epoch == 0);
+  tsconfig_snapshot *snap = reader->snap;
+  pthread_mutex_lock(&snap->lock);
+  tsconfig_snapshot_reader **p = &snap->readers;
+  while (*p != reader) {
+    p = &(*p)->next;
+  }
+  *p = reader->next;
+  pthread_mutex_unlock(&snap->lock);
+
+  free(reader);
+}
+
+const tsconfig_tree *tsconfig_snapshot_acquire(
+                          tsconfig_snapshot_reader *reader) {
+  tsconfig_shared_tree *s = acquire(reader);
+  return (s != NULL) ? &s->tree : NULL;
+}
+
+void tsconfig_snapshot_release(tsconfig_snapshot_reader *reader) {
+  // Reads of tree happen before publisher sees slot cleared
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+tsconfig_shared_tree *tsconfig_snapshot_get(tsconfig_snapshot_reader *reader) {
+  tsconfig_shared_tree *s = acquire(reader);
+  if (s != NULL) {
+    tsconfig_shared_tree_retain(s);
+  }
+  tsconfig_snapshot_release(reader);
+  return s;
+}
+
+/*
+ * Announce epoch in reader's slot, then load current tree.
+ */
+static tsconfig_shared_tree *acquire(tsconfig_snapshot_reader *reader) {
+  tsconfig_snapshot *snap = reader->snap;
+  assert(reader->epoch == 0);
+
+  uint64_t epoch = __atomic_load_n(&snap->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&snap->current, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Remove retired trees that no reader can hold.  Must hold lock.
+ * return: list of removed trees
+ */
+static retired_tree *take_unused(tsconfig_snapshot *snap) {
+  // Oldest epoch of any reader holding a tree
+  uint64_t oldest = UINT64_MAX;
+  for (tsconfig_snapshot_reader *r = snap->readers; r != NULL; r = r->next) {
+    uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  retired_tree *unused = NULL;
+  retired_tree **p = &snap->retired;
+  while (*p != NULL) {
+    retired_tree *r = *p;
+    if (r->epoch <= oldest) {
+      *p = r->next;
+      r->next = unused;
+      unused = r;
+    } else {
+      p = &r->next;
+    }
+  }
+  return unused;
+}
+
+static void release_retired(retired_tree *list) {
+  while (list != NULL) {
+    retired_tree *next = list->next;
+    tsconfig_shared_tree_release(list->shared);
+    free(list);
+    list = next;
+  }
+}
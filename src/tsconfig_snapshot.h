@@ -0,0 +1,136 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Sharing finished trees between threads, and swapping in new trees for
+ * hot reload.
+ *
+ * A shared tree is a finished tree that is never modified again, with a
+ * reference count, so any number of threads can read it without locking.
+ * A snapshot holds the current shared tree of a service.  Readers take
+ * the current tree without locks or waiting, while another thread
+ * publishes a new one.  Trees replaced by a publish are freed once no
+ * reader that could have taken them still holds them.
+ *
+ * Readers announce which publish they last saw in a slot of their own,
+ * as in epoch-based reclamation.  So each reader thread registers a
+ * reader with the snapshot, and a tree stays in use from acquire to
+ * release:
+ *
+ *   const tsconfig_tree *tree = tsconfig_snapshot_acquire(reader);
+ *   ... look up values in tree ...
+ *   tsconfig_snapshot_release(reader);
+ */
+
+#ifndef __TSCONFIG_SNAPSHOT_H
+#define __TSCONFIG_SNAPSHOT_H
+
+#include "tsconfig_common.h"
+#include "tsconfig_tree.h"
+
+typedef struct tsconfig_shared_tree tsconfig_shared_tree;
+typedef struct tsconfig_snapshot tsconfig_snapshot;
+typedef struct tsconfig_snapshot_reader tsconfig_snapshot_reader;
+
+/*
+ * Make finished tree shared, with one reference held by the caller.
+ * tree: parsed or loaded tree, owned by shared tree afterwards.  It is
+ *       left empty, and must not be freed by the caller.
+ */
+tscfg_rc tsconfig_tree_share(tsconfig_tree *tree,
+                             tsconfig_shared_tree **shared);
+
+/*
+ * Read-only tree, valid while a reference is held.
+ */
+const tsconfig_tree *tsconfig_shared_tree_get(
+                          const tsconfig_shared_tree *shared);
+
+/*
+ * Take another reference, e.g. for another thread.
+ */
+void tsconfig_shared_tree_retain(tsconfig_shared_tree *shared);
+
+/*
+ * Drop reference, freeing tree when it was the last.
+ */
+void tsconfig_shared_tree_release(tsconfig_shared_tree *shared);
+
+/*
+ * Create snapshot with no tree yet.
+ */
+tscfg_rc tsconfig_snapshot_new(tsconfig_snapshot **snap);
+
+/*
+ * Free snapshot and drop its references to trees.  All readers must be
+ * freed first.
+ */
+void tsconfig_snapshot_free(tsconfig_snapshot *snap);
+
+/*
+ * Make tree the current tree of snapshot.  The tree it replaces is
+ * released once no reader can be using it, which is checked now and at
+ * later publishes.  Publishes from several threads are serialized.
+ * shared: tree, taking over the caller's reference
+ */
+tscfg_rc tsconfig_snapshot_publish(tsconfig_snapshot *snap,
+                                   tsconfig_shared_tree *shared);
+
+/*
+ * Release trees replaced in snapshot that are no longer in use, without
+ * waiting for the next publish.
+ */
+void tsconfig_snapshot_reclaim(tsconfig_snapshot *snap);
+
+/*
+ * Register reader for one thread.  Registering takes a lock, so readers
+ * should be kept for the life of the thread, not made for each read.
+ */
+tscfg_rc tsconfig_snapshot_reader_new(tsconfig_snapshot *snap,
+                                      tsconfig_snapshot_reader **reader);
+
+/*
+ * Unregister and free reader, which must not hold a tree.
+ */
+void tsconfig_snapshot_reader_free(tsconfig_snapshot_reader *reader);
+
+/*
+ * Get current tree of snapshot, which stays valid until
+ * tsconfig_snapshot_release().  Wait-free: a fixed number of atomic loads
+ * and stores, with no locks and no writes to memory shared with other
+ * readers.  A reader can hold one tree at a time.
+ * return: current tree, or NULL if none published yet
+ */
+const tsconfig_tree *tsconfig_snapshot_acquire(
+                          tsconfig_snapshot_reader *reader);
+
+/*
+ * Finish with tree from tsconfig_snapshot_acquire().
+ */
+void tsconfig_snapshot_release(tsconfig_snapshot_reader *reader);
+
+/*
+ * Get reference to current tree that stays valid after it is replaced,
+ * e.g. to keep for the whole of a request.  Updates the shared
+ * reference count, so acquire and release are cheaper for short reads.
+ * return: reference to release with tsconfig_shared_tree_release(), or
+ *         NULL if none published yet
+ */
+tsconfig_shared_tree *tsconfig_snapshot_get(tsconfig_snapshot_reader *reader);
+
+#endif // __TSCONFIG_SNAPSHOT_H
@@ -0,0 +1,530 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+// Needed for POSIX file mapping functions
+#define _POSIX_C_SOURCE 200112L
+
+#include "tsconfig_split.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tsconfig_alloc.h"
+#include "tsconfig_err.h"
+#include "tsconfig_limits.h"
+#include "tsconfig_pool.h"
+#include "tsconfig_stats.h"
+#include "tsconfig_tree_reader.h"
+
+/*
+ * Progress through field at top level of root object.
+ */
+typedef enum {
+  FIELD_KEY, // Key, or before start of field
+  FIELD_SEP, // After separator, before value
+  FIELD_VAL, // In value
+} field_state;
+
+/*
+ * Part of input being parsed by worker.
+ */
+typedef struct {
+  tscfg_job job; // First member, so job can be converted to part
+
+  tsconfig_input in;
+  const char *path;
+  int depth;
+  tscfg_pool *pool;
+  const tscfg_path_filter *filter;
+
+  // Result of parsing
+  tscfg_rc rc;
+  tsconfig_tree tree;
+  tscfg_include **incs;
+  size_t nincs;
+
+  // Stats for part, if collecting
+  bool collect_stats;
+  tsconfig_stats stats;
+
+  // Limits of thread that submitted part, or NULL
+  const tsconfig_limits *limits;
+} read_part;
+
+static void read_part_run(tscfg_job *job);
+static tscfg_rc join_parts(read_part *parts, size_t nparts,
+                           const char *path, int depth,
+                           tsconfig_tree *tree);
+static tscfg_rc take_part_includes(read_part *parts, size_t nparts,
+                                   tscfg_include ***incs, size_t *nincs);
+static void add_part_stats(tsconfig_stats *stats, read_part *parts,
+                           size_t nparts, size_t len);
+static void *map_file(const char *path, size_t *len);
+
+static size_t skip_string(const char *buf, size_t len, size_t pos);
+static size_t skip_comment(const char *buf, size_t len, size_t pos);
+static size_t skip_trivia(const char *buf, size_t len, size_t pos);
+
+static inline bool is_ascii_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+/*
+ * Length of comment start at pos, or 0 if none.
+ */
+static inline size_t comment_start(const char *buf, size_t len,
+                                   size_t pos) {
+  if (buf[pos] == '#') {
+    return 1;
+  } else if (buf[pos] == '/' && pos + 1 < len &&
+             (buf[pos + 1] == '/' || buf[pos + 1] == '*')) {
+    return 2;
+  }
+  return 0;
+}
+
+size_t tscfg_split_fields(const char *buf, size_t len, size_t nparts,
+                          tscfg_span *parts) {
+  if (nparts == 0) {
+    return 0;
+  }
+
+  size_t pos = 0;
+  if (len >= 3 && memcmp(buf, "\xEF\xBB\xBF", 3) == 0) {
+    pos = 3;
+  }
+
+  pos = skip_trivia(buf, len, pos);
+  if (pos == SIZE_MAX || (pos < len && buf[pos] == '[')) {
+    return 0;
+  }
+
+  bool braced = (pos < len && buf[pos] == '{');
+  size_t body_start = braced ? pos + 1 : 0;
+  size_t body_end = len;
+  size_t step = (len - body_start) / nparts;
+
+  size_t nfound = 0;
+  size_t part_start = body_start;
+  int depth = 0;
+  field_state state = FIELD_KEY;
+
+  bool closed = false;
+  for (pos = body_start; pos < len && !closed; pos++) {
+    char c = buf[pos];
+    if (comment_start(buf, len, pos) > 0) {
+      pos = skip_comment(buf, len, pos);
+      if (pos == SIZE_MAX) {
+        return 0;
+      }
+      // Back up so newline after line comment is seen
+      pos--;
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        pos = skip_string(buf, len, pos);
+        if (pos == SIZE_MAX) {
+          return 0;
+        }
+        pos--;
+        if (depth == 0 && state == FIELD_SEP) {
+          state = FIELD_VAL;
+        }
+        break;
+
+      case '{':
+      case '[':
+        if (depth == 0 && (state == FIELD_SEP ||
+                           (state == FIELD_KEY && c == '{'))) {
+          // Object value may directly follow key
+          state = FIELD_VAL;
+        }
+        depth++;
+        break;
+
+      case '}':
+      case ']':
+        if (depth == 0) {
+          if (!braced || c != '}') {
+            return 0;
+          }
+          // End of root object, which can only be followed by comments
+          if (skip_trivia(buf, len, pos + 1) != len) {
+            return 0;
+          }
+          body_end = pos;
+          closed = true;
+          break;
+        }
+        depth--;
+        break;
+
+      case '=':
+      case ':':
+        if (depth == 0 && state == FIELD_KEY) {
+          state = FIELD_SEP;
+        }
+        break;
+
+      case '\n':
+      case ',':
+        if (depth == 0 && state == FIELD_VAL) {
+          state = FIELD_KEY;
+          if (pos - part_start >= step && nfound + 1 < nparts) {
+            parts[nfound].start = part_start;
+            parts[nfound].end = pos;
+            nfound++;
+            part_start = pos + 1;
+          }
+        }
+        break;
+
+      default:
+        if (depth == 0 && state == FIELD_SEP && !is_ascii_space(c)) {
+          state = FIELD_VAL;
+        }
+        break;
+    }
+  }
+
+  if ((braced && !closed) || depth != 0) {
+    // Brackets don't match, so parsing as one will give an error
+    return 0;
+  }
+
+  parts[nfound].start = part_start;
+  parts[nfound].end = body_end;
+  return nfound + 1;
+}
+
+tscfg_rc tscfg_read_tree_parts(tsconfig_input in, const char *path,
+                               int depth, tscfg_pool *pool,
+                               const tscfg_path_filter *filter,
+                               tsconfig_tree *tree, tscfg_include ***incs,
+                               size_t *nincs, bool *done) {
+  *done = false;
+
+  const char *buf;
+  size_t len;
+  void *map = NULL;
+  if (in.kind == TS_CONFIG_IN_STR || in.kind == TS_CONFIG_IN_STR_BORROW) {
+    if (in.data.s.pos > in.data.s.len) {
+      return TSCFG_OK;
+    }
+    buf = in.data.s.str + in.data.s.pos;
+    len = in.data.s.len - in.data.s.pos;
+  } else if (in.kind == TS_CONFIG_IN_MMAP) {
+    // Any errors are reported when parsing as one
+    map = map_file(in.data.path, &len);
+    if (map == NULL) {
+      return TSCFG_OK;
+    }
+    buf = map;
+  } else {
+    // Can't split streams
+    return TSCFG_OK;
+  }
+
+  size_t nparts = (size_t)tscfg_pool_threads(pool) *
+                  TSCFG_SPLIT_PARTS_PER_THREAD;
+  if (nparts > len / TSCFG_SPLIT_PART_SIZE) {
+    nparts = len / TSCFG_SPLIT_PART_SIZE;
+  }
+
+  // Parts are each under byte limit, so whole input is checked instead
+  const tsconfig_limits *limits = tscfg_limits_current();
+  bool too_long = limits != NULL && limits->max_bytes > 0 &&
+                  len > limits->max_bytes;
+
+  tscfg_rc rc = TSCFG_OK;
+  tscfg_span *spans = NULL;
+  read_part *parts = NULL;
+  size_t nsplit = 0;
+  if (len < TSCFG_SPLIT_MIN_SIZE || nparts < 2 || too_long) {
+    goto cleanup;
+  }
+
+  spans = tscfg_malloc(sizeof(spans[0]) * nparts);
+  TSCFG_CHECK_MALLOC_GOTO(spans, cleanup, rc);
+
+  nsplit = tscfg_split_fields(buf, len, nparts, spans);
+  if (nsplit < 2) {
+    nsplit = 0;
+    goto cleanup;
+  }
+
+  parts = tscfg_calloc(nsplit, sizeof(parts[0]));
+  if (parts == NULL) {
+    nsplit = 0;
+    TSCFG_CHECK_MALLOC_GOTO(parts, cleanup, rc);
+  }
+
+  tsconfig_stats *stats = tscfg_stats_current();
+  for (size_t i = 0; i < nsplit; i++) {
+    read_part *p = &parts[i];
+    p->job.run = read_part_run;
+    p->collect_stats = (stats != NULL);
+    p->in.kind = TS_CONFIG_IN_STR_BORROW;
+    p->in.data.s.str = buf + spans[i].start;
+    p->in.data.s.len = spans[i].end - spans[i].start;
+    p->in.data.s.pos = 0;
+    p->path = path;
+    p->depth = depth;
+    p->pool = pool;
+    p->filter = filter;
+    p->limits = limits;
+    tscfg_pool_submit(pool, &p->job);
+  }
+
+  bool parts_ok = true;
+  for (size_t i = 0; i < nsplit; i++) {
+    tscfg_pool_wait(pool, &parts[i].job);
+    parts_ok = parts_ok && parts[i].rc == TSCFG_OK;
+  }
+
+  if (!parts_ok) {
+    // Boundary may have been wrong, so parse as one, counted from scratch
+    goto cleanup;
+  }
+
+  TSCFG_STAT(stats, add_part_stats(stats, parts, nsplit, len));
+
+  *done = true;
+  rc = join_parts(parts, nsplit, path, depth, tree);
+  if (rc == TSCFG_OK && incs != NULL) {
+    rc = take_part_includes(parts, nsplit, incs, nincs);
+    if (rc != TSCFG_OK) {
+      tsconfig_tree_free(tree);
+    }
+  }
+
+cleanup:
+  for (size_t i = 0; i < nsplit; i++) {
+    read_part *p = &parts[i];
+    if (p->rc == TSCFG_OK) {
+      tsconfig_tree_free(&p->tree);
+      for (size_t j = 0; j < p->nincs; j++) {
+        tscfg_include_release(p->incs[j]);
+      }
+      tscfg_free(p->incs);
+    }
+  }
+  tscfg_free(parts);
+  tscfg_free(spans);
+  if (map != NULL) {
+    munmap(map, len);
+  }
+  return rc;
+}
+
+static void read_part_run(tscfg_job *job) {
+  read_part *p = (read_part*)job;
+
+  // Worker collects into part's stats, added up once all are done
+  tsconfig_stats *prev = tscfg_stats_use(p->collect_stats ? &p->stats : NULL);
+  const tsconfig_limits *prev_limits = tscfg_limits_use(p->limits);
+  p->rc = tscfg_read_tree_whole(p->in, p->path, p->depth, p->pool,
+                                p->filter, &p->tree, &p->incs, &p->nincs);
+  tscfg_limits_use(prev_limits);
+  tscfg_stats_use(prev);
+}
+
+/*
+ * Add up stats for parts of input.
+ * len: length of whole input, including bytes between parts, which are
+ *      only scanned by the split
+ */
+static void add_part_stats(tsconfig_stats *stats, read_part *parts,
+                           size_t nparts, size_t len) {
+  for (size_t i = 0; i < nparts; i++) {
+    tscfg_stats_add(stats, &parts[i].stats);
+    stats->bytes -= parts[i].stats.bytes;
+  }
+  stats->bytes += len;
+}
+
+/*
+ * Join trees for parts into one tree, in order.
+ */
+static tscfg_rc join_parts(read_part *parts, size_t nparts,
+                           const char *path, int depth,
+                           tsconfig_tree *tree) {
+  tscfg_batch_reader reader;
+  tscfg_treeread_state *state;
+  tscfg_rc rc = tscfg_tree_reader_init(&reader, &state);
+  TSCFG_CHECK(rc);
+
+  rc = tscfg_tree_reader_set_file(state, path, depth, NULL);
+  TSCFG_CHECK_GOTO(rc, error);
+
+  tscfg_event ev = { .tag = TSCFG_EV_OBJ_START };
+  if (!reader.events(state, &ev, 1)) {
+    rc = tscfg_tree_reader_err(state);
+    goto error;
+  }
+
+  for (size_t i = 0; i < nparts; i++) {
+    rc = tscfg_tree_reader_splice(state, &parts[i].tree);
+    TSCFG_CHECK_GOTO(rc, error);
+  }
+
+  ev.tag = TSCFG_EV_OBJ_END;
+  if (!reader.events(state, &ev, 1)) {
+    rc = tscfg_tree_reader_err(state);
+    goto error;
+  }
+
+  return tscfg_tree_reader_done(state, tree);
+
+error:
+  tscfg_tree_reader_free(state);
+  return rc;
+}
+
+/*
+ * Move files included by parts into one array, in order.
+ */
+static tscfg_rc take_part_includes(read_part *parts, size_t nparts,
+                                   tscfg_include ***incs, size_t *nincs) {
+  size_t total = 0;
+  for (size_t i = 0; i < nparts; i++) {
+    total += parts[i].nincs;
+  }
+
+  tscfg_include **all = tscfg_malloc(sizeof(all[0]) * (total > 0 ? total : 1));
+  TSCFG_CHECK_MALLOC(all);
+
+  size_t n = 0;
+  for (size_t i = 0; i < nparts; i++) {
+    read_part *p = &parts[i];
+    for (size_t j = 0; j < p->nincs; j++) {
+      all[n++] = p->incs[j];
+    }
+    p->nincs = 0;
+  }
+
+  *incs = all;
+  *nincs = total;
+  return TSCFG_OK;
+}
+
+/*
+ * Map file read-only.
+ * return: NULL if file couldn't be mapped or is empty
+ */
+static void *map_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  void *map = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size >= TSCFG_SPLIT_MIN_SIZE) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+    }
+    *len = (size_t)st.st_size;
+  }
+
+  // Mapping stays valid after close
+  close(fd);
+  return map;
+}
+
+/*
+ * Skip quoted string starting at pos.
+ * return: position after string, or SIZE_MAX if not terminated
+ */
+static size_t skip_string(const char *buf, size_t len, size_t pos) {
+  if (pos + 2 < len && buf[pos + 1] == '"' && buf[pos + 2] == '"') {
+    // Triple-quoted string ends at last quote of three or more quotes
+    for (pos += 3; pos + 2 < len; pos++) {
+      if (buf[pos] == '"' && buf[pos + 1] == '"' && buf[pos + 2] == '"') {
+        pos += 3;
+        while (pos < len && buf[pos] == '"') {
+          pos++;
+        }
+        return pos;
+      }
+    }
+    return SIZE_MAX;
+  }
+
+  for (pos++; pos < len; pos++) {
+    if (buf[pos] == '\\') {
+      pos++;
+    } else if (buf[pos] == '"') {
+      return pos + 1;
+    } else if (buf[pos] == '\n') {
+      return SIZE_MAX;
+    }
+  }
+  return SIZE_MAX;
+}
+
+/*
+ * Skip comment starting at pos.
+ * return: position after comment, i.e. of newline ending line comment,
+ *         or SIZE_MAX if multi-line comment is not terminated
+ */
+static size_t skip_comment(const char *buf, size_t len, size_t pos) {
+  if (buf[pos] == '/' && buf[pos + 1] == '*') {
+    for (pos += 2; pos + 1 < len; pos++) {
+      if (buf[pos] == '*' && buf[pos + 1] == '/') {
+        return pos + 2;
+      }
+    }
+    return SIZE_MAX;
+  }
+
+  const char *nl = memchr(&buf[pos], '\n', len - pos);
+  return (nl != NULL) ? (size_t)(nl - buf) : len;
+}
+
+/*
+ * Skip whitespace and comments.
+ * return: position of next other character, or SIZE_MAX for unterminated
+ *         comment
+ */
+static size_t skip_trivia(const char *buf, size_t len, size_t pos) {
+  while (pos < len) {
+    if (is_ascii_space(buf[pos])) {
+      pos++;
+    } else if (comment_start(buf, len, pos) > 0) {
+      pos = skip_comment(buf, len, pos);
+      if (pos == SIZE_MAX) {
+        return SIZE_MAX;
+      }
+    } else {
+      break;
+    }
+  }
+  return pos;
+}
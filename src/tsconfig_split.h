@@ -0,0 +1,81 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Parsing of large inputs in parts in parallel.
+ *
+ * Input is split at boundaries between top-level fields by a quick scan
+ * of the bytes that only tracks brackets, strings and comments.  This is
+ * not a full check of the syntax, so if any part fails to parse, the
+ * whole input is parsed as one, so that errors are reported as usual.
+ */
+
+#ifndef __TSCONFIG_SPLIT_H
+#define __TSCONFIG_SPLIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tsconfig_include.h"
+
+// Inputs smaller than this are always parsed as one
+#define TSCFG_SPLIT_MIN_SIZE (4 * 1024 * 1024)
+
+// Minimum size of parts
+#define TSCFG_SPLIT_PART_SIZE (1024 * 1024)
+
+// Parts per thread, so that threads finish at about the same time
+#define TSCFG_SPLIT_PARTS_PER_THREAD 4
+
+/*
+ * Range of bytes in input.
+ */
+typedef struct {
+  size_t start;
+  size_t end;
+} tscfg_span;
+
+/*
+ * Split body of root object into parts of about equal size, each made up
+ * of whole fields.  Braces around the root object are not included in
+ * the parts, so each part can be parsed as an object without braces.
+ * Boundaries are only placed after a field with a key, separator and
+ * value, at a newline or comma outside any brackets.
+ *
+ * nparts: maximum number of parts
+ * parts: array of at least nparts spans, filled in with parts in order
+ * return: number of parts, or 0 if input can't be split, e.g. because
+ *         root is an array or a string or comment is not terminated
+ */
+size_t tscfg_split_fields(const char *buf, size_t len, size_t nparts,
+                          tscfg_span *parts);
+
+/*
+ * Parse input to unmerged tree in parts on worker pool, if it is an
+ * in-memory string or mapped file that is large enough and can be split.
+ * Arguments are as for tscfg_read_tree().
+ * done: set to false if input was not parsed, in which case it should be
+ *       parsed as one
+ */
+tscfg_rc tscfg_read_tree_parts(tsconfig_input in, const char *path,
+                               int depth, tscfg_pool *pool,
+                               const tscfg_path_filter *filter,
+                               tsconfig_tree *tree, tscfg_include ***incs,
+                               size_t *nincs, bool *done);
+
+#endif // __TSCONFIG_SPLIT_H
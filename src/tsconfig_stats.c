@@ -0,0 +1,69 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+
+/*
+ * Collection of parse statistics.
+ */
+
+// Needed for clock_gettime
+#define _POSIX_C_SOURCE 200112L
+
+#include "tsconfig_stats.h"
+
+#include <time.h>
+
+// Stats for this thread, or NULL if not collecting
+static __thread tsconfig_stats *stats_current = NULL;
+
+tsconfig_stats *tscfg_stats_use(tsconfig_stats *stats) {
+  tsconfig_stats *prev = stats_current;
+  stats_current = TSCFG_STATS ? stats : NULL;
+  return prev;
+}
+
+tsconfig_stats *tscfg_stats_current(void) {
+  return stats_current;
+}
+
+void tscfg_stats_add(tsconfig_stats *dst, const tsconfig_stats *src) {
+  dst->bytes += src->bytes;
+  dst->refills += src->refills;
+  for (int i = 0; i < TSCFG_TOK_NTAGS; i++) {
+    dst->toks[i] += src->toks[i];
+  }
+  if (src->max_depth > dst->max_depth) {
+    dst->max_depth = src->max_depth;
+  }
+  if (src->max_lookahead > dst->max_lookahead) {
+    dst->max_lookahead = src->max_lookahead;
+  }
+  dst->subs += src->subs;
+  dst->merge_collisions += src->merge_collisions;
+  dst->lex_ns += src->lex_ns;
+  dst->parse_ns += src->parse_ns;
+  dst->build_ns += src->build_ns;
+  dst->merge_ns += src->merge_ns;
+  dst->resolve_ns += src->resolve_ns;
+}
+
+uint64_t tscfg_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
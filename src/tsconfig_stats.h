@@ -0,0 +1,69 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+
+/*
+ * Collection of parse statistics.
+ *
+ * Statistics are collected into the tsconfig_stats of the current thread,
+ * if any, which is set by the parse entry point for the top-level input
+ * and by workers parsing parts of it.  Files loaded for includes are not
+ * counted.  Built with TSCFG_STATS defined as 0, all collection compiles
+ * away.
+ */
+
+#ifndef __TSCONFIG_STATS_H
+#define __TSCONFIG_STATS_H
+
+#include <stdint.h>
+
+#include "tsconfig.h"
+
+#ifndef TSCFG_STATS
+#define TSCFG_STATS 1
+#endif
+
+/*
+ * Run statement if collecting into stats.
+ */
+#define TSCFG_STAT(stats, stmt) \
+  do { if (TSCFG_STATS && (stats) != NULL) { stmt; } } while (0)
+
+/*
+ * Set stats to collect into for this thread.
+ * stats: stats, or NULL to not collect
+ * return: previous stats, to be restored when done
+ */
+tsconfig_stats *tscfg_stats_use(tsconfig_stats *stats);
+
+/*
+ * Get stats being collected for this thread, or NULL if none.
+ */
+tsconfig_stats *tscfg_stats_current(void);
+
+/*
+ * Add counts and times from src into dst.
+ */
+void tscfg_stats_add(tsconfig_stats *dst, const tsconfig_stats *src);
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+uint64_t tscfg_stats_now(void);
+
+#endif // __TSCONFIG_STATS_H
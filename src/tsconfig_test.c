@@ -44,5 +44,6 @@ int main(int argc, const char **argv) {
   }
 
   fprintf(stderr, "Success!\n");
+  tsconfig_tree_free(&cfg);
   return 0;
 }
@@ -24,6 +24,7 @@
 
 #include "tsconfig_tok.h"
 
+#include "tsconfig_alloc.h"
 #include "tsconfig_err.h"
 
 #include <assert.h>
@@ -84,12 +85,29 @@ const char *tscfg_tok_tag_name(tscfg_tok_tag tag) {
 }
 
 void tscfg_tok_free(tscfg_tok *tok) {
-  if (tok->str != NULL) {
-    free(tok->str);
+  if (tok->str != NULL && !tok->borrowed) {
+    tscfg_free(tok->str);
   }
   tok->tag = TSCFG_TOK_INVALID;
   tok->str = NULL;
   tok->len = 0;
+  tok->borrowed = false;
+}
+
+tscfg_rc tscfg_tok_own(tscfg_tok *tok) {
+  if (!tok->borrowed) {
+    return TSCFG_OK;
+  }
+
+  char *str = tscfg_malloc(tok->len + 1);
+  TSCFG_CHECK_MALLOC(str);
+
+  memcpy(str, tok->str, tok->len);
+  str[tok->len] = '\0';
+
+  tok->str = str;
+  tok->borrowed = false;
+  return TSCFG_OK;
 }
 
 tscfg_rc tscfg_tok_array_expand(tscfg_tok_array *toks, int min_size) {
@@ -99,7 +117,8 @@ tscfg_rc tscfg_tok_array_expand(tscfg_tok_array *toks, int min_size) {
       new_size = min_size;
     }
 
-    void *tmp = realloc(toks->toks, sizeof(toks->toks[0]) * (size_t)new_size);
+    void *tmp = tscfg_realloc(toks->toks,
+                              sizeof(toks->toks[0]) * (size_t)new_size);
     TSCFG_CHECK_MALLOC(tmp);
 
     toks->toks = tmp;
@@ -121,6 +140,8 @@ tscfg_rc tscfg_tok_array_append(tscfg_tok_array *arr, tscfg_tok *tok) {
   tok->tag = TSCFG_TOK_INVALID;
   tok->str = NULL;
   tok->len = 0;
+  tok->borrowed = false;
+  return TSCFG_OK;
 }
 
 /*
@@ -131,8 +152,10 @@ tscfg_rc tscfg_tok_array_concat(tscfg_tok_array *dst, tscfg_tok_array *src) {
   tscfg_rc rc = tscfg_tok_array_expand(dst, dst->len + src->len);
   TSCFG_CHECK(rc);
 
-  memcpy(&dst->toks[dst->len], &src->toks[0],
-         sizeof(src->toks[0]) * (size_t)src->len);
+  if (src->len > 0) {
+    memcpy(&dst->toks[dst->len], &src->toks[0],
+           sizeof(src->toks[0]) * (size_t)src->len);
+  }
 
   dst->len += src->len;
   src->len = 0;
@@ -149,7 +172,7 @@ void tscfg_tok_array_free(tscfg_tok_array *toks, bool free_array) {
   toks->len = 0;
 
   if (free_array && toks->toks != NULL) {
-    free(toks->toks);
+    tscfg_free(toks->toks);
     toks->toks = NULL;
     toks->size = 0;
   }
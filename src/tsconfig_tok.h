@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "tsconfig_common.h"
 
@@ -65,24 +66,44 @@ typedef enum {
   TSCFG_TOK_NULL,
 
   /* Literals and variables: include string */
-  TSCFG_TOK_NUMBER, // Numeric token, text is stored in str
+  TSCFG_TOK_NUMBER, // Numeric token, text is stored in str, value in num
   TSCFG_TOK_UNQUOTED, // Unquoted text, text is stored in str
   TSCFG_TOK_STRING, // Quoted text, string contents after escaping, etc
 } tscfg_tok_tag;
 
+// Number of token tags
+#define TSCFG_TOK_NTAGS (TSCFG_TOK_STRING + 1)
+
+/*
+ * Decoded value of number.  Numbers written without a fraction or
+ * exponent that fit in 64 bits are integers.
+ */
+typedef struct {
+  bool is_int; // If true, v.i is set, otherwise v.d
+  union {
+    int64_t i;
+    double d; // Infinite if out of range of double
+  } v;
+} tscfg_num;
+
 /*
  * Lexer token
  */
 typedef struct {
   tscfg_tok_tag tag;
   /* String, if any.  Null terminated, but may have nulls in string if
-     they were in input. */
+     they were in input.  If borrowed, str is not owned by the token and
+     must not be freed: it points into the input buffer, in which case it
+     is not null terminated, or into a parse arena. */
   char *str;
   size_t len;
+  bool borrowed;
 
-  /* Location in file (both start at 1) */
-  int line;
-  int line_char; // UTF-8 character index in line
+  /* Byte offset of start in input, e.g. for tsconfig_lines_find() */
+  size_t offset;
+
+  /* Value of NUMBER token, decoded by lexer */
+  tscfg_num num;
 } tscfg_tok;
 
 /*
@@ -101,6 +122,12 @@ static const tscfg_tok_array TSCFG_EMPTY_TOK_ARRAY = {
 const char *tscfg_tok_tag_name(tscfg_tok_tag tag);
 void tscfg_tok_free(tscfg_tok *tok);
 
+/*
+ * Replace a borrowed token string with an owned, null terminated copy.
+ * Does nothing if token already owns its string.
+ */
+tscfg_rc tscfg_tok_own(tscfg_tok *tok);
+
 tscfg_rc tscfg_tok_array_expand(tscfg_tok_array *toks, int min_size);
 tscfg_rc tscfg_tok_array_append(tscfg_tok_array *arr, tscfg_tok *tok);
 tscfg_rc tscfg_tok_array_concat(tscfg_tok_array *dst, tscfg_tok_array *src);
@@ -22,142 +22,637 @@
  * Data model for HOCON/JSON.
  */
 
+// Needed for POSIX file mapping functions
+#define _POSIX_C_SOURCE 200112L
+
 #include "tsconfig_tree.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include "tsconfig_alloc.h"
+#include "tsconfig_arena.h"
 #include "tsconfig_err.h"
+#include "tsconfig_num.h"
 
-static int key_cmp(const char *s1, size_t l1, const char *s2, size_t l2);
-static int obj_kv_cmp(const void *p1, const void *p2);
+#define INIT_POOL_SIZE 4096
+#define INIT_INDEX_SIZE 64
 
-static void tscfg_val_invalidate(tscfg_val *v);
+static tscfg_rc index_obj(tsconfig_tree *tree, size_t obj_ix);
+static void index_insert_sorted(const tsconfig_tree *tree,
+        tscfg_index_entry *entries, uint32_t *n, tscfg_index_entry entry);
+static void index_insert_hashed(const tsconfig_tree *tree,
+        tscfg_index_entry *entries, uint32_t size, tscfg_index_entry entry);
+static tscfg_rc pool_add_entry(char **pool, size_t *len, size_t *size,
+                        const char *str, size_t str_len,
+                        const void *extra, size_t extra_len, uint64_t *off);
+static bool str_is_one_of(const char *str, size_t len,
+                          const char * const *options);
 
-/*
- * TODO: this approach cannot handle self-referential substitutions.
- * Needed approach:
- * - Resolve non-self-referential subs after final merge.
- * - Detect self-referential subs before merge, handle specially
- */
-tscfg_rc tscfg_obj_merge_keys(tscfg_obj *obj) {
+void tsconfig_tree_free(tsconfig_tree *tree) {
+  if (tree->image != NULL) {
+    // Everything is in image
+    munmap(tree->image, tree->image_len);
+  } else {
+    const tscfg_allocator *prev = tscfg_alloc_use(tree->alloc);
+    tscfg_free(tree->tape);
+    tscfg_free(tree->pool);
+    tscfg_free(tree->objs);
+    tscfg_free(tree->index);
+    tscfg_arena_free(tree->arena);
+    tscfg_alloc_use(prev);
+  }
+  tree->tape = NULL;
+  tree->tape_len = 0;
+  tree->pool = NULL;
+  tree->pool_len = 0;
+  tree->objs = NULL;
+  tree->nobjs = 0;
+  tree->index = NULL;
+  tree->index_len = 0;
+  tree->index_size = 0;
+  tree->arena = NULL;
+  tree->alloc = NULL;
+  tree->image = NULL;
+  tree->image_len = 0;
+}
+
+tscfg_rc tscfg_tree_build_index(tsconfig_tree *tree) {
   tscfg_rc rc;
 
-  int prev = 0; /* Previous (merged) key pos */
-  int curr = 1; /* Current (unmerged) key pos */
-
-  for (; curr < obj->nelems; curr++) {
-    tscfg_obj_kv *prev_kv = &obj->elems[prev];
-    tscfg_obj_kv *curr_kv = &obj->elems[curr];
-    if (key_cmp(prev_kv->key, prev_kv->key_len,
-                curr_kv->key, curr_kv->key_len) == 0) {
-      // Matching keys: needs merge
-      if (curr_kv->assignment == TSCFG_KV_APPEND) {
-        // Attempt to concatenate
-        rc = tscfg_val_concat(&prev_kv->val, &curr_kv->val);
-        TSCFG_CHECK(rc);
-      } else {
-        assert(curr_kv->assignment == TSCFG_KV_ASSIGN);
-        rc = tscfg_val_overwrite(&prev_kv->val, &curr_kv->val);
-        TSCFG_CHECK(rc);
-      }
-      free(curr_kv->key);
-      curr_kv->key = NULL;
-    } else {
-      // Non-matching keys: no merge, just relocate
-      prev++;
-      obj->elems[prev] = *curr_kv;
-      curr_kv->key = NULL;
+  tscfg_free(tree->objs);
+  tree->objs = NULL;
+  tree->index_len = 0;
+  if (tree->nobjs == 0) {
+    return TSCFG_OK;
+  }
+
+  TSCFG_COND(tree->nobjs <= SIZE_MAX / sizeof(tree->objs[0]),
+             TSCFG_ERR_OOM);
+  tree->objs = tscfg_malloc(sizeof(tree->objs[0]) * tree->nobjs);
+  TSCFG_CHECK_MALLOC(tree->objs);
+
+  for (size_t i = 0; i < tree->tape_len; i++) {
+    if (tscfg_tape_get_tag(tree->tape[i]) == TSCFG_TAPE_OBJ) {
+      rc = index_obj(tree, i);
+      TSCFG_CHECK(rc);
     }
   }
 
   return TSCFG_OK;
 }
 
-tscfg_rc tscfg_obj_sort(tscfg_obj *obj) {
-  if (obj == NULL || obj->elems == NULL || obj->nelems < 0) {
-    REPORT_ERR("Invalid key-value object: %p", obj);
-    return TSCFG_ERR_ARG;
+tscfg_rc tscfg_tree_index_obj(tsconfig_tree *tree, size_t obj_ix,
+                              size_t *objs_size) {
+  size_t end_ix = obj_ix + tscfg_tape_get_payload(tree->tape[obj_ix]);
+  uint64_t obj_num = tscfg_tape_get_payload(tree->tape[end_ix]);
+  assert(obj_num < tree->nobjs);
+
+  if (obj_num >= *objs_size) {
+    size_t new_size = (*objs_size > 0) ? *objs_size : 16;
+    while (new_size <= obj_num) {
+      TSCFG_COND(new_size <= SIZE_MAX / 2 / sizeof(tree->objs[0]),
+                 TSCFG_ERR_OOM);
+      new_size *= 2;
+    }
+
+    tscfg_obj_index *objs = tscfg_realloc(tree->objs,
+                                    sizeof(objs[0]) * new_size);
+    TSCFG_CHECK_MALLOC(objs);
+    tree->objs = objs;
+    *objs_size = new_size;
+  }
+
+  return index_obj(tree, obj_ix);
+}
+
+tscfg_rc tscfg_pool_add(char **pool, size_t *len, size_t *size,
+                        const char *str, size_t str_len, uint64_t *off) {
+  return pool_add_entry(pool, len, size, str, str_len, NULL, 0, off);
+}
+
+tscfg_rc tscfg_pool_add_num(char **pool, size_t *len, size_t *size,
+                            const char *str, size_t str_len, tscfg_num num,
+                            uint64_t *off) {
+  return pool_add_entry(pool, len, size, str, str_len, &num, sizeof(num),
+                        off);
+}
+
+/*
+ * Add string to pool, followed by any extra data at next 8-byte aligned
+ * offset.
+ */
+static tscfg_rc pool_add_entry(char **pool, size_t *len, size_t *size,
+                        const char *str, size_t str_len,
+                        const void *extra, size_t extra_len, uint64_t *off) {
+  if (str_len > UINT32_MAX) {
+    REPORT_ERR("String too long for tree: %zu bytes", str_len);
+    return TSCFG_ERR_INVALID;
+  }
+
+  // Keep headers aligned
+  size_t start = (*len + 3) & ~(size_t)3;
+  size_t entry_size = sizeof(tscfg_pool_hdr) + str_len + 1;
+  size_t extra_start = 0;
+  if (extra_len > 0) {
+    extra_start = (start + entry_size + 7) & ~(size_t)7;
+    entry_size = extra_start + extra_len - start;
+  }
+
+  if (start > *size || entry_size > *size - start) {
+    size_t new_size = (*size > 0) ? *size : INIT_POOL_SIZE;
+    while (new_size < start + entry_size) {
+      TSCFG_COND(new_size <= SIZE_MAX / 2, TSCFG_ERR_OOM);
+      new_size *= 2;
+    }
+
+    char *new_pool = tscfg_realloc(*pool, new_size);
+    TSCFG_CHECK_MALLOC(new_pool);
+    *pool = new_pool;
+    *size = new_size;
   }
 
-  qsort(obj->elems, (size_t)obj->nelems, sizeof(obj->elems[0]), obj_kv_cmp);
+  tscfg_pool_hdr hdr = { .len = (uint32_t)str_len,
+                         .hash = tscfg_str_hash(str, str_len) };
+  char *p = &(*pool)[start];
+  memcpy(p, &hdr, sizeof(hdr));
+  if (str_len > 0) {
+    memcpy(p + sizeof(hdr), str, str_len);
+  }
+  p[sizeof(hdr) + str_len] = '\0';
 
+  if (extra_len > 0) {
+    // Zero padding, so that images are reproducible
+    size_t pad_start = start + sizeof(hdr) + str_len + 1;
+    memset(&(*pool)[pad_start], 0, extra_start - pad_start);
+    memcpy(&(*pool)[extra_start], extra, extra_len);
+  }
+
+  *len = start + entry_size;
+  *off = start;
   return TSCFG_OK;
 }
 
 /*
- * Compare keys with explicit lengths.
+ * Pool header for string of tape entry.
+ */
+static inline const tscfg_pool_hdr *pool_hdr(const tsconfig_tree *tree,
+                                             size_t ix) {
+  return (const tscfg_pool_hdr*)
+      (tree->pool + tscfg_tape_get_payload(tree->tape[ix]));
+}
+
+/*
+ * Whether key at tape index matches string.
  */
-static int key_cmp(const char *s1, size_t l1, const char *s2, size_t l2) {
-  int result;
-  size_t min_len = (l1 < l2) ?  l1 : l2;
-  if ((result = memcmp(s1, s2, min_len)) != 0) {
-    return result;
-  } else if (l1 == l2) {
-    // Identical
-    return 0;
+static inline bool key_eq(const tsconfig_tree *tree, size_t key_ix,
+                          const char *str, size_t len) {
+  const tscfg_pool_hdr *hdr = pool_hdr(tree, key_ix);
+  return hdr->len == len &&
+         memcmp((const char*)(hdr + 1), str, len) == 0;
+}
+
+static inline bool key_ix_eq(const tsconfig_tree *tree, size_t ix1,
+                             size_t ix2) {
+  const tscfg_pool_hdr *hdr = pool_hdr(tree, ix2);
+  return key_eq(tree, ix1, (const char*)(hdr + 1), hdr->len);
+}
+
+/*
+ * Index of next key in object after the key at ix.
+ */
+static inline size_t next_key(const tsconfig_tree *tree, size_t ix) {
+  return tscfg_val_end((tscfg_val){ .tree = tree, .ix = ix + 1 });
+}
+
+static tscfg_rc index_obj(tsconfig_tree *tree, size_t obj_ix) {
+  size_t end_ix = obj_ix + tscfg_tape_get_payload(tree->tape[obj_ix]);
+  uint64_t obj_num = tscfg_tape_get_payload(tree->tape[end_ix]);
+  assert(obj_num < tree->nobjs);
+  tscfg_obj_index *idx = &tree->objs[obj_num];
+
+  size_t nkeys = 0;
+  for (size_t ix = obj_ix + 1; ix < end_ix; ix = next_key(tree, ix)) {
+    nkeys++;
+  }
+
+  uint32_t size;
+  if (nkeys <= TSCFG_INDEX_SORTED_MAX) {
+    size = (uint32_t)nkeys;
+    idx->hashed = false;
   } else {
-    // One has trailing chars
-    return (l1 < l2) ? -1 : 1;
+    if (nkeys > UINT32_MAX / 2) {
+      REPORT_ERR("Too many keys to index object: %zu", nkeys);
+      return TSCFG_ERR_INVALID;
+    }
+
+    // Keep load factor at most 1/2
+    size = 1;
+    while (size < nkeys * 2) {
+      size *= 2;
+    }
+    idx->hashed = true;
   }
-}
 
-static int obj_kv_cmp(const void *p1, const void *p2) {
-  const tscfg_obj_kv *kv1 = p1, *kv2 = p2;
+  if (size > tree->index_size - tree->index_len) {
+    size_t new_size = (tree->index_size > 0) ? tree->index_size :
+                                               INIT_INDEX_SIZE;
+    while (new_size - tree->index_len < size) {
+      TSCFG_COND(new_size <= SIZE_MAX / 2 / sizeof(tree->index[0]),
+                 TSCFG_ERR_OOM);
+      new_size *= 2;
+    }
+
+    tscfg_index_entry *index = tscfg_realloc(tree->index,
+                                       sizeof(index[0]) * new_size);
+    TSCFG_CHECK_MALLOC(index);
+    tree->index = index;
+    tree->index_size = new_size;
+  }
+
+  idx->entries = tree->index_len;
+  tscfg_index_entry *entries = &tree->index[idx->entries];
+  tree->index_len += size;
 
-  int result;
-  if ((result = key_cmp(kv1->key, kv1->key_len, kv2->key, kv2->key_len)) != 0) {
-    // Difference in corresponding chars
-    return result;
-  } else if (kv1->orig_ix != kv2->orig_ix) {
-    // Break ties by original index
-    return (kv1->orig_ix < kv2->orig_ix) ? -1 : 1;
+  if (idx->hashed) {
+    memset(entries, 0, sizeof(entries[0]) * size);
+    idx->nentries = size;
   } else {
-    return 0;
+    idx->nentries = 0;
   }
+
+  for (size_t ix = obj_ix + 1; ix < end_ix; ix = next_key(tree, ix)) {
+    tscfg_index_entry entry = { .key_ix = ix,
+                                .hash = pool_hdr(tree, ix)->hash };
+    if (idx->hashed) {
+      index_insert_hashed(tree, entries, size, entry);
+    } else {
+      index_insert_sorted(tree, entries, &idx->nentries, entry);
+    }
+  }
+
+  return TSCFG_OK;
 }
 
-tscfg_rc tscfg_val_concat(tscfg_val *v1, tscfg_val *v2) {
-  // TODO
-  // * Types must match
-  // * Value concat: append tokens
-  // * Array concat: append elements
-  // * Obj concat: merge objects
-  // * TODO: do we assume sub-objects already merged?
-  return TSCFG_ERR_UNIMPL;
+/*
+ * Insert into array sorted by hash, replacing any matching key.
+ */
+static void index_insert_sorted(const tsconfig_tree *tree,
+        tscfg_index_entry *entries, uint32_t *n, tscfg_index_entry entry) {
+  uint32_t pos = 0;
+  for (; pos < *n && entries[pos].hash <= entry.hash; pos++) {
+    if (entries[pos].hash == entry.hash &&
+        key_ix_eq(tree, entries[pos].key_ix, entry.key_ix)) {
+      // Later definition wins
+      entries[pos].key_ix = entry.key_ix;
+      return;
+    }
+  }
+
+  memmove(&entries[pos + 1], &entries[pos],
+          sizeof(entries[0]) * (*n - pos));
+  entries[pos] = entry;
+  (*n)++;
 }
 
-tscfg_rc tscfg_obj_merge(tscfg_obj *o1, tscfg_obj *o2) {
-  // TODO
-  return TSCFG_ERR_UNIMPL;
+/*
+ * Insert into hash table, replacing any matching key.
+ */
+static void index_insert_hashed(const tsconfig_tree *tree,
+        tscfg_index_entry *entries, uint32_t size, tscfg_index_entry entry) {
+  uint32_t mask = size - 1;
+  for (uint32_t i = entry.hash & mask; ; i = (i + 1) & mask) {
+    tscfg_index_entry *slot = &entries[i];
+    if (slot->key_ix == 0) {
+      *slot = entry;
+      return;
+    } else if (slot->hash == entry.hash &&
+               key_ix_eq(tree, slot->key_ix, entry.key_ix)) {
+      // Later definition wins
+      slot->key_ix = entry.key_ix;
+      return;
+    }
+  }
 }
 
-bool val_is_obj(tscfg_val *v1) {
-  // TODO: implement
-  return true;
+tscfg_rc tscfg_obj_get(tscfg_val obj, const char *key, size_t len,
+                       tscfg_val *val) {
+  obj = tscfg_val_deref(obj);
+  if (tscfg_val_tag(obj) != TSCFG_TAPE_OBJ) {
+    return TSCFG_ERR_TYPE;
+  }
+
+  size_t val_ix;
+  tscfg_rc rc = tscfg_obj_find(obj.tree, obj.ix, key, len, &val_ix);
+  if (rc != TSCFG_OK) {
+    return rc;
+  }
+
+  *val = tscfg_val_deref((tscfg_val){ .tree = obj.tree, .ix = val_ix });
+  if (tscfg_val_tag(*val) == TSCFG_TAPE_UNDEF) {
+    // Optional substitution that was not defined
+    return TSCFG_ERR_NOT_FOUND;
+  }
+  return TSCFG_OK;
 }
 
-tscfg_rc tscfg_val_overwrite(tscfg_val *v1, tscfg_val *v2) {
-  tscfg_rc rc;
-  if (val_is_obj(v1) && val_is_obj(v2)) {
-    // TODO
-    tscfg_obj *o1 = NULL, *o2 = NULL;
-    rc = tscfg_obj_merge(o1, o2);
-    TSCFG_CHECK(rc);
+tscfg_rc tscfg_obj_find(const tsconfig_tree *tree, size_t obj_ix,
+                        const char *key, size_t len, size_t *val_ix) {
+  tscfg_tape_entry start = tree->tape[obj_ix];
+  assert(tscfg_tape_get_tag(start) == TSCFG_TAPE_OBJ);
+
+  size_t end_ix = obj_ix + tscfg_tape_get_payload(start);
+  const tscfg_obj_index *idx =
+      &tree->objs[tscfg_tape_get_payload(tree->tape[end_ix])];
+  const tscfg_index_entry *entries = &tree->index[idx->entries];
+  uint32_t hash = tscfg_str_hash(key, len);
+
+  if (idx->hashed) {
+    uint32_t mask = idx->nentries - 1;
+    for (uint32_t i = hash & mask; entries[i].key_ix != 0;
+         i = (i + 1) & mask) {
+      if (entries[i].hash == hash && key_eq(tree, entries[i].key_ix,
+                                            key, len)) {
+        *val_ix = entries[i].key_ix + 1;
+        return TSCFG_OK;
+      }
+    }
+    return TSCFG_ERR_NOT_FOUND;
+  }
+
+  // Binary search for first entry with hash
+  uint32_t lo = 0, hi = idx->nentries;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (; lo < idx->nentries && entries[lo].hash == hash; lo++) {
+    if (key_eq(tree, entries[lo].key_ix, key, len)) {
+      *val_ix = entries[lo].key_ix + 1;
+      return TSCFG_OK;
+    }
+  }
+  return TSCFG_ERR_NOT_FOUND;
+}
+
+tscfg_rc tsconfig_get(const tsconfig_tree *tree, const char *path,
+                      tscfg_val *val) {
+  tscfg_val curr = tsconfig_root(tree);
+  const char *p = path;
+
+  while (true) {
+    const char *elem;
+    size_t len;
+    if (*p == '"') {
+      elem = p + 1;
+      const char *close = strchr(elem, '"');
+      if (close == NULL) {
+        REPORT_ERR("Unterminated quoted element in path: %s", path);
+        return TSCFG_ERR_ARG;
+      }
+      len = (size_t)(close - elem);
+      p = close + 1;
+    } else {
+      elem = p;
+      len = strcspn(p, ".");
+      p += len;
+      if (len == 0) {
+        REPORT_ERR("Empty element in path: \"%s\"", path);
+        return TSCFG_ERR_ARG;
+      }
+    }
+
+    // Not found is an expected result, so no error trace
+    tscfg_rc rc = tscfg_obj_get(curr, elem, len, &curr);
+    if (rc != TSCFG_OK) {
+      return rc;
+    }
+
+    if (*p == '\0') {
+      break;
+    } else if (*p != '.') {
+      REPORT_ERR("Expected . after quoted element in path: %s", path);
+      return TSCFG_ERR_ARG;
+    }
+    p++;
+  }
+
+  *val = curr;
+  return TSCFG_OK;
+}
+
+tscfg_rc tscfg_val_str(tscfg_val val, const char **str, size_t *len) {
+  val = tscfg_val_deref(val);
+  tscfg_tape_entry e = val.tree->tape[val.ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED:
+    case TSCFG_TAPE_NUMBER:
+      *str = tscfg_tape_str(val.tree, e, len);
+      return TSCFG_OK;
+    case TSCFG_TAPE_TRUE:
+      *str = "true";
+      *len = 4;
+      return TSCFG_OK;
+    case TSCFG_TAPE_FALSE:
+      *str = "false";
+      *len = 5;
+      return TSCFG_OK;
+    default:
+      return TSCFG_ERR_TYPE;
+  }
+}
+
+tscfg_rc tscfg_val_bool(tscfg_val val, bool *b) {
+  static const char * const true_strs[] = { "true", "yes", "on", NULL };
+  static const char * const false_strs[] = { "false", "no", "off", NULL };
+
+  val = tscfg_val_deref(val);
+  tscfg_tape_entry e = val.tree->tape[val.ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_TRUE:
+      *b = true;
+      return TSCFG_OK;
+    case TSCFG_TAPE_FALSE:
+      *b = false;
+      return TSCFG_OK;
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED: {
+      size_t len;
+      const char *str = tscfg_tape_str(val.tree, e, &len);
+      if (str_is_one_of(str, len, true_strs)) {
+        *b = true;
+        return TSCFG_OK;
+      } else if (str_is_one_of(str, len, false_strs)) {
+        *b = false;
+        return TSCFG_OK;
+      }
+      return TSCFG_ERR_TYPE;
+    }
+    default:
+      return TSCFG_ERR_TYPE;
+  }
+}
+
+/*
+ * Get decoded number, or decode string that contains only a number.
+ */
+static tscfg_rc val_number(tscfg_val val, tscfg_num *num) {
+  val = tscfg_val_deref(val);
+  tscfg_tape_entry e = val.tree->tape[val.ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_NUMBER:
+      *num = tscfg_tape_num(val.tree, e);
+      return TSCFG_OK;
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED: {
+      size_t len, used;
+      const char *str = tscfg_tape_str(val.tree, e, &len);
+      tscfg_rc rc = tscfg_num_scan(str, len, &used, num);
+      TSCFG_CHECK(rc);
+      return (used > 0 && used == len) ? TSCFG_OK : TSCFG_ERR_TYPE;
+    }
+    default:
+      return TSCFG_ERR_TYPE;
+  }
+}
+
+/*
+ * Get text of value that may be a duration or size.
+ */
+static tscfg_rc unit_text(tscfg_val val, const char **str, size_t *len) {
+  tscfg_tape_entry e = val.tree->tape[val.ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED:
+      *str = tscfg_tape_str(val.tree, e, len);
+      return TSCFG_OK;
+    default:
+      return TSCFG_ERR_TYPE;
+  }
+}
+
+tscfg_rc tscfg_val_int64(tscfg_val val, int64_t *i) {
+  tscfg_num num;
+  tscfg_rc rc = val_number(val, &num);
+  if (rc != TSCFG_OK) {
+    return rc;
+  } else if (!num.is_int) {
+    return TSCFG_ERR_TYPE;
+  }
+
+  *i = num.v.i;
+  return TSCFG_OK;
+}
+
+tscfg_rc tscfg_val_double(tscfg_val val, double *d) {
+  tscfg_num num;
+  tscfg_rc rc = val_number(val, &num);
+  if (rc != TSCFG_OK) {
+    return rc;
+  }
+
+  if (num.is_int) {
+    *d = (double)num.v.i;
+  } else if (isinf(num.v.d)) {
+    // Out of range
+    return TSCFG_ERR_TYPE;
   } else {
-    tscfg_val_free(v1);
-    *v1 = *v2;
-    tscfg_val_invalidate(v2);
+    *d = num.v.d;
   }
-  return TSCFG_ERR_UNIMPL;
+  return TSCFG_OK;
 }
 
-void tscfg_val_free(tscfg_val *v) {
-  // TODO: implemnent
+tscfg_rc tscfg_val_duration(tscfg_val val, int64_t *ns) {
+  val = tscfg_val_deref(val);
+  if (tscfg_val_tag(val) == TSCFG_TAPE_NUMBER) {
+    // Milliseconds if no unit
+    tscfg_num num = tscfg_tape_num(val.tree, val.tree->tape[val.ix]);
+    return tscfg_num_scale(num, TSCFG_NS_PER_MS, ns);
+  }
+
+  const char *str;
+  size_t len;
+  tscfg_rc rc = unit_text(val, &str, &len);
+  return (rc == TSCFG_OK) ? tscfg_parse_duration(str, len, ns) : rc;
 }
 
-static void tscfg_val_invalidate(tscfg_val *v) {
-  // TODO: set to invalid value
+tscfg_rc tscfg_val_size(tscfg_val val, int64_t *bytes) {
+  val = tscfg_val_deref(val);
+  if (tscfg_val_tag(val) == TSCFG_TAPE_NUMBER) {
+    // Bytes if no unit
+    tscfg_num num = tscfg_tape_num(val.tree, val.tree->tape[val.ix]);
+    return tscfg_num_scale(num, 1, bytes);
+  }
+
+  const char *str;
+  size_t len;
+  tscfg_rc rc = unit_text(val, &str, &len);
+  return (rc == TSCFG_OK) ? tscfg_parse_size(str, len, bytes) : rc;
+}
+
+bool tscfg_val_is_null(tscfg_val val) {
+  return tscfg_val_tag(tscfg_val_deref(val)) == TSCFG_TAPE_NULL;
+}
+
+tscfg_rc tsconfig_get_str(const tsconfig_tree *tree, const char *path,
+                          const char **str, size_t *len) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_str(val, str, len) : rc;
+}
+
+tscfg_rc tsconfig_get_bool(const tsconfig_tree *tree, const char *path,
+                           bool *b) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_bool(val, b) : rc;
+}
+
+tscfg_rc tsconfig_get_int64(const tsconfig_tree *tree, const char *path,
+                            int64_t *i) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_int64(val, i) : rc;
+}
+
+tscfg_rc tsconfig_get_double(const tsconfig_tree *tree, const char *path,
+                             double *d) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_double(val, d) : rc;
+}
+
+tscfg_rc tsconfig_get_duration(const tsconfig_tree *tree, const char *path,
+                               int64_t *ns) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_duration(val, ns) : rc;
+}
+
+tscfg_rc tsconfig_get_size(const tsconfig_tree *tree, const char *path,
+                           int64_t *bytes) {
+  tscfg_val val;
+  tscfg_rc rc = tsconfig_get(tree, path, &val);
+  return (rc == TSCFG_OK) ? tscfg_val_size(val, bytes) : rc;
+}
+
+static bool str_is_one_of(const char *str, size_t len,
+                          const char * const *options) {
+  for (; *options != NULL; options++) {
+    if (strlen(*options) == len && memcmp(*options, str, len) == 0) {
+      return true;
+    }
+  }
+  return false;
 }
@@ -24,92 +24,432 @@
 #ifndef __TSCONFIG_TREE_H
 #define __TSCONFIG_TREE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tsconfig_alloc.h"
 #include "tsconfig_common.h"
 #include "tsconfig_tok.h"
 
+/*
+ * The tree is stored as a tape: a flat array of tagged 64-bit entries in
+ * document order, with strings kept separately in a string pool.  Each
+ * entry has a tag in the top 8 bits and a 56-bit payload.
+ *
+ * Containers (objects, arrays, concatenations, substitutions) are a start
+ * entry, the entries for their contents, then an end entry.  The payloads
+ * of start entries, and of end entries other than OBJ_END, are the offset
+ * between the two, so a value can be skipped over without visiting its
+ * contents, and a subtree can be moved within the tape without patching
+ * offsets.
+ *
+ * Object contents are a sequence of key entries each directly followed by
+ * the value entries.  Keys with path expressions, e.g. a.b.c, are expanded
+ * into nested objects.  Values made up of several elements, e.g. a
+ * concatenation of strings and whitespace, are wrapped in CONCAT and
+ * CONCAT_END.
+ *
+ * Once substitutions are resolved, substitutions, concatenations and
+ * merges are replaced in place by references.  Values created during
+ * resolution, e.g. concatenated strings, are stored on the tape after the
+ * root value.
+ */
 typedef enum {
+  TSCFG_TAPE_OBJ, // Payload: offset to OBJ_END
+  TSCFG_TAPE_OBJ_END, // Payload: object number, for tsconfig_tree.objs
+  TSCFG_TAPE_ARR, // Payload: offset to ARR_END
+  TSCFG_TAPE_ARR_END, // Payload: offset back to ARR
 
-  TSCFG_NODE_OBJ,
-  TSCFG_NODE_ARR,
-} tscfg_node_kind;
+  /* String entries: payload is string pool offset */
+  TSCFG_TAPE_KEY, // Key followed by value, e.g. from = or :
+  TSCFG_TAPE_KEY_APPEND, // Key followed by value, from +=
+  TSCFG_TAPE_STRING, // Quoted string
+  TSCFG_TAPE_UNQUOTED, // Unquoted string
+  TSCFG_TAPE_NUMBER, // Number, as text followed by decoded value
+  TSCFG_TAPE_WS, // Whitespace between concatenated values
+  TSCFG_TAPE_PATH, // Path element in substitution
+  /*
+   * As PATH, but prepended to substitution from file included inside an
+   * object, so that path is relative to where file was included.
+   */
+  TSCFG_TAPE_PATH_PREFIX,
 
-typedef struct {
-  // TODO
-  // * single token
-  // * list of unconcatenated tokens
-  // * object or array
-  int dummy;
-} tscfg_val;
+  /* Keywords: no payload */
+  TSCFG_TAPE_TRUE,
+  TSCFG_TAPE_FALSE,
+  TSCFG_TAPE_NULL,
 
-typedef enum {
-  TSCFG_KV_ASSIGN, // E.g. from the = operator
-  TSCFG_KV_APPEND, // E.g. from the += operator
-} tscfg_kv_assignment;
+  TSCFG_TAPE_CONCAT, // Payload: offset to CONCAT_END
+  TSCFG_TAPE_CONCAT_END, // Payload: offset back to CONCAT
 
-typedef struct {
-  char *key;
-  size_t key_len;
-  int orig_ix;
-  /** Type of separator used to create KV */
-  tscfg_kv_assignment assignment;
-  tscfg_val val;
-} tscfg_obj_kv;
+  /* Substitution containing PATH entries */
+  TSCFG_TAPE_SUB, // Payload: offset to SUB_END
+  TSCFG_TAPE_SUB_OPT, // As SUB, for optional substitution ${?
+  TSCFG_TAPE_SUB_END, // Payload: offset back to SUB or SUB_OPT
+
+  /*
+   * Reference to another value, e.g. the target of a resolved
+   * substitution.  Contents between REF and REF_END are ignored.
+   */
+  TSCFG_TAPE_REF, // Payload: offset to REF_END
+  TSCFG_TAPE_REF_END, // Payload: tape index of referenced value
+
+  TSCFG_TAPE_UNDEF, // Undefined value from optional substitution
 
+  /*
+   * Definitions of a key that depend on substitutions, in order, e.g.
+   * a = ${x} then a { y = 1 }.  Once resolved, later values override
+   * earlier ones unless both are objects, which are merged, and undefined
+   * values are skipped.  Only in merged trees before resolution.
+   */
+  TSCFG_TAPE_MERGE, // Payload: offset to MERGE_END
+  TSCFG_TAPE_MERGE_END, // Payload: offset back to MERGE
+
+  // Placeholder for included file being loaded, only seen by tree reader
+  TSCFG_TAPE_INCLUDE,
+} tscfg_tape_tag;
+
+typedef uint64_t tscfg_tape_entry;
+
+#define TSCFG_TAPE_TAG_SHIFT 56
+#define TSCFG_TAPE_PAYLOAD_MAX ((UINT64_C(1) << TSCFG_TAPE_TAG_SHIFT) - 1)
+
+/*
+ * String pool entries start at 4-byte aligned offsets with the length
+ * and hash of the string, followed by the string and a null terminator.
+ * Entries for NUMBER are then followed by the decoded tscfg_num at the
+ * next 8-byte aligned offset, so that numbers are only decoded once.
+ */
 typedef struct {
-  tscfg_obj_kv *elems;
-  int nelems;
-} tscfg_obj;
+  uint32_t len;
+  uint32_t hash; // tscfg_str_hash() of string
+} tscfg_pool_hdr;
 
+/*
+ * Index entry for key in object.
+ */
 typedef struct {
-  tscfg_val *elems;
-  int nelems;
-} tscfg_arr;
+  uint64_t key_ix; // Tape index of KEY entry, 0 for empty hash table slot
+  uint32_t hash; // Hash of key from string pool
+} tscfg_index_entry;
 
-typedef union {
-  tscfg_obj *obj;
-  tscfg_arr *arr;
-} tscfg_node;
+// Objects with more keys than this get a hash table
+#define TSCFG_INDEX_SORTED_MAX 8
 
+/*
+ * Index of keys in object.  For small objects this is an array sorted by
+ * hash, for binary search.  For wider objects it is an open-addressing
+ * hash table with linear probing.  If a key is repeated, the last
+ * definition is indexed.  Entries for all objects are in one array, so
+ * that the index has no pointers and can be saved in an image.
+ */
 typedef struct {
-  tscfg_node_kind root_kind;
-  tscfg_node root;
+  uint64_t entries; // Offset of first entry in tsconfig_tree.index
+  // Number of keys if sorted, or hash table size, a power of two
+  uint32_t nentries;
+  bool hashed;
+} tscfg_obj_index;
+
+typedef struct tsconfig_tree {
+  // Tape for whole tree, starting with root OBJ or ARR
+  tscfg_tape_entry *tape;
+  size_t tape_len;
+
+  char *pool;
+  size_t pool_len;
+
+  // Key indexes for objects, by object number in OBJ_END payload
+  tscfg_obj_index *objs;
+  size_t nobjs;
+
+  // Entries for key indexes
+  tscfg_index_entry *index;
+  size_t index_len;
+  size_t index_size;
+
+  // Owns any other memory for tree
+  struct tscfg_arena *arena;
+
+  // Allocator for memory owned by tree, or NULL for malloc
+  const tscfg_allocator *alloc;
+
+  // If non-NULL, mapped image that tree is read from, and tape, pool and
+  // index are read-only
+  void *image;
+  size_t image_len;
 } tsconfig_tree;
 
 /*
- * Sort object keys by (key, orig_ix).
+ * Reference to value in tree: the first tape entry of the value.
+ */
+typedef struct {
+  const tsconfig_tree *tree;
+  size_t ix;
+} tscfg_val;
+
+static inline tscfg_tape_entry tscfg_tape_make(tscfg_tape_tag tag,
+                                               uint64_t payload) {
+  return ((uint64_t)tag << TSCFG_TAPE_TAG_SHIFT) | payload;
+}
+
+static inline tscfg_tape_tag tscfg_tape_get_tag(tscfg_tape_entry e) {
+  return (tscfg_tape_tag)(e >> TSCFG_TAPE_TAG_SHIFT);
+}
+
+static inline uint64_t tscfg_tape_get_payload(tscfg_tape_entry e) {
+  return e & TSCFG_TAPE_PAYLOAD_MAX;
+}
+
+/*
+ * 32-bit FNV-1a hash of string, as stored in string pool.
+ */
+static inline uint32_t tscfg_str_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Root value of tree.
+ */
+static inline tscfg_val tsconfig_root(const tsconfig_tree *tree) {
+  return (tscfg_val){ .tree = tree, .ix = 0 };
+}
+
+static inline tscfg_tape_tag tscfg_val_tag(tscfg_val val) {
+  return tscfg_tape_get_tag(val.tree->tape[val.ix]);
+}
+
+/*
+ * Follow references to get referenced value.
+ */
+static inline tscfg_val tscfg_val_deref(tscfg_val val) {
+  const tscfg_tape_entry *tape = val.tree->tape;
+  while (tscfg_tape_get_tag(tape[val.ix]) == TSCFG_TAPE_REF) {
+    size_t end = val.ix + (size_t)tscfg_tape_get_payload(tape[val.ix]);
+    val.ix = (size_t)tscfg_tape_get_payload(tape[end]);
+  }
+  return val;
+}
+
+/*
+ * Index of tape entry after value, i.e. of next sibling.
+ */
+static inline size_t tscfg_val_end(tscfg_val val) {
+  tscfg_tape_entry e = val.tree->tape[val.ix];
+  switch (tscfg_tape_get_tag(e)) {
+    case TSCFG_TAPE_OBJ:
+    case TSCFG_TAPE_ARR:
+    case TSCFG_TAPE_CONCAT:
+    case TSCFG_TAPE_MERGE:
+    case TSCFG_TAPE_SUB:
+    case TSCFG_TAPE_SUB_OPT:
+    case TSCFG_TAPE_REF:
+      return val.ix + (size_t)tscfg_tape_get_payload(e) + 1;
+    default:
+      return val.ix + 1;
+  }
+}
+
+/*
+ * Pool string for tape entry with string payload.
+ * len: if non-NULL, set to length of string
+ * return: null-terminated string
+ */
+static inline const char *tscfg_tape_str(const tsconfig_tree *tree,
+                        tscfg_tape_entry e, size_t *len) {
+  const char *p = tree->pool + tscfg_tape_get_payload(e);
+  if (len != NULL) {
+    *len = ((const tscfg_pool_hdr*)p)->len;
+  }
+  return p + sizeof(tscfg_pool_hdr);
+}
+
+/*
+ * Decoded value of NUMBER tape entry.
+ */
+static inline tscfg_num tscfg_tape_num(const tsconfig_tree *tree,
+                                       tscfg_tape_entry e) {
+  uint64_t off = tscfg_tape_get_payload(e);
+  const tscfg_pool_hdr *hdr = (const tscfg_pool_hdr*)(tree->pool + off);
+  off += sizeof(tscfg_pool_hdr) + hdr->len + 1;
+  off = (off + 7) & ~(uint64_t)7;
+
+  // Pool of mapped image may not be 8-byte aligned
+  tscfg_num num;
+  memcpy(&num, tree->pool + off, sizeof(num));
+  return num;
+}
+
+/*
+ * Free all memory owned by tree.
+ */
+void tsconfig_tree_free(tsconfig_tree *tree);
+
+/*
+ * Write parsed tree to binary image file, which can be loaded by
+ * tsconfig_image_load() without parsing.  The tape, string pool and key
+ * index are written as they are in memory, so images can only be loaded
+ * on platforms with the same byte order and struct layout.  An existing
+ * file is replaced atomically.
+ */
+tscfg_rc tsconfig_image_write(const tsconfig_tree *tree, const char *path);
+
+/*
+ * Map image written by tsconfig_image_write() read-only as tree.  Nothing
+ * is parsed or allocated: lookups read from the mapping, which is shared
+ * with other processes using the same image.  The header and section
+ * bounds are checked, but the contents must be from a trusted writer.
+ * Free tree with tsconfig_tree_free() to unmap it.
+ * return: TSCFG_ERR_INVALID if file is not a compatible image
+ */
+tscfg_rc tsconfig_image_load(const char *path, tsconfig_tree *tree);
+
+/*
+ * Text formats for rendering tree.
+ */
+typedef enum {
+  TSCFG_RENDER_JSON, // JSON without whitespace
+  TSCFG_RENDER_JSON_PRETTY, // JSON with one value per line
+  /*
+   * HOCON with one field per line, = between keys and values other than
+   * objects, no braces around root object and no commas.  Strings are
+   * always quoted and keys are quoted unless plain identifiers.
+   */
+  TSCFG_RENDER_HOCON,
+} tscfg_render_fmt;
+
+/*
+ * Render resolved tree as text, appending it to a buffer.  References
+ * are followed, so shared values are written out in full where they are
+ * used, and undefined fields and elements are left out.  Nested values
+ * are indented by two spaces in pretty JSON and HOCON.
+ * buf: buffer allocated with malloc(), or NULL, grown with realloc() as
+ *      needed.  Text is null-terminated.
+ * len: length of text already in buffer, updated
+ * size: allocated size of buffer, updated
+ * return: TSCFG_ERR_INVALID if tree is not resolved.  On error, *len is
+ *         not updated.
+ */
+tscfg_rc tsconfig_render(const tsconfig_tree *tree, tscfg_render_fmt fmt,
+                         char **buf, size_t *len, size_t *size);
+
+/*
+ * Render resolved tree as text, as for tsconfig_render(), writing it to
+ * file descriptor fd through a fixed-size buffer.
+ */
+tscfg_rc tsconfig_render_fd(const tsconfig_tree *tree, tscfg_render_fmt fmt,
+                            int fd);
+
+/*
+ * Merge duplicate keys in all objects according to HOCON rules,
+ * replacing tape.  Objects defined more than once are merged, other
+ * values are overridden by later definitions and += appends to arrays.
+ * Concatenations of only objects or only arrays are also merged.
+ * Substitutions are left unresolved.
+ */
+tscfg_rc tscfg_tree_merge(tsconfig_tree *tree);
+
+/*
+ * Resolve substitutions and concatenations in merged and indexed tree
+ * according to HOCON rules, replacing them with references.  Paths
+ * not found in tree are looked up in environment variables.
+ */
+tscfg_rc tscfg_tree_resolve(tsconfig_tree *tree);
+
+/*
+ * Build key indexes for all objects in tree.  Must be called again
+ * if tape is modified.
  */
-tscfg_rc tscfg_obj_sort(tscfg_obj *obj);
+tscfg_rc tscfg_tree_build_index(tsconfig_tree *tree);
 
 /*
- * Merge duplicate keys according to HOCON config rules.
- * Before, keys should be sorted.
- * After, no duplicate keys will exist.
- * Any unused memory from duplicate keys will be freed.
+ * Build key index for object appended to tree, adding to objs.
+ * objs_size: allocated size of tree->objs, updated if it grows
  */
-tscfg_rc tscfg_obj_merge_keys(tscfg_obj *obj);
+tscfg_rc tscfg_tree_index_obj(tsconfig_tree *tree, size_t obj_ix,
+                              size_t *objs_size);
 
 /*
- * Concatenate v2 onto v1, freeing any unused memory for v2.
- * After returning, v1 contains concatenated value and v2 is empty.
+ * Find value for key in object without following references.
+ * val_ix: set to tape index of value
+ * return: TSCFG_ERR_NOT_FOUND if not present
  */
-tscfg_rc tscfg_val_concat(tscfg_val *v1, tscfg_val *v2);
+tscfg_rc tscfg_obj_find(const tsconfig_tree *tree, size_t obj_ix,
+                        const char *key, size_t len, size_t *val_ix);
 
 /*
- * Implement HOCON rules for overwritten values.
+ * Add string to string pool, growing pool if needed.
+ * size: allocated size of pool, updated if it grows
+ * off: set to offset of new entry
  */
-tscfg_rc tscfg_val_overwrite(tscfg_val *v1, tscfg_val *v2);
+tscfg_rc tscfg_pool_add(char **pool, size_t *len, size_t *size,
+                        const char *str, size_t str_len, uint64_t *off);
 
-void tscfg_val_free(tscfg_val *v);
+/*
+ * Add text of number to string pool, followed by decoded value, as for
+ * NUMBER entries.
+ */
+tscfg_rc tscfg_pool_add_num(char **pool, size_t *len, size_t *size,
+                            const char *str, size_t str_len, tscfg_num num,
+                            uint64_t *off);
 
 /*
- * Merge o2 into o1. Definitions from o2 take precedence over o1.
- * Before, both o2 and o1 must have sorted keys.
+ * Look up value by HOCON path expression, e.g. a.b."c.d", starting from
+ * root object.  Path elements are separated by '.', and an element in
+ * double quotes may contain '.'.
  *
- * After return, o2 is empty and o1 contains keys from both.
- * This doesn't merge any duplicate keys.
- * TODO: should this return a flag indicating duplicates?
- * TODO: should this do some preliminary merging, e.g. overwrites?
+ * return: TSCFG_ERR_NOT_FOUND if no value at path, TSCFG_ERR_TYPE if path
+ *         goes through a value that is not an object.
+ */
+tscfg_rc tsconfig_get(const tsconfig_tree *tree, const char *path,
+                      tscfg_val *val);
+
+/*
+ * Look up single key in object, following references.
+ * return: as for tsconfig_get()
+ */
+tscfg_rc tscfg_obj_get(tscfg_val obj, const char *key, size_t len,
+                       tscfg_val *val);
+
+/*
+ * Typed accessors for values.  Strings, numbers and keywords in the tree
+ * are converted where HOCON allows it, e.g. the string "yes" to boolean.
+ * Numbers use the value decoded when parsing.  Durations are converted
+ * to nanoseconds and memory sizes to bytes, using the units in the
+ * HOCON spec, e.g. 10s or 512MiB.
+ * return: TSCFG_ERR_TYPE if value cannot be converted
+ */
+tscfg_rc tscfg_val_str(tscfg_val val, const char **str, size_t *len);
+tscfg_rc tscfg_val_bool(tscfg_val val, bool *b);
+tscfg_rc tscfg_val_int64(tscfg_val val, int64_t *i);
+tscfg_rc tscfg_val_double(tscfg_val val, double *d);
+tscfg_rc tscfg_val_duration(tscfg_val val, int64_t *ns);
+tscfg_rc tscfg_val_size(tscfg_val val, int64_t *bytes);
+
+/*
+ * True if value is null, following references.
+ */
+bool tscfg_val_is_null(tscfg_val val);
+
+/*
+ * Look up path, as for tsconfig_get(), and convert value.
  */
-tscfg_rc tscfg_obj_merge(tscfg_obj *o1, tscfg_obj *o2);
+tscfg_rc tsconfig_get_str(const tsconfig_tree *tree, const char *path,
+                          const char **str, size_t *len);
+tscfg_rc tsconfig_get_bool(const tsconfig_tree *tree, const char *path,
+                           bool *b);
+tscfg_rc tsconfig_get_int64(const tsconfig_tree *tree, const char *path,
+                            int64_t *i);
+tscfg_rc tsconfig_get_double(const tsconfig_tree *tree, const char *path,
+                             double *d);
+tscfg_rc tsconfig_get_duration(const tsconfig_tree *tree, const char *path,
+                               int64_t *ns);
+tscfg_rc tsconfig_get_size(const tsconfig_tree *tree, const char *path,
+                           int64_t *bytes);
 
 #endif // __TSCONFIG_TREE_H
@@ -24,146 +24,1138 @@
 
 #include "tsconfig_tree_reader.h"
 
+#include <assert.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "tsconfig_alloc.h"
 #include "tsconfig_err.h"
 
-struct tscfg_treeread_state {
-  tsconfig_tree tree;
-};
+#define INIT_TAPE_SIZE 256
+#define INIT_STACK_SIZE 16
+#define INIT_PATH_SIZE 8
+#define INIT_INCLUDES_SIZE 4
+#define INIT_POOL_SIZE 4096
+
+typedef enum {
+  FRAME_CONTAINER, // Object or array with events for contents
+  FRAME_PATH_OBJ, // Object implied by path expression in key
+  FRAME_VALUE, // Value of key-value pair or array element
+} tread_frame_kind;
+
+typedef struct {
+  tread_frame_kind kind;
+
+  // Tape index of container start entry, or of first entry of value
+  size_t start;
+
+  // Elements of value so far, e.g. tokens, subs, objects
+  size_t nelems;
+} tread_frame;
 
 /*
- * Reader functions
+ * Included file being loaded by worker pool, spliced into tape when
+ * reading is finished.
  */
-static bool tread_obj_start(void *s);
-static bool tread_obj_end(void *s);
-static bool tread_arr_start(void *s);
-static bool tread_arr_end(void *s);
-static bool tread_key_val_start(void *s, tscfg_tok *key_toks, int nkey_toks,
-                                tscfg_tok_tag sep);
-static bool tread_key_val_end(void *s);
-static bool tread_val_start(void *s);
-static bool tread_val_end(void *s);
-static bool tread_token(void *s, tscfg_tok *tok);
-static bool tread_var_sub(void *s, tscfg_tok *toks, int ntoks, bool optional);
+typedef struct {
+  tscfg_job job; // First member, so job can be converted to include
 
-tscfg_rc
-tscfg_tree_reader_init(tscfg_reader *reader, tscfg_treeread_state **state) {
-  *state = malloc(sizeof(tscfg_treeread_state));
-  TSCFG_CHECK_MALLOC(*state);
-
-  reader->obj_start = tread_obj_start;
-  reader->obj_end = tread_obj_end;
-  reader->arr_start = tread_arr_start;
-  reader->arr_end = tread_arr_end;
-  reader->key_val_start = tread_key_val_start;
-  reader->key_val_end = tread_key_val_end;
-  reader->val_start = tread_val_start;
-  reader->val_end = tread_val_end;
-  reader->token = tread_token;
-  reader->var_sub = tread_var_sub;
+  tscfg_pool *pool;
+  char *path;
+  int depth;
+  bool required;
+
+  // Pool offsets of keys enclosing include statement
+  uint64_t *prefix;
+  int prefix_len;
+
+  // Result of load
+  tscfg_rc rc;
+  tscfg_include *inc;
+} tread_include;
+
+struct tscfg_treeread_state {
+  tscfg_tape_entry *tape;
+  size_t tape_len;
+  size_t tape_size;
+
+  char *pool;
+  size_t pool_len;
+  size_t pool_size;
+
+  // Objects completed so far
+  size_t nobjs;
+
+  // Containers and values that are currently open
+  tread_frame *stack;
+  int depth;
+  int stack_size;
+
+  // Pool offsets of elements of last path parsed
+  uint64_t *path;
+  int path_len;
+  int path_size;
+
+  // Buffer for building path element
+  char *buf;
+  size_t buf_len;
+  size_t buf_size;
+
+  /*
+   * Memory only needed while parsing, e.g. token strings.  The parser
+   * rewinds it once each batch of events is read, and it is reset when
+   * the tree is taken.
+   */
+  tscfg_arena *scratch;
 
+  // Memory owned by tree
+  tscfg_arena *arena;
+
+  // Directory of file being read, or NULL for working directory
+  char *dir;
+  int include_depth;
+
+  // Workers for loading includes, or NULL to load them while reading
+  tscfg_pool *workers;
+
+  // Includes being loaded, indexed by payload of TSCFG_TAPE_INCLUDE
+  tread_include **pending;
+  size_t npending;
+  size_t pending_size;
+
+  // Files spliced into tree
+  tscfg_include **incs;
+  size_t nincs;
+  size_t incs_size;
+
+  // Tape indices of containers open while splicing include
+  size_t *opens;
+  size_t nopens;
+  size_t opens_size;
+
+  // Reason for last failure
+  tscfg_rc err;
+};
+
+static bool tread_events(void *s, tscfg_event *events, int nevents);
+
+static bool container_start(tscfg_treeread_state *state, tscfg_tape_tag tag);
+static bool container_end(tscfg_treeread_state *state,
+                          tscfg_tape_tag start_tag, tscfg_tape_tag end_tag);
+static bool key_val_start(tscfg_treeread_state *state, tscfg_tok *toks,
+                          int ntoks, tscfg_tok_tag sep);
+static bool key_val_end(tscfg_treeread_state *state);
+static bool val_start(tscfg_treeread_state *state);
+static bool val_end(tscfg_treeread_state *state);
+static bool token(tscfg_treeread_state *state, tscfg_tok *tok);
+static bool var_sub(tscfg_treeread_state *state, tscfg_tok *toks, int ntoks,
+                    bool optional);
+static bool include(tscfg_treeread_state *state, tscfg_tok *tok,
+                    bool required);
+static void load_include(tscfg_job *job);
+static bool add_include(tscfg_treeread_state *state, tscfg_rc rc,
+                        tscfg_include *inc, const char *path,
+                        bool required);
+static bool in_object(tscfg_treeread_state *state);
+static bool splice_tree(tscfg_treeread_state *state,
+                        const tsconfig_tree *inc);
+static bool copy_tape(tscfg_treeread_state *state,
+                      const tscfg_tape_entry *tape, size_t start,
+                      size_t end, size_t pool_base, bool add_prefix);
+static bool include_prefix(tscfg_treeread_state *state);
+static void free_pending(tscfg_treeread_state *state);
+
+static bool parse_path(tscfg_treeread_state *state, tscfg_tok *toks,
+                       int ntoks);
+static bool path_elem_end(tscfg_treeread_state *state, bool quoted);
+static bool buf_append(tscfg_treeread_state *state, const char *str,
+                       size_t len);
+
+static bool elem_start(tscfg_treeread_state *state);
+static bool push_frame(tscfg_treeread_state *state, tread_frame_kind kind);
+static bool tape_grow(tscfg_treeread_state *state);
+static bool pool_add(tscfg_treeread_state *state, const char *str,
+                     size_t len, uint64_t *off);
+static bool grow_array(void **arr, size_t *size, size_t elem_size,
+                       size_t min_size, size_t init_size);
+static bool fail(tscfg_treeread_state *state, tscfg_rc rc);
+
+tscfg_rc tscfg_tree_reader_init(tscfg_batch_reader *reader,
+                                tscfg_treeread_state **state) {
+  tscfg_treeread_state *s = tscfg_malloc(sizeof(tscfg_treeread_state));
+  TSCFG_CHECK_MALLOC(s);
+
+  memset(s, 0, sizeof(*s));
+  s->err = TSCFG_OK;
+  s->scratch = tscfg_arena_new(0);
+  s->arena = tscfg_arena_new(0);
+  if (s->scratch == NULL || s->arena == NULL) {
+    tscfg_tree_reader_free(s);
+    return TSCFG_ERR_OOM;
+  }
+
+  reader->events = tread_events;
+  reader->batch_size = TSCFG_DEFAULT_BATCH_SIZE;
+
+  *state = s;
   return TSCFG_OK;
 }
 
+tscfg_rc tscfg_tree_reader_set_file(tscfg_treeread_state *state,
+                                    const char *path, int depth,
+                                    tscfg_pool *pool) {
+  tscfg_free(state->dir);
+  state->dir = NULL;
+  state->include_depth = depth;
+  state->workers = pool;
+
+  const char *slash = (path != NULL) ? strrchr(path, '/') : NULL;
+  if (slash != NULL) {
+    // Keep root directory as "/"
+    size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+    state->dir = tscfg_malloc(len + 1);
+    TSCFG_CHECK_MALLOC(state->dir);
+    memcpy(state->dir, path, len);
+    state->dir[len] = '\0';
+  }
+  return TSCFG_OK;
+}
+
+tscfg_arena *tscfg_tree_reader_arena(tscfg_treeread_state *state) {
+  return state->scratch;
+}
+
+tscfg_rc tscfg_tree_reader_err(tscfg_treeread_state *state) {
+  return state->err != TSCFG_OK ? state->err : TSCFG_ERR_READER;
+}
+
+tscfg_rc tscfg_tree_reader_splice(tscfg_treeread_state *state,
+                                  const tsconfig_tree *tree) {
+  if (!in_object(state)) {
+    REPORT_ERR("Tree spliced outside of object");
+    return TSCFG_ERR_INVALID;
+  }
+  if (tscfg_tape_get_tag(tree->tape[0]) != TSCFG_TAPE_OBJ) {
+    REPORT_ERR("Spliced tree must be an object");
+    return TSCFG_ERR_INVALID;
+  }
+
+  if (!include_prefix(state) || !splice_tree(state, tree)) {
+    return state->err;
+  }
+  return TSCFG_OK;
+}
+
+tscfg_rc tscfg_tree_reader_finish_includes(tscfg_treeread_state *state) {
+  if (state->npending == 0) {
+    return TSCFG_OK;
+  }
+
+  for (size_t i = 0; i < state->npending; i++) {
+    tscfg_pool_wait(state->workers, &state->pending[i]->job);
+  }
+
+  // Copy tape, replacing placeholders with included files
+  tscfg_tape_entry *tape = state->tape;
+  size_t tape_len = state->tape_len;
+  state->tape = NULL;
+  state->tape_len = state->tape_size = 0;
+  state->nobjs = 0;
+
+  bool ok = copy_tape(state, tape, 0, tape_len, 0, false);
+  tscfg_free(tape);
+  free_pending(state);
+  return ok ? TSCFG_OK : state->err;
+}
+
+void tscfg_tree_reader_take_includes(tscfg_treeread_state *state,
+                                     tscfg_include ***incs, size_t *nincs) {
+  *incs = state->incs;
+  *nincs = state->nincs;
+  state->incs = NULL;
+  state->nincs = 0;
+  state->incs_size = 0;
+}
+
 tscfg_rc
 tscfg_tree_reader_done(tscfg_treeread_state *state, tsconfig_tree *tree) {
-  *tree = state->tree; // Shallow copy
+  tscfg_rc rc = tscfg_tree_reader_take(state, tree);
+  tscfg_tree_reader_free(state);
+  return rc;
+}
 
-  free(state);
+tscfg_rc
+tscfg_tree_reader_take(tscfg_treeread_state *state, tsconfig_tree *tree) {
+  if (state->depth != 0 || state->tape_len == 0) {
+    REPORT_ERR("Tree incomplete at end of input");
+    return TSCFG_ERR_INVALID;
+  }
+
+  tscfg_rc rc = tscfg_tree_reader_finish_includes(state);
+  TSCFG_CHECK(rc);
+
+  tree->tape = state->tape;
+  tree->tape_len = state->tape_len;
+  tree->pool = state->pool;
+  tree->pool_len = state->pool_len;
+  tree->objs = NULL; // Built later from tape
+  tree->nobjs = state->nobjs;
+  tree->index = NULL;
+  tree->index_len = tree->index_size = 0;
+  tree->arena = state->arena;
+  tree->alloc = tscfg_alloc_current();
+  tree->image = NULL;
+  tree->image_len = 0;
+
+  // Tree now owns these
+  state->tape = NULL;
+  state->tape_len = state->tape_size = 0;
+  state->pool = NULL;
+  state->pool_len = state->pool_size = 0;
+  state->arena = NULL;
+
+  // Tokens were all copied into tree
+  tscfg_arena_reset(state->scratch);
   return TSCFG_OK;
 }
 
-static bool tread_obj_start(void *s) {
-  // TODO: implement
-  fprintf(stderr, "obj_start\n");
-  return true;
+tscfg_rc tscfg_tree_reader_reset(tscfg_treeread_state *state) {
+  free_pending(state);
+
+  // Partial tree, if not taken
+  tscfg_free(state->tape);
+  state->tape = NULL;
+  state->tape_len = state->tape_size = 0;
+  tscfg_free(state->pool);
+  state->pool = NULL;
+  state->pool_len = state->pool_size = 0;
+  state->nobjs = 0;
+
+  for (size_t i = 0; i < state->nincs; i++) {
+    tscfg_include_release(state->incs[i]);
+  }
+
+  // Keep arrays for reuse
+  state->nincs = 0;
+  state->depth = 0;
+  state->path_len = 0;
+  state->buf_len = 0;
+  state->nopens = 0;
+  state->workers = NULL;
+  state->err = TSCFG_OK;
+
+  tscfg_arena_reset(state->scratch);
+  if (state->arena == NULL) {
+    state->arena = tscfg_arena_new(0);
+    TSCFG_CHECK_MALLOC(state->arena);
+  } else {
+    tscfg_arena_reset(state->arena);
+  }
+  return TSCFG_OK;
 }
 
-static bool tread_obj_end(void *s) {
-  // TODO: implement
-  fprintf(stderr, "obj_end\n");
+void tscfg_tree_reader_free(tscfg_treeread_state *state) {
+  // Wait for any includes still being loaded
+  free_pending(state);
+
+  tscfg_free(state->tape);
+  tscfg_free(state->pool);
+  tscfg_free(state->stack);
+  tscfg_free(state->path);
+  tscfg_free(state->buf);
+  tscfg_free(state->dir);
+  for (size_t i = 0; i < state->nincs; i++) {
+    tscfg_include_release(state->incs[i]);
+  }
+  tscfg_free(state->incs);
+  tscfg_free(state->opens);
+  tscfg_arena_free(state->scratch);
+  tscfg_arena_free(state->arena);
+  tscfg_free(state);
+}
+
+static bool tread_events(void *s, tscfg_event *events, int nevents) {
+  tscfg_treeread_state *state = s;
+
+  // Token strings and arrays are in scratch arena, so nothing to free
+  for (int i = 0; i < nevents; i++) {
+    tscfg_event *ev = &events[i];
+    bool ok;
+    switch (ev->tag) {
+      case TSCFG_EV_OBJ_START:
+        ok = container_start(state, TSCFG_TAPE_OBJ);
+        break;
+      case TSCFG_EV_OBJ_END:
+        ok = container_end(state, TSCFG_TAPE_OBJ, TSCFG_TAPE_OBJ_END);
+        break;
+      case TSCFG_EV_ARR_START:
+        ok = container_start(state, TSCFG_TAPE_ARR);
+        break;
+      case TSCFG_EV_ARR_END:
+        ok = container_end(state, TSCFG_TAPE_ARR, TSCFG_TAPE_ARR_END);
+        break;
+      case TSCFG_EV_KEY_VAL_START:
+        ok = key_val_start(state, ev->data.key.toks, ev->data.key.ntoks,
+                           ev->data.key.sep);
+        break;
+      case TSCFG_EV_KEY_VAL_END:
+        ok = key_val_end(state);
+        break;
+      case TSCFG_EV_VAL_START:
+        ok = val_start(state);
+        break;
+      case TSCFG_EV_VAL_END:
+        ok = val_end(state);
+        break;
+      case TSCFG_EV_TOKEN:
+        ok = token(state, &ev->data.tok);
+        break;
+      case TSCFG_EV_VAR_SUB:
+        ok = var_sub(state, ev->data.sub.toks, ev->data.sub.ntoks,
+                     ev->data.sub.optional);
+        break;
+      case TSCFG_EV_INCLUDE:
+        ok = include(state, &ev->data.include.tok,
+                     ev->data.include.required);
+        break;
+      default:
+        REPORT_ERR("Unexpected event tag %i", (int)ev->tag);
+        ok = fail(state, TSCFG_ERR_INVALID);
+        break;
+    }
+
+    if (!ok) {
+      return false;
+    }
+  }
+
   return true;
 }
 
-static bool tread_arr_start(void *s) {
-  // TODO: implement
-  fprintf(stderr, "arr_start\n");
+static inline tread_frame *top_frame(tscfg_treeread_state *state) {
+  return (state->depth > 0) ? &state->stack[state->depth - 1] : NULL;
+}
+
+static inline bool tape_append(tscfg_treeread_state *state,
+                               tscfg_tape_tag tag, uint64_t payload) {
+  if (state->tape_len == state->tape_size && !tape_grow(state)) {
+    return false;
+  }
+
+  state->tape[state->tape_len++] = tscfg_tape_make(tag, payload);
   return true;
 }
 
-static bool tread_arr_end(void *s) {
-  // TODO: implement
-  fprintf(stderr, "arr_end\n");
+static inline bool tape_append_str(tscfg_treeread_state *state,
+                  tscfg_tape_tag tag, const char *str, size_t len) {
+  uint64_t off;
+  return pool_add(state, str, len, &off) && tape_append(state, tag, off);
+}
+
+static inline bool tape_append_num(tscfg_treeread_state *state,
+                                   const tscfg_tok *tok) {
+  uint64_t off;
+  tscfg_rc rc = tscfg_pool_add_num(&state->pool, &state->pool_len,
+                        &state->pool_size, tok->str, tok->len, tok->num, &off);
+  return (rc == TSCFG_OK || fail(state, rc)) &&
+         tape_append(state, TSCFG_TAPE_NUMBER, off);
+}
+
+static bool container_start(tscfg_treeread_state *state, tscfg_tape_tag tag) {
+  // Offset is filled in at end
+  return elem_start(state) && push_frame(state, FRAME_CONTAINER) &&
+         tape_append(state, tag, 0);
+}
+
+/*
+ * Close innermost container, filling in offset in start entry.
+ */
+static bool container_end(tscfg_treeread_state *state,
+                          tscfg_tape_tag start_tag, tscfg_tape_tag end_tag) {
+  tread_frame *frame = top_frame(state);
+  if (frame == NULL || frame->kind == FRAME_VALUE ||
+      tscfg_tape_get_tag(state->tape[frame->start]) != start_tag) {
+    REPORT_ERR("Unexpected end of %s", start_tag == TSCFG_TAPE_OBJ ?
+                                       "object" : "array");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+
+  uint64_t off = state->tape_len - frame->start;
+  state->tape[frame->start] = tscfg_tape_make(start_tag, off);
+  state->depth--;
+
+  if (start_tag == TSCFG_TAPE_OBJ) {
+    return tape_append(state, end_tag, state->nobjs++);
+  }
+  return tape_append(state, end_tag, off);
+}
+
+static bool key_val_start(tscfg_treeread_state *state, tscfg_tok *toks,
+                          int ntoks, tscfg_tok_tag sep) {
+  tread_frame *frame = top_frame(state);
+  if (frame == NULL || frame->kind != FRAME_CONTAINER ||
+      tscfg_tape_get_tag(state->tape[frame->start]) != TSCFG_TAPE_OBJ) {
+    REPORT_ERR("Key-value pair outside of object");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+
+  if (!parse_path(state, toks, ntoks)) {
+    return false;
+  }
+
+  // Expand a.b.c = x into a { b { c = x } }
+  for (int i = 0; i < state->path_len - 1; i++) {
+    if (!tape_append(state, TSCFG_TAPE_KEY, state->path[i]) ||
+        !push_frame(state, FRAME_PATH_OBJ) ||
+        !tape_append(state, TSCFG_TAPE_OBJ, 0)) {
+      return false;
+    }
+  }
+
+  tscfg_tape_tag key_tag = (sep == TSCFG_TOK_PLUSEQUAL) ?
+                           TSCFG_TAPE_KEY_APPEND : TSCFG_TAPE_KEY;
+  return tape_append(state, key_tag, state->path[state->path_len - 1]) &&
+         val_start(state);
+}
+
+static bool key_val_end(tscfg_treeread_state *state) {
+  if (!val_end(state)) {
+    return false;
+  }
+
+  // Close objects implied by key path
+  tread_frame *frame;
+  while ((frame = top_frame(state)) != NULL &&
+         frame->kind == FRAME_PATH_OBJ) {
+    uint64_t off = state->tape_len - frame->start;
+    state->tape[frame->start] = tscfg_tape_make(TSCFG_TAPE_OBJ, off);
+    state->depth--;
+
+    if (!tape_append(state, TSCFG_TAPE_OBJ_END, state->nobjs++)) {
+      return false;
+    }
+  }
+
   return true;
 }
 
-static bool tread_key_val_start(void *s, tscfg_tok *key_toks, int nkey_toks,
-                                tscfg_tok_tag sep) {
-  // TODO: implement
-  fprintf(stderr, "key_val_start: key=[");
+static bool val_start(tscfg_treeread_state *state) {
+  return push_frame(state, FRAME_VALUE);
+}
 
-  for (int i = 0; i < nkey_toks; i++) {
-    if (i != 0) {
-      fprintf(stderr, ", ");
+/*
+ * Finish value: empty values become empty strings, and values with
+ * multiple elements are wrapped in a concatenation.
+ */
+static bool val_end(tscfg_treeread_state *state) {
+  tread_frame *frame = top_frame(state);
+  if (frame == NULL || frame->kind != FRAME_VALUE) {
+    REPORT_ERR("Unexpected end of value");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+
+  size_t start = frame->start;
+  size_t nelems = frame->nelems;
+  state->depth--;
+
+  if (nelems == 0) {
+    return tape_append_str(state, TSCFG_TAPE_STRING, "", 0);
+  } else if (nelems == 1) {
+    return true;
+  }
+
+  // Shift value along to make room: contents only use relative offsets
+  if (state->tape_len == state->tape_size && !tape_grow(state)) {
+    return false;
+  }
+
+  memmove(&state->tape[start + 1], &state->tape[start],
+          sizeof(state->tape[0]) * (state->tape_len - start));
+  state->tape_len++;
+
+  uint64_t off = state->tape_len - start;
+  state->tape[start] = tscfg_tape_make(TSCFG_TAPE_CONCAT, off);
+  return tape_append(state, TSCFG_TAPE_CONCAT_END, off);
+}
+
+static bool token(tscfg_treeread_state *state, tscfg_tok *tok) {
+  tread_frame *frame = top_frame(state);
+  if (frame == NULL || frame->kind != FRAME_VALUE) {
+    REPORT_ERR("Token outside of value");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+  frame->nelems++;
+
+  switch (tok->tag) {
+    case TSCFG_TOK_TRUE:
+      return tape_append(state, TSCFG_TAPE_TRUE, 0);
+    case TSCFG_TOK_FALSE:
+      return tape_append(state, TSCFG_TAPE_FALSE, 0);
+    case TSCFG_TOK_NULL:
+      return tape_append(state, TSCFG_TAPE_NULL, 0);
+    case TSCFG_TOK_NUMBER:
+      return tape_append_num(state, tok);
+    case TSCFG_TOK_UNQUOTED:
+      return tape_append_str(state, TSCFG_TAPE_UNQUOTED, tok->str, tok->len);
+    case TSCFG_TOK_STRING:
+      return tape_append_str(state, TSCFG_TAPE_STRING, tok->str, tok->len);
+    case TSCFG_TOK_WS:
+    case TSCFG_TOK_WS_NEWLINE:
+      return tape_append_str(state, TSCFG_TAPE_WS, tok->str, tok->len);
+    default:
+      REPORT_ERR("Unexpected token in value: %s",
+                 tscfg_tok_tag_name(tok->tag));
+      return fail(state, TSCFG_ERR_INVALID);
+  }
+}
+
+static bool var_sub(tscfg_treeread_state *state, tscfg_tok *toks, int ntoks,
+                    bool optional) {
+  if (!elem_start(state) || !parse_path(state, toks, ntoks)) {
+    return false;
+  }
+
+  size_t start = state->tape_len;
+  tscfg_tape_tag tag = optional ? TSCFG_TAPE_SUB_OPT : TSCFG_TAPE_SUB;
+  uint64_t off = (uint64_t)state->path_len + 1;
+  if (!tape_append(state, tag, off)) {
+    return false;
+  }
+
+  for (int i = 0; i < state->path_len; i++) {
+    if (!tape_append(state, TSCFG_TAPE_PATH, state->path[i])) {
+      return false;
     }
-    fprintf(stderr, "%s \"%.*s\"", tscfg_tok_tag_name(key_toks[i].tag),
-                (int)key_toks[i].len, key_toks[i].str);
+  }
+
+  assert(state->tape_len - start == off);
+  return tape_append(state, TSCFG_TAPE_SUB_END, off);
+}
 
-    tscfg_tok_free(&key_toks[i]);
+/*
+ * Splice contents of included file into current object.  Relative paths
+ * are relative to directory of file being read.
+ */
+static bool include(tscfg_treeread_state *state, tscfg_tok *tok,
+                    bool required) {
+  if (!in_object(state)) {
+    REPORT_ERR("Include outside of object");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+
+  if (tok->len == 0 || memchr(tok->str, '\0', tok->len) != NULL) {
+    REPORT_ERR("Invalid file name for include: \"%.*s\"", (int)tok->len,
+               tok->str);
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+
+  if (state->include_depth >= TSCFG_MAX_INCLUDE_DEPTH) {
+    REPORT_ERR("Includes nested more than %d deep, including %.*s",
+               TSCFG_MAX_INCLUDE_DEPTH, (int)tok->len, tok->str);
+    return fail(state, TSCFG_ERR_INVALID);
   }
 
-  fprintf(stderr, "] sep=%s\n", tscfg_tok_tag_name(sep));
+  state->buf_len = 0;
+  if (tok->str[0] != '/' && state->dir != NULL) {
+    if (!buf_append(state, state->dir, strlen(state->dir)) ||
+        !buf_append(state, "/", 1)) {
+      return false;
+    }
+  }
+  if (!buf_append(state, tok->str, tok->len) ||
+      !buf_append(state, "", 1)) {
+    return false;
+  }
 
-  free(key_toks);
+  if (!include_prefix(state)) {
+    return false;
+  }
+
+  if (state->workers == NULL) {
+    tscfg_include *inc = NULL;
+    tscfg_rc rc = tscfg_include_get(state->buf, state->include_depth + 1,
+                                    NULL, &inc);
+    return add_include(state, rc, inc, state->buf, required);
+  }
+
+  // Load in parallel, leaving placeholder for contents
+  if (state->npending == state->pending_size &&
+      !grow_array((void**)&state->pending, &state->pending_size,
+                  sizeof(state->pending[0]), state->npending + 1,
+                  INIT_INCLUDES_SIZE)) {
+    return fail(state, TSCFG_ERR_OOM);
+  }
+
+  tread_include *p = tscfg_malloc(sizeof(tread_include));
+  if (p == NULL) {
+    return fail(state, TSCFG_ERR_OOM);
+  }
+  p->path = tscfg_malloc(state->buf_len);
+  p->prefix = tscfg_malloc(sizeof(p->prefix[0]) * (size_t)state->path_len + 1);
+  if (p->path == NULL || p->prefix == NULL) {
+    tscfg_free(p->path);
+    tscfg_free(p->prefix);
+    tscfg_free(p);
+    return fail(state, TSCFG_ERR_OOM);
+  }
+
+  memcpy(p->path, state->buf, state->buf_len);
+  memcpy(p->prefix, state->path,
+         sizeof(p->prefix[0]) * (size_t)state->path_len);
+  p->prefix_len = state->path_len;
+  p->job.run = load_include;
+  p->pool = state->workers;
+  p->depth = state->include_depth + 1;
+  p->required = required;
+  p->rc = TSCFG_OK;
+  p->inc = NULL;
+
+  if (!tape_append(state, TSCFG_TAPE_INCLUDE, state->npending)) {
+    tscfg_free(p->path);
+    tscfg_free(p->prefix);
+    tscfg_free(p);
+    return false;
+  }
+  state->pending[state->npending++] = p;
+  tscfg_pool_submit(state->workers, &p->job);
   return true;
 }
 
-static bool tread_key_val_end(void *s) {
-  // TODO: implement
-  fprintf(stderr, "key_val_end\n");
+static void load_include(tscfg_job *job) {
+  tread_include *p = (tread_include*)job;
+  p->rc = tscfg_include_get(p->path, p->depth, p->pool, &p->inc);
+}
+
+/*
+ * Add result of loading include to tree.  state->path must be keys
+ * enclosing include statement.
+ * inc: reference to loaded file if rc is TSCFG_OK, taken by state
+ */
+static bool add_include(tscfg_treeread_state *state, tscfg_rc rc,
+                        tscfg_include *inc, const char *path,
+                        bool required) {
+  if (rc == TSCFG_ERR_NOT_FOUND) {
+    if (required) {
+      REPORT_ERR("Could not find included file %s", path);
+      return fail(state, TSCFG_ERR_IO);
+    }
+    // Missing files are ignored unless required
+    return true;
+  } else if (rc != TSCFG_OK) {
+    return fail(state, rc);
+  }
+
+  if (state->nincs == state->incs_size &&
+      !grow_array((void**)&state->incs, &state->incs_size,
+                  sizeof(state->incs[0]), state->nincs + 1,
+                  INIT_INCLUDES_SIZE)) {
+    tscfg_include_release(inc);
+    return fail(state, TSCFG_ERR_OOM);
+  }
+  state->incs[state->nincs++] = inc;
+
+  const tsconfig_tree *tree = tscfg_include_tree(inc);
+  if (tscfg_tape_get_tag(tree->tape[0]) != TSCFG_TAPE_OBJ) {
+    REPORT_ERR("Included file must contain an object: %s", path);
+    return fail(state, TSCFG_ERR_INVALID);
+  }
+  return splice_tree(state, tree);
+}
+
+/*
+ * Whether directly inside object, where fields can be added.
+ */
+static bool in_object(tscfg_treeread_state *state) {
+  tread_frame *frame = top_frame(state);
+  return frame != NULL && frame->kind == FRAME_CONTAINER &&
+         tscfg_tape_get_tag(state->tape[frame->start]) == TSCFG_TAPE_OBJ;
+}
+
+/*
+ * Copy contents of root object of unmerged tree to tape.  Pool is copied
+ * whole, and the tape is copied entry by entry so that offsets of
+ * substitutions and their containers can be adjusted for path prefixes.
+ */
+static bool splice_tree(tscfg_treeread_state *state,
+                        const tsconfig_tree *inc) {
+  // Keep alignment of headers and of decoded numbers after them
+  size_t base = (state->pool_len + 7) & ~(size_t)7;
+  if (base < state->pool_len || inc->pool_len > SIZE_MAX - base) {
+    return fail(state, TSCFG_ERR_OOM);
+  }
+  if (base + inc->pool_len > state->pool_size &&
+      !grow_array((void**)&state->pool, &state->pool_size, 1,
+                  base + inc->pool_len, INIT_POOL_SIZE)) {
+    return fail(state, TSCFG_ERR_OOM);
+  }
+  if (inc->pool_len > 0) {
+    memcpy(&state->pool[base], inc->pool, inc->pool_len);
+  }
+  state->pool_len = base + inc->pool_len;
+
+  return copy_tape(state, inc->tape, 1,
+                   tscfg_tape_get_payload(inc->tape[0]), base, true);
+}
+
+/*
+ * Append entries of another tape to tape, adjusting container offsets
+ * and object numbers for new positions.
+ * pool_base: offset to add to pool offsets
+ * add_prefix: add state->path as prefix to substitutions
+ */
+static bool copy_tape(tscfg_treeread_state *state,
+                      const tscfg_tape_entry *tape, size_t start,
+                      size_t end, size_t pool_base, bool add_prefix) {
+  size_t nopens = state->nopens;
+  for (size_t i = start; i < end; i++) {
+    tscfg_tape_entry e = tape[i];
+    tscfg_tape_tag tag = tscfg_tape_get_tag(e);
+    uint64_t payload = tscfg_tape_get_payload(e);
+    switch (tag) {
+      case TSCFG_TAPE_OBJ:
+      case TSCFG_TAPE_ARR:
+      case TSCFG_TAPE_CONCAT:
+      case TSCFG_TAPE_SUB:
+      case TSCFG_TAPE_SUB_OPT:
+        if (state->nopens == state->opens_size &&
+            !grow_array((void**)&state->opens, &state->opens_size,
+                        sizeof(state->opens[0]), state->nopens + 1,
+                        INIT_STACK_SIZE)) {
+          return fail(state, TSCFG_ERR_OOM);
+        }
+        state->opens[state->nopens++] = state->tape_len;
+
+        // Offset is filled in at end
+        if (!tape_append(state, tag, 0)) {
+          return false;
+        }
+
+        if (add_prefix &&
+            (tag == TSCFG_TAPE_SUB || tag == TSCFG_TAPE_SUB_OPT)) {
+          for (int p = 0; p < state->path_len; p++) {
+            if (!tape_append(state, TSCFG_TAPE_PATH_PREFIX,
+                             state->path[p])) {
+              return false;
+            }
+          }
+        }
+        break;
+
+      case TSCFG_TAPE_OBJ_END:
+      case TSCFG_TAPE_ARR_END:
+      case TSCFG_TAPE_CONCAT_END:
+      case TSCFG_TAPE_SUB_END: {
+        assert(state->nopens > nopens);
+        size_t open = state->opens[--state->nopens];
+        uint64_t off = state->tape_len - open;
+        state->tape[open] = tscfg_tape_make(
+                tscfg_tape_get_tag(state->tape[open]), off);
+
+        payload = (tag == TSCFG_TAPE_OBJ_END) ? state->nobjs++ : off;
+        if (!tape_append(state, tag, payload)) {
+          return false;
+        }
+        break;
+      }
+
+      case TSCFG_TAPE_KEY:
+      case TSCFG_TAPE_KEY_APPEND:
+      case TSCFG_TAPE_STRING:
+      case TSCFG_TAPE_UNQUOTED:
+      case TSCFG_TAPE_NUMBER:
+      case TSCFG_TAPE_WS:
+      case TSCFG_TAPE_PATH:
+      case TSCFG_TAPE_PATH_PREFIX:
+        if (!tape_append(state, tag, payload + pool_base)) {
+          return false;
+        }
+        break;
+
+      case TSCFG_TAPE_TRUE:
+      case TSCFG_TAPE_FALSE:
+      case TSCFG_TAPE_NULL:
+        if (!tape_append(state, tag, payload)) {
+          return false;
+        }
+        break;
+
+      case TSCFG_TAPE_INCLUDE: {
+        tread_include *p = state->pending[payload];
+        memcpy(state->path, p->prefix,
+               sizeof(state->path[0]) * (size_t)p->prefix_len);
+        state->path_len = p->prefix_len;
+
+        tscfg_include *inc = p->inc;
+        p->inc = NULL;
+        if (!add_include(state, p->rc, inc, p->path, p->required)) {
+          return false;
+        }
+        break;
+      }
+
+      default:
+        REPORT_ERR("Unexpected tape entry: %i", (int)tag);
+        return fail(state, TSCFG_ERR_INVALID);
+    }
+  }
+
+  assert(state->nopens == nopens);
   return true;
 }
 
-static bool tread_val_start(void *s) {
-  // TODO: implement
-  fprintf(stderr, "val_start\n");
+/*
+ * Set state->path to keys of objects enclosing current position, to be
+ * prepended to substitutions in included file.  Left empty inside an
+ * array, where there is no path to the position.
+ */
+static bool include_prefix(tscfg_treeread_state *state) {
+  // Path can't be longer than stack
+  if (state->depth > state->path_size) {
+    size_t size = (size_t)state->path_size;
+    if (!grow_array((void**)&state->path, &size, sizeof(state->path[0]),
+                    (size_t)state->depth, INIT_PATH_SIZE)) {
+      return fail(state, TSCFG_ERR_OOM);
+    }
+    state->path_size = size > INT32_MAX ? INT32_MAX : (int)size;
+  }
+
+  state->path_len = 0;
+  for (int i = 1; i < state->depth; i++) {
+    tread_frame *frame = &state->stack[i];
+    if (frame->kind == FRAME_CONTAINER) {
+      continue;
+    }
+
+    tread_frame *parent = &state->stack[i - 1];
+    if (parent->kind == FRAME_CONTAINER &&
+        tscfg_tape_get_tag(state->tape[parent->start]) == TSCFG_TAPE_ARR) {
+      state->path_len = 0;
+      return true;
+    }
+
+    tscfg_tape_entry key = state->tape[frame->start - 1];
+    state->path[state->path_len++] = tscfg_tape_get_payload(key);
+  }
   return true;
 }
 
-static bool tread_val_end(void *s) {
-  // TODO: implement
-  fprintf(stderr, "val_end\n");
+/*
+ * Split key or substitution tokens into path elements according to
+ * HOCON rules: . separates elements, except in quoted strings, and
+ * whitespace between tokens is part of the element.
+ * Elements are added to string pool and offsets stored in state->path.
+ */
+static bool parse_path(tscfg_treeread_state *state, tscfg_tok *toks,
+                       int ntoks) {
+  state->path_len = 0;
+  state->buf_len = 0;
+
+  if (ntoks == 0) {
+    REPORT_ERR("Empty path expression");
+    return fail(state, TSCFG_ERR_SYNTAX);
+  }
+
+  bool quoted = false; // If current element has quoted string
+  for (int i = 0; i < ntoks; i++) {
+    tscfg_tok *tok = &toks[i];
+    bool ok;
+    switch (tok->tag) {
+      case TSCFG_TOK_TRUE:
+        ok = buf_append(state, "true", 4);
+        break;
+      case TSCFG_TOK_FALSE:
+        ok = buf_append(state, "false", 5);
+        break;
+      case TSCFG_TOK_NULL:
+        ok = buf_append(state, "null", 4);
+        break;
+      case TSCFG_TOK_STRING:
+        quoted = true;
+        ok = buf_append(state, tok->str, tok->len);
+        break;
+      case TSCFG_TOK_WS:
+      case TSCFG_TOK_WS_NEWLINE:
+        ok = buf_append(state, tok->str, tok->len);
+        break;
+      case TSCFG_TOK_NUMBER:
+      case TSCFG_TOK_UNQUOTED: {
+        const char *p = tok->str, *end = tok->str + tok->len;
+        const char *dot;
+        ok = true;
+        while (ok && (dot = memchr(p, '.', (size_t)(end - p))) != NULL) {
+          ok = buf_append(state, p, (size_t)(dot - p)) &&
+               path_elem_end(state, quoted);
+          quoted = false;
+          p = dot + 1;
+        }
+        ok = ok && buf_append(state, p, (size_t)(end - p));
+        break;
+      }
+      default:
+        REPORT_ERR("Invalid token for path expression: %s",
+                   tscfg_tok_tag_name(tok->tag));
+        ok = fail(state, TSCFG_ERR_SYNTAX);
+        break;
+    }
+
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return path_elem_end(state, quoted);
+}
+
+/*
+ * Finish path element in buffer and add to path.
+ * quoted: if element included quoted string, in which case it can be empty
+ */
+static bool path_elem_end(tscfg_treeread_state *state, bool quoted) {
+  if (state->buf_len == 0 && !quoted) {
+    REPORT_ERR("Empty element in path expression");
+    return fail(state, TSCFG_ERR_SYNTAX);
+  }
+
+  if (state->path_len == state->path_size) {
+    size_t size = (size_t)state->path_size;
+    if (state->path_size == INT32_MAX ||
+        !grow_array((void**)&state->path, &size, sizeof(state->path[0]),
+                    size + 1, INIT_PATH_SIZE)) {
+      return fail(state, TSCFG_ERR_OOM);
+    }
+    state->path_size = size > INT32_MAX ? INT32_MAX : (int)size;
+  }
+
+  if (!pool_add(state, state->buf, state->buf_len,
+                &state->path[state->path_len])) {
+    return false;
+  }
+  state->path_len++;
+  state->buf_len = 0;
   return true;
 }
 
-static bool tread_token(void *s, tscfg_tok *tok) {
-  fprintf(stderr, "tok: %s \"%.*s\"\n", tscfg_tok_tag_name(tok->tag),
-              (int)tok->len, tok->str);
-  tscfg_tok_free(tok);
+static bool buf_append(tscfg_treeread_state *state, const char *str,
+                       size_t len) {
+  if (len > state->buf_size - state->buf_len &&
+      !grow_array((void**)&state->buf, &state->buf_size, 1,
+                  state->buf_len + len, 64)) {
+    return fail(state, TSCFG_ERR_OOM);
+  }
+
+  if (len > 0) {
+    memcpy(&state->buf[state->buf_len], str, len);
+  }
+  state->buf_len += len;
   return true;
 }
 
-static bool tread_var_sub(void *s, tscfg_tok *toks, int ntoks, bool optional) {
-  // TODO: implement
-  fprintf(stderr, "var_sub: optional=%s path=[", optional ? "true" : "false");
+/*
+ * Count new element in current value, if any.
+ */
+static bool elem_start(tscfg_treeread_state *state) {
+  tread_frame *frame = top_frame(state);
+  if (frame == NULL) {
+    // Root object or array
+    if (state->tape_len != 0) {
+      REPORT_ERR("Multiple root values");
+      return fail(state, TSCFG_ERR_INVALID);
+    }
+    return true;
+  } else if (frame->kind != FRAME_VALUE) {
+    REPORT_ERR("Value outside of key-value pair or array element");
+    return fail(state, TSCFG_ERR_INVALID);
+  }
 
-  for (int i = 0; i < ntoks; i++) {
-    if (i != 0) {
-      fprintf(stderr, ", ");
+  frame->nelems++;
+  return true;
+}
+
+static bool push_frame(tscfg_treeread_state *state, tread_frame_kind kind) {
+  if (state->depth == state->stack_size) {
+    size_t size = (size_t)state->stack_size;
+    if (state->stack_size == INT32_MAX ||
+        !grow_array((void**)&state->stack, &size, sizeof(state->stack[0]),
+                    size + 1, INIT_STACK_SIZE)) {
+      return fail(state, TSCFG_ERR_OOM);
     }
-    fprintf(stderr, "%s \"%.*s\"", tscfg_tok_tag_name(toks[i].tag),
-                (int)toks[i].len, toks[i].str);
+    state->stack_size = size > INT32_MAX ? INT32_MAX : (int)size;
+  }
+
+  state->stack[state->depth++] = (tread_frame){ .kind = kind,
+      .start = state->tape_len, .nelems = 0 };
+  return true;
+}
 
-    tscfg_tok_free(&toks[i]);
+static bool tape_grow(tscfg_treeread_state *state) {
+  if (!grow_array((void**)&state->tape, &state->tape_size,
+                  sizeof(state->tape[0]), state->tape_len + 1,
+                  INIT_TAPE_SIZE)) {
+    return fail(state, TSCFG_ERR_OOM);
   }
+  return true;
+}
 
-  fprintf(stderr, "]\n");
+/*
+ * Add string to pool with header and null terminator.
+ * off: set to offset of entry in pool
+ */
+static bool pool_add(tscfg_treeread_state *state, const char *str,
+                     size_t len, uint64_t *off) {
+  tscfg_rc rc = tscfg_pool_add(&state->pool, &state->pool_len,
+                               &state->pool_size, str, len, off);
+  return (rc == TSCFG_OK) || fail(state, rc);
+}
+
+/*
+ * Grow array by doubling until it has at least min_size elements.
+ */
+static bool grow_array(void **arr, size_t *size, size_t elem_size,
+                       size_t min_size, size_t init_size) {
+  size_t new_size = (*size > 0) ? *size : init_size;
+  while (new_size < min_size) {
+    if (new_size > SIZE_MAX / 2) {
+      return false;
+    }
+    new_size *= 2;
+  }
+
+  if (new_size > SIZE_MAX / elem_size) {
+    return false;
+  }
 
-  free(toks);
+  void *new_arr = tscfg_realloc(*arr, new_size * elem_size);
+  if (new_arr == NULL) {
+    return false;
+  }
 
+  *arr = new_arr;
+  *size = new_size;
   return true;
 }
 
+/*
+ * Wait for and free includes being loaded.
+ */
+static void free_pending(tscfg_treeread_state *state) {
+  for (size_t i = 0; i < state->npending; i++) {
+    tread_include *p = state->pending[i];
+    tscfg_pool_wait(state->workers, &p->job);
+    if (p->inc != NULL) {
+      tscfg_include_release(p->inc);
+    }
+    tscfg_free(p->path);
+    tscfg_free(p->prefix);
+    tscfg_free(p);
+  }
+  tscfg_free(state->pending);
+  state->pending = NULL;
+  state->npending = state->pending_size = 0;
+}
+
+static bool fail(tscfg_treeread_state *state, tscfg_rc rc) {
+  state->err = rc;
+  return false;
+}
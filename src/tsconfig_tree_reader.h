@@ -24,6 +24,9 @@
 #ifndef __TSCONFIG_TREE_READER_H
 #define __TSCONFIG_TREE_READER_H
 
+#include "tsconfig_arena.h"
+#include "tsconfig_include.h"
+#include "tsconfig_pool.h"
 #include "tsconfig_reader.h"
 #include "tsconfig_tree.h"
 
@@ -31,10 +34,61 @@
 typedef struct tscfg_treeread_state tscfg_treeread_state;
 
 /*
- * Initialize tree reader.
+ * Initialize tree reader, which builds tape and string pool for tree
+ * from batches of events.
+ * The reader does not free tokens or token arrays: the parser must
+ * allocate them from the reader's arena.
  */
-tscfg_rc
-tscfg_tree_reader_init(tscfg_reader *reader, tscfg_treeread_state **state);
+tscfg_rc tscfg_tree_reader_init(tscfg_batch_reader *reader,
+                                tscfg_treeread_state **state);
+
+/*
+ * Set file being read, for resolving includes.
+ * path: path of file, or NULL if input is not a file, in which case
+ *       includes are relative to working directory
+ * depth: nesting depth of includes, 0 for top-level file
+ * pool: pool to load included files in parallel while reading continues,
+ *       or NULL to load each one when its include statement is read
+ */
+tscfg_rc tscfg_tree_reader_set_file(tscfg_treeread_state *state,
+                                    const char *path, int depth,
+                                    tscfg_pool *pool);
+
+/*
+ * Arena for parser tokens.  Tokens are only needed until their batch of
+ * events is read, so the parser may reset it between batches once it has
+ * moved any tokens it still holds.  It is reset when the tree is taken.
+ */
+tscfg_arena *tscfg_tree_reader_arena(tscfg_treeread_state *state);
+
+/*
+ * Error code for reason why reader failed, to be returned instead of
+ * TSCFG_ERR_READER.
+ */
+tscfg_rc tscfg_tree_reader_err(tscfg_treeread_state *state);
+
+/*
+ * Splice contents of root object of unmerged tree into object being
+ * read, as if they had been read in its place, e.g. to join trees for
+ * parts of a file.
+ */
+tscfg_rc tscfg_tree_reader_splice(tscfg_treeread_state *state,
+                                  const tsconfig_tree *tree);
+
+/*
+ * Wait for included files being loaded in parallel and splice them into
+ * tree in place of their include statements, so that precedence is the
+ * same as loading them in order.  Called after all events are read.
+ */
+tscfg_rc tscfg_tree_reader_finish_includes(tscfg_treeread_state *state);
+
+/*
+ * Take included files spliced into tree, after finishing includes.
+ * incs: set to array of includes, owned by caller along with a reference
+ *       to each include
+ */
+void tscfg_tree_reader_take_includes(tscfg_treeread_state *state,
+                                     tscfg_include ***incs, size_t *nincs);
 
 /*
  * Extract tree and finalize tree reader, including freeing memory.
@@ -44,4 +98,23 @@ tscfg_tree_reader_init(tscfg_reader *reader, tscfg_treeread_state **state);
 tscfg_rc
 tscfg_tree_reader_done(tscfg_treeread_state *state, tsconfig_tree *tree);
 
+/*
+ * Extract tree as tscfg_tree_reader_done(), but keep reader, which must
+ * be reset before reading another tree.
+ */
+tscfg_rc
+tscfg_tree_reader_take(tscfg_treeread_state *state, tsconfig_tree *tree);
+
+/*
+ * Prepare reader to read another tree, freeing any partial tree, e.g.
+ * after error, but keeping scratch memory.  Tokens allocated from the
+ * reader's arena are freed.  File must be set again.
+ */
+tscfg_rc tscfg_tree_reader_reset(tscfg_treeread_state *state);
+
+/*
+ * Free tree reader and all memory for partial tree, e.g. after error.
+ */
+void tscfg_tree_reader_free(tscfg_treeread_state *state);
+
 #endif // __TSCONFIG_TREE_READER_H
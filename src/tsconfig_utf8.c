@@ -0,0 +1,311 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Whole-buffer UTF-8 validation.
+ *
+ * With SSSE3 or AVX2, uses the lookup table algorithm from
+ * Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per
+ * Byte" (2020): each pair of adjacent bytes is classified with three
+ * nibble table lookups, then continuation byte counts are checked.
+ * With only SSE2 or NEON, blocks of ASCII are skipped in bulk and other
+ * characters are checked one at a time.
+ */
+
+#include "tsconfig_utf8.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UTF8_LOOKUP 1
+#define UTF8_BLOCK 32
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define UTF8_LOOKUP 1
+#define UTF8_BLOCK 16
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define UTF8_ASCII_BLOCK 16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define UTF8_ASCII_BLOCK 16
+#endif
+
+static tscfg_rc validate_scalar(const unsigned char *s, size_t len,
+                                size_t *pos);
+
+/*
+ * Validate one character starting at non-ASCII byte
+ */
+static inline tscfg_rc validate_char(const unsigned char *s, size_t len,
+                                     size_t *pos) {
+  size_t i = *pos;
+  size_t enc_len;
+  tscfg_char_t c;
+  if (tscfg_decode_byte1(s[i], &enc_len, &c) != TSCFG_OK ||
+      enc_len > len - i ||
+      tscfg_decode_rest(&s[i + 1], enc_len - 1, &c) != TSCFG_OK) {
+    return TSCFG_ERR_INVALID;
+  }
+
+  *pos = i + enc_len;
+  return TSCFG_OK;
+}
+
+#ifdef UTF8_LOOKUP
+
+/* Error classes for pairs of bytes */
+#define TOO_SHORT (1 << 0) // Lead byte not followed by continuation
+#define TOO_LONG (1 << 1) // Continuation after ASCII
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7) // Two continuations: validity depends on lead
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* Tables indexed by nibbles: high and low of first byte, high of second */
+#define BYTE_1_HIGH \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+  TOO_SHORT | OVERLONG_2, \
+  TOO_SHORT, \
+  TOO_SHORT | OVERLONG_3 | SURROGATE, \
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+  CARRY | OVERLONG_2, \
+  CARRY, \
+  CARRY, \
+  CARRY | TOO_LARGE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | \
+    OVERLONG_4, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+static const unsigned char byte_1_high_tab[16] = { BYTE_1_HIGH };
+static const unsigned char byte_1_low_tab[16] = { BYTE_1_LOW };
+static const unsigned char byte_2_high_tab[16] = { BYTE_2_HIGH };
+
+/* Last bytes that can't end input: lead bytes needing more bytes */
+static const unsigned char incomplete_tab[32] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define v_load(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define v_zero() _mm256_setzero_si256()
+#define v_set1(c) _mm256_set1_epi8((char)(c))
+#define v_table(t) _mm256_broadcastsi128_si256( \
+                      _mm_loadu_si128((const __m128i *)(const void *)(t)))
+#define v_shuffle(t, i) _mm256_shuffle_epi8((t), (i))
+#define v_and(a, b) _mm256_and_si256((a), (b))
+#define v_or(a, b) _mm256_or_si256((a), (b))
+#define v_xor(a, b) _mm256_xor_si256((a), (b))
+#define v_subs(a, b) _mm256_subs_epu8((a), (b))
+#define v_shr4(a) v_and(_mm256_srli_epi16((a), 4), v_set1(0x0F))
+#define v_prev(x, p, n) _mm256_alignr_epi8((x), \
+          _mm256_permute2x128_si256((p), (x), 0x21), 16 - (n))
+#define v_is_ascii(a) (_mm256_movemask_epi8(a) == 0)
+#define v_any(a) \
+  (_mm256_movemask_epi8(_mm256_cmpeq_epi8((a), v_zero())) != -1)
+#define v_incomplete() v_load(incomplete_tab)
+#else
+typedef __m128i vec;
+#define v_load(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define v_zero() _mm_setzero_si128()
+#define v_set1(c) _mm_set1_epi8((char)(c))
+#define v_table(t) v_load(t)
+#define v_shuffle(t, i) _mm_shuffle_epi8((t), (i))
+#define v_and(a, b) _mm_and_si128((a), (b))
+#define v_or(a, b) _mm_or_si128((a), (b))
+#define v_xor(a, b) _mm_xor_si128((a), (b))
+#define v_subs(a, b) _mm_subs_epu8((a), (b))
+#define v_shr4(a) v_and(_mm_srli_epi16((a), 4), v_set1(0x0F))
+#define v_prev(x, p, n) _mm_alignr_epi8((x), (p), 16 - (n))
+#define v_is_ascii(a) (_mm_movemask_epi8(a) == 0)
+#define v_any(a) (_mm_movemask_epi8(_mm_cmpeq_epi8((a), v_zero())) != 0xFFFF)
+#define v_incomplete() v_load(&incomplete_tab[16])
+#endif
+
+/*
+ * Check block of input, given previous block.
+ * Returns non-zero bytes where errors were found.
+ */
+static inline vec check_block(vec input, vec prev_input) {
+  vec prev1 = v_prev(input, prev_input, 1);
+  vec byte_1_high = v_shuffle(v_table(byte_1_high_tab), v_shr4(prev1));
+  vec byte_1_low = v_shuffle(v_table(byte_1_low_tab),
+                             v_and(prev1, v_set1(0x0F)));
+  vec byte_2_high = v_shuffle(v_table(byte_2_high_tab), v_shr4(input));
+  vec special = v_and(v_and(byte_1_high, byte_1_low), byte_2_high);
+
+  // Third and fourth bytes of 3 and 4 byte characters must be continuations
+  vec prev2 = v_prev(input, prev_input, 2);
+  vec prev3 = v_prev(input, prev_input, 3);
+  vec is_third = v_subs(prev2, v_set1(0xE0 - 0x80));
+  vec is_fourth = v_subs(prev3, v_set1(0xF0 - 0x80));
+  vec must_23 = v_and(v_or(is_third, is_fourth), v_set1(0x80));
+
+  return v_xor(must_23, special);
+}
+
+tscfg_rc tscfg_utf8_validate(const unsigned char *s, size_t len,
+                             size_t *err_pos) {
+  vec prev_input = v_zero();
+  vec prev_incomplete = v_zero();
+  vec error = v_zero();
+
+  size_t i = 0;
+  bool last = false;
+  while (!last) {
+    vec input;
+    if (i + UTF8_BLOCK <= len) {
+      input = v_load(&s[i]);
+    } else {
+      // Pad final block with zeroes to detect truncated characters
+      unsigned char tail[UTF8_BLOCK];
+      memset(tail, 0, sizeof(tail));
+      if (i < len) {
+        memcpy(tail, &s[i], len - i);
+      }
+      input = v_load(tail);
+      last = true;
+    }
+
+    if (v_is_ascii(input)) {
+      error = v_or(error, prev_incomplete);
+    } else {
+      error = v_or(error, check_block(input, prev_input));
+      prev_incomplete = v_subs(input, v_incomplete());
+    }
+    prev_input = input;
+    i += UTF8_BLOCK;
+  }
+
+  if (!v_any(error)) {
+    return TSCFG_OK;
+  }
+
+  // Find exact position of error
+  size_t pos = 0;
+  tscfg_rc rc = validate_scalar(s, len, &pos);
+  *err_pos = pos;
+  return rc;
+}
+
+#else // !UTF8_LOOKUP
+
+tscfg_rc tscfg_utf8_validate(const unsigned char *s, size_t len,
+                             size_t *err_pos) {
+  size_t i = 0;
+
+#ifdef UTF8_ASCII_BLOCK
+  while (i + UTF8_ASCII_BLOCK <= len) {
+#if defined(__SSE2__)
+    int mask = _mm_movemask_epi8(
+                  _mm_loadu_si128((const __m128i *)(const void *)&s[i]));
+    if (mask == 0) {
+      i += UTF8_ASCII_BLOCK;
+      continue;
+    }
+    i += (size_t)__builtin_ctz((unsigned)mask);
+#else
+    if (vmaxvq_u8(vld1q_u8(&s[i])) < 0x80) {
+      i += UTF8_ASCII_BLOCK;
+      continue;
+    }
+    while (s[i] < 0x80) {
+      i++;
+    }
+#endif
+
+    // Check run of non-ASCII characters
+    while (i < len && s[i] >= 0x80) {
+      if (validate_char(s, len, &i) != TSCFG_OK) {
+        *err_pos = i;
+        return TSCFG_ERR_INVALID;
+      }
+    }
+  }
+#endif
+
+  tscfg_rc rc = validate_scalar(s, len, &i);
+  *err_pos = i;
+  return rc;
+}
+
+#endif // UTF8_LOOKUP
+
+/*
+ * Validate one character at a time, skipping ASCII a word at a time.
+ * pos: position to start from, set to position of any error
+ */
+static tscfg_rc validate_scalar(const unsigned char *s, size_t len,
+                                size_t *pos) {
+  const uint64_t high_bits = UINT64_C(0x8080808080808080);
+  size_t i = *pos;
+
+  while (i < len) {
+    if (i + sizeof(uint64_t) <= len) {
+      uint64_t word;
+      memcpy(&word, &s[i], sizeof(word));
+      if ((word & high_bits) == 0) {
+        i += sizeof(uint64_t);
+        continue;
+      }
+    }
+
+    if (s[i] < 0x80) {
+      i++;
+    } else if (validate_char(s, len, &i) != TSCFG_OK) {
+      *pos = i;
+      return TSCFG_ERR_INVALID;
+    }
+  }
+
+  *pos = i;
+  return TSCFG_OK;
+}
@@ -26,6 +26,7 @@
 #ifndef __TSCONFIG_UTF8_H
 #define __TSCONFIG_UTF8_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "tsconfig_common.h"
@@ -40,7 +41,8 @@ typedef uint32_t tscfg_char_t;
 
 /*
  * Decode first byte of UTF-8 character.
- * This will detect any overlong encodings
+ * This will detect overlong 2-byte encodings, other overlong encodings
+ * are detected by tscfg_decode_rest.
  * accum: accumulator final value, store value of first byte
  * len: number of bytes in full encoding (including this one)
  * return: TSCFG_OK if valid initial byte of UTF-8, TSCFG_ERR_INVALID
@@ -53,11 +55,28 @@ static inline tscfg_rc tscfg_decode_byte1(unsigned char b, size_t *len,
  * s: pointer to string
  * len: length of remainder to decode
  * accum: values added to accumulator
- * return: TSCFG_OK if valid bytes UTF-8, TSCFG_ERR_INVALID if invalid
+ * return: TSCFG_OK if valid bytes UTF-8, TSCFG_ERR_INVALID if invalid,
+ *    overlong, a surrogate or out of Unicode range.
  */
 static inline tscfg_rc tscfg_decode_rest(const unsigned char *s, size_t len,
                                         tscfg_char_t *accum);
 
+/*
+ * Decode character from UTF-8 that was already validated.
+ * len: set to number of bytes in encoding
+ */
+static inline tscfg_char_t tscfg_decode_valid(const unsigned char *s,
+                                              size_t *len);
+
+/*
+ * Validate that buffer is entirely valid UTF-8 by the same rules as
+ * tscfg_decode_byte1 and tscfg_decode_rest.  Vectorized if possible.
+ * err_pos: if invalid, set to offset of first invalid character
+ * return: TSCFG_OK if valid, TSCFG_ERR_INVALID if invalid
+ */
+tscfg_rc tscfg_utf8_validate(const unsigned char *s, size_t len,
+                             size_t *err_pos);
+
 /*==============================*
  * Inline function definitions  *
  *==============================*/
@@ -82,24 +101,14 @@ static inline tscfg_rc tscfg_decode_byte1(unsigned char b, size_t *len,
   } else if (b <= 0xEF) { // Binary 1110 xxxx
     *len = 3;
     *accum = 0x0F & b;
-  } else if (b <= 0xF7) { // Binary 1111 0xxx
+  } else if (b <= 0xF4) { // Binary 1111 0xxx, up to U+10FFFF
     *len = 4;
     *accum = 0x07 & b;
   } else {
-    // Invalid first byte
+    // Invalid first byte or out of Unicode range
     return TSCFG_ERR_INVALID;
   }
 
-  if (*accum == 0x0) {
-    /*
-     * Detect overlong encoding.
-     * This handles all cases of overlong characters where it was extended
-     * by > 1 byte, or where the canonical encoding is longer than 1 byte.
-     * This leaves 2 byte encodings of 1 byte characters, which is handled
-     * above.
-     */
-    return TSCFG_ERR_INVALID;
-  }
   return TSCFG_OK;
 }
 
@@ -115,6 +124,19 @@ static inline tscfg_rc tscfg_decode_rest(const unsigned char *s, size_t len,
     *accum = ((*accum) << 6) + (b & 0x3F);
   }
 
+  /*
+   * Detect overlong 3 and 4 byte encodings, i.e. where canonical encoding
+   * is shorter.
+   */
+  if ((len == 2 && *accum < 0x800) || (len == 3 && *accum < 0x10000)) {
+    return TSCFG_ERR_INVALID;
+  }
+
+  // UTF-16 surrogates are not valid characters
+  if (*accum >= 0xD800 && *accum <= 0xDFFF) {
+    return TSCFG_ERR_INVALID;
+  }
+
   // Out of Unicode range
   if (*accum > 0x10FFFF) {
     return TSCFG_ERR_INVALID;
@@ -123,6 +145,27 @@ static inline tscfg_rc tscfg_decode_rest(const unsigned char *s, size_t len,
   return TSCFG_OK;
 }
 
+static inline tscfg_char_t tscfg_decode_valid(const unsigned char *s,
+                                              size_t *len) {
+  unsigned char b = s[0];
+  if (b <= 0x7F) {
+    *len = 1;
+    return b;
+  } else if (b <= 0xDF) {
+    *len = 2;
+    return ((tscfg_char_t)(b & 0x1F) << 6) | (s[1] & 0x3F);
+  } else if (b <= 0xEF) {
+    *len = 3;
+    return ((tscfg_char_t)(b & 0x0F) << 12) |
+           ((tscfg_char_t)(s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+  } else {
+    *len = 4;
+    return ((tscfg_char_t)(b & 0x07) << 18) |
+           ((tscfg_char_t)(s[1] & 0x3F) << 12) |
+           ((tscfg_char_t)(s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+  }
+}
+
 /*
  * Return encoded length, or 0 if invalid
  */
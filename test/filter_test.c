@@ -0,0 +1,139 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that parsing with filter paths keeps exactly the wanted values,
+ * without adding keys on the way to them that the input doesn't have.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+#define MAX_PATHS 4
+
+typedef struct {
+  const char *input;
+  const char *paths[MAX_PATHS]; // Filter paths, NULL after last
+  const char *expected; // Tree with filter, parsed without filter
+  const char *missing[MAX_PATHS]; // Paths that must not be found
+} filter_case;
+
+static const filter_case cases[] = {
+  // Sibling of wanted path
+  { "a.b = 1\na.c = 2", { "a.c" }, "a.c = 2", { "a.b" } },
+  { "a { b = 1, c = 2 }", { "a.c" }, "a.c = 2", { "a.b" } },
+  { "http { server { port = 80 }, client { timeout = 5 } }\n"
+    "http.client.retries = 3\ndb.host = h",
+    { "http.server" }, "http.server.port = 80", { "http.client", "db" } },
+  // Keys sharing characters with wanted path
+  { "ab = 1\na.b = 2\na.bc = 3\na.b2.c = 4", { "a.b" }, "a.b = 2",
+    { "ab", "a.bc", "a.b2" } },
+  // Paths longer than wanted path are kept whole
+  { "a.b.c.d = 1\na.b.e = 2\na { b { c { f = 3 } } }", { "a.b.c" },
+    "a.b.c { d = 1, f = 3 }", { "a.b.e" } },
+  // Wanted path longer than key: value kept as is
+  { "a.b = 5\na.x = 1", { "a.b.c" }, "a.b = 5", { "a.x" } },
+  // Skipped key still makes prefix of wanted path an object
+  { "a = 5\na.c = 1", { "a.b" }, "a {}", { "a.b", "a.c" } },
+  { "a.b = 5\na.b.z.y = 1", { "a.b.x" }, "a.b {}", { "a.b.x", "a.b.z" } },
+  { "a.b.c = 5\na.b.d = 1\na.e = 2", { "a.b.c", "a.e.f" },
+    "a.b.c = 5\na.e = 2", { "a.b.d" } },
+  // Quoted elements
+  { "\"a\".c = 1\n\"a\".\"b\" = 2", { "a.b" }, "a.b = 2", { "a.c" } },
+  { "\"a.b\" = 1\na.b = 2", { "a.b" }, "a.b = 2", { NULL } },
+  // Several paths
+  { "db { host = h }\nhttp.server = 1\nhttp.client = 2\nother = 3",
+    { "db", "http.server" }, "db.host = h\nhttp.server = 1",
+    { "http.client", "other" } },
+  // Arrays are kept whole, even if appended to
+  { "a.b = [{ c = 1 }]\na.b += 2\na.d = [3]", { "a.b" },
+    "a.b = [{ c = 1 }, 2]", { "a.d" } },
+};
+
+static int check_case(const filter_case *c);
+static tscfg_rc parse_filtered(const char *input, const char *const *paths,
+                               tsconfig_tree *tree);
+static void print_json(const char *name, const tsconfig_tree *tree);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (check_case(&cases[i]) != 0) {
+      fprintf(stderr, "Filter case %zu failed for input:\n%s\n", i,
+              cases[i].input);
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+static int check_case(const filter_case *c) {
+  tsconfig_tree tree, expected;
+  CHECK_OK(parse_filtered(c->input, c->paths, &tree));
+  CHECK_OK(test_parse(c->expected, &expected));
+
+  bool equal = test_tree_equal(&tree, &expected);
+  if (!equal) {
+    print_json("Got", &tree);
+    print_json("Expected", &expected);
+  }
+  CHECK(equal);
+
+  for (int i = 0; i < MAX_PATHS && c->missing[i] != NULL; i++) {
+    tscfg_val val;
+    CHECK(tsconfig_get(&tree, c->missing[i], &val) == TSCFG_ERR_NOT_FOUND);
+  }
+
+  tsconfig_tree_free(&tree);
+  tsconfig_tree_free(&expected);
+  return 0;
+}
+
+/*
+ * Parse string input, which can be filtered, unlike input read with a
+ * callback.
+ */
+static tscfg_rc parse_filtered(const char *input, const char *const *paths,
+                               tsconfig_tree *tree) {
+  int npaths = 0;
+  while (npaths < MAX_PATHS && paths[npaths] != NULL) {
+    npaths++;
+  }
+
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.paths = paths;
+  opts.npaths = npaths;
+
+  tsconfig_input in = { .kind = TS_CONFIG_IN_STR };
+  in.data.s.str = input;
+  in.data.s.len = strlen(input);
+  in.data.s.pos = 0;
+  return tsconfig_parse_tree_opts(in, TSCFG_HOCON, &opts, tree);
+}
+
+static void print_json(const char *name, const tsconfig_tree *tree) {
+  char *buf = NULL;
+  size_t len = 0, size = 0;
+  if (tsconfig_render(tree, TSCFG_RENDER_JSON, &buf, &len, &size) ==
+      TSCFG_OK) {
+    fprintf(stderr, "%s: %s\n", name, buf);
+  }
+  free(buf);
+}
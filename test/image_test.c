@@ -0,0 +1,169 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that trees written to images load as equal trees, that lookups
+ * work on loaded images, and that invalid images are rejected.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Image files, in directory tests are run from
+#define IMAGE_PATH "image_test.img"
+#define IMAGE_PATH2 "image_test2.img"
+
+// Keys in generated wide object, enough to be hashed
+#define WIDE_KEYS 1000
+
+static const char *const inputs[] = {
+  "{}",
+  "a = 1\nb = -2.5e3\nc = true\nd = null\ne = \"str\\n\"\nf = unquoted",
+  "a { b { c { d = [1, [2, { e = 3 }], []] } } }",
+  // References and values created by resolution
+  "a { b = 1 }\nc = ${a} { d = 2 }\ne = x ${a.b} y\nf = [1] ${g}\ng = [2]",
+  "a = ${?nope}\nb = [${?nope}, 1]\nc = ${b}",
+};
+
+static int check_round_trip(const char *input);
+static int check_wide(void);
+static int check_invalid(void);
+static int read_file(const char *path, char **data, size_t *len);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    failed |= check_round_trip(inputs[i]);
+  }
+  failed |= check_wide();
+  failed |= check_invalid();
+
+  remove(IMAGE_PATH);
+  remove(IMAGE_PATH2);
+  return failed;
+}
+
+/*
+ * Write tree to image and load it, then write loaded tree to a second
+ * image, which must be identical.
+ */
+static int check_round_trip(const char *input) {
+  tsconfig_tree tree, loaded;
+  CHECK_OK(test_parse(input, &tree));
+  CHECK_OK(tsconfig_image_write(&tree, IMAGE_PATH));
+  CHECK_OK(tsconfig_image_load(IMAGE_PATH, &loaded));
+  CHECK(loaded.image != NULL);
+  CHECK(test_tree_equal(&tree, &loaded));
+
+  CHECK_OK(tsconfig_image_write(&loaded, IMAGE_PATH2));
+  char *data1, *data2;
+  size_t len1, len2;
+  CHECK(read_file(IMAGE_PATH, &data1, &len1) == 0);
+  CHECK(read_file(IMAGE_PATH2, &data2, &len2) == 0);
+  CHECK(len1 == len2 && memcmp(data1, data2, len1) == 0);
+
+  free(data1);
+  free(data2);
+  tsconfig_tree_free(&loaded);
+  tsconfig_tree_free(&tree);
+  return 0;
+}
+
+/*
+ * Look up every key of an object with a hashed index in loaded image.
+ */
+static int check_wide(void) {
+  size_t size = WIDE_KEYS * 32;
+  char *input = malloc(size);
+  CHECK(input != NULL);
+  size_t len = 0;
+  for (int i = 0; i < WIDE_KEYS; i++) {
+    int n = snprintf(input + len, size - len, "o.k%d = %d\n", i, i);
+    CHECK(n > 0 && (size_t)n < size - len);
+    len += (size_t)n;
+  }
+
+  tsconfig_tree tree, loaded;
+  CHECK_OK(test_parse(input, &tree));
+  CHECK_OK(tsconfig_image_write(&tree, IMAGE_PATH));
+  tsconfig_tree_free(&tree);
+  free(input);
+
+  CHECK_OK(tsconfig_image_load(IMAGE_PATH, &loaded));
+  for (int i = 0; i < WIDE_KEYS; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "o.k%d", i);
+    int64_t val;
+    CHECK_OK(tsconfig_get_int64(&loaded, path, &val));
+    CHECK(val == i);
+  }
+
+  tscfg_val val;
+  CHECK(tsconfig_get(&loaded, "o.nope", &val) == TSCFG_ERR_NOT_FOUND);
+  tsconfig_tree_free(&loaded);
+  return 0;
+}
+
+/*
+ * Truncated or corrupted images must fail to load.
+ */
+static int check_invalid(void) {
+  tsconfig_tree tree;
+  CHECK_OK(test_parse("a { b = [1, 2, 3] }\nc = str", &tree));
+  CHECK_OK(tsconfig_image_write(&tree, IMAGE_PATH));
+  tsconfig_tree_free(&tree);
+
+  char *data;
+  size_t len;
+  CHECK(read_file(IMAGE_PATH, &data, &len) == 0);
+
+  // Truncated
+  FILE *f = fopen(IMAGE_PATH2, "wb");
+  CHECK(f != NULL);
+  CHECK(fwrite(data, 1, len - 8, f) == len - 8);
+  CHECK(fclose(f) == 0);
+  CHECK(tsconfig_image_load(IMAGE_PATH2, &tree) == TSCFG_ERR_INVALID);
+
+  // Not an image
+  data[0] = 'X';
+  f = fopen(IMAGE_PATH2, "wb");
+  CHECK(f != NULL);
+  CHECK(fwrite(data, 1, len, f) == len);
+  CHECK(fclose(f) == 0);
+  CHECK(tsconfig_image_load(IMAGE_PATH2, &tree) == TSCFG_ERR_INVALID);
+
+  free(data);
+  return 0;
+}
+
+static int read_file(const char *path, char **data, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  CHECK(f != NULL);
+  CHECK(fseek(f, 0, SEEK_END) == 0);
+  long size = ftell(f);
+  CHECK(size > 0);
+  CHECK(fseek(f, 0, SEEK_SET) == 0);
+
+  *data = malloc((size_t)size);
+  CHECK(*data != NULL);
+  *len = fread(*data, 1, (size_t)size, f);
+  CHECK(*len == (size_t)size);
+  CHECK(fclose(f) == 0);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that included files are cached, and parsed again only when they
+ * or files they include change.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_include.h"
+
+// Included files, in directory tests are run from
+#define INC_A "include_test_a.conf"
+#define INC_B "include_test_b.conf"
+#define INC_EMPTY "include_test_empty.conf"
+#define INC_MISSING "include_test_missing.conf"
+
+static int write_file(const char *path, const char *contents);
+static int check_int(const char *input, const char *path, int64_t expected);
+static int check_cache(void);
+static int check_nested(void);
+static int check_empty(void);
+
+int main(void) {
+  int failed = 0;
+  failed |= check_cache();
+  failed |= check_nested();
+  failed |= check_empty();
+
+  tsconfig_include_cache_clear();
+  remove(INC_A);
+  remove(INC_B);
+  remove(INC_EMPTY);
+  return failed;
+}
+
+/*
+ * Replace file with new one, so it has a new inode even if written
+ * within the resolution of modification times.
+ */
+static int write_file(const char *path, const char *contents) {
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  CHECK(f != NULL);
+  size_t len = strlen(contents);
+  CHECK(fwrite(contents, 1, len, f) == len);
+  CHECK(fclose(f) == 0);
+  CHECK(rename(tmp, path) == 0);
+  return 0;
+}
+
+static int check_int(const char *input, const char *path, int64_t expected) {
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+  int64_t val;
+  CHECK_OK(tsconfig_get_int64(&tree, path, &val));
+  CHECK(val == expected);
+  tsconfig_tree_free(&tree);
+  return 0;
+}
+
+/*
+ * File is reused while unchanged, including when rewritten with the same
+ * contents, but not when rewritten with different contents of the same
+ * size.
+ */
+static int check_cache(void) {
+  tscfg_include *inc1, *inc2;
+  CHECK(write_file(INC_A, "a = 1\n") == 0);
+  CHECK_OK(tscfg_include_get(INC_A, 1, NULL, &inc1));
+  CHECK_OK(tscfg_include_get(INC_A, 1, NULL, &inc2));
+  CHECK(inc1 == inc2);
+  tscfg_include_release(inc2);
+
+  CHECK(write_file(INC_A, "a = 1\n") == 0);
+  CHECK_OK(tscfg_include_get(INC_A, 1, NULL, &inc2));
+  CHECK(inc1 == inc2);
+  tscfg_include_release(inc2);
+  CHECK(check_int("include \"" INC_A "\"", "a", 1) == 0);
+
+  CHECK(write_file(INC_A, "a = 2\n") == 0);
+  CHECK_OK(tscfg_include_get(INC_A, 1, NULL, &inc2));
+  CHECK(inc1 != inc2);
+  tscfg_include_release(inc2);
+  CHECK(check_int("include \"" INC_A "\"", "a", 2) == 0);
+
+  // Stale version is still usable by holder of reference
+  CHECK(tsconfig_root(tscfg_include_tree(inc1)).tree != NULL);
+  tscfg_include_release(inc1);
+
+  CHECK(tscfg_include_get(INC_MISSING, 1, NULL, &inc1) ==
+        TSCFG_ERR_NOT_FOUND);
+  return 0;
+}
+
+/*
+ * File is parsed again if a file it includes changed, even though the
+ * file itself didn't.
+ */
+static int check_nested(void) {
+  CHECK(write_file(INC_A, "a = 1\n") == 0);
+  CHECK(write_file(INC_B, "include \"" INC_A "\"\nb = ${a}\n") == 0);
+
+  tscfg_include *inc1, *inc2;
+  CHECK_OK(tscfg_include_get(INC_B, 1, NULL, &inc1));
+  CHECK(check_int("include \"" INC_B "\"", "b", 1) == 0);
+
+  CHECK(write_file(INC_A, "a = 3\n") == 0);
+  CHECK_OK(tscfg_include_get(INC_B, 1, NULL, &inc2));
+  CHECK(inc1 != inc2);
+  tscfg_include_release(inc1);
+  tscfg_include_release(inc2);
+  CHECK(check_int("include \"" INC_B "\"", "b", 3) == 0);
+  return 0;
+}
+
+static int check_empty(void) {
+  CHECK(write_file(INC_EMPTY, "") == 0);
+  CHECK(check_int("include \"" INC_EMPTY "\"\nx = 1", "x", 1) == 0);
+  CHECK(write_file(INC_EMPTY, "x = 2") == 0);
+  CHECK(check_int("include \"" INC_EMPTY "\"", "x", 2) == 0);
+  return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that the pull iterator returns the same events as the batch
+ * parser, that errors stick, and that memory stays bounded by nesting
+ * depth however long the input is, including when stopping early.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_alloc.h"
+
+// Elements of streamed array
+#define LONG_ELEMS 1000000
+
+// Most memory iterator may use for streamed array
+#define MAX_LONG_PEAK (64 * 1024)
+
+// Nesting of streamed arrays
+#define DEEP 100000
+
+// Parser state per level of nesting, with room for stack doubling
+#define LEVEL_BYTES 4
+
+typedef struct {
+  char *str;
+  size_t len;
+  size_t size;
+  bool failed;
+} event_log;
+
+/*
+ * Generated input: "a = " followed by an array, produced as it is read.
+ */
+typedef struct {
+  int elems; // Elements of flat array, or 0 for nested
+  int depth; // Nesting of empty arrays, or 0 for flat
+  size_t pos; // Bytes produced so far
+  size_t len; // Total bytes
+} gen_input;
+
+static const char *const inputs[] = {
+  "{}",
+  "a = 1\nb = [1, \"two\", { c = true }, []]\nd { e = null }",
+  "a.b.\"c d\" = x y  z\n# comment\ne += 1\nf : ${a.b} ${?g}",
+  "include \"missing.conf\"\nh = \"\"\"multi\nline\"\"\"",
+  "[1, 2, [3]]",
+};
+
+static int log_append(event_log *log, const char *fmt, ...);
+static void log_event(event_log *log, const tscfg_event *ev);
+static void log_toks(event_log *log, const tscfg_tok *toks, int ntoks);
+static bool batch_events(void *s, tscfg_event *events, int nevents);
+static tsconfig_input str_input(tsconfig_input *src, const char *str);
+static int check_same_events(const char *input);
+static int check_err(void);
+static tscfg_rc gen_read(void *ctx, void *buf, size_t len, size_t *got);
+static int check_bounded(gen_input gen, int stop_after, size_t max_peak);
+static void ignore_err(void *ctx, const char *msg);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    if (check_same_events(inputs[i]) != 0) {
+      fprintf(stderr, "Events differ for input:\n%s\n", inputs[i]);
+      failed = 1;
+    }
+  }
+  failed |= check_err();
+
+  gen_input flat = { .elems = LONG_ELEMS, .depth = 0 };
+  failed |= check_bounded(flat, 0, MAX_LONG_PEAK);
+  failed |= check_bounded(flat, LONG_ELEMS / 2, MAX_LONG_PEAK);
+  gen_input deep = { .elems = 0, .depth = DEEP };
+  failed |= check_bounded(deep, 0, MAX_LONG_PEAK + LEVEL_BYTES * DEEP);
+  return failed;
+}
+
+static int log_append(event_log *log, const char *fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(log->str + log->len, log->size - log->len, fmt, ap);
+    va_end(ap);
+    CHECK(n >= 0);
+    if ((size_t)n < log->size - log->len) {
+      log->len += (size_t)n;
+      return 0;
+    }
+
+    size_t size = log->size * 2 + (size_t)n + 1;
+    char *str = realloc(log->str, size);
+    CHECK(str != NULL);
+    log->str = str;
+    log->size = size;
+  }
+}
+
+/*
+ * Append description of event to log.
+ */
+static void log_event(event_log *log, const tscfg_event *ev) {
+  int rc = log_append(log, "%d:%d", (int)ev->tag, ev->depth);
+  switch (ev->tag) {
+    case TSCFG_EV_TOKEN:
+      log_toks(log, &ev->data.tok, 1);
+      break;
+    case TSCFG_EV_KEY_VAL_START:
+      log_toks(log, ev->data.key.toks, ev->data.key.ntoks);
+      rc |= log_append(log, " sep %d", (int)ev->data.key.sep);
+      break;
+    case TSCFG_EV_VAR_SUB:
+      log_toks(log, ev->data.sub.toks, ev->data.sub.ntoks);
+      rc |= log_append(log, " opt %d", (int)ev->data.sub.optional);
+      break;
+    case TSCFG_EV_INCLUDE:
+      log_toks(log, &ev->data.include.tok, 1);
+      break;
+    default:
+      break;
+  }
+  rc |= log_append(log, "\n");
+  log->failed = log->failed || rc != 0;
+}
+
+static void log_toks(event_log *log, const tscfg_tok *toks, int ntoks) {
+  for (int i = 0; i < ntoks; i++) {
+    const char *str = (toks[i].str != NULL) ? toks[i].str : "";
+    int rc = log_append(log, " %s(%.*s)", tscfg_tok_tag_name(toks[i].tag),
+                        (int)toks[i].len, str);
+    log->failed = log->failed || rc != 0;
+  }
+}
+
+static bool batch_events(void *s, tscfg_event *events, int nevents) {
+  for (int i = 0; i < nevents; i++) {
+    log_event(s, &events[i]);
+    tsconfig_event_free(&events[i]);
+  }
+  return true;
+}
+
+static tsconfig_input str_input(tsconfig_input *src, const char *str) {
+  src->kind = TS_CONFIG_IN_STR;
+  src->data.s.str = str;
+  src->data.s.len = strlen(str);
+  src->data.s.pos = 0;
+
+  tsconfig_input in = { .kind = TS_CONFIG_IN_FUNC };
+  in.data.fn.read = test_read_str;
+  in.data.fn.ctx = src;
+  in.data.fn.chunk_size = 0;
+  return in;
+}
+
+static int check_same_events(const char *input) {
+  tsconfig_input src;
+  event_log batch = { .str = NULL, .len = 0, .size = 0 };
+  tscfg_batch_reader reader = { .events = batch_events, .batch_size = 0 };
+  CHECK_OK(tsconfig_parse_batch(str_input(&src, input), TSCFG_HOCON,
+                                reader, &batch));
+
+  event_log pulled = { .str = NULL, .len = 0, .size = 0 };
+  tsconfig_iter *it;
+  CHECK_OK(tsconfig_iter_new(str_input(&src, input), TSCFG_HOCON, &it));
+  for (;;) {
+    tscfg_event ev;
+    bool done = false;
+    CHECK_OK(tsconfig_iter_next(it, &ev, &done));
+    if (done) {
+      break;
+    }
+    log_event(&pulled, &ev);
+    tsconfig_event_free(&ev);
+  }
+  tsconfig_iter_free(it);
+
+  CHECK(!batch.failed && !pulled.failed);
+  CHECK(batch.len > 0);
+  CHECK(batch.len == pulled.len &&
+        memcmp(batch.str, pulled.str, batch.len) == 0);
+  free(batch.str);
+  free(pulled.str);
+  return 0;
+}
+
+/*
+ * Events before error are returned, then the error every time.
+ */
+static int check_err(void) {
+  tsconfig_set_err_handler(ignore_err, NULL);
+
+  tsconfig_input src;
+  tsconfig_iter *it;
+  CHECK_OK(tsconfig_iter_new(str_input(&src, "a = 1\nb = [2, }"),
+                             TSCFG_HOCON, &it));
+  tscfg_rc rc;
+  int nevents = 0;
+  for (;;) {
+    tscfg_event ev;
+    bool done = false;
+    rc = tsconfig_iter_next(it, &ev, &done);
+    if (rc != TSCFG_OK) {
+      break;
+    }
+    CHECK(!done);
+    tsconfig_event_free(&ev);
+    nevents++;
+  }
+  CHECK(rc == TSCFG_ERR_SYNTAX);
+  CHECK(nevents > 0);
+
+  tscfg_event ev;
+  bool done = false;
+  CHECK(tsconfig_iter_next(it, &ev, &done) == rc);
+  tsconfig_iter_free(it);
+
+  tsconfig_set_err_handler(NULL, NULL);
+  return 0;
+}
+
+static tscfg_rc gen_read(void *ctx, void *buf, size_t len, size_t *got) {
+  gen_input *gen = ctx;
+  char *out = buf;
+  size_t n = 0;
+  for (; n < len && gen->pos < gen->len; n++, gen->pos++) {
+    size_t p = gen->pos;
+    if (p < 4) {
+      out[n] = "a = "[p];
+    } else if (gen->depth > 0) {
+      out[n] = (p - 4 < (size_t)gen->depth) ? '[' : ']';
+    } else if (p == 4) {
+      out[n] = '[';
+    } else if (p == gen->len - 1) {
+      out[n] = ']';
+    } else {
+      // Elements "1, "
+      out[n] = "1, "[(p - 5) % 3];
+    }
+  }
+  *got = n;
+  return TSCFG_OK;
+}
+
+/*
+ * Iterate over generated input, with memory counted, stopping early if
+ * stop_after > 0.
+ * max_peak: most memory allowed at once
+ */
+static int check_bounded(gen_input gen, int stop_after, size_t max_peak) {
+  gen.pos = 0;
+  gen.len = (gen.depth > 0) ? 4 + 2 * (size_t)gen.depth
+                            : 4 + 3 * (size_t)gen.elems;
+  tsconfig_input in = { .kind = TS_CONFIG_IN_FUNC };
+  in.data.fn.read = gen_read;
+  in.data.fn.ctx = &gen;
+  in.data.fn.chunk_size = 0;
+
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  const tscfg_allocator *prev = tscfg_alloc_use(&ca.alloc);
+
+  tsconfig_iter *it;
+  CHECK_OK(tsconfig_iter_new(in, TSCFG_HOCON, &it));
+  int nums = 0, max_depth = 0;
+  for (;;) {
+    tscfg_event ev;
+    bool done = false;
+    CHECK_OK(tsconfig_iter_next(it, &ev, &done));
+    if (done) {
+      break;
+    }
+
+    if (ev.tag == TSCFG_EV_TOKEN && ev.data.tok.tag == TSCFG_TOK_NUMBER) {
+      nums++;
+    }
+    if (ev.depth > max_depth) {
+      max_depth = ev.depth;
+    }
+    tsconfig_event_free(&ev);
+
+    if (stop_after > 0 && nums == stop_after) {
+      break;
+    }
+  }
+  tsconfig_iter_free(it);
+  tscfg_alloc_use(prev);
+
+  tscfg_alloc_stats stats;
+  tscfg_counting_alloc_stats(&ca, &stats);
+  printf("%d elems, %d deep%s: peak %zu bytes\n", gen.elems, gen.depth,
+         stop_after > 0 ? ", stopped early" : "", stats.peak);
+  CHECK(stats.current == 0);
+  CHECK(stats.peak <= max_peak);
+  if (stop_after > 0) {
+    CHECK(nums == stop_after);
+  } else {
+    CHECK(nums == gen.elems);
+    // Root object, field, then array nesting
+    CHECK(max_depth >= gen.depth);
+  }
+  return 0;
+}
+
+static void ignore_err(void *ctx, const char *msg) {
+  (void)ctx;
+  (void)msg;
+}
@@ -0,0 +1,176 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check tokens from the lexer's byte class tables and DFAs, for input in
+ * memory and input read a byte at a time, so that every token is split
+ * across refills of the buffer.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_lex.h"
+
+// Room for tokens of input, written as text
+#define TOKS_SIZE 512
+
+typedef struct {
+  const char *input;
+  /*
+   * Tags without TOK_ prefix, separated by spaces, each followed by
+   * string in parentheses if it has one, then ERR if input is invalid.
+   */
+  const char *toks;
+} lex_case;
+
+static const lex_case cases[] = {
+  { "{}[](),=:", "OPEN_BRACE CLOSE_BRACE OPEN_SQUARE CLOSE_SQUARE "
+                 "OPEN_PAREN CLOSE_PAREN COMMA EQUAL COLON" },
+  // Keywords, which end where the keyword does, as in the reference
+  // implementation
+  { "true false null", "TRUE WS FALSE WS NULL" },
+  { "truex", "TRUE UNQUOTED(x)" },
+  { "falsetto", "FALSE UNQUOTED(tto)" },
+  { "true.x", "TRUE UNQUOTED(.x)" },
+  { "tru", "UNQUOTED(tru)" },
+  { "n", "UNQUOTED(n)" },
+  // Substitutions and operators
+  { "${a}", "OPEN_SUB UNQUOTED(a) CLOSE_BRACE" },
+  { "${?a.b}", "OPEN_OPT_SUB UNQUOTED(a.b) CLOSE_BRACE" },
+  { "a += 1", "UNQUOTED(a) WS PLUSEQUAL WS NUMBER(1)" },
+  { "$x", "ERR" },
+  { "+x", "ERR" },
+  // Numbers end where a JSON number does
+  { "-12.5e+3", "NUMBER(-12.5e+3)" },
+  { "10e", "NUMBER(10) UNQUOTED(e)" },
+  { "1.5e-3x", "NUMBER(1.5e-3) UNQUOTED(x)" },
+  { "0x10", "NUMBER(0) UNQUOTED(x10)" },
+  { "1-2", "NUMBER(1) NUMBER(-2)" },
+  { "-", "UNQUOTED(-)" },
+  { "-x", "UNQUOTED(-x)" },
+  // Unquoted text, comments and whitespace
+  { "a.b.1", "UNQUOTED(a.b.1)" },
+  { "a/b", "UNQUOTED(a/b)" },
+  { "a//c\nb", "UNQUOTED(a) COMMENT WS_NEWLINE UNQUOTED(b)" },
+  { "a#c\r\n", "UNQUOTED(a) COMMENT WS_NEWLINE" },
+  { "\x1c\t\v", "WS" },
+  { " \n ", "WS_NEWLINE" },
+  { "\xc2\xa0x", "WS UNQUOTED(x)" },
+  { "\xc3\xa9t\xe2\x82\xac", "UNQUOTED(\xc3\xa9t\xe2\x82\xac)" },
+  { "a\\b", "UNQUOTED(a) ERR" },
+  { "`", "ERR" },
+  // Strings
+  { "\"s\\n\\u00e9\"", "STRING(s\n\xc3\xa9)" },
+  { "\"\"", "STRING()" },
+  { "\"\"\"a\"b\"\"\"\"", "STRING(a\"b\")" },
+  { "\"abc", "ERR" },
+};
+
+static int check_case(const lex_case *c);
+static tscfg_rc lex_all(tsconfig_input in, char *toks, size_t size);
+static void ignore_err(void *ctx, const char *msg);
+
+int main(void) {
+  // Errors for invalid input are expected
+  tsconfig_set_err_handler(ignore_err, NULL);
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (check_case(&cases[i]) != 0) {
+      fprintf(stderr, "Lexer case failed for input: %s\n", cases[i].input);
+      failed = 1;
+    }
+  }
+  return failed;
+}
+
+static int check_case(const lex_case *c) {
+  tsconfig_input src = { .kind = TS_CONFIG_IN_STR };
+  src.data.s.str = c->input;
+  src.data.s.len = strlen(c->input);
+  src.data.s.pos = 0;
+
+  char toks[TOKS_SIZE];
+  CHECK_OK(lex_all(src, toks, sizeof(toks)));
+  if (strcmp(toks, c->toks) != 0) {
+    fprintf(stderr, "Got: %s\nExpected: %s\n", toks, c->toks);
+    return 1;
+  }
+
+  // Byte at a time
+  tsconfig_input in = { .kind = TS_CONFIG_IN_FUNC };
+  in.data.fn.read = test_read_str;
+  in.data.fn.ctx = &src;
+  in.data.fn.chunk_size = 1;
+  CHECK_OK(lex_all(in, toks, sizeof(toks)));
+  if (strcmp(toks, c->toks) != 0) {
+    fprintf(stderr, "Got when streamed: %s\nExpected: %s\n", toks, c->toks);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Write tokens of input as text, as in lex_case.
+ */
+static tscfg_rc lex_all(tsconfig_input in, char *toks, size_t size) {
+  tscfg_lex_state lex;
+  tscfg_rc rc = tscfg_lex_init(&lex, in);
+  if (rc != TSCFG_OK) {
+    return rc;
+  }
+
+  size_t len = 0;
+  toks[0] = '\0';
+  for (;;) {
+    tscfg_tok tok;
+    const char *sep = (len > 0) ? " " : "";
+    rc = tscfg_read_tok(&lex, &tok, (tscfg_lex_opts){ 0 });
+    if (rc != TSCFG_OK) {
+      snprintf(toks + len, size - len, "%sERR", sep);
+      break;
+    } else if (tok.tag == TSCFG_TOK_EOF) {
+      break;
+    }
+
+    // Skip TOK_ prefix
+    const char *name = tscfg_tok_tag_name(tok.tag) + 4;
+    int n;
+    if (tok.str != NULL) {
+      n = snprintf(toks + len, size - len, "%s%s(%.*s)", sep, name,
+                   (int)tok.len, tok.str);
+    } else {
+      n = snprintf(toks + len, size - len, "%s%s", sep, name);
+    }
+    tscfg_tok_free(&tok);
+    if (n < 0 || (size_t)n >= size - len) {
+      rc = TSCFG_ERR_OOM;
+      break;
+    }
+    len += (size_t)n;
+  }
+
+  tscfg_lex_finalize(&lex);
+  return (rc == TSCFG_ERR_OOM) ? rc : TSCFG_OK;
+}
+
+static void ignore_err(void *ctx, const char *msg) {
+  (void)ctx;
+  (void)msg;
+}
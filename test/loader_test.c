@@ -0,0 +1,170 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that the loader merges files in order, reports a change only when
+ * a file or a file it includes changes, and keeps working after a file
+ * fails to parse.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_include.h"
+
+// Files, in directory tests are run from
+#define DEFAULTS "loader_test_defaults.conf"
+#define OVERRIDES "loader_test_overrides.conf"
+#define NESTED "loader_test_nested.conf"
+
+static int write_file(const char *path, const char *contents);
+static int load(tsconfig_loader *loader, bool expect_changed,
+                int64_t expect_a, int64_t expect_b, int64_t expect_c);
+static int check_reload(void);
+static int check_err(void);
+static void ignore_err(void *ctx, const char *msg);
+
+int main(void) {
+  int failed = 0;
+  remove(OVERRIDES);
+  failed |= check_reload();
+  failed |= check_err();
+
+  tsconfig_include_cache_clear();
+  remove(DEFAULTS);
+  remove(OVERRIDES);
+  remove(NESTED);
+  return failed;
+}
+
+/*
+ * Replace file with new one, so it has a new inode even if written
+ * within the resolution of modification times.
+ */
+static int write_file(const char *path, const char *contents) {
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  CHECK(f != NULL);
+  size_t len = strlen(contents);
+  CHECK(fwrite(contents, 1, len, f) == len);
+  CHECK(fclose(f) == 0);
+  CHECK(rename(tmp, path) == 0);
+  return 0;
+}
+
+/*
+ * Load, and check values of a, b and c if changed.
+ */
+static int load(tsconfig_loader *loader, bool expect_changed,
+                int64_t expect_a, int64_t expect_b, int64_t expect_c) {
+  bool changed;
+  tsconfig_tree tree;
+  CHECK_OK(tsconfig_loader_load(loader, NULL, &changed, &tree));
+  CHECK(changed == expect_changed);
+  if (!changed) {
+    return 0;
+  }
+
+  int64_t a, b, c;
+  CHECK_OK(tsconfig_get_int64(&tree, "a", &a));
+  CHECK_OK(tsconfig_get_int64(&tree, "b", &b));
+  CHECK_OK(tsconfig_get_int64(&tree, "c", &c));
+  tsconfig_tree_free(&tree);
+  CHECK(a == expect_a && b == expect_b && c == expect_c);
+  return 0;
+}
+
+static int check_reload(void) {
+  const char *const paths[] = { DEFAULTS, OVERRIDES };
+  CHECK(write_file(NESTED, "c = 3") == 0);
+  CHECK(write_file(DEFAULTS, "a = 1\nb = ${a}\ninclude \"" NESTED "\"")
+        == 0);
+
+  tsconfig_loader *loader;
+  CHECK_OK(tsconfig_loader_new(paths, 2, &loader));
+
+  // Missing overrides are empty
+  CHECK(load(loader, true, 1, 1, 3) == 0);
+  CHECK(load(loader, false, 0, 0, 0) == 0);
+
+  // Substitution in defaults resolved against overrides
+  CHECK(write_file(OVERRIDES, "a = 2") == 0);
+  CHECK(load(loader, true, 2, 2, 3) == 0);
+  CHECK(load(loader, false, 0, 0, 0) == 0);
+
+  // Same contents in new file
+  CHECK(write_file(OVERRIDES, "a = 2") == 0);
+  CHECK(write_file(DEFAULTS, "a = 1\nb = ${a}\ninclude \"" NESTED "\"")
+        == 0);
+  CHECK(load(loader, false, 0, 0, 0) == 0);
+
+  // Change of same size to file included by defaults
+  CHECK(write_file(NESTED, "c = 4") == 0);
+  CHECK(load(loader, true, 2, 2, 4) == 0);
+
+  // Overrides removed again
+  CHECK(remove(OVERRIDES) == 0);
+  CHECK(load(loader, true, 1, 1, 4) == 0);
+  CHECK(load(loader, false, 0, 0, 0) == 0);
+
+  tsconfig_loader_free(loader);
+  return 0;
+}
+
+/*
+ * Invalid file fails load until fixed, then loads as before.
+ */
+static int check_err(void) {
+  const char *const paths[] = { DEFAULTS, OVERRIDES };
+  CHECK(write_file(NESTED, "c = 3") == 0);
+  CHECK(write_file(DEFAULTS, "a = 1\nb = ${a}\ninclude \"" NESTED "\"")
+        == 0);
+
+  tsconfig_loader *loader;
+  CHECK_OK(tsconfig_loader_new(paths, 2, &loader));
+  CHECK(load(loader, true, 1, 1, 3) == 0);
+
+  tsconfig_set_err_handler(ignore_err, NULL);
+  bool changed;
+  tsconfig_tree tree;
+  CHECK(write_file(OVERRIDES, "a = [") == 0);
+  CHECK(tsconfig_loader_load(loader, NULL, &changed, &tree) ==
+        TSCFG_ERR_SYNTAX);
+  CHECK(tsconfig_loader_load(loader, NULL, &changed, &tree) ==
+        TSCFG_ERR_SYNTAX);
+  CHECK(write_file(OVERRIDES, "a = ${missing}") == 0);
+  CHECK(tsconfig_loader_load(loader, NULL, &changed, &tree) ==
+        TSCFG_ERR_INVALID);
+  tsconfig_set_err_handler(NULL, NULL);
+
+  CHECK(write_file(OVERRIDES, "a = 5") == 0);
+  CHECK(load(loader, true, 5, 5, 3) == 0);
+
+  // Overrides removed after errors
+  CHECK(remove(OVERRIDES) == 0);
+  CHECK(load(loader, true, 1, 1, 3) == 0);
+
+  tsconfig_loader_free(loader);
+  return 0;
+}
+
+static void ignore_err(void *ctx, const char *msg) {
+  (void)ctx;
+  (void)msg;
+}
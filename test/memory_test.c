@@ -0,0 +1,199 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that memory used while parsing is proportional to the size of
+ * the tree, i.e. that memory for tokens is reused during the parse, and
+ * that all memory is freed after errors.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Size of generated inputs
+#define INPUT_SIZE (2 * 1024 * 1024)
+
+/*
+ * Most peak memory allowed, as a multiple of input size.  A tree with
+ * short keys and values takes about 5 times the input, with up to twice
+ * that while arrays grow and keys are merged.
+ */
+#define MAX_PEAK_RATIO 12
+
+/*
+ * Most allocations allowed per parse.  Arrays are grown by doubling and
+ * reused between keys, so the count doesn't grow with the number of keys.
+ */
+#define MAX_ALLOCS 1000
+
+// Most memory a parser may keep for reuse after parsing generated input
+#define MAX_KEPT (1024 * 1024)
+
+typedef struct {
+  char *str;
+  size_t len;
+  size_t size;
+} gen_buf;
+
+static int append(gen_buf *b, const char *fmt, ...);
+static int gen_wide(gen_buf *b);
+static int gen_deep(gen_buf *b);
+static int check_peak(const char *name, int (*gen)(gen_buf*));
+static int check_err_freed(const char *input);
+static int check_parser_kept(void);
+
+int main(void) {
+  int failed = 0;
+  failed |= check_peak("wide", gen_wide);
+  failed |= check_peak("deep", gen_deep);
+  failed |= check_parser_kept();
+
+  // Lexer errors at various points
+  failed |= check_err_freed("a = ${e\xc3");
+  failed |= check_err_freed("a { b = \"x");
+  failed |= check_err_freed("a = [1, 2\nb.\xff = 3");
+  failed |= check_err_freed("a = 1 \"\"\"");
+  return failed;
+}
+
+static int append(gen_buf *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(b->str + b->len, b->size - b->len, fmt, ap);
+  va_end(ap);
+  CHECK(n >= 0 && (size_t)n < b->size - b->len);
+  b->len += (size_t)n;
+  return 0;
+}
+
+/*
+ * Many top-level keys with short values.
+ */
+static int gen_wide(gen_buf *b) {
+  for (int n = 0; b->len < INPUT_SIZE; n++) {
+    CHECK(append(b, "k%d = %d\ns%d = \"str%d\"\no%d { a = [1, 2], b = x }\n",
+                 n, n, n, n, n) == 0);
+  }
+  return 0;
+}
+
+/*
+ * Objects nested several levels deep, with repeated keys to be merged.
+ */
+static int gen_deep(gen_buf *b) {
+  for (int n = 0; b->len < INPUT_SIZE; n++) {
+    CHECK(append(b, "d%d { a { b { c { d { e = %d, f = \"g\" } } } } }\n",
+                 n % 1000, n) == 0);
+  }
+  return 0;
+}
+
+static int check_peak(const char *name, int (*gen)(gen_buf*)) {
+  gen_buf b = { .len = 0, .size = INPUT_SIZE + 4096 };
+  b.str = malloc(b.size);
+  CHECK(b.str != NULL);
+  CHECK(gen(&b) == 0);
+
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = &ca.alloc;
+  opts.threads = 1;
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse_opts(b.str, &opts, &tree));
+  tsconfig_tree_free(&tree);
+
+  tscfg_alloc_stats stats;
+  tscfg_counting_alloc_stats(&ca, &stats);
+  double ratio = (double)stats.peak / (double)b.len;
+  printf("%s: %zu bytes of input, peak %zu bytes (%.1fx), %zu allocs\n",
+         name, b.len, stats.peak, ratio, stats.allocs);
+  free(b.str);
+
+  CHECK(stats.current == 0);
+  CHECK(ratio <= MAX_PEAK_RATIO);
+  CHECK(stats.allocs <= MAX_ALLOCS);
+  return 0;
+}
+
+/*
+ * Parse invalid input, which must fail without leaking memory.
+ */
+static int check_err_freed(const char *input) {
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = &ca.alloc;
+
+  tsconfig_tree tree;
+  CHECK(test_parse_opts(input, &opts, &tree) != TSCFG_OK);
+
+  tscfg_alloc_stats stats;
+  tscfg_counting_alloc_stats(&ca, &stats);
+  CHECK(stats.allocs > 0);
+  CHECK(stats.current == 0);
+  return 0;
+}
+
+/*
+ * Memory kept by a parser between parses must not grow with the input,
+ * since tokens are released once the tree is built.
+ */
+static int check_parser_kept(void) {
+  gen_buf b = { .len = 0, .size = INPUT_SIZE + 4096 };
+  b.str = malloc(b.size);
+  CHECK(b.str != NULL);
+  CHECK(gen_wide(&b) == 0);
+
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = &ca.alloc;
+  opts.threads = 1;
+
+  tsconfig_parser *parser;
+  CHECK_OK(tsconfig_parser_new(&parser));
+
+  tsconfig_input in = { .kind = TS_CONFIG_IN_STR };
+  in.data.s.str = b.str;
+  in.data.s.len = b.len;
+  for (int i = 0; i < 2; i++) {
+    in.data.s.pos = 0;
+    tsconfig_tree tree;
+    CHECK_OK(tsconfig_parser_parse_tree(parser, in, TSCFG_HOCON, &opts,
+                                        &tree));
+    tsconfig_tree_free(&tree);
+  }
+
+  tscfg_alloc_stats stats;
+  tscfg_counting_alloc_stats(&ca, &stats);
+  printf("parser: kept %zu bytes\n", stats.current);
+  CHECK(stats.current <= MAX_KEPT);
+
+  tsconfig_parser_free(parser);
+  tscfg_counting_alloc_stats(&ca, &stats);
+  CHECK(stats.current == 0);
+  free(b.str);
+  return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check merging of duplicate keys: objects are merged, other values
+ * override, += appends, and definitions whose type depends on
+ * substitutions are combined once resolved.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Nesting of deep values, enough to overflow the stack if merged
+// recursively
+#define DEEP 100000
+
+typedef struct {
+  const char *input;
+  const char *expected; // Expected value, or error message
+} merge_case;
+
+static const merge_case cases[] = {
+  // Objects are merged recursively
+  { "a { b = 1 }\na { c = 2 }", "{ a: { b: 1, c: 2 } }" },
+  { "a { b { c = 1 } }\na { b { d = 2 } }",
+    "{ a: { b: { c: 1, d: 2 } } }" },
+  { "a { b = 1 }\na { b = 2 }", "{ a: { b: 2 } }" },
+  { "a { b = 1 } { c = 2 }", "{ a: { b: 1, c: 2 } }" },
+
+  // Other values override
+  { "a = 1\na = 2", "{ a: 2 }" },
+  { "a { b = 1 }\na = 2", "{ a: 2 }" },
+  { "a = 1\na { b = 2 }", "{ a: { b: 2 } }" },
+  { "a { b = 1 }\na = null\na { c = 2 }", "{ a: { c: 2 } }" },
+  { "a = [1]\na = [2]", "{ a: [2] }" },
+
+  // Path expressions are the same as nested objects
+  { "a.b = 1\na { c = 2 }", "{ a: { b: 1, c: 2 } }" },
+  { "a { b = 1 }\na.b = 2\na.c.d = 3",
+    "{ a: { b: 2, c: { d: 3 } } }" },
+  { "\"a.b\" = 1\na.b = 2", "{ \"a.b\": 1, a: { b: 2 } }" },
+
+  // Appends
+  { "a = [1]\na += 2\na += [3]", "{ a: [1, 2, [3]] }" },
+  { "a += 1", "{ a: [1] }" },
+  { "a = [1]\na += 2\na = [3]\na += 4", "{ a: [3, 4] }" },
+  { "a = [1] [2]\na += 3", "{ a: [1, 2, 3] }" },
+  { "a.b = [1]\na { b += 2 }", "{ a: { b: [1, 2] } }" },
+
+  // Self-references see previous definitions
+  { "a = 1\na = ${a}", "{ a: 1 }" },
+  { "a = x\na = ${a}y", "{ a: xy }" },
+  { "a = [1]\na = ${a} [2]", "{ a: [1, 2] }" },
+  { "a { b = 1 }\na = ${a} { c = 2 }", "{ a: { b: 1, c: 2 } }" },
+  { "a = [1]\na += 2\na = ${?a} [3]", "{ a: [1, 2, 3] }" },
+
+  // Definitions that depend on substitutions
+  { "x { q = 2 }\na = ${x}\na { r = 3 }",
+    "{ x: { q: 2 }, a: { q: 2, r: 3 } }" },
+  { "x { q = 2 }\na { p = 1 }\na = ${x}",
+    "{ x: { q: 2 }, a: { p: 1, q: 2 } }" },
+  { "x = 5\na { p = 1 }\na = ${x}", "{ x: 5, a: 5 }" },
+  { "x = 5\na = ${x}\na { p = 1 }", "{ x: 5, a: { p: 1 } }" },
+  { "a = 1\na = ${?nope}", "{ a: 1 }" },
+  { "a { p = 1 }\na = ${?nope}\na { q = 2 }",
+    "{ a: { p: 1, q: 2 } }" },
+  { "a = ${?nope}\na = ${?none}", "{}" },
+  { "x = [1]\na = ${x}\na += 2", "{ x: [1], a: [1, 2] }" },
+  { "a { p = 1 }\na = ${a} { q = 2 }\na { r = 3 }",
+    "{ a: { p: 1, q: 2, r: 3 } }" },
+  { "a { b = ${c} }\na = ${x}\nx { y = 1 }\nc = 2",
+    "{ a: { b: 2, y: 1 }, x: { y: 1 }, c: 2 }" },
+};
+
+static const merge_case errors[] = {
+  { "a { b = 1 }\na += 2", "previous value is not an array" },
+  { "a = 1\na += 2", "previous value is not an array" },
+  { "x = 1\na = ${x}\na += 2", "Cannot concatenate" },
+};
+
+static int check_deep_objs(void);
+static int check_deep_arrs(void);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    failed |= test_expect(cases[i].input, cases[i].expected);
+  }
+  for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+    failed |= test_expect_err(errors[i].input, TSCFG_ERR_INVALID,
+                              errors[i].expected);
+  }
+  failed |= check_deep_objs();
+  failed |= check_deep_arrs();
+  return failed;
+}
+
+/*
+ * Deeply nested object defined twice, so merged at every level.
+ */
+static int check_deep_objs(void) {
+  size_t size = DEEP * 8 * 2 + 64;
+  char *input = malloc(size);
+  CHECK(input != NULL);
+
+  char *p = input;
+  for (int def = 0; def < 2; def++) {
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, "a { ");
+    }
+    p += sprintf(p, def == 0 ? "x = 1" : "y = 2");
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, " }");
+    }
+    p += sprintf(p, "\n");
+  }
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+  free(input);
+
+  tscfg_val val = tsconfig_root(&tree);
+  for (int i = 0; i < DEEP; i++) {
+    CHECK_OK(tscfg_obj_get(val, "a", 1, &val));
+  }
+
+  tscfg_val x, y;
+  int64_t i;
+  CHECK_OK(tscfg_obj_get(val, "x", 1, &x));
+  CHECK_OK(tscfg_val_int64(x, &i));
+  CHECK(i == 1);
+  CHECK_OK(tscfg_obj_get(val, "y", 1, &y));
+  CHECK_OK(tscfg_val_int64(y, &i));
+  CHECK(i == 2);
+
+  tsconfig_tree_free(&tree);
+  return 0;
+}
+
+/*
+ * Deeply nested array, appended to.
+ */
+static int check_deep_arrs(void) {
+  size_t size = DEEP * 2 + 64;
+  char *input = malloc(size);
+  CHECK(input != NULL);
+
+  char *p = input;
+  p += sprintf(p, "a = ");
+  for (int i = 0; i < DEEP; i++) {
+    *p++ = '[';
+  }
+  for (int i = 0; i < DEEP; i++) {
+    *p++ = ']';
+  }
+  sprintf(p, "\na += 1");
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+  free(input);
+
+  tscfg_val val;
+  CHECK_OK(tsconfig_get(&tree, "a", &val));
+  CHECK(tscfg_val_tag(val) == TSCFG_TAPE_ARR);
+
+  // Appended value follows nested arrays
+  tscfg_val elem = { .tree = val.tree, .ix = val.ix + 1 };
+  tscfg_val appended = { .tree = val.tree, .ix = tscfg_val_end(elem) };
+  int64_t i;
+  CHECK_OK(tscfg_val_int64(tscfg_val_deref(appended), &i));
+  CHECK(i == 1);
+
+  for (int depth = 1; depth < DEEP; depth++) {
+    elem = tscfg_val_deref(elem);
+    CHECK(tscfg_val_tag(elem) == TSCFG_TAPE_ARR);
+    elem.ix++;
+  }
+  CHECK(tscfg_val_tag(elem) == TSCFG_TAPE_ARR_END);
+
+  tsconfig_tree_free(&tree);
+  return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that numbers decode to the same doubles as strtod(), whether they
+ * take the exact path or fall back to strtod(), that integers are exact,
+ * and that durations and sizes are scaled by their units.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_num.h"
+
+// Random numbers compared against strtod()
+#define RANDOM_NUMS 100000
+
+typedef enum {
+  NUM_INT, // Integer value
+  NUM_DOUBLE, // Double value, same as strtod()
+  NUM_RANGE, // Number out of range of double
+} num_kind;
+
+typedef struct {
+  const char *str;
+  num_kind kind;
+  int64_t i; // Value if integer
+} num_case;
+
+static const num_case nums[] = {
+  { "0", NUM_INT, 0 },
+  { "-0", NUM_INT, 0 },
+  { "00012", NUM_INT, 12 },
+  { "-0.0", NUM_DOUBLE, 0 },
+  { "0.1", NUM_DOUBLE, 0 },
+  { ".5", NUM_DOUBLE, 0 },
+  { "1.", NUM_DOUBLE, 0 },
+  { "1e5", NUM_DOUBLE, 0 },
+  { "-2.5E-3", NUM_DOUBLE, 0 },
+  { "9223372036854775807", NUM_INT, INT64_MAX },
+  { "-9223372036854775808", NUM_INT, INT64_MIN },
+  { "9007199254740993", NUM_INT, INT64_C(9007199254740993) },
+  // Too large for integer, so double
+  { "9223372036854775808", NUM_DOUBLE, 0 },
+  { "-9223372036854775809", NUM_DOUBLE, 0 },
+  // Long mantissas, not exact in a double, so converted with strtod()
+  { "9007199254740993.0", NUM_DOUBLE, 0 },
+  { "3.14159265358979323846264338327950288", NUM_DOUBLE, 0 },
+  { "123456789012345678901234567890", NUM_DOUBLE, 0 },
+  { "0.000000000000000000000000000000000000000000000000000001234567",
+    NUM_DOUBLE, 0 },
+  { "2.2250738585072011e-308", NUM_DOUBLE, 0 },
+  { "4.9406564584124654e-324", NUM_DOUBLE, 0 },
+  { "1.7976931348623157e308", NUM_DOUBLE, 0 },
+  { "1e-400", NUM_DOUBLE, 0 },
+  { "1e23", NUM_DOUBLE, 0 },
+  { "8.98846567431158e307", NUM_DOUBLE, 0 },
+  { "1e400", NUM_RANGE, 0 },
+  { "-1e400", NUM_RANGE, 0 },
+};
+
+typedef struct {
+  const char *str;
+  tscfg_rc rc;
+  int64_t val;
+} unit_case;
+
+static const unit_case durations[] = {
+  { "10s", TSCFG_OK, INT64_C(10000000000) },
+  { "1.5 hours", TSCFG_OK, INT64_C(5400000000000) },
+  { "250", TSCFG_OK, INT64_C(250000000) },
+  { "-0", TSCFG_OK, 0 },
+  { "1e3ms", TSCFG_OK, INT64_C(1000000000) },
+  { "3 second", TSCFG_OK, INT64_C(3000000000) },
+  { "106751 days", TSCFG_OK, INT64_C(9223286400000000000) },
+  { "106752 days", TSCFG_ERR_TYPE, 0 },
+  { "5 fortnights", TSCFG_ERR_TYPE, 0 },
+  { "s", TSCFG_ERR_TYPE, 0 },
+};
+
+static const unit_case sizes[] = {
+  { "4096", TSCFG_OK, 4096 },
+  { "512MiB", TSCFG_OK, INT64_C(536870912) },
+  { "10 kB", TSCFG_OK, 10000 },
+  { "1.5K", TSCFG_OK, 1536 },
+  { "2 kibibytes", TSCFG_OK, 2048 },
+  { "3 megabyte", TSCFG_OK, 3000000 },
+  { "7e", TSCFG_OK, INT64_C(7) << 60 },
+  { "7EiB", TSCFG_OK, INT64_C(7) << 60 },
+  { "8EiB", TSCFG_ERR_TYPE, 0 },
+  { "10e", TSCFG_ERR_TYPE, 0 },
+  { "1 KB", TSCFG_ERR_TYPE, 0 },
+};
+
+static int check_num(const num_case *c);
+static int check_scan(const char *str);
+static int check_long(void);
+static int check_random(void);
+static int check_units(void);
+static bool same_double(double a, double b);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+    if (check_num(&nums[i]) != 0) {
+      fprintf(stderr, "Number case failed: %s\n", nums[i].str);
+      failed = 1;
+    }
+  }
+  failed |= check_long();
+  failed |= check_random();
+  failed |= check_units();
+  return failed;
+}
+
+/*
+ * Value of number parsed in a config.
+ */
+static int check_num(const num_case *c) {
+  char input[128];
+  snprintf(input, sizeof(input), "a = %s", c->str);
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+
+  int64_t i;
+  double d;
+  tscfg_rc int_rc = tsconfig_get_int64(&tree, "a", &i);
+  tscfg_rc double_rc = tsconfig_get_double(&tree, "a", &d);
+  tsconfig_tree_free(&tree);
+
+  if (c->kind == NUM_INT) {
+    CHECK_OK(int_rc);
+    CHECK(i == c->i);
+    CHECK_OK(double_rc);
+    CHECK(d == (double)c->i);
+  } else if (c->kind == NUM_DOUBLE) {
+    CHECK(int_rc == TSCFG_ERR_TYPE);
+    CHECK_OK(double_rc);
+    CHECK(same_double(d, strtod(c->str, NULL)));
+  } else {
+    CHECK(int_rc == TSCFG_ERR_TYPE);
+    CHECK(double_rc == TSCFG_ERR_TYPE);
+  }
+  return check_scan(c->str);
+}
+
+/*
+ * Decode number with scanner, which must use all of it and give the same
+ * double as strtod() unless it is an integer.
+ */
+static int check_scan(const char *str) {
+  size_t len = strlen(str), used;
+  tscfg_num num;
+  CHECK_OK(tscfg_num_scan(str, len, &used, &num));
+  CHECK(used == len);
+  if (!num.is_int) {
+    CHECK(same_double(num.v.d, strtod(str, NULL)));
+  }
+  return 0;
+}
+
+/*
+ * Mantissas longer than the stack buffer for strtod().
+ */
+static int check_long(void) {
+  static const char *const formats[] = { "0.%s", "%s", "%s.5e-300",
+                                         "1.%se5" };
+  char digits[401], str[512];
+  for (int n = 1; n <= 400; n += 13) {
+    for (int i = 0; i < n; i++) {
+      digits[i] = (char)('1' + i % 9);
+    }
+    digits[n] = '\0';
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      snprintf(str, sizeof(str), formats[f], digits);
+      if (check_scan(str) != 0) {
+        fprintf(stderr, "Long number failed: %s\n", str);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Random mantissas and exponents, around the limits of the exact path.
+ */
+static int check_random(void) {
+  uint64_t state = 42;
+  char str[64];
+  for (int n = 0; n < RANDOM_NUMS; n++) {
+    state = state * UINT64_C(6364136223846793005) +
+            UINT64_C(1442695040888963407);
+    uint64_t r = state >> 11;
+
+    int ndigits = 1 + (int)(r % 20);
+    int point = (int)((r >> 5) % (uint64_t)(ndigits + 1));
+    int exp = (int)((r >> 10) % 700) - 350;
+    uint64_t digit_bits = r >> 20;
+
+    size_t len = 0;
+    for (int i = 0; i < ndigits; i++) {
+      if (i == point) {
+        str[len++] = '.';
+      }
+      str[len++] = (char)('0' + (digit_bits + (uint64_t)i * 7) % 10);
+      digit_bits /= 3;
+    }
+    snprintf(str + len, sizeof(str) - len, "e%d", exp);
+
+    if (check_scan(str) != 0) {
+      fprintf(stderr, "Random number failed: %s\n", str);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_units(void) {
+  for (size_t i = 0; i < sizeof(durations) / sizeof(durations[0]); i++) {
+    const unit_case *c = &durations[i];
+    int64_t ns = 0;
+    tscfg_rc rc = tscfg_parse_duration(c->str, strlen(c->str), &ns);
+    if (rc != c->rc || ns != c->val) {
+      fprintf(stderr, "Duration case failed: %s\n", c->str);
+      return 1;
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    const unit_case *c = &sizes[i];
+    int64_t bytes = 0;
+    tscfg_rc rc = tscfg_parse_size(c->str, strlen(c->str), &bytes);
+    if (rc != c->rc || bytes != c->val) {
+      fprintf(stderr, "Size case failed: %s\n", c->str);
+      return 1;
+    }
+  }
+
+  // Numbers without unit in config are milliseconds and bytes
+  tsconfig_tree tree;
+  CHECK_OK(test_parse("t = 2\nu = 2 minutes\ns = 3\nz = 1 GiB", &tree));
+  int64_t val;
+  CHECK_OK(tsconfig_get_duration(&tree, "t", &val));
+  CHECK(val == INT64_C(2000000));
+  CHECK_OK(tsconfig_get_duration(&tree, "u", &val));
+  CHECK(val == INT64_C(120000000000));
+  CHECK_OK(tsconfig_get_size(&tree, "s", &val));
+  CHECK(val == 3);
+  CHECK_OK(tsconfig_get_size(&tree, "z", &val));
+  CHECK(val == INT64_C(1) << 30);
+  tsconfig_tree_free(&tree);
+  return 0;
+}
+
+/*
+ * Whether doubles are the same, including sign of zero.
+ */
+static bool same_double(double a, double b) {
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
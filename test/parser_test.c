@@ -0,0 +1,164 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that a parser reused for many inputs, including ones that fail
+ * part way through, gives the same trees as parsing each input afresh,
+ * and that it allocates less per input without its memory growing.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Times inputs are parsed with the same parser
+#define ROUNDS 50
+
+static const char *const inputs[] = {
+  "a = 1\nb = [1, 2, { c = str }]\nd { e = true, f = null }",
+  "a = [1, 2\nb = 3", // Syntax error
+  "x { y = 1 }\nz = ${x} { w = 2 }\nv = ${x.y} text",
+  "s = \"\"\"multi\nline\"\"\"\n# comment\nt = \"esc\\n\"",
+  "a = \"unterminated", // Lexer error
+  "{ \"quoted key\" = 1, k = ${?missing}, l += 2 }",
+  "a = ${nope}", // Resolution error
+  "",
+};
+
+static int check_trees(void);
+static int check_allocs(void);
+static tscfg_rc parse_with(tsconfig_parser *parser, const char *str,
+        bool stream, const tsconfig_parse_opts *opts, tsconfig_tree *tree);
+static void ignore_err(void *ctx, const char *msg);
+
+int main(void) {
+  // Errors for invalid input are expected
+  tsconfig_set_err_handler(ignore_err, NULL);
+
+  int failed = 0;
+  failed |= check_trees();
+  failed |= check_allocs();
+  return failed;
+}
+
+/*
+ * Each input, from memory and streamed, gives same result with parser
+ * as without.
+ */
+static int check_trees(void) {
+  tsconfig_parser *parser;
+  CHECK_OK(tsconfig_parser_new(&parser));
+
+  for (int round = 0; round < ROUNDS; round++) {
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+      bool stream = (round + i) % 2 == 0;
+      tsconfig_tree fresh, reused;
+      tscfg_rc rc = parse_with(NULL, inputs[i], stream, NULL, &fresh);
+      tscfg_rc reused_rc = parse_with(parser, inputs[i], stream, NULL,
+                                      &reused);
+      if (reused_rc != rc) {
+        fprintf(stderr, "Result %d with parser and %d without for:\n%s\n",
+                (int)reused_rc, (int)rc, inputs[i]);
+        return 1;
+      }
+
+      if (rc == TSCFG_OK) {
+        CHECK(test_tree_equal(&fresh, &reused));
+        tsconfig_tree_free(&fresh);
+        tsconfig_tree_free(&reused);
+      }
+    }
+  }
+
+  tsconfig_parser_free(parser);
+  return 0;
+}
+
+/*
+ * Reused parser allocates less than a fresh parse of the same input, and
+ * keeps the same memory from one input to the next.
+ */
+static int check_allocs(void) {
+  tscfg_counting_alloc ca;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = &ca.alloc;
+  opts.threads = 1;
+
+  tsconfig_tree tree;
+  tscfg_alloc_stats fresh, reused;
+  CHECK_OK(parse_with(NULL, inputs[0], false, &opts, &tree));
+  tsconfig_tree_free(&tree);
+  tscfg_counting_alloc_stats(&ca, &fresh);
+  CHECK(fresh.current == 0);
+
+  tsconfig_parser *parser;
+  CHECK_OK(tsconfig_parser_new(&parser));
+  size_t kept = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    tscfg_counting_alloc_reset(&ca);
+    CHECK_OK(parse_with(parser, inputs[0], false, &opts, &tree));
+    tsconfig_tree_free(&tree);
+    tscfg_counting_alloc_stats(&ca, &reused);
+
+    if (round == 0) {
+      kept = reused.current;
+    } else {
+      CHECK(reused.allocs < fresh.allocs);
+      CHECK(reused.current == kept);
+    }
+  }
+  printf("allocations per parse: %zu fresh, %zu with parser\n",
+         fresh.allocs, reused.allocs);
+
+  tsconfig_parser_free(parser);
+  tscfg_counting_alloc_stats(&ca, &reused);
+  CHECK(reused.current == 0);
+  return 0;
+}
+
+/*
+ * Parse string with parser, or without if NULL.
+ * stream: if true, read string in chunks rather than from memory
+ */
+static tscfg_rc parse_with(tsconfig_parser *parser, const char *str,
+        bool stream, const tsconfig_parse_opts *opts, tsconfig_tree *tree) {
+  tsconfig_input src = { .kind = TS_CONFIG_IN_STR };
+  src.data.s.str = str;
+  src.data.s.len = strlen(str);
+  src.data.s.pos = 0;
+
+  tsconfig_input in = src;
+  if (stream) {
+    in.kind = TS_CONFIG_IN_FUNC;
+    in.data.fn.read = test_read_str;
+    in.data.fn.ctx = &src;
+    in.data.fn.chunk_size = 0;
+  }
+
+  if (parser == NULL) {
+    return tsconfig_parse_tree_opts(in, TSCFG_HOCON, opts, tree);
+  }
+  return tsconfig_parser_parse_tree(parser, in, TSCFG_HOCON, opts, tree);
+}
+
+static void ignore_err(void *ctx, const char *msg) {
+  (void)ctx;
+  (void)msg;
+}
@@ -0,0 +1,99 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that rendered trees parse back to equal trees in every format,
+ * and that rendering a reparsed tree gives the same text again.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+static const char *const inputs[] = {
+  "{}",
+  "a = 1\nb = -2\nc = 1.5\nd = -2.5e-3\ne = 9007199254740993\nf = 0",
+  "a = true\nb = false\nc = null\nd = unquoted text",
+  "a { b { c { d = [1, [2, { e = 3 }], [], {}] } } }\nf = []\ng {}",
+  // Strings that need escaping or quoting
+  "a = \"quote \\\" backslash \\\\ slash /\"\n"
+  "b = \"tab\\t newline\\n cr\\r ctrl\\u0001 del\\u007f\"\n"
+  "c = \"unicode \\u00e9 \xe2\x82\xac \xf0\x9f\x98\x80\"\n"
+  "d = \"${not.a.sub} // not a comment # nor this\"\n"
+  "e = \"\"\nf = \" spaces \"\ng = \"\"\"multi\nline \"quoted\" \"\"\"",
+  // Keys that need quoting
+  "\"a.b\" = 1\n\"\" = 2\n\" \" = 3\n\"true\" = 4\n\"1x\" = 5\n"
+  "\"k=v\" = 6\n\"\\u00e9\" = 7\n\"a\\\"b\" = 8\n\"$x\" = 9\nplain-key_1 = 10",
+  // Values from resolution
+  "a { b = 1 }\nc = ${a} { d = 2 }\ne = x ${a.b} y\nf = [1] ${g}\ng = [2]",
+  "a = ${?nope}\nb = [${?nope}, 1]\nc { d = ${?nope}, e = 1 }",
+};
+
+static const tscfg_render_fmt fmts[] = {
+  TSCFG_RENDER_JSON,
+  TSCFG_RENDER_JSON_PRETTY,
+  TSCFG_RENDER_HOCON,
+};
+
+static int check_round_trip(const char *input, tscfg_render_fmt fmt);
+
+int main(void) {
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    for (size_t f = 0; f < sizeof(fmts) / sizeof(fmts[0]); f++) {
+      if (check_round_trip(inputs[i], fmts[f]) != 0) {
+        fprintf(stderr, "Round trip failed in format %d for input:\n%s\n",
+                (int)fmts[f], inputs[i]);
+        failed = 1;
+      }
+    }
+  }
+  return failed;
+}
+
+static int check_round_trip(const char *input, tscfg_render_fmt fmt) {
+  tsconfig_tree tree, reparsed, reparsed2;
+  CHECK_OK(test_parse(input, &tree));
+
+  char *text = NULL;
+  size_t len = 0, size = 0;
+  CHECK_OK(tsconfig_render(&tree, fmt, &text, &len, &size));
+  CHECK(strlen(text) == len);
+  CHECK_OK(test_parse(text, &reparsed));
+  CHECK(test_tree_equal(&tree, &reparsed));
+
+  // Text of reparsed tree is stable
+  char *text2 = NULL;
+  size_t len2 = 0, size2 = 0;
+  CHECK_OK(tsconfig_render(&reparsed, fmt, &text2, &len2, &size2));
+  CHECK_OK(test_parse(text2, &reparsed2));
+  CHECK(test_tree_equal(&reparsed, &reparsed2));
+
+  char *text3 = NULL;
+  size_t len3 = 0, size3 = 0;
+  CHECK_OK(tsconfig_render(&reparsed2, fmt, &text3, &len3, &size3));
+  CHECK(len2 == len3 && memcmp(text2, text3, len2) == 0);
+
+  free(text);
+  free(text2);
+  free(text3);
+  tsconfig_tree_free(&tree);
+  tsconfig_tree_free(&reparsed);
+  tsconfig_tree_free(&reparsed2);
+  return 0;
+}
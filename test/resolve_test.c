@@ -0,0 +1,188 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check resolution of substitutions and concatenations, and that cycles
+ * and missing substitutions are reported.
+ */
+
+// For setenv()
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Length of deep substitution chains and nesting of merged objects,
+// enough to overflow the stack if resolved recursively
+#define DEEP 100000
+
+typedef struct {
+  const char *input;
+  const char *expected; // Expected value, or error message
+} resolve_case;
+
+static const resolve_case cases[] = {
+  // References in either direction, and chains of references
+  { "a = ${b}\nb = 1", "{ a: 1, b: 1 }" },
+  { "a = 1\nb = ${a}", "{ a: 1, b: 1 }" },
+  { "a = ${b}\nb = ${c}\nc = ${d.e}\nd { e = x }",
+    "{ a: x, b: x, c: x, d: { e: x } }" },
+  { "a { b = ${c.d} }\nc { d = ${e} }\ne = [1, 2]",
+    "{ a: { b: [1, 2] }, c: { d: [1, 2] }, e: [1, 2] }" },
+
+  // Whole objects and arrays, and values inside them
+  { "a { b = 1, c = [2] }\nd = ${a}\ne = ${a.c}",
+    "{ a: { b: 1, c: [2] }, d: { b: 1, c: [2] }, e: [2] }" },
+  { "a = [${b}, ${c}]\nb = 1\nc { d = 2 }",
+    "{ a: [1, { d: 2 }], b: 1, c: { d: 2 } }" },
+  { "a { b = ${c} }\nc = 1\nd = ${a.b}", "{ a: { b: 1 }, c: 1, d: 1 }" },
+
+  // Concatenation of strings, arrays and objects
+  { "a = 1\nb = x ${a} y", "{ a: 1, b: \"x 1 y\" }" },
+  { "a = foo\nb = ${a}${a}", "{ a: foo, b: foofoo }" },
+  { "a = [1]\nb = ${a} [2] ${a}", "{ a: [1], b: [1, 2, 1] }" },
+  { "a { b = 1 }\nc = ${a} { d = 2 }",
+    "{ a: { b: 1 }, c: { b: 1, d: 2 } }" },
+  { "a { b = 1 }\nc = ${a} { b = 2 }",
+    "{ a: { b: 1 }, c: { b: 2 } }" },
+
+  // Optional substitutions that are undefined are left out
+  { "a = ${?nope}", "{}" },
+  { "a = [1, ${?nope}, 2]", "{ a: [1, 2] }" },
+  { "a = ${?nope} x", "{ a: x }" },
+  { "a { b = ${?nope} }\nc = ${a}", "{ a: {}, c: {} }" },
+  { "a = 1\nb = ${?a}", "{ a: 1, b: 1 }" },
+
+  // Environment variables are used if not in the tree
+  { "a = ${TSCFG_TEST_VAR}", "{ a: from_env }" },
+  { "a = ${?TSCFG_TEST_VAR}", "{ a: from_env }" },
+  { "TSCFG_TEST_VAR = 1\na = ${TSCFG_TEST_VAR}",
+    "{ TSCFG_TEST_VAR: 1, a: 1 }" },
+
+  // Self-reference with no previous value falls back to environment
+  { "TSCFG_TEST_VAR = ${TSCFG_TEST_VAR}", "{ TSCFG_TEST_VAR: from_env }" },
+  { "a = ${?a}", "{}" },
+};
+
+static const resolve_case errors[] = {
+  { "a = ${b}\nb = ${a}", "Substitution cycle: ${b} -> ${a}" },
+  { "a = ${b}\nb = ${c}\nc = ${a}", "Substitution cycle" },
+  { "a { b = ${c} }\nc = ${a.b}", "Substitution cycle" },
+  { "a = [${a}]", "Substitution cycle" },
+  { "a = ${nope}", "Could not resolve substitution ${nope}" },
+  { "a = 1\nb = ${a.c}", "Could not resolve substitution ${a.c}" },
+  { "a = ${a}", "Could not resolve substitution ${a}" },
+  { "a = [1] ${b}\nb { c = 1 }", "Cannot concatenate object with array" },
+  { "a = x ${b}\nb = [1]", "Cannot concatenate array with string" },
+};
+
+static int check_chain(void);
+static int check_deep_merge(void);
+
+int main(void) {
+  if (setenv("TSCFG_TEST_VAR", "from_env", 1) != 0) {
+    perror("setenv");
+    return 1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    failed |= test_expect(cases[i].input, cases[i].expected);
+  }
+  for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+    failed |= test_expect_err(errors[i].input, TSCFG_ERR_INVALID,
+                              errors[i].expected);
+  }
+  failed |= check_chain();
+  failed |= check_deep_merge();
+  return failed;
+}
+
+/*
+ * Each key refers to the next, with keys defined in order so that every
+ * substitution is reached before its target is resolved.
+ */
+static int check_chain(void) {
+  size_t size = (size_t)DEEP * 32;
+  char *input = malloc(size);
+  CHECK(input != NULL);
+
+  size_t len = 0;
+  for (int i = 0; i < DEEP; i++) {
+    len += (size_t)snprintf(input + len, size - len, "k%d = ${k%d}\n", i,
+                            i + 1);
+  }
+  snprintf(input + len, size - len, "k%d = end", DEEP);
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+  free(input);
+
+  const char *str;
+  CHECK_OK(tsconfig_get_str(&tree, "k0", &str, &len));
+  CHECK(len == 3 && memcmp(str, "end", 3) == 0);
+
+  tsconfig_tree_free(&tree);
+  return 0;
+}
+
+/*
+ * Deeply nested object concatenated with a substitution, so merged when
+ * resolved at every level.
+ */
+static int check_deep_merge(void) {
+  size_t size = (size_t)DEEP * 8 * 2 + 64;
+  char *input = malloc(size);
+  CHECK(input != NULL);
+
+  char *p = input;
+  for (int def = 0; def < 2; def++) {
+    p += sprintf(p, def == 0 ? "x " : "y = ${x} ");
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, "{ a ");
+    }
+    p += sprintf(p, def == 0 ? "{ v = 1 }" : "{ w = 2 }");
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, " }");
+    }
+    p += sprintf(p, "\n");
+  }
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse(input, &tree));
+  free(input);
+
+  tscfg_val val;
+  CHECK_OK(tsconfig_get(&tree, "y", &val));
+  for (int i = 0; i < DEEP; i++) {
+    CHECK_OK(tscfg_obj_get(val, "a", 1, &val));
+  }
+
+  tscfg_val v, w;
+  int64_t i;
+  CHECK_OK(tscfg_obj_get(val, "v", 1, &v));
+  CHECK_OK(tscfg_val_int64(v, &i));
+  CHECK(i == 1);
+  CHECK_OK(tscfg_obj_get(val, "w", 1, &w));
+  CHECK_OK(tscfg_val_int64(w, &i));
+  CHECK(i == 2);
+
+  tsconfig_tree_free(&tree);
+  return 0;
+}
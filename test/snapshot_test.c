@@ -0,0 +1,290 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that trees replaced in a snapshot are freed once, and only once,
+ * no reader can be using them.  Each tree is allocated with its own
+ * counting allocator, so freeing it is seen as no memory being left.
+ */
+
+// Needed for pthreads
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_snapshot.h"
+
+// Reader threads and trees published in stress test
+#define THREADS 4
+#define PUBLISHES 200
+
+typedef struct {
+  tsconfig_snapshot *snap;
+  int failed;
+} reader_arg;
+
+static int make_tree(int version, tscfg_counting_alloc *ca,
+                     tsconfig_shared_tree **shared);
+static size_t alloc_current(tscfg_counting_alloc *ca);
+static int check_no_readers(void);
+static int check_acquired(void);
+static int check_get(void);
+static int check_stress(void);
+static void *reader_main(void *arg);
+static int read_versions(tsconfig_snapshot_reader *reader);
+
+static bool stop_readers = false;
+
+int main(void) {
+  int failed = 0;
+  failed |= check_no_readers();
+  failed |= check_acquired();
+  failed |= check_get();
+  failed |= check_stress();
+  return failed;
+}
+
+/*
+ * Parse shared tree with version key, allocated with ca.
+ */
+static int make_tree(int version, tscfg_counting_alloc *ca,
+                     tsconfig_shared_tree **shared) {
+  char input[64];
+  snprintf(input, sizeof(input), "version = %d\na.b = [1, 2, 3]", version);
+
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.alloc = &ca->alloc;
+  opts.threads = 1;
+
+  tsconfig_tree tree;
+  CHECK_OK(test_parse_opts(input, &opts, &tree));
+  CHECK_OK(tsconfig_tree_share(&tree, shared));
+  return 0;
+}
+
+static size_t alloc_current(tscfg_counting_alloc *ca) {
+  tscfg_alloc_stats stats;
+  tscfg_counting_alloc_stats(ca, &stats);
+  return stats.current;
+}
+
+/*
+ * Replaced tree is freed at once if no reader holds it, including
+ * readers that are registered but idle.
+ */
+static int check_no_readers(void) {
+  tscfg_counting_alloc ca1, ca2;
+  tscfg_counting_alloc_init(&ca1, NULL);
+  tscfg_counting_alloc_init(&ca2, NULL);
+
+  tsconfig_snapshot *snap;
+  CHECK_OK(tsconfig_snapshot_new(&snap));
+  tsconfig_snapshot_reader *reader;
+  CHECK_OK(tsconfig_snapshot_reader_new(snap, &reader));
+
+  tsconfig_shared_tree *t1, *t2;
+  CHECK(make_tree(1, &ca1, &t1) == 0);
+  CHECK(make_tree(2, &ca2, &t2) == 0);
+  CHECK_OK(tsconfig_snapshot_publish(snap, t1));
+  CHECK(tsconfig_snapshot_acquire(reader) != NULL);
+  tsconfig_snapshot_release(reader);
+
+  CHECK_OK(tsconfig_snapshot_publish(snap, t2));
+  CHECK(alloc_current(&ca1) == 0);
+  CHECK(alloc_current(&ca2) > 0);
+
+  tsconfig_snapshot_reader_free(reader);
+  tsconfig_snapshot_free(snap);
+  CHECK(alloc_current(&ca2) == 0);
+  return 0;
+}
+
+/*
+ * Tree held by a reader is kept until released, and then freed by the
+ * next reclaim.
+ */
+static int check_acquired(void) {
+  tscfg_counting_alloc ca1, ca2;
+  tscfg_counting_alloc_init(&ca1, NULL);
+  tscfg_counting_alloc_init(&ca2, NULL);
+
+  tsconfig_snapshot *snap;
+  CHECK_OK(tsconfig_snapshot_new(&snap));
+  tsconfig_snapshot_reader *reader;
+  CHECK_OK(tsconfig_snapshot_reader_new(snap, &reader));
+  CHECK(tsconfig_snapshot_acquire(reader) == NULL);
+  tsconfig_snapshot_release(reader);
+
+  tsconfig_shared_tree *t1, *t2;
+  CHECK(make_tree(1, &ca1, &t1) == 0);
+  CHECK(make_tree(2, &ca2, &t2) == 0);
+  CHECK_OK(tsconfig_snapshot_publish(snap, t1));
+
+  const tsconfig_tree *tree = tsconfig_snapshot_acquire(reader);
+  CHECK(tree != NULL);
+  CHECK_OK(tsconfig_snapshot_publish(snap, t2));
+  tsconfig_snapshot_reclaim(snap);
+  CHECK(alloc_current(&ca1) > 0);
+
+  // Old tree is still readable
+  int64_t version;
+  CHECK_OK(tsconfig_get_int64(tree, "version", &version));
+  CHECK(version == 1);
+  tsconfig_snapshot_release(reader);
+
+  tsconfig_snapshot_reclaim(snap);
+  CHECK(alloc_current(&ca1) == 0);
+
+  tree = tsconfig_snapshot_acquire(reader);
+  CHECK_OK(tsconfig_get_int64(tree, "version", &version));
+  CHECK(version == 2);
+  tsconfig_snapshot_release(reader);
+
+  tsconfig_snapshot_reader_free(reader);
+  tsconfig_snapshot_free(snap);
+  CHECK(alloc_current(&ca2) == 0);
+  return 0;
+}
+
+/*
+ * Reference from tsconfig_snapshot_get() keeps tree after it is
+ * replaced and reclaimed, until the reference is released.
+ */
+static int check_get(void) {
+  tscfg_counting_alloc ca1, ca2;
+  tscfg_counting_alloc_init(&ca1, NULL);
+  tscfg_counting_alloc_init(&ca2, NULL);
+
+  tsconfig_snapshot *snap;
+  CHECK_OK(tsconfig_snapshot_new(&snap));
+  tsconfig_snapshot_reader *reader;
+  CHECK_OK(tsconfig_snapshot_reader_new(snap, &reader));
+
+  tsconfig_shared_tree *t1, *t2;
+  CHECK(make_tree(1, &ca1, &t1) == 0);
+  CHECK(make_tree(2, &ca2, &t2) == 0);
+  CHECK_OK(tsconfig_snapshot_publish(snap, t1));
+
+  tsconfig_shared_tree *ref = tsconfig_snapshot_get(reader);
+  CHECK(ref == t1);
+  CHECK_OK(tsconfig_snapshot_publish(snap, t2));
+  tsconfig_snapshot_reclaim(snap);
+  CHECK(alloc_current(&ca1) > 0);
+
+  int64_t version;
+  CHECK_OK(tsconfig_get_int64(tsconfig_shared_tree_get(ref), "version",
+                              &version));
+  CHECK(version == 1);
+  tsconfig_shared_tree_release(ref);
+  CHECK(alloc_current(&ca1) == 0);
+
+  tsconfig_snapshot_reader_free(reader);
+  tsconfig_snapshot_free(snap);
+  CHECK(alloc_current(&ca2) == 0);
+  return 0;
+}
+
+/*
+ * Readers on several threads read while trees are published.  Versions
+ * seen by each reader must never go backwards, and once readers are done
+ * all trees but the current one must be freed.
+ */
+static int check_stress(void) {
+  tscfg_counting_alloc ca, ca_last;
+  tscfg_counting_alloc_init(&ca, NULL);
+  tscfg_counting_alloc_init(&ca_last, NULL);
+
+  tsconfig_snapshot *snap;
+  CHECK_OK(tsconfig_snapshot_new(&snap));
+
+  pthread_t threads[THREADS];
+  reader_arg args[THREADS];
+  __atomic_store_n(&stop_readers, false, __ATOMIC_RELAXED);
+  for (int i = 0; i < THREADS; i++) {
+    args[i].snap = snap;
+    args[i].failed = 0;
+    CHECK(pthread_create(&threads[i], NULL, reader_main, &args[i]) == 0);
+  }
+
+  for (int v = 1; v <= PUBLISHES; v++) {
+    tsconfig_shared_tree *shared;
+    CHECK(make_tree(v, v < PUBLISHES ? &ca : &ca_last, &shared) == 0);
+    CHECK_OK(tsconfig_snapshot_publish(snap, shared));
+  }
+
+  __atomic_store_n(&stop_readers, true, __ATOMIC_RELAXED);
+  int failed = 0;
+  for (int i = 0; i < THREADS; i++) {
+    CHECK(pthread_join(threads[i], NULL) == 0);
+    failed |= args[i].failed;
+  }
+  CHECK(failed == 0);
+
+  tsconfig_snapshot_reclaim(snap);
+  CHECK(alloc_current(&ca) == 0);
+  CHECK(alloc_current(&ca_last) > 0);
+
+  tsconfig_snapshot_free(snap);
+  CHECK(alloc_current(&ca_last) == 0);
+  return 0;
+}
+
+static void *reader_main(void *arg) {
+  reader_arg *ra = arg;
+  tsconfig_snapshot_reader *reader;
+  if (tsconfig_snapshot_reader_new(ra->snap, &reader) != TSCFG_OK) {
+    ra->failed = 1;
+    return NULL;
+  }
+
+  ra->failed = read_versions(reader);
+  tsconfig_snapshot_reader_free(reader);
+  return NULL;
+}
+
+static int read_versions(tsconfig_snapshot_reader *reader) {
+  int64_t last = 0;
+  for (int n = 0; !__atomic_load_n(&stop_readers, __ATOMIC_RELAXED); n++) {
+    const tsconfig_tree *tree = tsconfig_snapshot_acquire(reader);
+    int64_t version = 0;
+    tscfg_val elem;
+    if (tree != NULL) {
+      CHECK_OK(tsconfig_get_int64(tree, "version", &version));
+      CHECK_OK(tsconfig_get(tree, "a.b", &elem));
+      CHECK(tscfg_val_tag(elem) == TSCFG_TAPE_ARR);
+    }
+    tsconfig_snapshot_release(reader);
+    CHECK(version >= last);
+    last = version;
+
+    // Sometimes keep a reference while trees are replaced
+    if (n % 16 == 0) {
+      tsconfig_shared_tree *ref = tsconfig_snapshot_get(reader);
+      if (ref != NULL) {
+        CHECK_OK(tsconfig_get_int64(tsconfig_shared_tree_get(ref),
+                                    "version", &version));
+        CHECK(version >= last);
+        tsconfig_shared_tree_release(ref);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that large inputs parsed in parts on several threads give the
+ * same tree as parsing them whole on one thread, including keys merged
+ * and substitutions resolved across parts.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_split.h"
+
+// Size of generated inputs, enough to be split into several parts
+#define INPUT_SIZE (TSCFG_SPLIT_MIN_SIZE + TSCFG_SPLIT_MIN_SIZE / 2)
+
+#define THREADS 4
+
+typedef struct {
+  char *str;
+  size_t len;
+  size_t size;
+} gen_buf;
+
+static int append(gen_buf *b, const char *fmt, ...);
+static int gen_fields(gen_buf *b, bool braces);
+static int check_split(const char *name, bool braces);
+static tscfg_rc parse_str(const char *str, size_t len, int threads,
+                          tsconfig_tree *tree);
+static int check_err(void);
+
+int main(void) {
+  int failed = 0;
+  failed |= check_split("fields", false);
+  failed |= check_split("braces", true);
+  failed |= check_err();
+  return failed;
+}
+
+static int append(gen_buf *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(b->str + b->len, b->size - b->len, fmt, ap);
+  va_end(ap);
+  CHECK(n >= 0 && (size_t)n < b->size - b->len);
+  b->len += (size_t)n;
+  return 0;
+}
+
+/*
+ * Top-level fields, with keys defined again and referred to from far
+ * apart in the input, so from different parts, and separators, brackets
+ * and comments in strings and comments, which must not split fields.
+ */
+static int gen_fields(gen_buf *b, bool braces) {
+  if (braces) {
+    CHECK(append(b, "{\n") == 0);
+  }
+  CHECK(append(b, "first = ${last}\nlist = [0]\n") == 0);
+
+  for (int n = 0; b->len < INPUT_SIZE; n++) {
+    int key = n % 5000;
+    CHECK(append(b,
+      "k%d { n%d = %d, s = \"a, b }\\n{\" }\n"
+      "# comment with } and ,\n"
+      "arr%d = [\n  1,\n  \"]\"\n  { x = %d }\n]\n"
+      "t%d = \"\"\"line }\nline {\"\"\"\n"
+      "r%d = ${k%d.s} // comment {\n"
+      "list += %d\n"
+      "p%d = ${?p%d}\":%d\"\n"
+      "o%d.p.q = ${?first}, o%d.p.r = ${?undefined}\n",
+      key, n, n, key, n, key, n, key, n, key, key, n, key, key) == 0);
+  }
+
+  CHECK(append(b, "last = done\n") == 0);
+  if (braces) {
+    CHECK(append(b, "}\n") == 0);
+  }
+  return 0;
+}
+
+static int check_split(const char *name, bool braces) {
+  gen_buf b = { .len = 0, .size = INPUT_SIZE + 4096 };
+  b.str = malloc(b.size);
+  CHECK(b.str != NULL);
+  CHECK(gen_fields(&b, braces) == 0);
+
+  // Input must actually be split for test to be useful
+  tscfg_span parts[THREADS * TSCFG_SPLIT_PARTS_PER_THREAD];
+  size_t nparts = tscfg_split_fields(b.str, b.len,
+                                     sizeof(parts) / sizeof(parts[0]), parts);
+  printf("%s: %zu bytes of input, %zu parts\n", name, b.len, nparts);
+  CHECK(nparts > 1);
+
+  tsconfig_tree whole, split;
+  CHECK_OK(parse_str(b.str, b.len, 1, &whole));
+  CHECK_OK(parse_str(b.str, b.len, THREADS, &split));
+  CHECK(test_tree_equal(&whole, &split));
+
+  const char *str;
+  size_t len;
+  CHECK_OK(tsconfig_get_str(&split, "first", &str, &len));
+  CHECK(len == 4 && memcmp(str, "done", 4) == 0);
+
+  tsconfig_tree_free(&whole);
+  tsconfig_tree_free(&split);
+  free(b.str);
+  return 0;
+}
+
+static tscfg_rc parse_str(const char *str, size_t len, int threads,
+                          tsconfig_tree *tree) {
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.threads = threads;
+
+  tsconfig_input in = { .kind = TS_CONFIG_IN_STR };
+  in.data.s.str = str;
+  in.data.s.len = len;
+  in.data.s.pos = 0;
+  return tsconfig_parse_tree_opts(in, TSCFG_HOCON, &opts, tree);
+}
+
+/*
+ * Syntax error in a later part fails as when parsed whole.
+ */
+static int check_err(void) {
+  gen_buf b = { .len = 0, .size = INPUT_SIZE + 4096 };
+  b.str = malloc(b.size);
+  CHECK(b.str != NULL);
+  CHECK(gen_fields(&b, false) == 0);
+  CHECK(append(&b, "bad = [1, 2\n") == 0);
+
+  tsconfig_tree tree;
+  tscfg_rc rc = parse_str(b.str, b.len, 1, &tree);
+  CHECK(rc != TSCFG_OK);
+  CHECK(parse_str(b.str, b.len, THREADS, &tree) == rc);
+
+  free(b.str);
+  return 0;
+}
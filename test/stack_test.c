@@ -0,0 +1,152 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that deeply nested input is parsed, merged and resolved on a
+ * thread with a small stack, since no pass recurses per nesting level.
+ */
+
+// Needed for pthreads
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "test_util.h"
+
+// Stack for parsing thread, as documented for tsconfig_parse_tree_opts()
+#define STACK_SIZE TSCFG_PARSE_STACK_SIZE
+
+// Nesting of values, and length of substitution chain
+#define DEEP 100000
+
+static char *gen_input(void);
+static void *parse_main(void *arg);
+static int check_tree(const tsconfig_tree *tree);
+
+int main(void) {
+  char *input = gen_input();
+  CHECK(input != NULL);
+
+  pthread_attr_t attr;
+  CHECK(pthread_attr_init(&attr) == 0);
+  size_t stack_size = STACK_SIZE < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN :
+                                                       STACK_SIZE;
+  CHECK(pthread_attr_setstacksize(&attr, stack_size) == 0);
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, &attr, parse_main, input) == 0);
+  void *result;
+  CHECK(pthread_join(thread, &result) == 0);
+  CHECK(result == NULL);
+
+  pthread_attr_destroy(&attr);
+  free(input);
+  return 0;
+}
+
+/*
+ * Arrays nested DEEP deep and appended to, an object nested DEEP deep
+ * defined twice and merged again through a substitution, and a chain of
+ * DEEP substitutions.
+ */
+static char *gen_input(void) {
+  size_t size = (size_t)DEEP * 64;
+  char *input = malloc(size);
+  if (input == NULL) {
+    return NULL;
+  }
+
+  char *p = input;
+  p += sprintf(p, "arr = ");
+  for (int i = 0; i < DEEP; i++) {
+    *p++ = '[';
+  }
+  for (int i = 0; i < DEEP; i++) {
+    *p++ = ']';
+  }
+  p += sprintf(p, "\narr += 1\n");
+
+  for (int def = 0; def < 3; def++) {
+    static const char *const starts[] = { "obj ", "obj ", "copy = ${obj} " };
+    static const char *const leaves[] = { "x = 1", "y = 2", "z = 3" };
+    p += sprintf(p, "%s", starts[def]);
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, "{ a ");
+    }
+    p += sprintf(p, "{ %s }", leaves[def]);
+    for (int i = 0; i < DEEP; i++) {
+      p += sprintf(p, " }");
+    }
+    *p++ = '\n';
+  }
+
+  for (int i = 0; i < DEEP; i++) {
+    p += sprintf(p, "k%d = ${k%d}\n", i, i + 1);
+  }
+  sprintf(p, "k%d = end\n", DEEP);
+  return input;
+}
+
+static void *parse_main(void *arg) {
+  static int failed = 1;
+
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.threads = 1;
+
+  tsconfig_tree tree;
+  if (test_parse_opts(arg, &opts, &tree) != TSCFG_OK) {
+    fprintf(stderr, "Parse failed\n");
+    return &failed;
+  }
+
+  int rc = check_tree(&tree);
+  tsconfig_tree_free(&tree);
+  return rc == 0 ? NULL : &failed;
+}
+
+static int check_tree(const tsconfig_tree *tree) {
+  tscfg_val val;
+  CHECK_OK(tsconfig_get(tree, "arr", &val));
+  for (int i = 0; i < DEEP; i++) {
+    CHECK(tscfg_val_tag(val) == TSCFG_TAPE_ARR);
+    val = tscfg_val_deref((tscfg_val){ .tree = tree, .ix = val.ix + 1 });
+  }
+  CHECK(tscfg_val_tag(val) == TSCFG_TAPE_ARR_END);
+
+  CHECK_OK(tsconfig_get(tree, "copy", &val));
+  for (int i = 0; i < DEEP; i++) {
+    CHECK_OK(tscfg_obj_get(val, "a", 1, &val));
+  }
+  static const char *const keys[] = { "x", "y", "z" };
+  for (int i = 0; i < 3; i++) {
+    tscfg_val leaf;
+    int64_t n;
+    CHECK_OK(tscfg_obj_get(val, keys[i], 1, &leaf));
+    CHECK_OK(tscfg_val_int64(leaf, &n));
+    CHECK(n == i + 1);
+  }
+
+  const char *str;
+  size_t len;
+  CHECK_OK(tsconfig_get_str(tree, "k0", &str, &len));
+  CHECK(len == 3 && memcmp(str, "end", 3) == 0);
+  return 0;
+}
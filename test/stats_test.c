@@ -0,0 +1,239 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check parse statistics: counts for small inputs, the same counts for
+ * input streamed or split between threads, and no lexer or parser counts
+ * for included files.  If the library was configured with
+ * --disable-stats, check that stats are all zero instead.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_stats.h"
+
+// Included file, in directory tests are run from
+#define INC_FILE "stats_test_inc.conf"
+
+// Size of input generated to be split into parts
+#define SPLIT_SIZE (6 * 1024 * 1024)
+
+typedef struct {
+  const char *input;
+  uint64_t toks; // Tokens of all tags, including EOF
+  uint64_t numbers; // Number tokens
+  int max_depth;
+  uint64_t subs;
+  uint64_t merge_collisions;
+} stats_case;
+
+static const stats_case cases[] = {
+  { "{}", 3, 0, 1, 0, 0 },
+  { "a = 1", 6, 1, 1, 0, 0 },
+  { "a { b { c = [1, [2]] } }", 25, 2, 5, 0, 0 },
+  // Substitution, and key defined twice
+  { "a = 1\nb = ${a}\na = 2", 20, 2, 1, 1, 1 },
+  // Objects merged, then fields within them
+  { "a { x = 1 }\na { y = 2 }\na { x = 3 }", 36, 3, 2, 0, 3 },
+  { "a = [1]\na += 2", 14, 2, 2, 0, 1 },
+  // Self-reference spliced by merge
+  { "a = x\na = ${a} y", 16, 0, 1, 1, 1 },
+};
+
+static int check_case(const stats_case *c);
+static tscfg_rc parse_stats(const char *str, size_t chunk_size, int threads,
+                            tsconfig_stats *stats);
+static int check_same_counts(const tsconfig_stats *a,
+                             const tsconfig_stats *b);
+static int check_include(void);
+static int check_split(void);
+static int check_disabled(void);
+
+int main(void) {
+  if (!TSCFG_STATS) {
+    return check_disabled();
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (check_case(&cases[i]) != 0) {
+      fprintf(stderr, "Stats case failed for input:\n%s\n", cases[i].input);
+      failed = 1;
+    }
+  }
+  failed |= check_include();
+  failed |= check_split();
+  return failed;
+}
+
+static int check_case(const stats_case *c) {
+  tsconfig_stats stats;
+  CHECK_OK(parse_stats(c->input, 0, 1, &stats));
+
+  uint64_t toks = 0;
+  for (int i = 0; i < TSCFG_TOK_NTAGS; i++) {
+    toks += stats.toks[i];
+  }
+  CHECK(stats.bytes == strlen(c->input));
+  CHECK(stats.refills == 0);
+  CHECK(toks == c->toks);
+  CHECK(stats.toks[TSCFG_TOK_NUMBER] == c->numbers);
+  CHECK(stats.toks[TSCFG_TOK_EOF] == 1);
+  CHECK(stats.max_depth == c->max_depth);
+  CHECK(stats.max_lookahead >= 1);
+  CHECK(stats.subs == c->subs);
+  CHECK(stats.merge_collisions == c->merge_collisions);
+
+  // Stats are reset for each parse
+  tsconfig_stats again = stats;
+  CHECK_OK(parse_stats(c->input, 0, 1, &again));
+  CHECK(check_same_counts(&stats, &again) == 0);
+
+  // Same counts streamed in small chunks, with refills counted
+  tsconfig_stats streamed;
+  CHECK_OK(parse_stats(c->input, 1, 1, &streamed));
+  CHECK(check_same_counts(&stats, &streamed) == 0);
+  CHECK(streamed.refills > 0);
+  return 0;
+}
+
+/*
+ * Parse string, from memory if chunk_size is 0, or else streamed in
+ * chunks of chunk_size.
+ */
+static tscfg_rc parse_stats(const char *str, size_t chunk_size, int threads,
+                            tsconfig_stats *stats) {
+  tsconfig_input src = { .kind = TS_CONFIG_IN_STR };
+  src.data.s.str = str;
+  src.data.s.len = strlen(str);
+  src.data.s.pos = 0;
+
+  tsconfig_input in = src;
+  if (chunk_size > 0) {
+    in.kind = TS_CONFIG_IN_FUNC;
+    in.data.fn.read = test_read_str;
+    in.data.fn.ctx = &src;
+    in.data.fn.chunk_size = chunk_size;
+  }
+
+  tsconfig_parse_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.threads = threads;
+  opts.stats = stats;
+
+  tsconfig_tree tree;
+  tscfg_rc rc = tsconfig_parse_tree_opts(in, TSCFG_HOCON, &opts, &tree);
+  if (rc == TSCFG_OK) {
+    tsconfig_tree_free(&tree);
+  }
+  return rc;
+}
+
+/*
+ * Counts other than refills, lookahead and times are the same.
+ */
+static int check_same_counts(const tsconfig_stats *a,
+                             const tsconfig_stats *b) {
+  CHECK(a->bytes == b->bytes);
+  CHECK(memcmp(a->toks, b->toks, sizeof(a->toks)) == 0);
+  CHECK(a->max_depth == b->max_depth);
+  CHECK(a->subs == b->subs);
+  CHECK(a->merge_collisions == b->merge_collisions);
+  return 0;
+}
+
+/*
+ * Included file is not lexed or parsed into counts, but its substitutions
+ * are resolved with the rest of the tree.
+ */
+static int check_include(void) {
+  FILE *f = fopen(INC_FILE, "wb");
+  CHECK(f != NULL);
+  CHECK(fputs("x { y { z = [1, 2, 3] } }\nx = ${x}", f) >= 0);
+  CHECK(fclose(f) == 0);
+
+  const char *input = "a = 1\ninclude \"" INC_FILE "\"";
+  tsconfig_stats stats;
+  tscfg_rc rc = parse_stats(input, 0, 1, &stats);
+  tsconfig_include_cache_clear();
+  remove(INC_FILE);
+  CHECK_OK(rc);
+
+  CHECK(stats.bytes == strlen(input));
+  CHECK(stats.toks[TSCFG_TOK_NUMBER] == 1);
+  CHECK(stats.max_depth == 1);
+  CHECK(stats.subs == 1);
+  return 0;
+}
+
+/*
+ * Input large enough to be split gives the same counts on several threads
+ * as on one, with time recorded.
+ */
+static int check_split(void) {
+  char *input = malloc(SPLIT_SIZE + 64);
+  CHECK(input != NULL);
+  size_t len = 0;
+  for (int i = 0; len < SPLIT_SIZE; i++) {
+    len += (size_t)sprintf(input + len,
+            "k%d { v = [%d, \"s\"], w = ${k%d.v} }\n", i % 1000, i,
+            i % 1000);
+  }
+
+  tsconfig_stats one, split;
+  tscfg_rc rc = parse_stats(input, 0, 1, &one);
+  tscfg_rc split_rc = parse_stats(input, 0, 4, &split);
+  free(input);
+  CHECK_OK(rc);
+  CHECK_OK(split_rc);
+
+  // Parts each end with EOF, and newlines between them are skipped over,
+  // but other tokens are all counted
+  static const tscfg_tok_tag value_tags[] = {
+    TSCFG_TOK_NUMBER, TSCFG_TOK_STRING, TSCFG_TOK_UNQUOTED,
+    TSCFG_TOK_OPEN_BRACE, TSCFG_TOK_OPEN_SUB, TSCFG_TOK_EQUAL,
+  };
+  for (size_t i = 0; i < sizeof(value_tags) / sizeof(value_tags[0]); i++) {
+    CHECK(one.toks[value_tags[i]] == split.toks[value_tags[i]]);
+  }
+  CHECK(split.toks[TSCFG_TOK_EOF] > 1);
+  CHECK(one.bytes == len && split.bytes == len);
+  CHECK(one.max_depth == split.max_depth);
+  CHECK(one.subs == split.subs);
+  CHECK(one.merge_collisions == split.merge_collisions);
+  CHECK(one.merge_collisions > 0 && one.subs > 0);
+  CHECK(split.lex_ns > 0 && split.parse_ns > 0 && split.build_ns > 0);
+  return 0;
+}
+
+/*
+ * Built without stats, nothing is filled in.
+ */
+static int check_disabled(void) {
+  tsconfig_stats zero, stats;
+  memset(&zero, 0, sizeof(zero));
+  memset(&stats, 0xff, sizeof(stats));
+  CHECK_OK(parse_stats(cases[3].input, 0, 1, &stats));
+  CHECK(memcmp(&stats, &zero, sizeof(zero)) == 0);
+
+  memset(&stats, 0xff, sizeof(stats));
+  CHECK_OK(parse_stats(cases[3].input, 1, 1, &stats));
+  CHECK(memcmp(&stats, &zero, sizeof(zero)) == 0);
+  return 0;
+}
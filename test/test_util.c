@@ -0,0 +1,241 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Helpers shared by unit tests: comparing trees by value, since merging
+ * and resolving don't keep keys in definition order.
+ */
+
+#include "test_util.h"
+
+#include <stdlib.h>
+
+typedef struct {
+  char *msgs;
+  size_t len;
+  size_t size;
+} err_buf;
+
+static bool obj_equal(tscfg_val a, tscfg_val b);
+static bool obj_subset(tscfg_val a, tscfg_val b);
+static bool arr_equal(tscfg_val a, tscfg_val b);
+static bool scalar_equal(tscfg_val a, tscfg_val b);
+static size_t next_defined(tscfg_val arr, size_t ix, size_t end);
+static void print_json(const char *name, const tsconfig_tree *tree);
+static void collect_err(void *ctx, const char *msg);
+
+bool test_val_equal(tscfg_val a, tscfg_val b) {
+  a = tscfg_val_deref(a);
+  b = tscfg_val_deref(b);
+
+  tscfg_tape_tag tag = tscfg_val_tag(a);
+  if (tag == TSCFG_TAPE_OBJ) {
+    return tscfg_val_tag(b) == TSCFG_TAPE_OBJ && obj_equal(a, b);
+  } else if (tag == TSCFG_TAPE_ARR) {
+    return tscfg_val_tag(b) == TSCFG_TAPE_ARR && arr_equal(a, b);
+  }
+  return scalar_equal(a, b);
+}
+
+bool test_tree_equal(const tsconfig_tree *a, const tsconfig_tree *b) {
+  return test_val_equal(tsconfig_root(a), tsconfig_root(b));
+}
+
+/*
+ * Objects are equal if each has all defined keys of the other.
+ */
+static bool obj_equal(tscfg_val a, tscfg_val b) {
+  return obj_subset(a, b) && obj_subset(b, a);
+}
+
+static bool obj_subset(tscfg_val a, tscfg_val b) {
+  size_t end = a.ix + (size_t)tscfg_tape_get_payload(a.tree->tape[a.ix]);
+  for (size_t ix = a.ix + 1; ix < end; ) {
+    size_t len;
+    const char *key = tscfg_tape_str(a.tree, a.tree->tape[ix], &len);
+    tscfg_val val = { .tree = a.tree, .ix = ix + 1 };
+    ix = tscfg_val_end(val);
+
+    val = tscfg_val_deref(val);
+    if (tscfg_val_tag(val) == TSCFG_TAPE_UNDEF) {
+      continue;
+    }
+
+    tscfg_val b_val;
+    if (tscfg_obj_get(b, key, len, &b_val) != TSCFG_OK ||
+        !test_val_equal(val, b_val)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Arrays are equal if defined elements are equal in order.
+ */
+static bool arr_equal(tscfg_val a, tscfg_val b) {
+  size_t a_end = a.ix + (size_t)tscfg_tape_get_payload(a.tree->tape[a.ix]);
+  size_t b_end = b.ix + (size_t)tscfg_tape_get_payload(b.tree->tape[b.ix]);
+  size_t a_ix = next_defined(a, a.ix + 1, a_end);
+  size_t b_ix = next_defined(b, b.ix + 1, b_end);
+  while (a_ix < a_end && b_ix < b_end) {
+    tscfg_val a_elem = { .tree = a.tree, .ix = a_ix };
+    tscfg_val b_elem = { .tree = b.tree, .ix = b_ix };
+    if (!test_val_equal(a_elem, b_elem)) {
+      return false;
+    }
+    a_ix = next_defined(a, tscfg_val_end(a_elem), a_end);
+    b_ix = next_defined(b, tscfg_val_end(b_elem), b_end);
+  }
+  return a_ix == a_end && b_ix == b_end;
+}
+
+/*
+ * Index of first element from ix that is not undefined, or end.
+ */
+static size_t next_defined(tscfg_val arr, size_t ix, size_t end) {
+  while (ix < end) {
+    tscfg_val elem = { .tree = arr.tree, .ix = ix };
+    if (tscfg_val_tag(tscfg_val_deref(elem)) != TSCFG_TAPE_UNDEF) {
+      break;
+    }
+    ix = tscfg_val_end(elem);
+  }
+  return ix;
+}
+
+static bool scalar_equal(tscfg_val a, tscfg_val b) {
+  tscfg_tape_tag a_tag = tscfg_val_tag(a), b_tag = tscfg_val_tag(b);
+  switch (a_tag) {
+    case TSCFG_TAPE_STRING:
+    case TSCFG_TAPE_UNQUOTED: {
+      if (b_tag != TSCFG_TAPE_STRING && b_tag != TSCFG_TAPE_UNQUOTED) {
+        return false;
+      }
+      size_t a_len, b_len;
+      const char *a_str = tscfg_tape_str(a.tree, a.tree->tape[a.ix], &a_len);
+      const char *b_str = tscfg_tape_str(b.tree, b.tree->tape[b.ix], &b_len);
+      return a_len == b_len && memcmp(a_str, b_str, a_len) == 0;
+    }
+
+    case TSCFG_TAPE_NUMBER: {
+      if (b_tag != TSCFG_TAPE_NUMBER) {
+        return false;
+      }
+      int64_t a_int, b_int;
+      if (tscfg_val_int64(a, &a_int) == TSCFG_OK &&
+          tscfg_val_int64(b, &b_int) == TSCFG_OK) {
+        return a_int == b_int;
+      }
+      double a_dbl, b_dbl;
+      return tscfg_val_double(a, &a_dbl) == TSCFG_OK &&
+             tscfg_val_double(b, &b_dbl) == TSCFG_OK && a_dbl == b_dbl;
+    }
+
+    case TSCFG_TAPE_TRUE:
+    case TSCFG_TAPE_FALSE:
+    case TSCFG_TAPE_NULL:
+      return a_tag == b_tag;
+
+    default:
+      // Unresolved or unexpected value
+      return false;
+  }
+}
+
+int test_expect(const char *input, const char *expected) {
+  tsconfig_tree tree, expected_tree;
+  if (test_parse(input, &tree) != TSCFG_OK) {
+    fprintf(stderr, "Failed to parse:\n%s\n", input);
+    return 1;
+  }
+  if (test_parse(expected, &expected_tree) != TSCFG_OK) {
+    fprintf(stderr, "Failed to parse expected value:\n%s\n", expected);
+    tsconfig_tree_free(&tree);
+    return 1;
+  }
+
+  bool equal = test_tree_equal(&tree, &expected_tree);
+  if (!equal) {
+    fprintf(stderr, "Unexpected value for input:\n%s\n", input);
+    print_json("Got", &tree);
+    print_json("Expected", &expected_tree);
+  }
+
+  tsconfig_tree_free(&tree);
+  tsconfig_tree_free(&expected_tree);
+  return equal ? 0 : 1;
+}
+
+static void print_json(const char *name, const tsconfig_tree *tree) {
+  char *buf = NULL;
+  size_t len = 0, size = 0;
+  if (tsconfig_render(tree, TSCFG_RENDER_JSON, &buf, &len, &size) ==
+      TSCFG_OK) {
+    fprintf(stderr, "%s: %s\n", name, buf);
+  } else {
+    fprintf(stderr, "%s: <not rendered>\n", name);
+  }
+  free(buf);
+}
+
+int test_expect_err(const char *input, tscfg_rc rc, const char *msg) {
+  err_buf errs = { .msgs = NULL, .len = 0, .size = 0 };
+  tsconfig_set_err_handler(collect_err, &errs);
+
+  tsconfig_tree tree;
+  tscfg_rc got = test_parse(input, &tree);
+  tsconfig_set_err_handler(NULL, NULL);
+  if (got == TSCFG_OK) {
+    tsconfig_tree_free(&tree);
+  }
+
+  int failed = 0;
+  if (got != rc) {
+    fprintf(stderr, "Expected rc %d, got %d for input:\n%s\n", (int)rc,
+            (int)got, input);
+    failed = 1;
+  } else if (errs.msgs == NULL || strstr(errs.msgs, msg) == NULL) {
+    fprintf(stderr, "Expected error \"%s\", got:\n%s\nfor input:\n%s\n",
+            msg, errs.msgs != NULL ? errs.msgs : "", input);
+    failed = 1;
+  }
+  free(errs.msgs);
+  return failed;
+}
+
+/*
+ * Append error message to buffer, one per line.
+ */
+static void collect_err(void *ctx, const char *msg) {
+  err_buf *errs = ctx;
+  size_t len = strlen(msg);
+  if (errs->len + len + 2 > errs->size) {
+    size_t size = (errs->len + len + 2) * 2;
+    char *msgs = realloc(errs->msgs, size);
+    if (msgs == NULL) {
+      return;
+    }
+    errs->msgs = msgs;
+    errs->size = size;
+  }
+  memcpy(errs->msgs + errs->len, msg, len);
+  errs->len += len;
+  errs->msgs[errs->len++] = '\n';
+  errs->msgs[errs->len] = '\0';
+}
@@ -0,0 +1,103 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Helpers shared by unit tests run by make check.
+ */
+
+#ifndef __TSCONFIG_TEST_UTIL_H
+#define __TSCONFIG_TEST_UTIL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tsconfig.h"
+
+/*
+ * Fail test with location if condition is false.  Used in functions
+ * returning int, non-zero for failure.
+ */
+#define CHECK(cond) do {                                                  \
+    if (!(cond)) {                                                        \
+      fprintf(stderr, "%s:%i: Check failed: %s\n", __FILE__, __LINE__,    \
+              #cond);                                                     \
+      return 1;                                                           \
+    }                                                                     \
+  } while (0)
+
+#define CHECK_OK(rc) CHECK((rc) == TSCFG_OK)
+
+/*
+ * Read callback for string, so that input is read in chunks as from a
+ * file.
+ */
+static inline tscfg_rc test_read_str(void *ctx, void *buf, size_t len,
+                                     size_t *got) {
+  tsconfig_input *in = ctx;
+  size_t left = in->data.s.len - in->data.s.pos;
+  *got = len < left ? len : left;
+  memcpy(buf, in->data.s.str + in->data.s.pos, *got);
+  in->data.s.pos += *got;
+  return TSCFG_OK;
+}
+
+/*
+ * Parse string to merged and resolved tree, reading it in chunks.
+ */
+static inline tscfg_rc test_parse_opts(const char *str,
+                    const tsconfig_parse_opts *opts, tsconfig_tree *tree) {
+  tsconfig_input src = { .kind = TS_CONFIG_IN_STR };
+  src.data.s.str = str;
+  src.data.s.len = strlen(str);
+  src.data.s.pos = 0;
+
+  tsconfig_input in = { .kind = TS_CONFIG_IN_FUNC };
+  in.data.fn.read = test_read_str;
+  in.data.fn.ctx = &src;
+  in.data.fn.chunk_size = 0;
+  return tsconfig_parse_tree_opts(in, TSCFG_HOCON, opts, tree);
+}
+
+static inline tscfg_rc test_parse(const char *str, tsconfig_tree *tree) {
+  return test_parse_opts(str, NULL, tree);
+}
+
+/*
+ * Whether values are equal as HOCON values: objects with the same keys
+ * and equal values, in any order, arrays with equal elements, and equal
+ * scalars, where quoted and unquoted strings are the same.  Keys with
+ * undefined values are ignored.
+ */
+bool test_val_equal(tscfg_val a, tscfg_val b);
+
+bool test_tree_equal(const tsconfig_tree *a, const tsconfig_tree *b);
+
+/*
+ * Check that input parses to a tree equal to expected, which is parsed
+ * the same way, printing both as JSON if not.
+ */
+int test_expect(const char *input, const char *expected);
+
+/*
+ * Check that input fails to parse with rc and an error message
+ * containing msg.
+ */
+int test_expect_err(const char *input, tscfg_rc rc, const char *msg);
+
+#endif // __TSCONFIG_TEST_UTIL_H
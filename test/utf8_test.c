@@ -0,0 +1,236 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Copyright 2015, Tim Armstrong
+ *
+ * Author: Tim Armstrong <tim.g.armstrong@gmail.com>
+ */
+
+/*
+ * Check that up-front UTF-8 validation of in-memory input agrees with
+ * decoding a character at a time, wherever the invalid bytes fall
+ * relative to the blocks validated together, and that invalid input is
+ * rejected the same way whether it is validated up front or not.
+ */
+
+#include <stdlib.h>
+
+#include "test_util.h"
+#include "tsconfig_utf8.h"
+
+// Offsets of sequences in buffer, and ASCII after them, to cover every
+// position in and across vectorized blocks
+#define MAX_PREFIX 80
+#define MAX_SUFFIX 40
+
+// Random buffers compared against decoding a character at a time
+#define RANDOM_BUFS 20000
+#define RANDOM_LEN 96
+
+typedef struct {
+  const char *bytes;
+  bool valid;
+} utf8_case;
+
+static const utf8_case seqs[] = {
+  { "\x7f", true },
+  { "\xc2\x80", true }, // U+0080
+  { "\xdf\xbf", true }, // U+07FF
+  { "\xe0\xa0\x80", true }, // U+0800
+  { "\xe2\x82\xac", true }, // Euro sign
+  { "\xed\x9f\xbf", true }, // U+D7FF, before surrogates
+  { "\xee\x80\x80", true }, // U+E000, after surrogates
+  { "\xef\xbf\xbf", true }, // U+FFFF
+  { "\xf0\x90\x80\x80", true }, // U+10000
+  { "\xf0\x9f\x98\x80", true }, // Emoji
+  { "\xf4\x8f\xbf\xbf", true }, // U+10FFFF
+  // Overlong
+  { "\xc0\x80", false },
+  { "\xc1\xbf", false },
+  { "\xe0\x80\x80", false },
+  { "\xe0\x9f\xbf", false },
+  { "\xf0\x80\x80\x80", false },
+  { "\xf0\x8f\xbf\xbf", false },
+  // Surrogates
+  { "\xed\xa0\x80", false },
+  { "\xed\xbf\xbf", false },
+  // Out of Unicode range
+  { "\xf4\x90\x80\x80", false },
+  { "\xf5\x80\x80\x80", false },
+  { "\xff", false },
+  // Stray continuation bytes
+  { "\x80", false },
+  { "\xbf", false },
+  // Truncated
+  { "\xc2", false },
+  { "\xe2\x82", false },
+  { "\xf0\x9f\x98", false },
+  // Continuation byte not followed by enough
+  { "\xe2\x28\xa1", false },
+};
+
+static int check_validate(const utf8_case *c);
+static int check_random(void);
+static int check_parse(const utf8_case *c);
+static tscfg_rc decode_all(const unsigned char *s, size_t len,
+                           size_t *err_pos);
+static tscfg_rc parse_str(const char *str, tsconfig_tree *tree);
+static void ignore_err(void *ctx, const char *msg);
+
+int main(void) {
+  // Errors for invalid input are expected
+  tsconfig_set_err_handler(ignore_err, NULL);
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(seqs) / sizeof(seqs[0]); i++) {
+    if (check_validate(&seqs[i]) != 0 || check_parse(&seqs[i]) != 0) {
+      fprintf(stderr, "UTF-8 case %zu failed\n", i);
+      failed = 1;
+    }
+  }
+  failed |= check_random();
+  return failed;
+}
+
+/*
+ * Sequence between ASCII text of every length up to the maximums.
+ */
+static int check_validate(const utf8_case *c) {
+  unsigned char buf[MAX_PREFIX + UTF8_MAX_BYTES + MAX_SUFFIX];
+  size_t seq_len = strlen(c->bytes);
+
+  for (size_t prefix = 0; prefix <= MAX_PREFIX; prefix++) {
+    for (size_t suffix = 0; suffix <= MAX_SUFFIX; suffix++) {
+      memset(buf, 'a', prefix);
+      memcpy(buf + prefix, c->bytes, seq_len);
+      memset(buf + prefix + seq_len, 'b', suffix);
+      size_t len = prefix + seq_len + suffix;
+
+      size_t err_pos;
+      tscfg_rc rc = tscfg_utf8_validate(buf, len, &err_pos);
+      if (c->valid) {
+        CHECK_OK(rc);
+      } else {
+        CHECK(rc == TSCFG_ERR_INVALID);
+        CHECK(err_pos == prefix);
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Random mix of valid and invalid sequences and ASCII.
+ */
+static int check_random(void) {
+  uint64_t state = 7;
+  unsigned char buf[RANDOM_LEN];
+  for (int n = 0; n < RANDOM_BUFS; n++) {
+    size_t len = 0;
+    while (len < RANDOM_LEN) {
+      state = state * UINT64_C(6364136223846793005) +
+              UINT64_C(1442695040888963407);
+      uint32_t r = (uint32_t)(state >> 33);
+      if (r % 8 != 0) {
+        buf[len++] = (unsigned char)(r >> 8) & 0x7f;
+        continue;
+      }
+
+      // Mostly valid sequences, sometimes with a corrupted byte
+      const utf8_case *c = &seqs[(r >> 3) % (sizeof(seqs) / sizeof(seqs[0]))];
+      if (!c->valid && (r >> 26) % 16 != 0) {
+        continue;
+      }
+      const char *seq = c->bytes;
+      size_t seq_len = strlen(seq);
+      if (seq_len > RANDOM_LEN - len) {
+        break;
+      }
+      memcpy(buf + len, seq, seq_len);
+      if ((r >> 12) % 64 == 0) {
+        buf[len + (r >> 18) % seq_len] = (unsigned char)(r >> 20);
+      }
+      len += seq_len;
+    }
+
+    size_t err_pos, expected_pos;
+    tscfg_rc rc = tscfg_utf8_validate(buf, len, &err_pos);
+    tscfg_rc expected = decode_all(buf, len, &expected_pos);
+    CHECK(rc == expected);
+    CHECK(rc == TSCFG_OK || err_pos == expected_pos);
+  }
+  return 0;
+}
+
+/*
+ * Sequence in string, unquoted text and comment, for input validated up
+ * front and input decoded as it is read.
+ */
+static int check_parse(const utf8_case *c) {
+  static const char *const formats[] = {
+    "a = \"%s\"", "a = x%sy", "# %s\na = 1", "a = \"\"\"%s\"\"\"",
+  };
+
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    char input[64];
+    snprintf(input, sizeof(input), formats[f], c->bytes);
+    tscfg_rc expected = c->valid ? TSCFG_OK : TSCFG_ERR_INVALID;
+
+    tsconfig_tree tree;
+    tscfg_rc rc = parse_str(input, &tree);
+    CHECK(rc == expected);
+    if (rc == TSCFG_OK) {
+      tsconfig_tree_free(&tree);
+    }
+
+    rc = test_parse(input, &tree);
+    CHECK(rc == expected);
+    if (rc == TSCFG_OK) {
+      tsconfig_tree_free(&tree);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Validate by decoding one character at a time, as the lexer does for
+ * input read in chunks.
+ */
+static tscfg_rc decode_all(const unsigned char *s, size_t len,
+                           size_t *err_pos) {
+  size_t i = 0;
+  while (i < len) {
+    size_t n;
+    tscfg_char_t c;
+    if (tscfg_decode_byte1(s[i], &n, &c) != TSCFG_OK || n > len - i ||
+        tscfg_decode_rest(s + i + 1, n - 1, &c) != TSCFG_OK) {
+      *err_pos = i;
+      return TSCFG_ERR_INVALID;
+    }
+    i += n;
+  }
+  return TSCFG_OK;
+}
+
+static tscfg_rc parse_str(const char *str, tsconfig_tree *tree) {
+  tsconfig_input in = { .kind = TS_CONFIG_IN_STR };
+  in.data.s.str = str;
+  in.data.s.len = strlen(str);
+  in.data.s.pos = 0;
+  return tsconfig_parse_tree_opts(in, TSCFG_HOCON, NULL, tree);
+}
+
+static void ignore_err(void *ctx, const char *msg) {
+  (void)ctx;
+  (void)msg;
+}